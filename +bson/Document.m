@@ -0,0 +1,89 @@
+classdef Document < handle
+%DOCUMENT BSON document kept in MEX memory.
+%
+%    document = bson.Document(bson_value)
+%
+% Parameters:
+%
+%    - `bson_value` BSON encoded binary.
+%
+% The document is validated and copied once, and the methods query it
+% through a handle without copying and validating the binary again. This
+% is faster when the same large document is queried many times.
+%
+% Paths are dot-separated keys, such as 'a.b.0.c', where array elements
+% are referred to by their zero-based index. The empty path '' refers to
+% the whole document.
+%
+% Methods:
+%
+%    Method name     Description
+%    --------------  ----------------------------------------------------
+%    get             value = document.get(path, default) decodes the value
+%                    at the path, or returns `default` if not found.
+%                    Default [].
+%    decode          value = document.decode(path, ...) decodes the value
+%                    at the path with the options of bson.decode. It is an
+%                    error if the path is not found.
+%    keys            keys = document.keys(path) returns a cell array of
+%                    the keys of the document or array at the path.
+%    length          n = document.length(path) returns the number of
+%                    elements of the document or array at the path.
+%
+% The memory is released when the object is deleted or cleared. The MEX
+% file stays locked while any document is alive.
+%
+% Example:
+%
+% >> document = bson.Document(bson.encode(struct('a', struct('b', 1:3))));
+% >> document.keys('a')
+% >> value = document.get('a.b');
+%
+% See also bson.decode
+  properties (Access = private)
+    id_ = []
+  end
+
+  methods
+    function this = Document(bson_value)
+      %DOCUMENT Keep the BSON document in MEX memory.
+      this.id_ = libbsonmex('createDocument', bson_value);
+    end
+
+    function delete(this)
+      %DELETE Release the document.
+      if ~isempty(this.id_)
+        libbsonmex('destroyDocument', this.id_);
+        this.id_ = [];
+      end
+    end
+
+    function value = get(this, path, default)
+      %GET Decode the value at the path, or return the default.
+      if nargin < 2, path = ''; end
+      [value, found] = libbsonmex('decodeDocument', this.id_, path);
+      if ~found
+        if nargin < 3, default = []; end
+        value = default;
+      end
+    end
+
+    function value = decode(this, path, varargin)
+      %DECODE Decode the value at the path with decoder options.
+      if nargin < 2, path = ''; end
+      value = libbsonmex('decodeDocument', this.id_, path, varargin{:});
+    end
+
+    function keys = keys(this, path)
+      %KEYS Get the keys of the document or array at the path.
+      if nargin < 2, path = ''; end
+      keys = libbsonmex('getDocumentKeys', this.id_, path);
+    end
+
+    function n = length(this, path)
+      %LENGTH Get the number of elements at the path.
+      if nargin < 2, path = ''; end
+      n = libbsonmex('getDocumentLength', this.id_, path);
+    end
+  end
+end
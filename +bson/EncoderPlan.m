@@ -0,0 +1,27 @@
+classdef EncoderPlan < handle
+%ENCODERPLAN Compiled struct layout for bson.encode.
+%
+% An encoder plan is created by bson.compileEncoder, and is given to
+% bson.encode with the 'Plan' option. The plan is released when the object
+% is deleted or cleared. The MEX file stays locked while any plan is alive.
+%
+% See also bson.compileEncoder bson.encode
+  properties (SetAccess = private, Hidden)
+    id = []
+  end
+
+  methods
+    function this = EncoderPlan(id)
+      %ENCODERPLAN Wrap the handle of a compiled plan.
+      this.id = id;
+    end
+
+    function delete(this)
+      %DELETE Release the plan.
+      if ~isempty(this.id)
+        libbsonmex('destroyEncoderPlan', this.id);
+        this.id = [];
+      end
+    end
+  end
+end
@@ -0,0 +1,29 @@
+function plan = compileEncoder(template)
+%COMPILEENCODER Compile the layout of a struct for repeated encoding.
+%
+%    plan = bson.compileEncoder(template)
+%
+% Parameters:
+%
+%    - `template` Struct of the layout to encode.
+%
+% Returns:
+%
+%    bson.EncoderPlan object to give to bson.encode with the 'Plan' option.
+%
+% The plan keeps the keys, and the classes and shapes of the field values
+% of the first element of the template, including nested scalar structs.
+% bson.encode checks that the input has the fields of the plan, and
+% appends real scalars and strings that fit the plan without the generic
+% conversion. Other values are converted as usual, so the result is the
+% same as without the plan.
+%
+% Example:
+%
+% >> plan = bson.compileEncoder(struct('time', 0, 'level', 'info', ...
+%                                      'count', int32(0)));
+% >> bson_value = bson.encode(record, 'Plan', plan);
+%
+% See also bson.encode bson.EncoderPlan
+  plan = bson.EncoderPlan(libbsonmex(mfilename, template));
+end
@@ -1,16 +1,68 @@
-function value = decode(bson_value, varargin)
+function varargout = decode(bson_value, varargin)
 %DECODE Deserialize value from BSON format.
 %
 %    value = bson.decode(bson_value, ...)
+%    [value, mismatches] = bson.decode(bson_value, 'Schema', schema, ...)
 %
 % Parameters:
 %
 %    - `bson_value` BSON encoded binary.
 %
+% Options:
+%
+%    Option name     Description
+%    --------------  ----------------------------------------------------
+%    IntegerClass    'auto' (default) decodes integer scalars to double and
+%                    integer arrays to int32 or int64. 'native' decodes
+%                    scalars to int32 or int64, too. 'smallest' decodes to
+%                    the smallest integer class that holds the values.
+%    FloatClass      'double' (default) or 'single'.
+%    Depth           Maximum nesting depth of documents and arrays. 0 does
+%                    not limit the depth. Deeper input fails to decode.
+%                    Default 0.
+%    Cache           Logical flag to return a copy of the value decoded
+%                    from the same bytes and options, if cached, and to
+%                    cache the decoded value otherwise. Default false. See
+%                    bson.decodeCache.
+%    Schema          Struct of the expected class and size of each field.
+%                    See below. Default none.
+%
 % Returns:
 %
-%    Decoded Matlab value.
+%    Decoded Matlab value. With the 'Schema' option, `mismatches` is a cell
+%    array of the paths of the values that do not fit the schema. It is an
+%    error if there is a mismatch and `mismatches` is not requested.
+%
+% A schema gives the document the same classes and sizes regardless of the
+% values, and skips the inference of arrays and struct keys. Each field of
+% the schema struct is one of the following.
+%
+%    - String of the class and the size such as 'double', 'int32[1x:]', or
+%      'logical[3x3]', where : is any size. The size defaults to [1x1].
+%      Numbers must fit the class, and matrices are arrays of rows.
+%    - 'char' for a string, or 'any' to decode the value as usual.
+%    - Scalar struct for a nested document.
+%    - Struct array for an array of documents, using the first element as
+%      the schema. An empty struct array decodes the fields as usual.
+%
+% Keys that are not in the schema are skipped. A missing or mismatched
+% value is decoded as an empty value of the class.
+%
+% Arrays of mixed int32, int64 and double numbers decode as one numeric
+% array of the wider class, with NaN for null. Arrays of rows merge into a
+% matrix the same way, so rows of int32 and int64 numbers now decode as an
+% int64 matrix rather than a cell array of rows. An array stays a cell when
+% int64 numbers beyond 2^53 would lose precision in double.
+%
+% Example:
+%
+% >> value = bson.decode(bson_value, 'IntegerClass', 'smallest', ...
+%                        'FloatClass', 'single');
+% >> schema = struct('time', 'double', 'samples', 'single[1x:]', ...
+%                    'source', struct('name', 'char', 'id', 'uint32'));
+% >> [value, mismatches] = bson.decode(bson_value, 'Schema', schema);
 %
-% See also bson
-  value = libbsonmex(mfilename, bson_value, varargin{:});
+% See also bson bson.decodeCache
+  [varargout{1:max(nargout, 1)}] = libbsonmex(mfilename, bson_value, ...
+                                              varargin{:});
 end
@@ -0,0 +1,35 @@
+function stats = decodeCache(varargin)
+%DECODECACHE Configure the decode cache, and get its statistics.
+%
+%    stats = bson.decodeCache(...)
+%
+% Options:
+%
+%    Option name     Description
+%    --------------  ----------------------------------------------------
+%    Capacity        Maximum number of cached values. 0 disables caching.
+%                    Default 64.
+%    MaxBytes        Maximum total size in bytes of the cached BSON inputs.
+%                    Default 268435456.
+%    Clear           Logical flag to release all the cached values and
+%                    reset the statistics. Default false.
+%
+% Returns:
+%
+%    Struct of the statistics with fields `hits`, `misses`, `evictions`,
+%    `entries`, `bytes`, `capacity`, and `maxBytes`.
+%
+% bson.decode with the 'Cache' option looks up the value decoded from the
+% same bytes and decoder options. A lookup hashes the input once, and a hit
+% returns a copy of the cached value without decoding. The least recently
+% used values are evicted beyond the capacity. The cache is released when
+% the MEX file is cleared.
+%
+% Example:
+%
+% >> value = bson.decode(bson_value, 'Cache', true);
+% >> stats = bson.decodeCache();
+%
+% See also bson.decode
+  stats = libbsonmex(mfilename, varargin{:});
+end
@@ -0,0 +1,30 @@
+function values = decodeMany(bson_values, varargin)
+%DECODEMANY Deserialize many values from BSON format.
+%
+%    values = bson.decodeMany(bson_values, ...)
+%
+% Parameters:
+%
+%    - `bson_values` Cell array of BSON binaries, or uint8 array of
+%      concatenated BSON documents.
+%
+% Options:
+%
+%    Decoder options of bson.decode are accepted, except Cache and Schema,
+%    and apply to each document.
+%
+% All the documents are decoded in one call without copying the binaries,
+% which is faster than calling bson.decode on each of many small documents.
+%
+% Returns:
+%
+%    Cell array of decoded values, of the same size as `bson_values` for a
+%    cell array, or a row vector for concatenated documents.
+%
+% Example:
+%
+% >> values = bson.decodeMany(bson.encodeMany({1, 'a'}, 'Concatenate', true));
+%
+% See also bson.decode bson.encodeMany
+  values = libbsonmex(mfilename, bson_values, varargin{:});
+end
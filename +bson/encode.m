@@ -7,10 +7,43 @@ function bson_value = encode(value, varargin)
 %
 %    - `bson_value` A value to be encoded as a BSON binary.
 %
+% Options:
+%
+%    Option name     Description
+%    --------------  ----------------------------------------------------
+%    PackLogical     Store logical arrays as a packed bitset binary that
+%                    keeps the N-D shape. Default false.
+%    DeltaEncode     Store int64, uint64, and bson.datetime arrays as a
+%                    packed binary of zigzag varint deltas. Suitable for
+%                    monotonic ids and timestamps. Default false.
+%    Compress        'zlib' stores large numeric, logical, and packed
+%                    arrays as a zlib-compressed binary. Default 'none'.
+%    CompressThreshold
+%                    Minimum payload size in bytes to compress. Default
+%                    100000.
+%    Depth           Maximum nesting depth of documents and arrays. 0 does
+%                    not limit the depth. Deeper input fails to encode.
+%                    Default 0.
+%    Plan            bson.EncoderPlan of the struct layout compiled by
+%                    bson.compileEncoder. The value must be a struct with
+%                    the fields of the plan. Default none.
+%    Allocator       'arena' builds the document in the scratch arena of
+%                    the encoder instead of the heap, which avoids repeated
+%                    reallocation of large documents. Default 'default'.
+%
+% Sparse and complex arrays are always stored as a packed binary, with
+% complex values interleaved in real and imaginary parts.
+%
 % Returns:
 %
 %    A BSON binary.
 %
-% See also bson
+% Example:
+%
+% >> bson_value = bson.encode(rand(1000) > 0.5, 'PackLogical', true);
+% >> bson_value = bson.encode(weights, 'Compress', 'zlib', ...
+%                             'CompressThreshold', 1e5);
+%
+% See also bson bson.compileEncoder
   bson_value = libbsonmex(mfilename, value, varargin{:});
 end
@@ -0,0 +1,36 @@
+function bson_values = encodeMany(values, varargin)
+%ENCODEMANY Serialize each value of a cell array in BSON format.
+%
+%    bson_values = bson.encodeMany(values, ...)
+%
+% Parameters:
+%
+%    - `values` Cell array of values to be encoded.
+%
+% Options:
+%
+%    Option name     Description
+%    --------------  ----------------------------------------------------
+%    Concatenate     Logical flag to return the documents concatenated in
+%                    one uint8 row vector instead of a cell array.
+%                    Default false.
+%
+%    Encoder options of bson.encode are also accepted, and apply to each
+%    value.
+%
+% All the values are encoded in one call, reusing one buffer, which is
+% faster than calling bson.encode on each of many small values.
+%
+% Returns:
+%
+%    Cell array of BSON binaries of the same size as `values`, or the
+%    concatenated binary.
+%
+% Example:
+%
+% >> bson_values = bson.encodeMany({struct('a', 1), struct('a', 2)});
+% >> bson_value = bson.encodeMany(records, 'Concatenate', true);
+%
+% See also bson.encode bson.decodeMany
+  bson_values = libbsonmex(mfilename, values, varargin{:});
+end
@@ -0,0 +1,34 @@
+function exportJSON(bson_file, json_file, varargin)
+%EXPORTJSON Export a BSON file to newline-delimited JSON.
+%
+%    bson.exportJSON(bson_file, json_file, ...)
+%
+% Parameters:
+%
+%    - `bson_file` Path to the BSON file of concatenated documents.
+%    - `json_file` Path to the JSON file to write.
+%
+% Options:
+%
+%    Option name     Description
+%    --------------  ----------------------------------------------------
+%    Threads         Number of threads formatting documents as JSON. 0
+%                    uses all the processors. Default 0.
+%    BatchSize       Size in bytes of the documents formatted at a time.
+%                    Default 4194304.
+%
+% Each document is written as one line of JSON in the order of the file,
+% without decoding to Matlab values. While a batch of documents is formatted
+% in parallel, the previous batch is written and the next batch is read.
+%
+% A gzip-compressed BSON file is accepted, and the JSON file is compressed
+% by gzip if it ends with .gz. Chunk documents written by bson.write are
+% skipped, so chunked arrays appear as their binary reference.
+%
+% Example:
+%
+% >> bson.exportJSON('records.bson', 'records.json');
+%
+% See also bson
+  libbsonmex(mfilename, bson_file, json_file, varargin{:});
+end
@@ -0,0 +1,37 @@
+function importJSON(json_file, bson_file, varargin)
+%IMPORTJSON Import a JSON file to a BSON file.
+%
+%    bson.importJSON(json_file, bson_file, ...)
+%
+% Parameters:
+%
+%    - `json_file` Path to the JSON file of records.
+%    - `bson_file` Path to the BSON file to write.
+%
+% Options:
+%
+%    Option name     Description
+%    --------------  ----------------------------------------------------
+%    Threads         Number of threads converting records to BSON. 0 uses
+%                    all the processors. Default 0.
+%    BatchSize       Size in bytes of the JSON text read and converted at
+%                    a time. Default 4194304.
+%
+% Records are JSON objects, either newline-delimited (NDJSON) or elements of
+% a top-level array. Each record is written as one document of the BSON
+% file in order, without the text passing through Matlab, so the file may
+% be larger than the memory. A record larger than BatchSize is read whole.
+% An empty element or a trailing comma in the array is an error reported at
+% its byte offset.
+%
+% A gzip-compressed JSON file is accepted, and the BSON file is compressed
+% by gzip if it ends with .gz.
+%
+% Example:
+%
+% >> bson.importJSON('feed.json', 'feed.bson');
+% >> records = bson.read('feed.bson');
+%
+% See also bson
+  libbsonmex(mfilename, json_file, bson_file, varargin{:});
+end
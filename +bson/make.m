@@ -81,8 +81,9 @@ function config = parse_options(varargin)
     end
   end
   compiler_flags = sprintf(' %s', varargin{~mark_for_delete});
+  compiler_flags = sprintf(' -lz%s', compiler_flags);
   if isunix
-    compiler_flags = sprintf(' CFLAGS="\\$CFLAGS -fPIC"%s', ...
+    compiler_flags = sprintf(' CFLAGS="\\$CFLAGS -fPIC" -lpthread%s', ...
                              compiler_flags);
     if ~ismac
       compiler_flags = sprintf(' -lrt %s', compiler_flags);
@@ -0,0 +1,31 @@
+function value = parseJSON(json_value, varargin)
+%PARSEJSON Convert JSON to a Matlab value.
+%
+%    value = bson.parseJSON(json_value, ...)
+%
+% Parameters:
+%
+%    - `json_value` JSON string.
+%
+% Options:
+%
+%    Decoder options of bson.decode are accepted.
+%
+% The value is the same as bson.decode(bson.fromJSON(json_value)), but the
+% JSON is decoded directly without creating BSON. An empty object or array
+% decodes to []. Extended JSON such as {"$oid": ...} is not interpreted and
+% decodes to a struct. This includes the {"$binary": ...} and {"$date": ...}
+% wrappers written by bson.toJSON, so binary and datetime values do not
+% round-trip through bson.parseJSON; use bson.fromJSON for such JSON.
+%
+% Returns:
+%
+%    Decoded Matlab value.
+%
+% Example:
+%
+% >> value = bson.parseJSON('{"a": [1, 2, 3], "b": "text"}');
+%
+% See also bson
+  value = libbsonmex(mfilename, json_value, varargin{:});
+end
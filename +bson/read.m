@@ -1,25 +1,48 @@
 function value = read(filename, varargin)
 %READ Read bson from file.
 %
-%    value = bson.read(filename)
+%    value = bson.read(filename, ...)
 %
 % Parameters:
 %
 %    - `filename` Path to the BSON file.
 %
+% Options:
+%
+%    Option name     Description
+%    --------------  ----------------------------------------------------
+%    Offset          Byte offset of the first document to read. Without
+%                    Length, one document at the offset is read. Default
+%                    0.
+%    Length          Byte length of the concatenated documents to read
+%                    from the offset, up to the end of the file. Default
+%                    0, one document.
+%    ReadAhead       Size in bytes of each of the two buffers that a
+%                    background thread fills with the following documents
+%                    while a document is decoded. 0 reads and decodes in
+%                    turn. Default 8388608.
+%
+%    Decoder options of bson.decode are also accepted.
+%
+% A gzip-compressed file, such as a .bson.gz archive of mongodump, is
+% inflated as the documents are read and decoded. Offset and Length are then
+% in uncompressed bytes.
+%
+% With Offset or Length, the byte range is read by a single positioned read
+% instead of loading the whole file.
+%
+% Arrays written in chunks by bson.write are reassembled directly into the
+% decoded value.
+%
 % Returns:
 %
-%    Matlab value.
+%    Matlab value. If the file contains multiple documents, a cell array of
+%    values.
+%
+% Example:
+%
+% >> record = bson.read('records.bson', 'Offset', offsets(k));
 %
 % See also bson
-  fid = fopen(filename, 'r');
-  assert(fid > 0, 'Invalid file: %s', filename);
-  try
-    bson_binary = fread(fid, inf, 'uint8=>uint8');
-    fclose(fid);
-  catch exception
-    fclose(fid);
-    rethrow(exception);
-  end
-  value = bson.decode(bson_binary, varargin{:});
+  value = libbsonmex('readFile', filename, varargin{:});
 end
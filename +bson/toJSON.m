@@ -0,0 +1,40 @@
+function json_value = toJSON(value, varargin)
+%TOJSON Convert a Matlab value to JSON.
+%
+%    json_value = bson.toJSON(value, ...)
+%    bson.toJSON(value, 'File', filename)
+%
+% Parameters:
+%
+%    - `value` Matlab value.
+%
+% Options:
+%
+%    Option name     Description
+%    --------------  ----------------------------------------------------
+%    File            Path to a file to write the JSON instead of returning
+%                    it.
+%
+% The value is written in the shape that bson.encode gives to BSON, without
+% creating BSON: matrices become nested arrays of rows, and N-D arrays are
+% nested along the last dimension. Doubles are written in the shortest
+% form that reads back to the same value, and NaN and Inf become null.
+% int8 and uint8 arrays, and packed sparse and complex arrays, are written
+% as {"$binary": ..., "$type": ...}, and bson.datetime as {"$date": ...}.
+% Values nested deeper than 1000 levels fail to convert.
+%
+% Returns:
+%
+%    JSON string.
+%
+% Example:
+%
+% >> json_value = bson.toJSON(struct('a', [1, 2, 3], 'b', 'text'));
+%
+% See also bson
+  if nargout > 0 || isempty(varargin)
+    json_value = libbsonmex(mfilename, value, varargin{:});
+  else
+    libbsonmex(mfilename, value, varargin{:});
+  end
+end
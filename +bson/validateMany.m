@@ -0,0 +1,40 @@
+function [status, error] = validateMany(input, varargin)
+%VALIDATEMANY Validate concatenated BSON documents.
+%
+%    [status, error] = bson.validateMany(bson_value, ...)
+%    [status, error] = bson.validateMany(filename, ...)
+%
+% Parameters:
+%
+%    - `bson_value` uint8 array of concatenated BSON documents.
+%    - `filename` Path to a BSON file of concatenated documents.
+%
+% Options:
+%
+%    Option name     Description
+%    --------------  ----------------------------------------------------
+%    UTF8            Logical flag to check that keys and strings are valid
+%                    UTF-8. Default false.
+%    Depth           Maximum nesting depth of documents. 0 does not limit
+%                    the depth. Default 0.
+%    Threads         Number of threads validating documents. 0 uses all
+%                    the processors. Default 0.
+%
+% `status` is a logical row vector of the validity of each document.
+% `error` is a struct of the first invalid document, with fields `document`
+% for its index, `offset` for the byte offset of the error from the start of
+% the input, and `reason` for the description. `error` is empty if all the
+% documents are valid.
+%
+% Documents are validated in parallel, and a file is read in batches, so
+% that files larger than the memory can be checked. Validation stops at a
+% document of an invalid length, which is the last in `status`. A
+% gzip-compressed file is accepted.
+%
+% Example:
+%
+% >> [status, error] = bson.validateMany('records.bson', 'UTF8', true);
+%
+% See also bson.validate
+  [status, error] = libbsonmex(mfilename, input, varargin{:});
+end
@@ -1,21 +1,45 @@
 function write(value, filename, varargin)
 %WRITE Write variable to a BSON file.
 %
-%    bson.write(value, filename)
+%    bson.write(value, filename, ...)
 %
 % Parameters:
 %
 %    - `filename` Path to the BSON file.
 %
+% Options:
+%
+%    Option name     Description
+%    --------------  ----------------------------------------------------
+%    ChunkSize       Size in bytes of a chunk document of chunked arrays.
+%                    Default 16777216.
+%    ChunkThreshold  Minimum size in bytes of numeric and logical arrays
+%                    to write in chunks. Default 1073741824.
+%    Streaming       Encode the document through a buffer that is written
+%                    to the file as it fills, patching the length of each
+%                    subdocument when it ends. Arrays are not chunked, and
+%                    Depth is 1000 unless given. Default false.
+%    BufferSize      Size in bytes of the streaming buffer. Default
+%                    4194304.
+%
+%    Encoder options of bson.encode are also accepted.
+%
+% A filename ending with .gz is written gzip-compressed as the documents
+% are encoded. Streaming is not supported for compressed files.
+%
+% Arrays too large for a BSON document are split into GridFS-like chunk
+% documents {files_id, n, data} written before the document of the value,
+% which references them. bson.read reassembles the chunks, and tells them
+% from user documents of the same fields by the binary subtype 0x81 and the
+% files_id, which is the file offset of the first chunk.
+%
+% Example:
+%
+% >> bson.write(struct('weights', rand(4e4)), 'weights.bson', ...
+%               'ChunkSize', 2^26);
+% >> bson.write(records, 'records.bson', 'Streaming', true);
+% >> bson.write(records, 'records.bson.gz');
+%
 % See also bson
-  bson_binary = bson.encode(value, varargin{:});
-  fid = fopen(filename, 'wb');
-  assert(fid > 0, 'Invalid file: %s', filename);
-  try
-    fwrite(fid, bson_binary, 'uint8');
-    fclose(fid);
-  catch exception
-    fclose(fid);
-    rethrow(exception);
-  end
+  libbsonmex('writeFile', value, filename, varargin{:});
 end
@@ -0,0 +1,192 @@
+/** Scratch memory arena implementation.
+ *
+ * Kota Yamaguchi 2013
+ */
+
+#include "bsonarena.h"
+#include <mex.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_MAX_KEPT_SIZE 16777216
+
+/** Round the size up to the alignment.
+ */
+#define ARENA_ALIGN(size) \
+    (((size) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+/** Header in front of each allocation.
+ */
+typedef struct arena_header_t {
+  size_t size; /* Requested size of the allocation. */
+  size_t heap; /* Nonzero if allocated from the heap. */
+} arena_header_t;
+
+#define ARENA_HEADER_SIZE ARENA_ALIGN(sizeof(arena_header_t))
+
+/** Block of the arena. The data follows the block.
+ */
+typedef struct arena_block_t {
+  struct arena_block_t* next; /* Previously filled block. */
+  size_t size;                /* Capacity of the data. */
+  size_t used;
+} arena_block_t;
+
+#define ARENA_BLOCK_HEADER_SIZE ARENA_ALIGN(sizeof(arena_block_t))
+
+/** State of the arena.
+ */
+static struct {
+  arena_block_t* head; /* Current block. */
+  int depth;           /* Number of open scopes. */
+} arena = {NULL, 0};
+
+/** Get the data of the block.
+ */
+static uint8_t* GetBlockData(arena_block_t* block) {
+  return (uint8_t*)block + ARENA_BLOCK_HEADER_SIZE;
+}
+
+/** Get the header of the allocation.
+ */
+static arena_header_t* GetHeader(void* pointer) {
+  return (arena_header_t*)((uint8_t*)pointer - ARENA_HEADER_SIZE);
+}
+
+/** Check if the allocation is the latest one of the current block.
+ */
+static bool IsLatestAllocation(void* pointer) {
+  arena_header_t* header = GetHeader(pointer);
+  return arena.head &&
+         (uint8_t*)pointer + ARENA_ALIGN(header->size) ==
+         GetBlockData(arena.head) + arena.head->used;
+}
+
+/** Free the blocks after the head, and the head too if it is too large.
+ */
+static void ReleaseBlocks(void) {
+  arena_block_t* block;
+  if (!arena.head)
+    return;
+  while ((block = arena.head->next) != NULL) {
+    arena.head->next = block->next;
+    free(block);
+  }
+  if (arena.head->size > ARENA_MAX_KEPT_SIZE) {
+    free(arena.head);
+    arena.head = NULL;
+  }
+  else
+    arena.head->used = 0;
+}
+
+/** Add a block holding at least the size.
+ */
+static void AddBlock(size_t size) {
+  size_t capacity = (arena.head) ? 2 * arena.head->size : ARENA_BLOCK_SIZE;
+  arena_block_t* block;
+  if (capacity < size)
+    capacity = ARENA_ALIGN(size);
+  block = (arena_block_t*)malloc(ARENA_BLOCK_HEADER_SIZE + capacity);
+  if (!block)
+    mexErrMsgIdAndTxt("bsonmex:error", "Out of memory.");
+  block->next = arena.head;
+  block->size = capacity;
+  block->used = 0;
+  arena.head = block;
+  AddExitHandler(DestroyArena);
+}
+
+EXTERN_C void BeginArena(void) {
+  ++arena.depth;
+}
+
+EXTERN_C void EndArena(void) {
+  if (arena.depth > 0 && --arena.depth == 0)
+    ReleaseBlocks();
+}
+
+EXTERN_C void ResetArena(void) {
+  arena.depth = 0;
+  ReleaseBlocks();
+}
+
+EXTERN_C void DestroyArena(void) {
+  ResetArena();
+  free(arena.head);
+  arena.head = NULL;
+}
+
+EXTERN_C void* ArenaMalloc(size_t size) {
+  size_t required = ARENA_HEADER_SIZE + ARENA_ALIGN(size);
+  arena_header_t* header;
+  if (required < size)
+    mexErrMsgIdAndTxt("bsonmex:error", "Out of memory.");
+  if (arena.depth == 0) {
+    header = (arena_header_t*)malloc(required);
+    if (!header)
+      mexErrMsgIdAndTxt("bsonmex:error", "Out of memory.");
+    header->heap = 1;
+  }
+  else {
+    if (!arena.head || arena.head->size - arena.head->used < required)
+      AddBlock(required);
+    header = (arena_header_t*)(GetBlockData(arena.head) + arena.head->used);
+    arena.head->used += required;
+    header->heap = 0;
+  }
+  header->size = size;
+  return (uint8_t*)header + ARENA_HEADER_SIZE;
+}
+
+EXTERN_C void* ArenaCalloc(size_t count, size_t size) {
+  void* pointer;
+  if (size && count > (size_t)-1 / size)
+    mexErrMsgIdAndTxt("bsonmex:error", "Out of memory.");
+  pointer = ArenaMalloc(count * size);
+  memset(pointer, 0, count * size);
+  return pointer;
+}
+
+EXTERN_C void* ArenaRealloc(void* pointer, size_t size) {
+  arena_header_t* header;
+  void* resized;
+  if (!pointer)
+    return ArenaMalloc(size);
+  if (size == 0) {
+    ArenaFree(pointer);
+    return NULL;
+  }
+  header = GetHeader(pointer);
+  if (!header->heap && IsLatestAllocation(pointer)) {
+    size_t start = (uint8_t*)pointer - GetBlockData(arena.head);
+    if (ARENA_ALIGN(size) >= size &&
+        arena.head->size - start >= ARENA_ALIGN(size)) {
+      arena.head->used = start + ARENA_ALIGN(size);
+      header->size = size;
+      return pointer;
+    }
+  }
+  resized = ArenaMalloc(size);
+  memcpy(resized, pointer, (header->size < size) ? header->size : size);
+  ArenaFree(pointer);
+  return resized;
+}
+
+EXTERN_C void ArenaFree(void* pointer) {
+  arena_header_t* header;
+  if (!pointer)
+    return;
+  header = GetHeader(pointer);
+  if (header->heap)
+    free(header);
+  else if (IsLatestAllocation(pointer))
+    arena.head->used -= ARENA_HEADER_SIZE + ARENA_ALIGN(header->size);
+}
+
+EXTERN_C void* ArenaReallocBuffer(void* pointer, size_t size, void* context) {
+  (void)context;
+  return ArenaRealloc(pointer, size);
+}
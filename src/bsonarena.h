@@ -0,0 +1,56 @@
+/** Scratch memory arena of the encoder and the decoder.
+ *
+ * Transient buffers such as key and dimension arrays are bumped from a chain
+ * of blocks, and released at once when the outermost scope ends. Freeing the
+ * latest allocation gives the memory back for reuse within the scope. The
+ * blocks are kept for the next call up to a limit.
+ *
+ * Outside of any scope, allocations fall back to the heap. A document can
+ * grow its buffer in the arena through bson_new_from_buffer. The arena is
+ * not thread-safe and must only be used on the Matlab thread.
+ *
+ * Kota Yamaguchi 2013
+ */
+
+#ifndef __BSONARENA_H__
+#define __BSONARENA_H__
+
+#include "bsonmex.h"
+
+/** Begin a scope of the arena. Scopes may be nested.
+ */
+EXTERN_C void BeginArena(void);
+/** End a scope of the arena. The memory is released when the outermost
+ * scope ends.
+ */
+EXTERN_C void EndArena(void);
+/** End all the scopes. Call at the start of a MEX call to recover from an
+ * error in a previous call.
+ */
+EXTERN_C void ResetArena(void);
+/** Release all the memory of the arena.
+ */
+EXTERN_C void DestroyArena(void);
+/** Allocate memory from the arena.
+ * @param size size of the memory.
+ * @return allocated memory, aligned for any type.
+ */
+EXTERN_C void* ArenaMalloc(size_t size);
+/** Allocate zero-initialized memory from the arena.
+ */
+EXTERN_C void* ArenaCalloc(size_t count, size_t size);
+/** Resize memory of the arena. The latest allocation grows in place.
+ * @param pointer memory to resize, or NULL to allocate.
+ * @param size new size of the memory, or 0 to free.
+ * @return resized memory.
+ */
+EXTERN_C void* ArenaRealloc(void* pointer, size_t size);
+/** Free memory of the arena. Only the latest allocation is reused before
+ * the scope ends.
+ */
+EXTERN_C void ArenaFree(void* pointer);
+/** Resize a document buffer in the arena. The signature matches
+ * bson_realloc_func for bson_new_from_buffer.
+ */
+EXTERN_C void* ArenaReallocBuffer(void* pointer, size_t size, void* context);
+#endif /* __BSONARENA_H__ */
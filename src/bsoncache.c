@@ -0,0 +1,313 @@
+/** Decode cache implementation.
+ *
+ * Kota Yamaguchi 2013
+ */
+
+#include "bsoncache.h"
+#include <mex.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+#define HASH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define HASH_PRIME5 0x27D4EB2F165667C5ULL
+#define MIN_CACHE_SLOTS 16
+
+/** Cached value. Entries form a list from the most recently used, and are
+ * indexed by the key in an open-addressing table.
+ */
+typedef struct cache_entry_t {
+  uint64_t key;  /* Hash of the input bytes and the options. */
+  uint8_t* data; /* Copy of the input bytes. */
+  size_t length;
+  integer_class_t integer_class;
+  mxClassID float_class;
+  size_t max_depth;
+  mxArray* value; /* Persistent decoded value. */
+  struct cache_entry_t* prev;
+  struct cache_entry_t* next;
+} cache_entry_t;
+
+/** State of the cache.
+ */
+static struct {
+  cache_entry_t* head;
+  cache_entry_t* tail;
+  cache_entry_t** slots; /* Linear probing table, at most half full. */
+  size_t num_slots;      /* Power of two, or 0. */
+  decode_cache_stats_t stats;
+} cache = {NULL, NULL, NULL, 0, {0, 0, 0, 0, 0, 64, 268435456}};
+
+/** Read a 64-bit lane of the input.
+ */
+static uint64_t ReadLane(const uint8_t* input) {
+  uint64_t value;
+  memcpy(&value, input, sizeof(value));
+  return value;
+}
+
+/** Rotate bits to the left.
+ */
+static uint64_t RotateLeft(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+/** Mix a lane into an accumulator.
+ */
+static uint64_t MixLane(uint64_t accumulator, uint64_t lane) {
+  accumulator += lane * HASH_PRIME2;
+  return RotateLeft(accumulator, 31) * HASH_PRIME1;
+}
+
+/** Merge an accumulator into the hash.
+ */
+static uint64_t MergeAccumulator(uint64_t hash, uint64_t accumulator) {
+  hash ^= MixLane(0, accumulator);
+  return hash * HASH_PRIME1 + HASH_PRIME4;
+}
+
+EXTERN_C uint64_t HashBytes(const uint8_t* data, size_t length) {
+  const uint8_t* end = data + length;
+  uint64_t hash;
+  /* Four independent accumulators keep the multipliers busy. */
+  if (length >= 32) {
+    uint64_t accumulators[4];
+    accumulators[0] = HASH_PRIME1 + HASH_PRIME2;
+    accumulators[1] = HASH_PRIME2;
+    accumulators[2] = 0;
+    accumulators[3] = 0 - HASH_PRIME1;
+    while (end - data >= 32) {
+      accumulators[0] = MixLane(accumulators[0], ReadLane(data));
+      accumulators[1] = MixLane(accumulators[1], ReadLane(data + 8));
+      accumulators[2] = MixLane(accumulators[2], ReadLane(data + 16));
+      accumulators[3] = MixLane(accumulators[3], ReadLane(data + 24));
+      data += 32;
+    }
+    hash = RotateLeft(accumulators[0], 1) + RotateLeft(accumulators[1], 7) +
+           RotateLeft(accumulators[2], 12) + RotateLeft(accumulators[3], 18);
+    hash = MergeAccumulator(hash, accumulators[0]);
+    hash = MergeAccumulator(hash, accumulators[1]);
+    hash = MergeAccumulator(hash, accumulators[2]);
+    hash = MergeAccumulator(hash, accumulators[3]);
+  }
+  else
+    hash = HASH_PRIME5;
+  hash += (uint64_t)length;
+  while (end - data >= 8) {
+    hash ^= MixLane(0, ReadLane(data));
+    hash = RotateLeft(hash, 27) * HASH_PRIME1 + HASH_PRIME4;
+    data += 8;
+  }
+  while (data < end) {
+    hash ^= (*data++) * HASH_PRIME5;
+    hash = RotateLeft(hash, 11) * HASH_PRIME1;
+  }
+  hash ^= hash >> 33;
+  hash *= HASH_PRIME2;
+  hash ^= hash >> 29;
+  hash *= HASH_PRIME3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+/** Get the key of the input hash and the options.
+ */
+static uint64_t GetEntryKey(uint64_t hash, const decode_options_t* options) {
+  uint64_t key = MixLane(hash, (uint64_t)options->integer_class);
+  key = MixLane(key, (uint64_t)options->float_class);
+  return MixLane(key, (uint64_t)options->max_depth);
+}
+
+/** Put the entry in a free slot of the table.
+ */
+static void InsertSlot(cache_entry_t* entry) {
+  size_t mask = cache.num_slots - 1;
+  size_t index = (size_t)entry->key & mask;
+  while (cache.slots[index])
+    index = (index + 1) & mask;
+  cache.slots[index] = entry;
+}
+
+/** Take the entry out of the table, and shift the following entries of the
+ * probe sequence back so that no tombstone is needed.
+ */
+static void RemoveSlot(cache_entry_t* entry) {
+  size_t mask = cache.num_slots - 1;
+  size_t index = (size_t)entry->key & mask;
+  size_t next;
+  while (cache.slots[index] != entry)
+    index = (index + 1) & mask;
+  next = index;
+  while (true) {
+    size_t home;
+    next = (next + 1) & mask;
+    if (!cache.slots[next])
+      break;
+    home = (size_t)cache.slots[next]->key & mask;
+    /* Move the entry unless its home lies cyclically in (index, next]. */
+    if ((index <= next) ? (home <= index || home > next) :
+                          (home <= index && home > next)) {
+      cache.slots[index] = cache.slots[next];
+      index = next;
+    }
+  }
+  cache.slots[index] = NULL;
+}
+
+/** Grow the table to keep it at most half full with one more entry.
+ * @return false if the table cannot be allocated.
+ */
+static bool ReserveSlots(void) {
+  cache_entry_t** slots;
+  cache_entry_t* entry;
+  size_t num_slots = (cache.num_slots) ? cache.num_slots : MIN_CACHE_SLOTS;
+  while (num_slots < 2 * (cache.stats.entries + 1))
+    num_slots *= 2;
+  if (num_slots == cache.num_slots)
+    return true;
+  slots = (cache_entry_t**)calloc(num_slots, sizeof(cache_entry_t*));
+  if (!slots)
+    return false;
+  free(cache.slots);
+  cache.slots = slots;
+  cache.num_slots = num_slots;
+  for (entry = cache.head; entry; entry = entry->next)
+    InsertSlot(entry);
+  return true;
+}
+
+/** Unlink the entry from the list.
+ */
+static void UnlinkEntry(cache_entry_t* entry) {
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    cache.head = entry->next;
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  else
+    cache.tail = entry->prev;
+}
+
+/** Link the entry at the head of the list.
+ */
+static void LinkEntry(cache_entry_t* entry) {
+  entry->prev = NULL;
+  entry->next = cache.head;
+  if (cache.head)
+    cache.head->prev = entry;
+  else
+    cache.tail = entry;
+  cache.head = entry;
+}
+
+/** Remove the entry from the cache.
+ */
+static void DestroyEntry(cache_entry_t* entry) {
+  RemoveSlot(entry);
+  UnlinkEntry(entry);
+  cache.stats.entries--;
+  cache.stats.bytes -= entry->length;
+  mxDestroyArray(entry->value);
+  free(entry->data);
+  free(entry);
+}
+
+/** Evict the least recently used entries until the bounds allow the size.
+ */
+static void EvictEntries(size_t entries, size_t bytes) {
+  while (cache.tail &&
+         (cache.stats.entries + entries > cache.stats.capacity ||
+          cache.stats.bytes + bytes > cache.stats.max_bytes)) {
+    DestroyEntry(cache.tail);
+    cache.stats.evictions++;
+  }
+}
+
+EXTERN_C mxArray* FindDecodeCache(const uint8_t* data,
+                                  size_t length,
+                                  uint64_t hash,
+                                  const decode_options_t* options) {
+  uint64_t key = GetEntryKey(hash, options);
+  size_t mask = cache.num_slots - 1;
+  size_t index = (size_t)key & mask;
+  cache_entry_t* entry;
+  for (; cache.num_slots && (entry = cache.slots[index]);
+       index = (index + 1) & mask) {
+    if (entry->key == key &&
+        entry->length == length &&
+        entry->integer_class == options->integer_class &&
+        entry->float_class == options->float_class &&
+        entry->max_depth == options->max_depth &&
+        memcmp(entry->data, data, length) == 0) {
+      if (entry != cache.head) {
+        UnlinkEntry(entry);
+        LinkEntry(entry);
+      }
+      cache.stats.hits++;
+      return mxDuplicateArray(entry->value);
+    }
+  }
+  cache.stats.misses++;
+  return NULL;
+}
+
+EXTERN_C void AddDecodeCache(const uint8_t* data,
+                             size_t length,
+                             uint64_t hash,
+                             const decode_options_t* options,
+                             const mxArray* value) {
+  cache_entry_t* entry;
+  if (cache.stats.capacity == 0 || length > cache.stats.max_bytes)
+    return;
+  entry = (cache_entry_t*)malloc(sizeof(cache_entry_t));
+  if (!entry)
+    return;
+  entry->data = (uint8_t*)malloc(length ? length : 1);
+  if (!entry->data) {
+    free(entry);
+    return;
+  }
+  memcpy(entry->data, data, length);
+  entry->key = GetEntryKey(hash, options);
+  entry->length = length;
+  entry->integer_class = options->integer_class;
+  entry->float_class = options->float_class;
+  entry->max_depth = options->max_depth;
+  entry->value = mxDuplicateArray(value);
+  mexMakeArrayPersistent(entry->value);
+  EvictEntries(1, length);
+  if (!ReserveSlots()) {
+    mxDestroyArray(entry->value);
+    free(entry->data);
+    free(entry);
+    return;
+  }
+  InsertSlot(entry);
+  LinkEntry(entry);
+  cache.stats.entries++;
+  cache.stats.bytes += length;
+}
+
+EXTERN_C void SetDecodeCacheCapacity(size_t capacity, size_t max_bytes) {
+  cache.stats.capacity = capacity;
+  cache.stats.max_bytes = max_bytes;
+  EvictEntries(0, 0);
+}
+
+EXTERN_C void ClearDecodeCache(void) {
+  while (cache.head)
+    DestroyEntry(cache.head);
+  free(cache.slots);
+  cache.slots = NULL;
+  cache.num_slots = 0;
+  cache.stats.hits = 0;
+  cache.stats.misses = 0;
+  cache.stats.evictions = 0;
+}
+
+EXTERN_C void GetDecodeCacheStats(decode_cache_stats_t* stats) {
+  *stats = cache.stats;
+}
@@ -0,0 +1,68 @@
+/** Decode cache of recently decoded BSON payloads.
+ *
+ * Entries are keyed by a 64-bit hash of the input bytes and the decoder
+ * options in an open-addressing table, and confirmed by comparing the bytes,
+ * so a lookup hashes the input once. Decoded values are kept as
+ * persistent mxArrays in least-recently-used order, bounded by the number
+ * of entries and the total size of the inputs.
+ *
+ * Kota Yamaguchi 2013
+ */
+
+#ifndef __BSONCACHE_H__
+#define __BSONCACHE_H__
+
+#include "bsonmex.h"
+
+/** Statistics of the decode cache.
+ */
+typedef struct decode_cache_stats_t {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  size_t entries;   /* Number of cached values. */
+  size_t bytes;     /* Total size of the cached inputs. */
+  size_t capacity;  /* Maximum number of entries. */
+  size_t max_bytes; /* Maximum total size of the inputs. */
+} decode_cache_stats_t;
+
+/** Hash bytes to 64 bits, reading 32 bytes at a time.
+ * @param data data to hash.
+ * @param length size of the data.
+ * @return hash value.
+ */
+EXTERN_C uint64_t HashBytes(const uint8_t* data, size_t length);
+/** Find a cached value decoded from the bytes.
+ * @param data input bytes.
+ * @param length size of the input.
+ * @param hash hash of the input by HashBytes().
+ * @param options decoder options of the value.
+ * @return copy of the cached value, or NULL if not cached.
+ */
+EXTERN_C mxArray* FindDecodeCache(const uint8_t* data,
+                                  size_t length,
+                                  uint64_t hash,
+                                  const decode_options_t* options);
+/** Add a decoded value to the cache, evicting the least recently used.
+ * @param data input bytes.
+ * @param length size of the input.
+ * @param hash hash of the input by HashBytes().
+ * @param options decoder options of the value.
+ * @param value decoded value to copy into the cache.
+ */
+EXTERN_C void AddDecodeCache(const uint8_t* data,
+                             size_t length,
+                             uint64_t hash,
+                             const decode_options_t* options,
+                             const mxArray* value);
+/** Change the bounds of the cache, evicting entries over the bounds.
+ */
+EXTERN_C void SetDecodeCacheCapacity(size_t capacity, size_t max_bytes);
+/** Release all the entries and reset the statistics.
+ */
+EXTERN_C void ClearDecodeCache(void);
+/** Get statistics of the cache.
+ */
+EXTERN_C void GetDecodeCacheStats(decode_cache_stats_t* stats);
+
+#endif /* __BSONCACHE_H__ */
@@ -0,0 +1,1710 @@
+/** BSON file reader and writer implementation.
+ *
+ * Kota Yamaguchi 2013
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include "bsonio.h"
+#include <mex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <unistd.h>
+#define BSONIO_HAS_THREADS 1
+#else
+#define BSONIO_HAS_THREADS 0
+#endif
+
+#define CHUNK_PREFIX_SIZE 40
+#define CHUNK_SUBTYPE 0x81
+#define MAX_ACTIVE_FILES 2
+#define GZIP_BUFFER_SIZE 131072
+#define VALIDATE_BATCH_SIZE 4194304
+#define RANGE_BLOCK_SIZE 4194304
+
+/** Plain or gzip-compressed file.
+ */
+typedef struct io_file_t {
+  FILE* fp;
+  gzFile gz; /* Used instead of fp if compressed. */
+  bool error;
+} io_file_t;
+
+/** Chunk storage of the file.
+ */
+typedef struct chunk_file_t {
+  io_file_t* file;
+  size_t chunk_size;
+} chunk_file_t;
+
+/** Buffered output of the streaming writer.
+ */
+typedef struct stream_file_t {
+  io_file_t* file;
+  uint8_t* buffer;
+  size_t capacity;
+  size_t length;
+  uint64_t offset; /* File position of the buffer. */
+} stream_file_t;
+
+/** Buffer of whole documents read ahead.
+ */
+typedef struct prefetch_buffer_t {
+  uint8_t* data;
+  size_t capacity;
+  size_t length;
+  bool ready; /* Filled and not yet consumed. */
+  bool end;   /* No document follows the buffer. */
+  bool error;
+} prefetch_buffer_t;
+
+/** Double-buffered reader of the documents, filled by a background thread.
+ * Buffers are allocated by malloc, as mxMalloc is not thread-safe.
+ */
+typedef struct prefetch_reader_t {
+  io_file_t file;
+  prefetch_buffer_t buffers[2];
+  uint8_t prefix[CHUNK_PREFIX_SIZE]; /* Prefix of the pending document. */
+  size_t prefix_size;
+  int32_t pending_length; /* Length of a document not yet buffered. */
+  bool stop;
+  bool threaded; /* Filled by the background thread. */
+#if BSONIO_HAS_THREADS
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t condition;
+#endif
+} prefetch_reader_t;
+
+/** Check if the filename has a .gz extension.
+ */
+static bool IsGzipFilename(const char* filename) {
+  size_t length = strlen(filename);
+  return length > 3 && strcmp(filename + length - 3, ".gz") == 0;
+}
+
+/** Open a file. A file is written gzip-compressed if the filename ends with
+ * .gz, and read gzip-compressed if it starts with the gzip magic.
+ */
+static bool OpenFile(const char* filename, bool write, io_file_t* file) {
+  uint8_t magic[2];
+  bool compressed;
+  file->fp = NULL;
+  file->gz = NULL;
+  file->error = false;
+  if (write)
+    compressed = IsGzipFilename(filename);
+  else {
+    file->fp = fopen(filename, "rb");
+    if (!file->fp)
+      return false;
+    compressed = fread(magic, 1, sizeof(magic), file->fp) == sizeof(magic) &&
+                 magic[0] == 0x1f &&
+                 magic[1] == 0x8b;
+    if (!compressed) {
+      rewind(file->fp);
+      return true;
+    }
+    fclose(file->fp);
+    file->fp = NULL;
+  }
+  if (compressed) {
+    file->gz = gzopen(filename, (write) ? "wb" : "rb");
+    if (file->gz)
+      gzbuffer(file->gz, GZIP_BUFFER_SIZE);
+    return file->gz != NULL;
+  }
+  file->fp = fopen(filename, "wb");
+  return file->fp != NULL;
+}
+
+/** Close the file.
+ * @return false if any error occurred.
+ */
+static bool CloseFile(io_file_t* file) {
+  bool status = !file->error;
+  if (file->gz)
+    status = (gzclose(file->gz) == Z_OK) && status;
+  if (file->fp)
+    status = (fclose(file->fp) == 0) && status;
+  return status;
+}
+
+/** Files of the current call. A Matlab error in the converter leaves the
+ * files open here, and they are closed at the next call or at exit.
+ */
+static struct {
+  io_file_t file;
+  bool open;
+} active_files[MAX_ACTIVE_FILES];
+
+/** Close the files left open by the current call.
+ */
+static void CloseActiveFiles(void) {
+  int i;
+  for (i = 0; i < MAX_ACTIVE_FILES; ++i) {
+    if (active_files[i].open) {
+      active_files[i].open = false;
+      CloseFile(&active_files[i].file);
+    }
+  }
+}
+
+/** Open a file of the current call, which is closed by CloseActiveFiles if
+ * the call does not close it.
+ * @return the file, or NULL on error.
+ */
+static io_file_t* OpenActiveFile(const char* filename, bool write) {
+  int i;
+  AddExitHandler(CloseActiveFiles);
+  for (i = 0; i < MAX_ACTIVE_FILES; ++i) {
+    if (!active_files[i].open) {
+      if (!OpenFile(filename, write, &active_files[i].file))
+        return NULL;
+      active_files[i].open = true;
+      return &active_files[i].file;
+    }
+  }
+  return NULL;
+}
+
+/** Close a file opened by OpenActiveFile.
+ * @return false if any error occurred.
+ */
+static bool CloseActiveFile(io_file_t* file) {
+  int i;
+  for (i = 0; i < MAX_ACTIVE_FILES; ++i) {
+    if (&active_files[i].file == file)
+      active_files[i].open = false;
+  }
+  return CloseFile(file);
+}
+
+/** Read bytes of the file.
+ * @return number of bytes read. Short at the end of the file or on error.
+ */
+static size_t ReadBytes(io_file_t* file, void* data, size_t size) {
+  size_t total = 0;
+  if (!file->gz) {
+    total = fread(data, 1, size, file->fp);
+    file->error = file->error || ferror(file->fp);
+    return total;
+  }
+  /* gzread reads at most UINT_MAX bytes at a time. */
+  while (total < size) {
+    unsigned length = (unsigned)BSON_MIN(size - total, 1u << 30);
+    int result = gzread(file->gz, (uint8_t*)data + total, length);
+    if (result <= 0) {
+      file->error = file->error || result < 0;
+      break;
+    }
+    total += (size_t)result;
+  }
+  return total;
+}
+
+/** Write bytes to the file.
+ */
+static bool WriteBytes(io_file_t* file, const void* data, size_t size) {
+  size_t total = 0;
+  if (!file->gz)
+    return fwrite(data, 1, size, file->fp) == size;
+  while (total < size) {
+    unsigned length = (unsigned)BSON_MIN(size - total, 1u << 30);
+    if (gzwrite(file->gz, (const uint8_t*)data + total, length) !=
+        (int)length)
+      return false;
+    total += length;
+  }
+  return true;
+}
+
+/** Get the current position of the file. The position of a compressed file
+ * is in the uncompressed bytes.
+ * @return position, or negative on failure.
+ */
+static int64_t TellFile(io_file_t* file) {
+  if (file->gz)
+    return (int64_t)gztell(file->gz);
+#if defined(_WIN32)
+  return (int64_t)_ftelli64(file->fp);
+#else
+  return (int64_t)ftello(file->fp);
+#endif
+}
+
+/** Set the current position of the file. Seeking a compressed file is
+ * emulated by zlib, and backward seeks restart the decompression.
+ */
+static bool SeekFile(io_file_t* file, int64_t offset) {
+  if (file->gz)
+    return offset == (int64_t)(z_off_t)offset &&
+           gzseek(file->gz, (z_off_t)offset, SEEK_SET) == (z_off_t)offset;
+#if defined(_WIN32)
+  return _fseeki64(file->fp, offset, SEEK_SET) == 0;
+#else
+  return fseeko(file->fp, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+/** Get the size of a plain file. The position of the file is kept.
+ * @return size of the file, or -1 if unknown as for a compressed file.
+ */
+static int64_t GetFileSize(io_file_t* file) {
+  int64_t position;
+  int64_t size;
+  if (file->gz)
+    return -1;
+  position = TellFile(file);
+#if defined(_WIN32)
+  if (position < 0 || _fseeki64(file->fp, 0, SEEK_END) != 0)
+    return -1;
+#else
+  if (position < 0 || fseeko(file->fp, 0, SEEK_END) != 0)
+    return -1;
+#endif
+  size = TellFile(file);
+  return SeekFile(file, position) ? size : -1;
+}
+
+/** Write a little-endian integer of the given size.
+ */
+static uint8_t* WriteLittleEndian(uint64_t value, int size, uint8_t* output) {
+  int i;
+  for (i = 0; i < size; ++i)
+    output[i] = (uint8_t)(value >> (8 * i));
+  return output + size;
+}
+
+/** Read a little-endian int32 value.
+ */
+static int32_t ReadInt32(const uint8_t* input) {
+  return (int32_t)((uint32_t)input[0] |
+                   ((uint32_t)input[1] << 8) |
+                   ((uint32_t)input[2] << 16) |
+                   ((uint32_t)input[3] << 24));
+}
+
+/** Write the BSON bytes of a chunk document preceding the data. The
+ * document ends with the data and a terminating zero.
+ */
+static void WriteChunkPrefix(uint64_t files_id,
+                             int32_t n,
+                             size_t length,
+                             uint8_t* output) {
+  output = WriteLittleEndian(CHUNK_PREFIX_SIZE + length + 1, 4, output);
+  memcpy(output, "\x12" "files_id", 10);
+  output = WriteLittleEndian(files_id, 8, output + 10);
+  memcpy(output, "\x10" "n", 3);
+  output = WriteLittleEndian((uint32_t)n, 4, output + 3);
+  memcpy(output, "\x05" "data", 6);
+  output = WriteLittleEndian(length, 4, output + 6);
+  *output = CHUNK_SUBTYPE;
+}
+
+/** Check if the document starting with the prefix at the position of the
+ * file is a chunk document. Besides the reserved subtype, the files_id of a
+ * chunk is the position of the first chunk, and every chunk before it has
+ * the same size, so a document of the same shape is not taken for a chunk.
+ */
+static bool IsChunkDocument(const uint8_t* prefix,
+                            int32_t length,
+                            int64_t position) {
+  uint64_t files_id;
+  uint64_t distance;
+  uint32_t n;
+  if (length <= CHUNK_PREFIX_SIZE ||
+      position < 0 ||
+      memcmp(prefix + 4, "\x12" "files_id", 10) != 0 ||
+      memcmp(prefix + 22, "\x10" "n", 3) != 0 ||
+      memcmp(prefix + 29, "\x05" "data", 6) != 0 ||
+      ReadInt32(prefix + 35) != length - CHUNK_PREFIX_SIZE - 1 ||
+      prefix[39] != CHUNK_SUBTYPE)
+    return false;
+  files_id = (uint64_t)(uint32_t)ReadInt32(prefix + 14) |
+             ((uint64_t)(uint32_t)ReadInt32(prefix + 18) << 32);
+  n = (uint32_t)ReadInt32(prefix + 25);
+  if (files_id > (uint64_t)position)
+    return false;
+  distance = (uint64_t)position - files_id;
+  if (n == 0)
+    return distance == 0;
+  return distance % n == 0 && distance / n >= (uint64_t)length;
+}
+
+/** Write the array data in chunk documents at the end of the file.
+ */
+static bool WriteChunks(const mxArray* input,
+                        void* context,
+                        uint64_t* offset) {
+  chunk_file_t* file = (chunk_file_t*)context;
+  const uint8_t* data = (const uint8_t*)mxGetData(input);
+  size_t size = mxGetNumberOfElements(input) * mxGetElementSize(input);
+  int64_t position = TellFile(file->file);
+  int32_t n;
+  if (position < 0)
+    return false;
+  *offset = (uint64_t)position;
+  for (n = 0; size; ++n) {
+    uint8_t prefix[CHUNK_PREFIX_SIZE];
+    size_t length = (size < file->chunk_size) ? size : file->chunk_size;
+    if (n == INT32_MAX)
+      return false;
+    WriteChunkPrefix(*offset, n, length, prefix);
+    if (!WriteBytes(file->file, prefix, sizeof(prefix)) ||
+        !WriteBytes(file->file, data, length) ||
+        !WriteBytes(file->file, "", 1))
+      return false;
+    data += length;
+    size -= length;
+  }
+  return true;
+}
+
+/** Read the array data from chunk documents.
+ */
+static bool ReadChunks(uint64_t offset,
+                       size_t chunk_size,
+                       uint8_t* data,
+                       size_t size,
+                       void* context) {
+  io_file_t* file = (io_file_t*)context;
+  int32_t n;
+  if (offset > INT64_MAX ||
+      chunk_size > BSONIO_MAX_CHUNK_SIZE ||
+      !SeekFile(file, (int64_t)offset))
+    return false;
+  for (n = 0; size; ++n) {
+    uint8_t expected_prefix[CHUNK_PREFIX_SIZE];
+    uint8_t prefix[CHUNK_PREFIX_SIZE];
+    uint8_t terminator;
+    size_t length = (size < chunk_size) ? size : chunk_size;
+    if (n == INT32_MAX)
+      return false;
+    WriteChunkPrefix(offset, n, length, expected_prefix);
+    if (ReadBytes(file, prefix, sizeof(prefix)) != sizeof(prefix) ||
+        memcmp(prefix, expected_prefix, sizeof(prefix)) != 0 ||
+        ReadBytes(file, data, length) != length ||
+        ReadBytes(file, &terminator, 1) != 1 ||
+        terminator != 0)
+      return false;
+    data += length;
+    size -= length;
+  }
+  return true;
+}
+
+/** Write the buffer of the stream to the file.
+ */
+static bool FlushStreamFile(stream_file_t* file) {
+  if (file->length && !WriteBytes(file->file, file->buffer, file->length))
+    return false;
+  file->offset += file->length;
+  file->length = 0;
+  return true;
+}
+
+/** Append data to the stream. Data larger than the buffer is written
+ * directly.
+ */
+static bool WriteStreamFile(const uint8_t* data, size_t size, void* context) {
+  stream_file_t* file = (stream_file_t*)context;
+  if (file->length + size > file->capacity) {
+    if (!FlushStreamFile(file))
+      return false;
+    if (size >= file->capacity) {
+      if (!WriteBytes(file->file, data, size))
+        return false;
+      file->offset += size;
+      return true;
+    }
+  }
+  memcpy(file->buffer + file->length, data, size);
+  file->length += size;
+  return true;
+}
+
+/** Overwrite data of the stream, in the file by a positioned write if
+ * already flushed.
+ */
+static bool PatchStreamFile(uint64_t position,
+                            const uint8_t* data,
+                            size_t size,
+                            void* context) {
+  stream_file_t* file = (stream_file_t*)context;
+  if (position + size > file->offset + file->length)
+    return false;
+  if (position < file->offset) {
+    size_t flushed_size = (size_t)BSON_MIN(size, file->offset - position);
+    if (file->file->gz ||
+        !SeekFile(file->file, (int64_t)position) ||
+        !WriteBytes(file->file, data, flushed_size) ||
+        !SeekFile(file->file, (int64_t)file->offset))
+      return false;
+    position += flushed_size;
+    data += flushed_size;
+    size -= flushed_size;
+  }
+  memcpy(file->buffer + (position - file->offset), data, size);
+  return true;
+}
+
+/** Stream the document of mxArray to the file.
+ */
+static bool StreamBSONFile(io_file_t* output,
+                           const mxArray* input,
+                           const encode_options_t* options,
+                           size_t buffer_size) {
+  stream_file_t file;
+  stream_writer_t writer;
+  bool status;
+  file.file = output;
+  file.buffer = (uint8_t*)mxMalloc(buffer_size);
+  file.capacity = buffer_size;
+  file.length = 0;
+  file.offset = 0;
+  writer.write = WriteStreamFile;
+  writer.patch = PatchStreamFile;
+  writer.buffer_size = buffer_size;
+  writer.context = &file;
+  /* The stream buffer is the only buffer. */
+  if (output->fp)
+    setvbuf(output->fp, NULL, _IONBF, 0);
+  status = ConvertMxArrayToBSONStream(input, options, &writer) &&
+           FlushStreamFile(&file);
+  mxFree(file.buffer);
+  return status;
+}
+
+/** Read the rest of the document after its prefix, and decode it. The file
+ * is read forward only, as seeking back is slow in a gzip file.
+ * @param prefix bytes of the document already read.
+ */
+static mxArray* ReadDocument(io_file_t* file,
+                             const uint8_t* prefix,
+                             size_t prefix_size,
+                             int32_t length,
+                             const decode_options_t* options) {
+  uint8_t* data = (uint8_t*)mxMalloc(length);
+  mxArray* value = NULL;
+  bson_t document;
+  memcpy(data, prefix, prefix_size);
+  if (ReadBytes(file, data + prefix_size, length - prefix_size) ==
+          length - prefix_size &&
+      bson_init_static(&document, data, length))
+    ConvertBSONToMxArray(&document, options, &value);
+  mxFree(data);
+  return value;
+}
+
+/** Read the prefix of the next document that is not a chunk.
+ * @return false at the end of the file or on error.
+ */
+static bool ReadNextPrefix(prefetch_reader_t* reader, bool* error) {
+  while (true) {
+    int64_t position = TellFile(&reader->file);
+    int32_t length;
+    size_t prefix_size = ReadBytes(&reader->file,
+                                   reader->prefix,
+                                   sizeof(int32_t));
+    if (prefix_size != sizeof(int32_t)) {
+      *error = prefix_size != 0 || reader->file.error;
+      return false;
+    }
+    length = ReadInt32(reader->prefix);
+    reader->prefix_size = sizeof(int32_t);
+    if (length > CHUNK_PREFIX_SIZE) {
+      reader->prefix_size = CHUNK_PREFIX_SIZE;
+      if (ReadBytes(&reader->file,
+                    reader->prefix + sizeof(int32_t),
+                    CHUNK_PREFIX_SIZE - sizeof(int32_t)) !=
+          CHUNK_PREFIX_SIZE - sizeof(int32_t)) {
+        *error = true;
+        return false;
+      }
+    }
+    else if (length < 5) {
+      *error = true;
+      return false;
+    }
+    if (!IsChunkDocument(reader->prefix, length, position)) {
+      reader->pending_length = length;
+      return true;
+    }
+    /* Chunks are read on reference by the decoder. */
+    if (!SeekFile(&reader->file,
+                  TellFile(&reader->file) + length - CHUNK_PREFIX_SIZE)) {
+      *error = true;
+      return false;
+    }
+  }
+}
+
+/** Fill the buffer with whole documents up to the capacity, validating each
+ * document. A document larger than the capacity is buffered alone.
+ */
+static void FillPrefetchBuffer(prefetch_reader_t* reader,
+                               prefetch_buffer_t* buffer) {
+  buffer->length = 0;
+  while (true) {
+    size_t length;
+    bson_t document;
+    if (!reader->pending_length &&
+        !ReadNextPrefix(reader, &buffer->error)) {
+      buffer->end = true;
+      return;
+    }
+    length = (size_t)reader->pending_length;
+    if (buffer->length + length > buffer->capacity) {
+      uint8_t* data;
+      if (buffer->length)
+        return;
+      data = (uint8_t*)realloc(buffer->data, length);
+      if (!data) {
+        buffer->error = true;
+        buffer->end = true;
+        return;
+      }
+      buffer->data = data;
+      buffer->capacity = length;
+    }
+    memcpy(buffer->data + buffer->length, reader->prefix, reader->prefix_size);
+    if (ReadBytes(&reader->file,
+                  buffer->data + buffer->length + reader->prefix_size,
+                  length - reader->prefix_size) !=
+            length - reader->prefix_size ||
+        !bson_init_static(&document, buffer->data + buffer->length, length) ||
+        !bson_validate(&document, BSON_VALIDATE_NONE, NULL)) {
+      buffer->error = true;
+      buffer->end = true;
+      return;
+    }
+    buffer->length += length;
+    reader->pending_length = 0;
+  }
+}
+
+#if BSONIO_HAS_THREADS
+/** Fill the buffers in turn while the other buffer is decoded.
+ */
+static void* PrefetchThread(void* context) {
+  prefetch_reader_t* reader = (prefetch_reader_t*)context;
+  int index = 0;
+  while (true) {
+    prefetch_buffer_t* buffer = &reader->buffers[index];
+    pthread_mutex_lock(&reader->mutex);
+    while (buffer->ready && !reader->stop)
+      pthread_cond_wait(&reader->condition, &reader->mutex);
+    if (reader->stop) {
+      pthread_mutex_unlock(&reader->mutex);
+      break;
+    }
+    pthread_mutex_unlock(&reader->mutex);
+    FillPrefetchBuffer(reader, buffer);
+    pthread_mutex_lock(&reader->mutex);
+    buffer->ready = true;
+    pthread_cond_broadcast(&reader->condition);
+    pthread_mutex_unlock(&reader->mutex);
+    if (buffer->end)
+      break;
+    index = 1 - index;
+  }
+  return NULL;
+}
+#endif
+
+/** Get the next filled buffer, filling it in place without threads.
+ */
+static prefetch_buffer_t* AcquirePrefetchBuffer(prefetch_reader_t* reader,
+                                                int index,
+                                                bool threaded) {
+  prefetch_buffer_t* buffer = &reader->buffers[index];
+#if BSONIO_HAS_THREADS
+  if (threaded) {
+    pthread_mutex_lock(&reader->mutex);
+    while (!buffer->ready)
+      pthread_cond_wait(&reader->condition, &reader->mutex);
+    pthread_mutex_unlock(&reader->mutex);
+    return buffer;
+  }
+#endif
+  FillPrefetchBuffer(reader, buffer);
+  return buffer;
+}
+
+/** Return the consumed buffer to the background thread.
+ */
+static void ReleasePrefetchBuffer(prefetch_reader_t* reader,
+                                  prefetch_buffer_t* buffer,
+                                  bool threaded) {
+#if BSONIO_HAS_THREADS
+  if (threaded) {
+    pthread_mutex_lock(&reader->mutex);
+    buffer->ready = false;
+    pthread_cond_broadcast(&reader->condition);
+    pthread_mutex_unlock(&reader->mutex);
+  }
+#endif
+}
+
+/** Decoded values of the documents.
+ */
+typedef struct value_list_t {
+  mxArray** values;
+  size_t size;
+} value_list_t;
+
+/** Append a decoded value to the list.
+ */
+static void AppendValue(value_list_t* list, mxArray* value) {
+  list->values = (mxArray**)mxRealloc(list->values,
+                                      (list->size + 1) * sizeof(mxArray*));
+  list->values[list->size++] = value;
+}
+
+/** Create the output of the values and release the list.
+ * @param status false to discard the values.
+ * @return true if any value is created.
+ */
+static bool CreateValueOutput(value_list_t* list,
+                              bool status,
+                              mxArray** output) {
+  size_t i;
+  if (status && list->size == 1)
+    *output = list->values[0];
+  else if (status && list->size > 1) {
+    *output = mxCreateCellMatrix(1, list->size);
+    for (i = 0; i < list->size; ++i)
+      mxSetCell(*output, i, list->values[i]);
+  }
+  else {
+    for (i = 0; i < list->size; ++i)
+      mxDestroyArray(list->values[i]);
+    status = false;
+  }
+  if (list->values)
+    mxFree(list->values);
+  return status;
+}
+
+/** Decode each document of the file, skipping chunks that are read on
+ * reference.
+ */
+static bool ReadFileDocuments(io_file_t* file,
+                              const decode_options_t* options,
+                              value_list_t* list) {
+  while (true) {
+    uint8_t prefix[CHUNK_PREFIX_SIZE];
+    int64_t position = TellFile(file);
+    size_t prefix_size = ReadBytes(file, prefix, sizeof(int32_t));
+    int32_t length;
+    if (prefix_size != sizeof(int32_t))
+      return prefix_size == 0 && !file->error;
+    length = ReadInt32(prefix);
+    if (length < 5)
+      return false;
+    /* Read the prefix without passing the end of the document. */
+    prefix_size = (length < CHUNK_PREFIX_SIZE) ?
+        (size_t)length : CHUNK_PREFIX_SIZE;
+    if (ReadBytes(file,
+                  prefix + sizeof(int32_t),
+                  prefix_size - sizeof(int32_t)) !=
+        prefix_size - sizeof(int32_t))
+      return false;
+    if (IsChunkDocument(prefix, length, position)) {
+      /* Chunks are read on reference by the decoder. */
+      if (!SeekFile(file, TellFile(file) + length - prefix_size))
+        return false;
+    }
+    else {
+      mxArray* value = ReadDocument(file,
+                                    prefix,
+                                    prefix_size,
+                                    length,
+                                    options);
+      if (!value)
+        return false;
+      AppendValue(list, value);
+    }
+  }
+}
+
+/** Reader of the current call. A Matlab error in the decoder leaves the
+ * reader here, and it is stopped at the next call or at exit.
+ */
+static prefetch_reader_t* active_prefetch_reader = NULL;
+
+/** Stop the background thread of the active reader and release it.
+ */
+static void DestroyPrefetchReader(void) {
+  prefetch_reader_t* reader = active_prefetch_reader;
+  int i;
+  if (!reader)
+    return;
+  active_prefetch_reader = NULL;
+#if BSONIO_HAS_THREADS
+  if (reader->threaded) {
+    pthread_mutex_lock(&reader->mutex);
+    reader->stop = true;
+    pthread_cond_broadcast(&reader->condition);
+    pthread_mutex_unlock(&reader->mutex);
+    pthread_join(reader->thread, NULL);
+  }
+  pthread_cond_destroy(&reader->condition);
+  pthread_mutex_destroy(&reader->mutex);
+#endif
+  for (i = 0; i < 2; ++i)
+    free(reader->buffers[i].data);
+  CloseFile(&reader->file);
+  free(reader);
+}
+
+/** Decode each document of the file while the following documents are read
+ * ahead in the background.
+ */
+static bool PrefetchFileDocuments(const char* filename,
+                                  const decode_options_t* options,
+                                  size_t read_ahead,
+                                  value_list_t* list) {
+  prefetch_reader_t* reader;
+  bool status = true;
+  int index = 0;
+  int i;
+  DestroyPrefetchReader();
+  reader = (prefetch_reader_t*)calloc(1, sizeof(prefetch_reader_t));
+  if (!reader)
+    return false;
+  if (!OpenFile(filename, false, &reader->file)) {
+    free(reader);
+    return false;
+  }
+  for (i = 0; i < 2; ++i) {
+    reader->buffers[i].data = (uint8_t*)malloc(read_ahead);
+    reader->buffers[i].capacity = (reader->buffers[i].data) ? read_ahead : 0;
+  }
+#if BSONIO_HAS_THREADS
+  pthread_mutex_init(&reader->mutex, NULL);
+  pthread_cond_init(&reader->condition, NULL);
+  reader->threaded = pthread_create(&reader->thread,
+                                    NULL,
+                                    PrefetchThread,
+                                    reader) == 0;
+#endif
+  active_prefetch_reader = reader;
+  AddExitHandler(DestroyPrefetchReader);
+  while (status) {
+    prefetch_buffer_t* buffer = AcquirePrefetchBuffer(reader,
+                                                      index,
+                                                      reader->threaded);
+    size_t position = 0;
+    bool end = buffer->end;
+    status = !buffer->error;
+    while (status && position < buffer->length) {
+      int32_t length = ReadInt32(buffer->data + position);
+      bson_t document;
+      mxArray* value = NULL;
+      if (bson_init_static(&document, buffer->data + position, length))
+        ConvertBSONToMxArray(&document, options, &value);
+      if (value)
+        AppendValue(list, value);
+      status = value != NULL;
+      position += length;
+    }
+    ReleasePrefetchBuffer(reader, buffer, reader->threaded);
+    if (end)
+      break;
+    index = 1 - index;
+  }
+  DestroyPrefetchReader();
+  return status;
+}
+
+/** Decode documents in the byte range of the file by a positioned read.
+ * Without the length, one document at the offset is read.
+ */
+static bool ReadRangeDocuments(io_file_t* file,
+                               const decode_options_t* options,
+                               const read_options_t* read_options,
+                               value_list_t* list) {
+  uint64_t length = read_options->length;
+  uint8_t* data;
+  size_t position = 0;
+  bool status;
+  if (read_options->offset > INT64_MAX ||
+      !SeekFile(file, (int64_t)read_options->offset))
+    return false;
+  if (length == 0) {
+    uint8_t prefix[4];
+    int32_t document_length;
+    if (ReadBytes(file, prefix, sizeof(prefix)) != sizeof(prefix))
+      return false;
+    document_length = ReadInt32(prefix);
+    if (document_length < 5)
+      return false;
+    length = (uint64_t)document_length;
+    data = (uint8_t*)mxMalloc(length);
+    memcpy(data, prefix, sizeof(prefix));
+    status = ReadBytes(file, data + sizeof(prefix), length - sizeof(prefix)) ==
+             length - sizeof(prefix);
+  }
+  else {
+    int64_t size = GetFileSize(file);
+    size_t capacity;
+    size_t filled = 0;
+    /* The range ends at the end of the file. The size of a compressed file
+     * is unknown, so the buffer grows as the data is read. */
+    if (size >= 0)
+      length = ((uint64_t)size > read_options->offset) ?
+          BSON_MIN(length, (uint64_t)size - read_options->offset) : 0;
+    if (length > SIZE_MAX)
+      return false;
+    capacity = (size >= 0) ?
+        (size_t)length : (size_t)BSON_MIN(length, RANGE_BLOCK_SIZE);
+    data = (uint8_t*)mxMalloc(capacity);
+    while (true) {
+      filled += ReadBytes(file, data + filled, capacity - filled);
+      if (filled < capacity || capacity == length)
+        break;
+      capacity = (size_t)BSON_MIN(length, 2 * (uint64_t)capacity);
+      data = (uint8_t*)mxRealloc(data, capacity);
+    }
+    status = !file->error;
+    length = filled;
+  }
+  while (status && position < length) {
+    int32_t document_length;
+    bson_t document;
+    mxArray* value = NULL;
+    if (length - position < 5) {
+      status = false;
+      break;
+    }
+    document_length = ReadInt32(data + position);
+    if (document_length < 5 ||
+        (uint64_t)document_length > length - position) {
+      status = false;
+      break;
+    }
+    if (!IsChunkDocument(data + position,
+                         document_length,
+                         (int64_t)(read_options->offset + position))) {
+      if (bson_init_static(&document, data + position, document_length))
+        ConvertBSONToMxArray(&document, options, &value);
+      if (!value) {
+        status = false;
+        break;
+      }
+      AppendValue(list, value);
+    }
+    position += document_length;
+  }
+  mxFree(data);
+  return status;
+}
+
+/** Batch of documents formatted as JSON by the workers.
+ */
+typedef struct export_batch_t {
+  prefetch_buffer_t buffer;
+  size_t* offsets;
+  char** json;
+  size_t* json_lengths;
+  size_t num_documents;
+  size_t capacity;
+} export_batch_t;
+
+/** Worker formatting a range of documents of the batch.
+ */
+typedef struct export_worker_t {
+  export_batch_t* batch;
+  size_t begin;
+  size_t end;
+#if BSONIO_HAS_THREADS
+  pthread_t thread;
+  bool started;
+#endif
+} export_worker_t;
+
+/** Fill the batch with documents and index them.
+ * @return false on error.
+ */
+static bool FillExportBatch(prefetch_reader_t* reader, export_batch_t* batch) {
+  size_t position = 0;
+  FillPrefetchBuffer(reader, &batch->buffer);
+  batch->num_documents = 0;
+  while (position < batch->buffer.length) {
+    if (batch->num_documents == batch->capacity) {
+      size_t capacity = (batch->capacity) ? 2 * batch->capacity : 1024;
+      size_t* offsets = (size_t*)realloc(batch->offsets,
+                                         capacity * sizeof(size_t));
+      char** json = (char**)realloc(batch->json, capacity * sizeof(char*));
+      size_t* json_lengths;
+      if (offsets)
+        batch->offsets = offsets;
+      if (json)
+        batch->json = json;
+      json_lengths = (size_t*)realloc(batch->json_lengths,
+                                      capacity * sizeof(size_t));
+      if (json_lengths)
+        batch->json_lengths = json_lengths;
+      if (!offsets || !json || !json_lengths)
+        return false;
+      batch->capacity = capacity;
+    }
+    batch->offsets[batch->num_documents] = position;
+    batch->json[batch->num_documents++] = NULL;
+    position += ReadInt32(batch->buffer.data + position);
+  }
+  return !batch->buffer.error;
+}
+
+/** Format the range of documents as JSON.
+ */
+static void* FormatJSONDocuments(void* context) {
+  export_worker_t* worker = (export_worker_t*)context;
+  export_batch_t* batch = worker->batch;
+  size_t i;
+  for (i = worker->begin; i < worker->end; ++i) {
+    const uint8_t* data = batch->buffer.data + batch->offsets[i];
+    bson_t document;
+    if (bson_init_static(&document, data, ReadInt32(data)))
+      batch->json[i] = bson_as_json(&document, &batch->json_lengths[i]);
+  }
+  return NULL;
+}
+
+/** Start formatting the batch, splitting documents among the workers.
+ */
+static void StartExportBatch(export_batch_t* batch,
+                             export_worker_t* workers,
+                             int num_workers) {
+  size_t step = (batch->num_documents + num_workers - 1) / num_workers;
+  int i;
+  for (i = 0; i < num_workers; ++i) {
+    workers[i].batch = batch;
+    workers[i].begin = BSON_MIN(i * step, batch->num_documents);
+    workers[i].end = BSON_MIN(workers[i].begin + step, batch->num_documents);
+#if BSONIO_HAS_THREADS
+    workers[i].started = workers[i].begin < workers[i].end &&
+                         pthread_create(&workers[i].thread,
+                                        NULL,
+                                        FormatJSONDocuments,
+                                        &workers[i]) == 0;
+    if (!workers[i].started)
+#endif
+      FormatJSONDocuments(&workers[i]);
+  }
+}
+
+/** Wait for the workers formatting the batch.
+ */
+static void JoinExportBatch(export_worker_t* workers, int num_workers) {
+#if BSONIO_HAS_THREADS
+  int i;
+  for (i = 0; i < num_workers; ++i)
+    if (workers[i].started)
+      pthread_join(workers[i].thread, NULL);
+#endif
+}
+
+/** Write the formatted documents in order, one per line, and release them.
+ */
+static bool WriteExportBatch(io_file_t* file,
+                             export_batch_t* batch,
+                             bool status) {
+  size_t i;
+  for (i = 0; i < batch->num_documents; ++i) {
+    status = status &&
+             batch->json[i] &&
+             WriteBytes(file, batch->json[i], batch->json_lengths[i]) &&
+             WriteBytes(file, "\n", 1);
+    if (batch->json[i])
+      bson_free(batch->json[i]);
+    batch->json[i] = NULL;
+  }
+  batch->num_documents = 0;
+  return status;
+}
+
+/** Get the number of processors.
+ */
+static int GetNumProcessors() {
+#if BSONIO_HAS_THREADS && defined(_SC_NPROCESSORS_ONLN)
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return (count > 0) ? (int)count : 1;
+#else
+  return 1;
+#endif
+}
+
+EXTERN_C bool ExportJSONFile(const char* input_filename,
+                             const char* output_filename,
+                             const export_options_t* options) {
+  prefetch_reader_t reader;
+  export_batch_t batches[2];
+  export_worker_t* workers;
+  io_file_t output;
+  int num_workers = (options->num_threads > 0) ?
+      options->num_threads : GetNumProcessors();
+  int index = 0;
+  bool has_previous = false;
+  bool status = true;
+  int i;
+  memset(&reader, 0, sizeof(reader));
+  memset(batches, 0, sizeof(batches));
+  if (!OpenFile(input_filename, false, &reader.file))
+    return false;
+  if (!OpenFile(output_filename, true, &output)) {
+    CloseFile(&reader.file);
+    return false;
+  }
+  workers = (export_worker_t*)mxCalloc(num_workers, sizeof(export_worker_t));
+  for (i = 0; i < 2; ++i) {
+    batches[i].buffer.data = (uint8_t*)malloc(options->batch_size);
+    batches[i].buffer.capacity =
+        (batches[i].buffer.data) ? options->batch_size : 0;
+  }
+  /* Workers format a batch while the previous batch is written and the next
+   * batch is read. */
+  status = FillExportBatch(&reader, &batches[index]);
+  while (status) {
+    bool has_next = !batches[index].buffer.end;
+    StartExportBatch(&batches[index], workers, num_workers);
+    if (has_previous)
+      status = WriteExportBatch(&output, &batches[1 - index], status);
+    if (has_next)
+      status = FillExportBatch(&reader, &batches[1 - index]) && status;
+    JoinExportBatch(workers, num_workers);
+    if (!has_next || !status) {
+      status = WriteExportBatch(&output, &batches[index], status);
+      break;
+    }
+    has_previous = true;
+    index = 1 - index;
+  }
+  for (i = 0; i < 2; ++i) {
+    WriteExportBatch(&output, &batches[i], false);
+    free(batches[i].buffer.data);
+    free(batches[i].offsets);
+    free(batches[i].json);
+    free(batches[i].json_lengths);
+  }
+  mxFree(workers);
+  CloseFile(&reader.file);
+  return CloseFile(&output) && status;
+}
+
+/** Splitter of JSON text into top-level object records. The state is kept
+ * across the buffers of the text.
+ */
+typedef struct json_splitter_t {
+  int depth;          /* Nesting depth inside the current record. */
+  bool in_string;
+  bool escape;
+  bool started;       /* Any non-whitespace character seen. */
+  bool array;         /* Records are elements of a top-level array. */
+  bool closed;        /* Top-level array closed. */
+  bool expect_record; /* After the opening bracket or a comma. */
+  bool after_comma;
+  size_t record_start; /* Position of the current record in the buffer. */
+  size_t offset;       /* Position of the buffer in the file. */
+  size_t error_offset; /* Position of a syntax error in the file. */
+} json_splitter_t;
+
+/** Range of a record in the text buffer.
+ */
+typedef struct json_record_t {
+  size_t offset;
+  size_t length;
+} json_record_t;
+
+/** Worker converting a range of records to concatenated BSON documents.
+ * Output is allocated by malloc, as mxMalloc is not thread-safe.
+ */
+typedef struct import_worker_t {
+  const char* text;
+  const json_record_t* records;
+  size_t num_records;
+  uint8_t* output;
+  size_t length;
+  size_t capacity;
+  bool error;
+#if BSONIO_HAS_THREADS
+  pthread_t thread;
+  bool started;
+#endif
+} import_worker_t;
+
+/** Check if the character is JSON whitespace.
+ */
+static bool IsJSONWhitespace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/** Keep the position of a syntax error at the position of the buffer.
+ * @return false.
+ */
+static bool SetJSONSplitError(json_splitter_t* splitter, size_t position) {
+  splitter->error_offset = splitter->offset + position;
+  return false;
+}
+
+/** Scan the text for complete records, either concatenated or
+ * newline-delimited objects, or objects in a top-level array.
+ * @return false on a malformed record boundary.
+ */
+static bool SplitJSONRecords(json_splitter_t* splitter,
+                             const char* text,
+                             size_t begin,
+                             size_t end,
+                             json_record_t** records,
+                             size_t* num_records,
+                             size_t* capacity) {
+  size_t i;
+  for (i = begin; i < end; ++i) {
+    char c = text[i];
+    if (splitter->in_string) {
+      if (splitter->escape)
+        splitter->escape = false;
+      else if (c == '\\')
+        splitter->escape = true;
+      else if (c == '"')
+        splitter->in_string = false;
+      continue;
+    }
+    if (splitter->depth == 0) {
+      if (IsJSONWhitespace(c))
+        continue;
+      if (!splitter->started) {
+        splitter->started = true;
+        splitter->array = (c == '[');
+        splitter->expect_record = true;
+        if (splitter->array)
+          continue;
+      }
+      if (splitter->closed)
+        return SetJSONSplitError(splitter, i);
+      /* Elements are separated by single commas without a trailing one. */
+      if (splitter->array && c == ',') {
+        if (splitter->expect_record)
+          return SetJSONSplitError(splitter, i);
+        splitter->expect_record = true;
+        splitter->after_comma = true;
+        continue;
+      }
+      if (splitter->array && c == ']') {
+        if (splitter->after_comma)
+          return SetJSONSplitError(splitter, i);
+        splitter->closed = true;
+        continue;
+      }
+      if (c != '{' || (splitter->array && !splitter->expect_record))
+        return SetJSONSplitError(splitter, i);
+      splitter->record_start = i;
+    }
+    if (c == '"')
+      splitter->in_string = true;
+    else if (c == '{' || c == '[')
+      ++splitter->depth;
+    else if ((c == '}' || c == ']') && --splitter->depth == 0) {
+      if (*num_records == *capacity) {
+        size_t new_capacity = (*capacity) ? 2 * *capacity : 1024;
+        json_record_t* new_records = (json_record_t*)realloc(
+            *records, new_capacity * sizeof(json_record_t));
+        if (!new_records)
+          return false;
+        *records = new_records;
+        *capacity = new_capacity;
+      }
+      (*records)[*num_records].offset = splitter->record_start;
+      (*records)[(*num_records)++].length = i + 1 - splitter->record_start;
+      splitter->expect_record = false;
+      splitter->after_comma = false;
+    }
+  }
+  return true;
+}
+
+/** Convert the range of records to BSON documents.
+ */
+static void* ParseJSONRecords(void* context) {
+  import_worker_t* worker = (import_worker_t*)context;
+  size_t i;
+  for (i = 0; i < worker->num_records && !worker->error; ++i) {
+    bson_t document;
+    bson_error_t error;
+    if (!bson_init_from_json(&document,
+                             worker->text + worker->records[i].offset,
+                             worker->records[i].length,
+                             &error)) {
+      worker->error = true;
+      break;
+    }
+    if (worker->length + document.len > worker->capacity) {
+      size_t capacity = BSON_MAX(2 * worker->capacity,
+                                 worker->length + document.len);
+      uint8_t* output = (uint8_t*)realloc(worker->output, capacity);
+      worker->error = (output == NULL);
+      if (output) {
+        worker->output = output;
+        worker->capacity = capacity;
+      }
+    }
+    if (!worker->error) {
+      memcpy(worker->output + worker->length,
+             bson_get_data(&document),
+             document.len);
+      worker->length += document.len;
+    }
+    bson_destroy(&document);
+  }
+  return NULL;
+}
+
+/** Convert the records by the workers and write the documents in order.
+ */
+static bool ImportJSONRecords(io_file_t* file,
+                              const char* text,
+                              const json_record_t* records,
+                              size_t num_records,
+                              import_worker_t* workers,
+                              int num_workers) {
+  size_t step = (num_records + num_workers - 1) / num_workers;
+  bool status = true;
+  int i;
+  for (i = 0; i < num_workers; ++i) {
+    size_t begin = BSON_MIN(i * step, num_records);
+    workers[i].text = text;
+    workers[i].records = records + begin;
+    workers[i].num_records = BSON_MIN(begin + step, num_records) - begin;
+    workers[i].length = 0;
+    workers[i].error = false;
+#if BSONIO_HAS_THREADS
+    workers[i].started = workers[i].num_records > 0 &&
+                         pthread_create(&workers[i].thread,
+                                        NULL,
+                                        ParseJSONRecords,
+                                        &workers[i]) == 0;
+    if (!workers[i].started)
+#endif
+      ParseJSONRecords(&workers[i]);
+  }
+  for (i = 0; i < num_workers; ++i) {
+#if BSONIO_HAS_THREADS
+    if (workers[i].started)
+      pthread_join(workers[i].thread, NULL);
+#endif
+    status = status &&
+             !workers[i].error &&
+             WriteBytes(file, workers[i].output, workers[i].length);
+  }
+  return status;
+}
+
+EXTERN_C bool ImportJSONFile(const char* input_filename,
+                             const char* output_filename,
+                             const export_options_t* options,
+                             size_t* error_offset) {
+  json_splitter_t splitter;
+  io_file_t input;
+  io_file_t output;
+  import_worker_t* workers;
+  json_record_t* records = NULL;
+  size_t num_records = 0;
+  size_t records_capacity = 0;
+  size_t capacity = BSON_MAX(options->batch_size, 1);
+  size_t length = 0;
+  char* text = (char*)malloc(capacity);
+  int num_workers = (options->num_threads > 0) ?
+      options->num_threads : GetNumProcessors();
+  bool status = (text != NULL);
+  int i;
+  memset(&splitter, 0, sizeof(splitter));
+  splitter.error_offset = SIZE_MAX;
+  *error_offset = SIZE_MAX;
+  if (!status || !OpenFile(input_filename, false, &input)) {
+    free(text);
+    return false;
+  }
+  if (!OpenFile(output_filename, true, &output)) {
+    free(text);
+    CloseFile(&input);
+    return false;
+  }
+  workers = (import_worker_t*)mxCalloc(num_workers, sizeof(import_worker_t));
+  while (status) {
+    size_t size = ReadBytes(&input, text + length, capacity - length);
+    size_t remaining;
+    status = !input.error &&
+             SplitJSONRecords(&splitter,
+                              text,
+                              length,
+                              length + size,
+                              &records,
+                              &num_records,
+                              &records_capacity);
+    length += size;
+    if (status && num_records)
+      status = ImportJSONRecords(&output,
+                                 text,
+                                 records,
+                                 num_records,
+                                 workers,
+                                 num_workers);
+    num_records = 0;
+    if (!status || size == 0)
+      break;
+    /* Carry over the incomplete record to the next buffer. */
+    remaining = (splitter.depth) ? length - splitter.record_start : 0;
+    memmove(text, text + length - remaining, remaining);
+    splitter.offset += length - remaining;
+    splitter.record_start = 0;
+    length = remaining;
+    if (length == capacity) {
+      char* new_text = (char*)realloc(text, 2 * capacity);
+      status = (new_text != NULL);
+      if (new_text) {
+        text = new_text;
+        capacity *= 2;
+      }
+    }
+  }
+  /* The text must not end in a record or an open array. */
+  if (status && (splitter.depth || (splitter.array && !splitter.closed))) {
+    SetJSONSplitError(&splitter, length);
+    status = false;
+  }
+  *error_offset = splitter.error_offset;
+  for (i = 0; i < num_workers; ++i)
+    free(workers[i].output);
+  mxFree(workers);
+  free(records);
+  free(text);
+  CloseFile(&input);
+  return CloseFile(&output) && status;
+}
+
+/** Worker validating a range of documents.
+ */
+typedef struct validate_worker_t {
+  const uint8_t* data;
+  size_t length;
+  const size_t* offsets;
+  size_t begin;
+  size_t end;
+  const validate_options_t* options;
+  mxLogical* status;
+  bool has_error;
+  size_t error_document;
+  size_t error_offset;
+  const char* error_reason;
+#if BSONIO_HAS_THREADS
+  pthread_t thread;
+  bool started;
+#endif
+} validate_worker_t;
+
+/** State of the batch validator.
+ */
+typedef struct validate_state_t {
+  const validate_options_t* options;
+  validate_worker_t* workers;
+  int num_workers;
+  size_t* offsets;
+  size_t capacity;
+  uint64_t position; /* Position of the batch from the start. */
+  validate_result_t* result;
+} validate_state_t;
+
+/** Validate the range of documents.
+ */
+static void* ValidateDocuments(void* context) {
+  validate_worker_t* worker = (validate_worker_t*)context;
+  size_t i;
+  for (i = worker->begin; i < worker->end; ++i) {
+    size_t offset = worker->offsets[i];
+    size_t error_offset;
+    const char* reason;
+    worker->status[i] = ValidateBSONDocument(worker->data + offset,
+                                             worker->length - offset,
+                                             worker->options,
+                                             &error_offset,
+                                             &reason);
+    if (!worker->status[i] && !worker->has_error) {
+      worker->has_error = true;
+      worker->error_document = i;
+      worker->error_offset = offset + error_offset;
+      worker->error_reason = reason;
+    }
+  }
+  return NULL;
+}
+
+/** Keep the first error of the result.
+ */
+static void SetValidateError(validate_result_t* result,
+                             size_t document,
+                             uint64_t offset,
+                             const char* reason) {
+  if (result->has_error)
+    return;
+  result->has_error = true;
+  result->error_document = document;
+  result->error_offset = offset;
+  result->error_reason = reason;
+}
+
+/** Validate the complete documents in the data by the workers.
+ * @param final true if no data follows, so a partial document is invalid.
+ * @param stop set to true at a document of an invalid length.
+ * @return size of the validated documents.
+ */
+static size_t ValidateBatch(validate_state_t* state,
+                            const uint8_t* data,
+                            size_t length,
+                            bool final,
+                            bool* stop) {
+  validate_result_t* result = state->result;
+  size_t first = result->num_documents;
+  size_t position = 0;
+  size_t count = 0;
+  size_t step;
+  const char* framing_error = NULL;
+  int i;
+  /* Documents are framed by the length prefix, and validated in parallel. */
+  while (length - position >= 4) {
+    int32_t document_length = ReadInt32(data + position);
+    if (document_length < 5) {
+      framing_error = "invalid document length";
+      break;
+    }
+    if ((size_t)document_length > length - position)
+      break;
+    if (count == state->capacity) {
+      size_t capacity = (state->capacity) ? 2 * state->capacity : 1024;
+      size_t* offsets = (size_t*)realloc(state->offsets,
+                                         capacity * sizeof(size_t));
+      if (!offsets) {
+        framing_error = "out of memory";
+        break;
+      }
+      state->offsets = offsets;
+      state->capacity = capacity;
+    }
+    state->offsets[count++] = position;
+    position += document_length;
+  }
+  if (!framing_error && final && position < length)
+    framing_error = "truncated document";
+  result->status = (mxLogical*)mxRealloc(
+      result->status,
+      (first + count + 1) * sizeof(mxLogical));
+  step = (count + state->num_workers - 1) / state->num_workers;
+  for (i = 0; i < state->num_workers; ++i) {
+    validate_worker_t* worker = &state->workers[i];
+    worker->data = data;
+    worker->length = length;
+    worker->offsets = state->offsets;
+    worker->begin = BSON_MIN(i * step, count);
+    worker->end = BSON_MIN(worker->begin + step, count);
+    worker->options = state->options;
+    worker->status = result->status + first;
+    worker->has_error = false;
+#if BSONIO_HAS_THREADS
+    worker->started = worker->begin < worker->end &&
+                      pthread_create(&worker->thread,
+                                     NULL,
+                                     ValidateDocuments,
+                                     worker) == 0;
+    if (!worker->started)
+#endif
+      ValidateDocuments(worker);
+  }
+  for (i = 0; i < state->num_workers; ++i) {
+    validate_worker_t* worker = &state->workers[i];
+#if BSONIO_HAS_THREADS
+    if (worker->started)
+      pthread_join(worker->thread, NULL);
+#endif
+    if (worker->has_error)
+      SetValidateError(result,
+                       first + worker->error_document,
+                       state->position + worker->error_offset,
+                       worker->error_reason);
+  }
+  result->num_documents += count;
+  if (framing_error) {
+    SetValidateError(result,
+                     result->num_documents,
+                     state->position + position,
+                     framing_error);
+    result->status[result->num_documents++] = false;
+    *stop = true;
+  }
+  state->position += position;
+  return position;
+}
+
+/** Start the batch validator.
+ */
+static void InitValidateState(validate_state_t* state,
+                              const validate_options_t* options,
+                              validate_result_t* result) {
+  memset(state, 0, sizeof(validate_state_t));
+  memset(result, 0, sizeof(validate_result_t));
+  state->options = options;
+  state->num_workers = (options->num_threads > 0) ?
+      options->num_threads : GetNumProcessors();
+  state->workers = (validate_worker_t*)mxCalloc(state->num_workers,
+                                                sizeof(validate_worker_t));
+  state->result = result;
+}
+
+/** Release the batch validator.
+ */
+static void DestroyValidateState(validate_state_t* state) {
+  mxFree(state->workers);
+  free(state->offsets);
+}
+
+EXTERN_C void ValidateBSONBuffer(const uint8_t* data,
+                                 size_t length,
+                                 const validate_options_t* options,
+                                 validate_result_t* result) {
+  validate_state_t state;
+  bool stop = false;
+  InitValidateState(&state, options, result);
+  ValidateBatch(&state, data, length, true, &stop);
+  DestroyValidateState(&state);
+}
+
+EXTERN_C bool ValidateBSONFile(const char* filename,
+                               const validate_options_t* options,
+                               validate_result_t* result) {
+  validate_state_t state;
+  io_file_t file;
+  size_t capacity = VALIDATE_BATCH_SIZE;
+  size_t length = 0;
+  uint8_t* data;
+  bool status = true;
+  if (!OpenFile(filename, false, &file))
+    return false;
+  data = (uint8_t*)malloc(capacity);
+  if (!data) {
+    CloseFile(&file);
+    return false;
+  }
+  InitValidateState(&state, options, result);
+  while (true) {
+    bool stop = false;
+    size_t size = ReadBytes(&file, data + length, capacity - length);
+    size_t consumed;
+    bool final;
+    if (file.error) {
+      status = false;
+      break;
+    }
+    length += size;
+    final = (length < capacity);
+    consumed = ValidateBatch(&state, data, length, final, &stop);
+    if (stop || final)
+      break;
+    /* Carry over the partial document, growing the buffer to hold it. */
+    memmove(data, data + consumed, length - consumed);
+    length -= consumed;
+    if (length == capacity) {
+      size_t new_capacity = BSON_MAX(2 * capacity,
+                                     (size_t)ReadInt32(data));
+      uint8_t* new_data = (uint8_t*)realloc(data, new_capacity);
+      if (!new_data) {
+        status = false;
+        break;
+      }
+      data = new_data;
+      capacity = new_capacity;
+    }
+  }
+  DestroyValidateState(&state);
+  free(data);
+  return CloseFile(&file) && status;
+}
+
+EXTERN_C bool WriteBSONFile(const char* filename,
+                            const mxArray* input,
+                            const encode_options_t* options,
+                            const write_options_t* write_options) {
+  encode_options_t chunk_options = *options;
+  chunk_file_t chunk_file;
+  io_file_t* file;
+  bson_t value;
+  bool status;
+  CloseActiveFiles();
+  if (options->chunk_size == 0 ||
+      options->chunk_size > BSONIO_MAX_CHUNK_SIZE ||
+      write_options->buffer_size == 0 ||
+      (write_options->streaming && IsGzipFilename(filename)))
+    return false;
+  file = OpenActiveFile(filename, true);
+  if (!file)
+    return false;
+  /* Chunks cannot be written in the middle of a streamed document. */
+  if (write_options->streaming) {
+    chunk_options.chunk_writer = NULL;
+    status = StreamBSONFile(file,
+                            input,
+                            &chunk_options,
+                            write_options->buffer_size);
+    return CloseActiveFile(file) && status;
+  }
+  chunk_file.file = file;
+  chunk_file.chunk_size = options->chunk_size;
+  chunk_options.chunk_writer = WriteChunks;
+  chunk_options.chunk_context = &chunk_file;
+  status = ConvertMxArrayToBSON(input, &chunk_options, &value);
+  if (status) {
+    status = WriteBytes(file, bson_get_data(&value), value.len);
+    bson_destroy(&value);
+  }
+  return CloseActiveFile(file) && status;
+}
+
+EXTERN_C bool ReadBSONFile(const char* filename,
+                           const decode_options_t* options,
+                           const read_options_t* read_options,
+                           mxArray** output) {
+  decode_options_t chunk_options = *options;
+  value_list_t list = {NULL, 0};
+  io_file_t* file;
+  io_file_t* chunk_file;
+  bool status;
+  CloseActiveFiles();
+  file = OpenActiveFile(filename, false);
+  if (!file)
+    return false;
+  /* Chunks are read through another handle, so that neither handle seeks
+   * back while the documents are read in order. */
+  chunk_file = OpenActiveFile(filename, false);
+  if (!chunk_file) {
+    CloseActiveFile(file);
+    return false;
+  }
+  chunk_options.chunk_reader = ReadChunks;
+  chunk_options.chunk_context = chunk_file;
+  if (read_options->range)
+    status = ReadRangeDocuments(file, &chunk_options, read_options, &list);
+  else if (read_options->read_ahead)
+    status = PrefetchFileDocuments(filename,
+                                   &chunk_options,
+                                   read_options->read_ahead,
+                                   &list);
+  else
+    status = ReadFileDocuments(file, &chunk_options, &list);
+  CloseActiveFile(chunk_file);
+  CloseActiveFile(file);
+  return CreateValueOutput(&list, status, output);
+}
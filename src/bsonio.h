@@ -0,0 +1,143 @@
+/** BSON file reader and writer.
+ *
+ * Numeric and logical arrays too large for a BSON document are stored in
+ * GridFS-like chunk documents, written before the document that references
+ * them by a PACK_CODEC_CHUNKED binary.
+ *
+ *   {files_id: int64 offset of the first chunk, n: int32 index,
+ *    data: binary of subtype 0x81}
+ *
+ * Kota Yamaguchi 2013
+ */
+
+#ifndef __BSONIO_H__
+#define __BSONIO_H__
+
+#include "bsonmex.h"
+#include "bsonvalid.h"
+
+/** Maximum size of the data in a chunk document.
+ */
+#define BSONIO_MAX_CHUNK_SIZE (BSON_MAX_SIZE - 64)
+
+/** Options of the file writer.
+ */
+typedef struct write_options_t {
+  bool streaming;     /* Stream the document through a fixed-size buffer. */
+  size_t buffer_size; /* Size of the stream buffer. */
+} write_options_t;
+
+/** Default file writer options.
+ */
+#define BSONIO_WRITE_OPTIONS_INIT {false, 4194304}
+
+/** Options of the file reader.
+ */
+typedef struct read_options_t {
+  bool range;      /* Read documents at the offset, not the whole file. */
+  uint64_t offset; /* Position of the first document. */
+  uint64_t length; /* Size of the documents, or 0 for one document. */
+  size_t read_ahead; /* Size of prefetch buffers, or 0 to disable. */
+} read_options_t;
+
+/** Default file reader options.
+ */
+#define BSONIO_READ_OPTIONS_INIT {false, 0, 0, 8388608}
+
+/** Options of the JSON exporter and importer.
+ */
+typedef struct export_options_t {
+  int num_threads;   /* Number of workers, or 0 for the processors. */
+  size_t batch_size; /* Size of documents converted at a time. */
+} export_options_t;
+
+/** Default JSON exporter and importer options.
+ */
+#define BSONIO_EXPORT_OPTIONS_INIT {0, 4194304}
+
+/** Result of validating concatenated documents.
+ */
+typedef struct validate_result_t {
+  mxLogical* status;     /* Validity of each document. Caller must mxFree. */
+  size_t num_documents;
+  bool has_error;
+  size_t error_document; /* Index of the first invalid document. */
+  uint64_t error_offset; /* Position of the error from the start. */
+  const char* error_reason;
+} validate_result_t;
+
+/** Write mxArray to a BSON file.
+ * @param filename path to the file.
+ * @param input mxArray to write.
+ * @param options encoder options. Arrays of at least chunk_threshold bytes
+ *                are written in chunks of chunk_size bytes, unless
+ *                streaming.
+ * @param write_options file writer options.
+ * @return true if success.
+ */
+EXTERN_C bool WriteBSONFile(const char* filename,
+                            const mxArray* input,
+                            const encode_options_t* options,
+                            const write_options_t* write_options);
+/** Read mxArray from a BSON file. Chunked arrays are read directly into the
+ * decoded mxArray.
+ * @param filename path to the file.
+ * @param options decoder options.
+ * @param read_options file reader options.
+ * @param output mxArray of the document, or a cell array of mxArray if
+ *               multiple documents are read.
+ * @return true if success.
+ */
+EXTERN_C bool ReadBSONFile(const char* filename,
+                           const decode_options_t* options,
+                           const read_options_t* read_options,
+                           mxArray** output);
+
+/** Export documents of a BSON file to a newline-delimited JSON file.
+ * Batches of documents are formatted in parallel and written in order.
+ * @param input_filename path to the BSON file.
+ * @param output_filename path to the JSON file.
+ * @param options exporter options.
+ * @return true if success.
+ */
+EXTERN_C bool ExportJSONFile(const char* input_filename,
+                             const char* output_filename,
+                             const export_options_t* options);
+
+/** Import records of a JSON file to a BSON file of concatenated documents.
+ * Records are objects, either newline-delimited or elements of a top-level
+ * array. Batches of records are converted in parallel and written in order.
+ * @param input_filename path to the JSON file.
+ * @param output_filename path to the BSON file.
+ * @param options importer options.
+ * @param error_offset byte offset of a syntax error of the record boundary,
+ *                     or SIZE_MAX.
+ * @return true if success.
+ */
+EXTERN_C bool ImportJSONFile(const char* input_filename,
+                             const char* output_filename,
+                             const export_options_t* options,
+                             size_t* error_offset);
+/** Validate concatenated documents in parallel. Validation stops at a
+ * document of an invalid length, which is the last in the result.
+ * @param data data of the documents.
+ * @param length size of the data.
+ * @param options validator options.
+ * @param result result to fill.
+ */
+EXTERN_C void ValidateBSONBuffer(const uint8_t* data,
+                                 size_t length,
+                                 const validate_options_t* options,
+                                 validate_result_t* result);
+/** Validate documents of a BSON file in parallel, reading batches of
+ * documents at a time.
+ * @param filename path to the file.
+ * @param options validator options.
+ * @param result result to fill.
+ * @return false if the file cannot be read.
+ */
+EXTERN_C bool ValidateBSONFile(const char* filename,
+                               const validate_options_t* options,
+                               validate_result_t* result);
+
+#endif /* __BSONIO_H__ */
@@ -0,0 +1,922 @@
+/** JSON tokenizer implementation.
+ *
+ * Kota Yamaguchi 2013
+ */
+
+#include "bsonjson.h"
+#include "bsonpack.h"
+#include <math.h>
+#include <mex.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#define BSONJSON_HAS_SSE2 1
+#else
+#define BSONJSON_HAS_SSE2 0
+#endif
+
+#define JSON_BUFFER_SIZE 65536
+
+/** State of the parser.
+ */
+typedef enum {
+  PARSE_VALUE,         /* Expecting a value. */
+  PARSE_FIRST_ELEMENT, /* Expecting a value or the end of an empty array. */
+  PARSE_FIRST_MEMBER,  /* Expecting a key or the end of an empty object. */
+  PARSE_KEY,           /* Expecting a key and a colon. */
+  PARSE_NEXT           /* Expecting a comma or the end of the container. */
+} parse_state_t;
+
+#if BSONJSON_HAS_SSE2
+/** Get the index of the lowest set bit of a non-zero mask.
+ */
+static int GetLowestBit(int mask) {
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward(&index, (unsigned long)mask);
+  return (int)index;
+#else
+  return __builtin_ctz((unsigned)mask);
+#endif
+}
+#endif
+
+/** Check if the character is JSON whitespace.
+ */
+static bool IsWhitespace(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+/** Check if the character is a decimal digit.
+ */
+static bool IsDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+/** Skip whitespace. Runs of indentation are skipped 16 bytes at a time.
+ */
+static char* SkipWhitespace(char* input, const char* end) {
+#if BSONJSON_HAS_SSE2
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i carriage_return = _mm_set1_epi8('\r');
+  const __m128i tab = _mm_set1_epi8('\t');
+  while (input + 16 <= end && IsWhitespace(*input)) {
+    __m128i block = _mm_loadu_si128((const __m128i*)input);
+    __m128i whitespace = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(block, space),
+                     _mm_cmpeq_epi8(block, newline)),
+        _mm_or_si128(_mm_cmpeq_epi8(block, carriage_return),
+                     _mm_cmpeq_epi8(block, tab)));
+    int mask = ~_mm_movemask_epi8(whitespace) & 0xFFFF;
+    if (mask)
+      return input + GetLowestBit(mask);
+    input += 16;
+  }
+#endif
+  while (input < end && IsWhitespace(*input))
+    ++input;
+  return input;
+}
+
+/** Find a quote, a backslash, or a control character in a string, 16 bytes
+ * at a time.
+ */
+static char* FindStringDelimiter(char* input, const char* end) {
+#if BSONJSON_HAS_SSE2
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1F);
+  while (input + 16 <= end) {
+    __m128i block = _mm_loadu_si128((const __m128i*)input);
+    __m128i delimiter = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(block, quote),
+                     _mm_cmpeq_epi8(block, backslash)),
+        _mm_cmpeq_epi8(_mm_min_epu8(block, control), block));
+    int mask = _mm_movemask_epi8(delimiter);
+    if (mask)
+      return input + GetLowestBit(mask);
+    input += 16;
+  }
+#endif
+  while (input < end &&
+         *input != '"' &&
+         *input != '\\' &&
+         (unsigned char)*input >= 0x20)
+    ++input;
+  return input;
+}
+
+/** Parse 4 hexadecimal digits of a unicode escape.
+ */
+static bool ParseHex4(const char* input, const char* end, uint32_t* code) {
+  int i;
+  *code = 0;
+  if (end - input < 4)
+    return false;
+  for (i = 0; i < 4; ++i) {
+    char c = input[i];
+    *code <<= 4;
+    if (IsDigit(c))
+      *code |= c - '0';
+    else if (c >= 'a' && c <= 'f')
+      *code |= c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      *code |= c - 'A' + 10;
+    else
+      return false;
+  }
+  return true;
+}
+
+/** Write the code point in UTF-8.
+ * @return position after the written bytes.
+ */
+static char* WriteUTF8(uint32_t code, char* output) {
+  if (code < 0x80)
+    *output++ = (char)code;
+  else if (code < 0x800) {
+    *output++ = (char)(0xC0 | (code >> 6));
+    *output++ = (char)(0x80 | (code & 0x3F));
+  }
+  else if (code < 0x10000) {
+    *output++ = (char)(0xE0 | (code >> 12));
+    *output++ = (char)(0x80 | ((code >> 6) & 0x3F));
+    *output++ = (char)(0x80 | (code & 0x3F));
+  }
+  else {
+    *output++ = (char)(0xF0 | (code >> 18));
+    *output++ = (char)(0x80 | ((code >> 12) & 0x3F));
+    *output++ = (char)(0x80 | ((code >> 6) & 0x3F));
+    *output++ = (char)(0x80 | (code & 0x3F));
+  }
+  return output;
+}
+
+EXTERN_C char* WriteCharUTF8(const mxChar* chars,
+                             size_t stride,
+                             size_t count,
+                             size_t* index,
+                             char* output) {
+  uint32_t code = chars[*index * stride];
+  if (code >= 0xD800 && code < 0xE000) {
+    uint32_t low_code = (*index + 1 < count) ?
+        chars[(*index + 1) * stride] : 0;
+    if (code >= 0xDC00 || low_code < 0xDC00 || low_code >= 0xE000)
+      return NULL;
+    code = 0x10000 + ((code - 0xD800) << 10) + (low_code - 0xDC00);
+    ++*index;
+  }
+  return WriteUTF8(code, output);
+}
+
+/** Parse a string after the opening quote. The string is unescaped in place
+ * and null-terminated, as escapes never expand.
+ * @return position after the closing quote, or NULL on error.
+ */
+static char* ParseString(char* input, const char* end) {
+  char* output = input;
+  while (true) {
+    char* delimiter = FindStringDelimiter(input, end);
+    uint32_t code;
+    if (output != input)
+      memmove(output, input, delimiter - input);
+    output += delimiter - input;
+    input = delimiter;
+    if (input >= end || (unsigned char)*input < 0x20)
+      return NULL;
+    if (*input == '"') {
+      *output = '\0';
+      return input + 1;
+    }
+    if (++input >= end)
+      return NULL;
+    switch (*input++) {
+      case '"':
+      case '\\':
+      case '/':
+        *output++ = input[-1];
+        break;
+      case 'b':
+        *output++ = '\b';
+        break;
+      case 'f':
+        *output++ = '\f';
+        break;
+      case 'n':
+        *output++ = '\n';
+        break;
+      case 'r':
+        *output++ = '\r';
+        break;
+      case 't':
+        *output++ = '\t';
+        break;
+      case 'u':
+        if (!ParseHex4(input, end, &code))
+          return NULL;
+        input += 4;
+        if (code >= 0xD800 && code < 0xDC00) {
+          /* Surrogate pair. */
+          uint32_t low_code;
+          if (end - input < 2 || input[0] != '\\' || input[1] != 'u' ||
+              !ParseHex4(input + 2, end, &low_code) ||
+              low_code < 0xDC00 || low_code >= 0xE000)
+            return NULL;
+          input += 6;
+          code = 0x10000 + ((code - 0xD800) << 10) + (low_code - 0xDC00);
+        }
+        else if (code >= 0xDC00 && code < 0xE000)
+          return NULL;
+        output = WriteUTF8(code, output);
+        break;
+      default:
+        return NULL;
+    }
+  }
+}
+
+/** Parse a number. Integers are typed as int32 or int64 if they fit, and
+ * others as double, as libbson does.
+ * @return position after the number, or NULL on error.
+ */
+static char* ParseNumber(char* input, const char* end, json_node_t* node) {
+  char* start = input;
+  bool negative = false;
+  bool is_integer = true;
+  uint64_t magnitude = 0;
+  int digits = 0;
+  if (input < end && *input == '-') {
+    negative = true;
+    ++input;
+  }
+  if (input >= end || !IsDigit(*input))
+    return NULL;
+  if (*input == '0')
+    ++input;
+  else
+    while (input < end && IsDigit(*input)) {
+      if (++digits <= 19)
+        magnitude = magnitude * 10 + (*input - '0');
+      ++input;
+    }
+  if (input < end && *input == '.') {
+    is_integer = false;
+    if (++input >= end || !IsDigit(*input))
+      return NULL;
+    while (input < end && IsDigit(*input))
+      ++input;
+  }
+  if (input < end && (*input == 'e' || *input == 'E')) {
+    is_integer = false;
+    if (++input < end && (*input == '+' || *input == '-'))
+      ++input;
+    if (input >= end || !IsDigit(*input))
+      return NULL;
+    while (input < end && IsDigit(*input))
+      ++input;
+  }
+  if (is_integer && digits <= 19 &&
+      magnitude <= (uint64_t)INT64_MAX + negative) {
+    int64_t value = (negative && magnitude) ?
+        -(int64_t)(magnitude - 1) - 1 : (int64_t)magnitude;
+    node->type = (value >= INT32_MIN && value <= INT32_MAX) ?
+        BSON_TYPE_INT32 : BSON_TYPE_INT64;
+    node->value.integer = value;
+  }
+  else {
+    char* number_end;
+    node->type = BSON_TYPE_DOUBLE;
+    node->value.number = strtod(start, &number_end);
+    if (number_end != input)
+      return NULL;
+  }
+  return input;
+}
+
+/** Parse a literal of true, false, or null.
+ * @return position after the literal, or NULL on error.
+ */
+static char* ParseLiteral(char* input, const char* end, json_node_t* node) {
+  if (end - input >= 4 && memcmp(input, "true", 4) == 0) {
+    node->type = BSON_TYPE_BOOL;
+    node->value.boolean = true;
+    return input + 4;
+  }
+  if (end - input >= 5 && memcmp(input, "false", 5) == 0) {
+    node->type = BSON_TYPE_BOOL;
+    node->value.boolean = false;
+    return input + 5;
+  }
+  if (end - input >= 4 && memcmp(input, "null", 4) == 0) {
+    node->type = BSON_TYPE_NULL;
+    return input + 4;
+  }
+  return NULL;
+}
+
+/** Append a node to the tape.
+ * @return index of the node.
+ */
+static size_t AppendJSONNode(json_tape_t* tape) {
+  if (tape->size == tape->capacity) {
+    tape->capacity = (tape->capacity) ? 2 * tape->capacity : 64;
+    tape->nodes = (json_node_t*)mxRealloc(tape->nodes,
+                                          tape->capacity *
+                                          sizeof(json_node_t));
+  }
+  memset(&tape->nodes[tape->size], 0, sizeof(json_node_t));
+  tape->nodes[tape->size].next = tape->size + 1;
+  return tape->size++;
+}
+
+EXTERN_C bool ParseJSONTape(char* text,
+                            size_t length,
+                            json_tape_t* tape,
+                            size_t* error_offset) {
+  char* input = text;
+  char* position = text;
+  const char* end = text + length;
+  const char* key = NULL;
+  size_t* stack = NULL; /* Indices of the open containers. */
+  size_t depth = 0;
+  size_t stack_capacity = 0;
+  parse_state_t state = PARSE_VALUE;
+  bool status = true;
+  memset(tape, 0, sizeof(json_tape_t));
+  while (status) {
+    size_t index;
+    input = SkipWhitespace(input, end);
+    position = input;
+    switch (state) {
+      case PARSE_VALUE:
+        if (input >= end) {
+          status = false;
+          break;
+        }
+        index = AppendJSONNode(tape);
+        tape->nodes[index].key = key;
+        key = NULL;
+        if (depth)
+          ++tape->nodes[stack[depth - 1]].size;
+        if (*input == '{' || *input == '[') {
+          tape->nodes[index].type = (*input == '{') ?
+              BSON_TYPE_DOCUMENT : BSON_TYPE_ARRAY;
+          state = (*input == '{') ? PARSE_FIRST_MEMBER : PARSE_FIRST_ELEMENT;
+          if (depth == stack_capacity) {
+            stack_capacity = (stack_capacity) ? 2 * stack_capacity : 16;
+            stack = (size_t*)mxRealloc(stack,
+                                       stack_capacity * sizeof(size_t));
+          }
+          stack[depth++] = index;
+          ++input;
+          break;
+        }
+        if (*input == '"') {
+          tape->nodes[index].type = BSON_TYPE_UTF8;
+          tape->nodes[index].value.string = input + 1;
+          input = ParseString(input + 1, end);
+        }
+        else if (*input == '-' || IsDigit(*input))
+          input = ParseNumber(input, end, &tape->nodes[index]);
+        else
+          input = ParseLiteral(input, end, &tape->nodes[index]);
+        status = (input != NULL);
+        state = PARSE_NEXT;
+        break;
+      case PARSE_FIRST_ELEMENT:
+      case PARSE_FIRST_MEMBER:
+        if (input < end && *input == ((state == PARSE_FIRST_MEMBER) ?
+                                      '}' : ']')) {
+          tape->nodes[stack[--depth]].next = tape->size;
+          ++input;
+          state = PARSE_NEXT;
+        }
+        else
+          state = (state == PARSE_FIRST_MEMBER) ? PARSE_KEY : PARSE_VALUE;
+        break;
+      case PARSE_KEY:
+        if (input >= end || *input != '"') {
+          status = false;
+          break;
+        }
+        key = input + 1;
+        input = ParseString(input + 1, end);
+        if (input)
+          input = SkipWhitespace(input, end);
+        status = (input != NULL && input < end && *input == ':');
+        if (status)
+          ++input;
+        state = PARSE_VALUE;
+        break;
+      case PARSE_NEXT:
+        if (!depth) {
+          status = (input == end);
+          if (status) {
+            mxFree(stack);
+            return true;
+          }
+          break;
+        }
+        index = stack[depth - 1];
+        if (input < end && *input == ',') {
+          ++input;
+          state = (tape->nodes[index].type == BSON_TYPE_DOCUMENT) ?
+              PARSE_KEY : PARSE_VALUE;
+        }
+        else if (input < end &&
+                 *input == ((tape->nodes[index].type == BSON_TYPE_DOCUMENT) ?
+                            '}' : ']')) {
+          ++input;
+          tape->nodes[index].next = tape->size;
+          --depth;
+        }
+        else
+          status = false;
+        break;
+    }
+  }
+  if (error_offset)
+    *error_offset = (size_t)(((input) ? input : position) - text);
+  mxFree(stack);
+  DestroyJSONTape(tape);
+  return false;
+}
+
+EXTERN_C void DestroyJSONTape(json_tape_t* tape) {
+  if (tape->nodes)
+    mxFree(tape->nodes);
+  memset(tape, 0, sizeof(json_tape_t));
+}
+
+/** Growable output of the JSON writer, flushed to the file if any.
+ */
+typedef struct json_writer_t {
+  char* data;
+  size_t length;
+  size_t capacity;
+  FILE* file;
+  size_t depth; /* Number of values being written. */
+} json_writer_t;
+
+static bool WriteJSONValue(const mxArray* input, json_writer_t* writer);
+
+/** Make room for the size of text in the writer.
+ */
+static bool ReserveJSON(json_writer_t* writer, size_t size) {
+  if (writer->length + size <= writer->capacity)
+    return true;
+  if (writer->file && writer->length) {
+    if (fwrite(writer->data, 1, writer->length, writer->file) !=
+        writer->length)
+      return false;
+    writer->length = 0;
+    if (size <= writer->capacity)
+      return true;
+  }
+  while (writer->length + size > writer->capacity)
+    writer->capacity = (writer->capacity) ?
+        2 * writer->capacity : JSON_BUFFER_SIZE;
+  writer->data = (char*)mxRealloc(writer->data, writer->capacity);
+  return writer->data != NULL;
+}
+
+/** Append text to the writer.
+ */
+static bool AppendJSON(json_writer_t* writer, const char* text, size_t size) {
+  if (!ReserveJSON(writer, size))
+    return false;
+  memcpy(writer->data + writer->length, text, size);
+  writer->length += size;
+  return true;
+}
+
+/** Append a character to the writer.
+ */
+static bool AppendJSONChar(json_writer_t* writer, char c) {
+  if (!ReserveJSON(writer, 1))
+    return false;
+  writer->data[writer->length++] = c;
+  return true;
+}
+
+/** Format an unsigned integer in decimal.
+ * @return length of the text.
+ */
+static int FormatUnsigned(uint64_t value, char* output) {
+  char buffer[20];
+  int length = 0;
+  int i;
+  do {
+    buffer[length++] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value);
+  for (i = 0; i < length; ++i)
+    output[i] = buffer[length - 1 - i];
+  return length;
+}
+
+/** Append an integer.
+ */
+static bool AppendJSONInteger(json_writer_t* writer,
+                              int64_t value,
+                              bool is_unsigned) {
+  char buffer[24];
+  int length = 0;
+  if (!is_unsigned && value < 0) {
+    buffer[length++] = '-';
+    length += FormatUnsigned(0 - (uint64_t)value, buffer + length);
+  }
+  else
+    length += FormatUnsigned((uint64_t)value, buffer + length);
+  return AppendJSON(writer, buffer, length);
+}
+
+/** Append a double in the shortest of 15, 16, or 17 significant digits that
+ * reads back to the same value, or a single in the shortest of 6 to 9 digits.
+ * Integral values take a fraction, so that they read back as double. NaN and
+ * Inf are null, as in jsonencode.
+ */
+static bool AppendJSONDouble(json_writer_t* writer,
+                             double value,
+                             bool is_single) {
+  char buffer[32];
+  int length;
+  if (value != value || mxIsInf(value))
+    return AppendJSON(writer, "null", 4);
+  if (value == floor(value) && fabs(value) < 1e15) {
+    length = 0;
+    if (value < 0)
+      buffer[length++] = '-';
+    length += FormatUnsigned((uint64_t)fabs(value), buffer + length);
+    memcpy(buffer + length, ".0", 2);
+    return AppendJSON(writer, buffer, length + 2);
+  }
+  if (is_single) {
+    int digits;
+    for (digits = 6; digits < 9; ++digits) {
+      length = sprintf(buffer, "%.*g", digits, value);
+      if (strtof(buffer, NULL) == (float)value)
+        break;
+    }
+    if (digits == 9)
+      length = sprintf(buffer, "%.9g", value);
+  }
+  else {
+    length = sprintf(buffer, "%.15g", value);
+    if (strtod(buffer, NULL) != value)
+      length = sprintf(buffer, "%.16g", value);
+    if (strtod(buffer, NULL) != value)
+      length = sprintf(buffer, "%.17g", value);
+  }
+  if (!strpbrk(buffer, ".eE")) {
+    memcpy(buffer + length, ".0", 2);
+    length += 2;
+  }
+  return AppendJSON(writer, buffer, length);
+}
+
+/** Append a code unit as a unicode escape.
+ */
+static bool AppendJSONEscape(json_writer_t* writer, unsigned code) {
+  static const char kHexDigits[] = "0123456789abcdef";
+  char buffer[6] = {'\\', 'u', '0', '0', '0', '0'};
+  int i;
+  for (i = 5; i >= 2; --i, code >>= 4)
+    buffer[i] = kHexDigits[code & 0xF];
+  return AppendJSON(writer, buffer, 6);
+}
+
+/** Append an ASCII string, such as a field name.
+ */
+static bool AppendJSONKey(json_writer_t* writer, const char* key) {
+  return AppendJSONChar(writer, '"') &&
+         AppendJSON(writer, key, strlen(key)) &&
+         AppendJSON(writer, "\":", 2);
+}
+
+/** Append characters as an escaped UTF-8 string. UTF-16 surrogate pairs are
+ * combined, and unpaired surrogates are escaped.
+ */
+static bool AppendJSONString(json_writer_t* writer,
+                             const mxChar* values,
+                             size_t offset,
+                             size_t stride,
+                             size_t count) {
+  size_t i;
+  if (!AppendJSONChar(writer, '"'))
+    return false;
+  for (i = 0; i < count; ++i) {
+    unsigned code = values[offset + i * stride];
+    char buffer[4];
+    if (code == '"' || code == '\\') {
+      buffer[0] = '\\';
+      buffer[1] = (char)code;
+      if (!AppendJSON(writer, buffer, 2))
+        return false;
+    }
+    else if (code < 0x20) {
+      static const char kEscapes[] = "btnvfr";
+      buffer[0] = '\\';
+      buffer[1] = (code >= '\b' && code <= '\r' && code != '\v') ?
+          kEscapes[code - '\b'] : 0;
+      if (!((buffer[1]) ? AppendJSON(writer, buffer, 2) :
+                          AppendJSONEscape(writer, code)))
+        return false;
+    }
+    else if (code < 0x80) {
+      if (!AppendJSONChar(writer, (char)code))
+        return false;
+    }
+    else {
+      char* end = WriteCharUTF8(values + offset, stride, count, &i, buffer);
+      if (!((end) ? AppendJSON(writer, buffer, end - buffer) :
+                    AppendJSONEscape(writer, code)))
+        return false;
+    }
+  }
+  return AppendJSONChar(writer, '"');
+}
+
+/** Append binary data in extended JSON.
+ */
+static bool AppendJSONBinary(json_writer_t* writer,
+                             const uint8_t* data,
+                             size_t size,
+                             bson_subtype_t subtype) {
+  static const char kBase64Digits[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  char type[16];
+  size_t i;
+  if (!AppendJSON(writer, "{\"$binary\":\"", 12) ||
+      !ReserveJSON(writer, (size + 2) / 3 * 4))
+    return false;
+  for (i = 0; i < size; i += 3) {
+    uint32_t triple = (uint32_t)data[i] << 16;
+    char* output = writer->data + writer->length;
+    if (i + 1 < size)
+      triple |= (uint32_t)data[i + 1] << 8;
+    if (i + 2 < size)
+      triple |= data[i + 2];
+    output[0] = kBase64Digits[(triple >> 18) & 0x3F];
+    output[1] = kBase64Digits[(triple >> 12) & 0x3F];
+    output[2] = (i + 1 < size) ? kBase64Digits[(triple >> 6) & 0x3F] : '=';
+    output[3] = (i + 2 < size) ? kBase64Digits[triple & 0x3F] : '=';
+    writer->length += 4;
+  }
+  sprintf(type, "\",\"$type\":\"%02x\"}", (unsigned)subtype);
+  return AppendJSON(writer, type, strlen(type));
+}
+
+/** Append an array packed as in the encoder.
+ */
+static bool AppendJSONPackedArray(json_writer_t* writer,
+                                  const mxArray* input) {
+  static const encode_options_t kDefaultOptions = BSONMEX_ENCODE_OPTIONS_INIT;
+  bson_t document;
+  bson_iter_t it;
+  bool status;
+  bson_init(&document);
+  status = ConvertPackedArrayToBSON(
+      input,
+      "0",
+      (mxIsSparse(input)) ? PACK_CODEC_SPARSE_CSC : PACK_CODEC_RAW,
+      &kDefaultOptions,
+      &document) &&
+      bson_iter_init_find(&it, &document, "0") &&
+      BSON_ITER_HOLDS_BINARY(&it);
+  if (status) {
+    bson_subtype_t subtype;
+    uint32_t size;
+    const uint8_t* data;
+    bson_iter_binary(&it, &subtype, &size, &data);
+    status = AppendJSONBinary(writer, data, size, subtype);
+  }
+  bson_destroy(&document);
+  return status;
+}
+
+/** Append a bson.datetime element in extended JSON.
+ */
+static bool AppendJSONDate(json_writer_t* writer,
+                           const mxArray* input,
+                           size_t index) {
+  mxArray* value = mxGetProperty(input, index, "number");
+  int64_t date_value;
+  if (!value)
+    return false;
+  date_value = (int64_t)((mxGetScalar(value) - 719529) * 86400);
+  mxDestroyArray(value);
+  return AppendJSON(writer, "{\"$date\":", 9) &&
+         AppendJSONInteger(writer, date_value, false) &&
+         AppendJSONChar(writer, '}');
+}
+
+/** Append an element of a numeric, logical, or date array.
+ */
+static bool AppendJSONElement(json_writer_t* writer,
+                              const mxArray* input,
+                              size_t index) {
+  const void* data = mxGetData(input);
+  switch (mxGetClassID(input)) {
+    case mxDOUBLE_CLASS:
+      return AppendJSONDouble(writer, ((const double*)data)[index], false);
+    case mxSINGLE_CLASS:
+      return AppendJSONDouble(writer, ((const float*)data)[index], true);
+    case mxLOGICAL_CLASS:
+      return (((const mxLogical*)data)[index]) ?
+          AppendJSON(writer, "true", 4) : AppendJSON(writer, "false", 5);
+    case mxINT16_CLASS:
+      return AppendJSONInteger(writer, ((const int16_t*)data)[index], false);
+    case mxUINT16_CLASS:
+      return AppendJSONInteger(writer, ((const uint16_t*)data)[index], false);
+    case mxINT32_CLASS:
+      return AppendJSONInteger(writer, ((const int32_t*)data)[index], false);
+    case mxUINT32_CLASS:
+      return AppendJSONInteger(writer, ((const uint32_t*)data)[index], false);
+    case mxINT64_CLASS:
+      return AppendJSONInteger(writer, ((const int64_t*)data)[index], false);
+    case mxUINT64_CLASS:
+      return AppendJSONInteger(writer,
+                               (int64_t)((const uint64_t*)data)[index],
+                               true);
+    default:
+      return mxIsClass(input, "bson.datetime") &&
+             AppendJSONDate(writer, input, index);
+  }
+}
+
+/** Append a struct element as an object.
+ */
+static bool AppendJSONObject(json_writer_t* writer,
+                             const mxArray* input,
+                             size_t index) {
+  int num_fields = mxGetNumberOfFields(input);
+  int i;
+  if (!AppendJSONChar(writer, '{'))
+    return false;
+  for (i = 0; i < num_fields; ++i) {
+    const mxArray* field = mxGetFieldByNumber(input, index, i);
+    if ((i && !AppendJSONChar(writer, ',')) ||
+        !AppendJSONKey(writer, mxGetFieldNameByNumber(input, i)) ||
+        !field ||
+        !WriteJSONValue(field, writer))
+      return false;
+  }
+  return AppendJSONChar(writer, '}');
+}
+
+/** Write a vector of elements as ConvertArrayToBSON does for a row vector.
+ */
+static bool WriteJSONVector(const mxArray* input,
+                            size_t offset,
+                            size_t stride,
+                            size_t count,
+                            json_writer_t* writer) {
+  mxClassID class_id = mxGetClassID(input);
+  bool is_array;
+  size_t i;
+  switch (class_id) {
+    case mxCHAR_CLASS:
+      return AppendJSONString(writer,
+                              mxGetChars(input),
+                              offset,
+                              stride,
+                              count);
+    case mxINT8_CLASS:
+    case mxUINT8_CLASS: {
+      const uint8_t* data = (const uint8_t*)mxGetData(input);
+      uint8_t* values;
+      bool status;
+      if (count == 0)
+        return AppendJSON(writer, "null", 4);
+      if (stride == 1)
+        return AppendJSONBinary(writer,
+                                data + offset,
+                                count,
+                                BSON_SUBTYPE_BINARY);
+      values = (uint8_t*)mxMalloc(count);
+      for (i = 0; i < count; ++i)
+        values[i] = data[offset + i * stride];
+      status = AppendJSONBinary(writer, values, count, BSON_SUBTYPE_BINARY);
+      mxFree(values);
+      return status;
+    }
+    case mxCELL_CLASS:
+      is_array = true;
+      break;
+    case mxSTRUCT_CLASS:
+      is_array = (count != 1);
+      break;
+    default:
+      if (count == 0)
+        return AppendJSON(writer, "null", 4);
+      is_array = (count != 1);
+      break;
+  }
+  if (is_array && !AppendJSONChar(writer, '['))
+    return false;
+  for (i = 0; i < count; ++i) {
+    size_t index = offset + i * stride;
+    bool status;
+    if (i && !AppendJSONChar(writer, ','))
+      return false;
+    if (class_id == mxCELL_CLASS) {
+      const mxArray* element = mxGetCell(input, index);
+      status = element && WriteJSONValue(element, writer);
+    }
+    else if (class_id == mxSTRUCT_CLASS)
+      status = AppendJSONObject(writer, input, index);
+    else
+      status = AppendJSONElement(writer, input, index);
+    if (!status)
+      return false;
+  }
+  return !is_array || AppendJSONChar(writer, ']');
+}
+
+/** Write an N-D block of the array starting at the offset. Matrices are
+ * nested arrays of rows, and N-D arrays are nested along the last dimension,
+ * as Convert2DOrNDArrayToCellArray.
+ */
+static bool WriteJSONArray(const mxArray* input,
+                           mwSize ndims,
+                           const mwSize* dims,
+                           size_t offset,
+                           json_writer_t* writer) {
+  size_t i;
+  if (ndims > 2) {
+    size_t slice_size = 1;
+    for (i = 0; i < ndims - 1; ++i)
+      slice_size *= dims[i];
+    if (!AppendJSONChar(writer, '['))
+      return false;
+    for (i = 0; i < dims[ndims - 1]; ++i)
+      if ((i && !AppendJSONChar(writer, ',')) ||
+          !WriteJSONArray(input,
+                          ndims - 1,
+                          dims,
+                          offset + i * slice_size,
+                          writer))
+        return false;
+    return AppendJSONChar(writer, ']');
+  }
+  if (dims[0] <= 1 || dims[1] <= 1)
+    return WriteJSONVector(input, offset, 1, dims[0] * dims[1], writer);
+  if (!AppendJSONChar(writer, '['))
+    return false;
+  for (i = 0; i < dims[0]; ++i)
+    if ((i && !AppendJSONChar(writer, ',')) ||
+        !WriteJSONVector(input, offset + i, dims[0], dims[1], writer))
+      return false;
+  return AppendJSONChar(writer, ']');
+}
+
+/** Write any mxArray. Sparse and complex arrays are packed as the encoder
+ * always does. Nested values recurse, so the depth is limited.
+ */
+static bool WriteJSONValue(const mxArray* input, json_writer_t* writer) {
+  bool status;
+  if (writer->depth >= BSONMEX_RECURSIVE_MAX_DEPTH)
+    return false;
+  if (mxGetNumberOfElements(input) &&
+      (mxIsSparse(input) || (mxIsComplex(input) && mxIsNumeric(input))))
+    return AppendJSONPackedArray(writer, input);
+  ++writer->depth;
+  status = WriteJSONArray(input,
+                          mxGetNumberOfDimensions(input),
+                          mxGetDimensions(input),
+                          0,
+                          writer);
+  --writer->depth;
+  return status;
+}
+
+EXTERN_C bool ConvertMxArrayToJSON(const mxArray* input,
+                                   FILE* file,
+                                   char** output,
+                                   size_t* length) {
+  json_writer_t writer;
+  bool status;
+  memset(&writer, 0, sizeof(writer));
+  writer.file = file;
+  status = WriteJSONValue(input, &writer);
+  if (status && file)
+    status = fwrite(writer.data, 1, writer.length, file) == writer.length;
+  else if (status)
+    status = AppendJSONChar(&writer, '\0');
+  if (!status || file) {
+    if (writer.data)
+      mxFree(writer.data);
+    return status;
+  }
+  *output = writer.data;
+  *length = writer.length - 1;
+  return true;
+}
@@ -0,0 +1,89 @@
+/** JSON tokenizer for the direct JSON decoder, and direct JSON writer.
+ *
+ * JSON text is parsed into a tape of nodes in document order. A container
+ * node is followed by its children, and each node records the index past its
+ * subtree, so that containers can be scanned twice like a bson iterator.
+ * Values are typed as the BSON types that libbson would produce from the
+ * same JSON.
+ *
+ * mxArray is written to JSON in the shape that the encoder gives to BSON,
+ * using MongoDB extended JSON for binary and date values.
+ *
+ * Kota Yamaguchi 2013
+ */
+
+#ifndef __BSONJSON_H__
+#define __BSONJSON_H__
+
+#include "bsonmex.h"
+#include <stdio.h>
+
+/** Node of the JSON tape.
+ */
+typedef struct json_node_t {
+  bson_type_t type; /* BSON_TYPE_DOCUMENT, ARRAY, UTF8, DOUBLE, INT32, INT64,
+                       BOOL, or NULL. */
+  const char* key;  /* Key of an object member, or NULL. */
+  size_t next;      /* Index past the subtree of the node. */
+  size_t size;      /* Number of children of a container. */
+  union {
+    const char* string; /* Unescaped and null-terminated. */
+    double number;
+    int64_t integer;
+    bool boolean;
+  } value;
+} json_node_t;
+
+/** Tape of the parsed JSON text.
+ */
+typedef struct json_tape_t {
+  json_node_t* nodes;
+  size_t size;
+  size_t capacity;
+} json_tape_t;
+
+/** Parse JSON text into a tape. Strings are unescaped in place, so the text
+ * must outlive the tape.
+ * @param text null-terminated JSON text, modified by the parser.
+ * @param length length of the text.
+ * @param tape tape to create. Caller must call DestroyJSONTape() after use.
+ * @param error_offset position of the error on failure.
+ * @return true if success.
+ */
+EXTERN_C bool ParseJSONTape(char* text,
+                            size_t length,
+                            json_tape_t* tape,
+                            size_t* error_offset);
+/** Release the tape.
+ */
+EXTERN_C void DestroyJSONTape(json_tape_t* tape);
+/** Write a UTF-16 character in UTF-8, combined with the next character if
+ * it is a surrogate pair.
+ * @param chars characters.
+ * @param stride distance between the characters.
+ * @param count number of the characters.
+ * @param index index of the character, moved to the low surrogate of a pair.
+ * @param output buffer of at least 4 bytes.
+ * @return position after the written bytes, or NULL for an unpaired
+ *         surrogate.
+ */
+EXTERN_C char* WriteCharUTF8(const mxChar* chars,
+                             size_t stride,
+                             size_t count,
+                             size_t* index,
+                             char* output);
+/** Convert mxArray to JSON text without building BSON. Values nested deeper
+ * than BSONMEX_RECURSIVE_MAX_DEPTH fail to convert.
+ * @param input mxArray to convert.
+ * @param file file to write the text, or NULL to return the text.
+ * @param output null-terminated text if the file is NULL. Caller must mxFree
+ *               the text.
+ * @param length length of the text if the file is NULL.
+ * @return true if success.
+ */
+EXTERN_C bool ConvertMxArrayToJSON(const mxArray* input,
+                                   FILE* file,
+                                   char** output,
+                                   size_t* length);
+
+#endif /* __BSONJSON_H__ */
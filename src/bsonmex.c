@@ -1,39 +1,70 @@
 /** mxArray BSON encoder implementation.
- *
- * TODO: Implement sparse array conversion.
  *
  * Kota Yamaguchi 2013
  */
 
 #include "bsonmex.h"
+#include "bsonarena.h"
+#include "bsoncache.h"
+#include "bsonjson.h"
+#include "bsonpack.h"
 #include <ctype.h>
 #include <mex.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define KEY_CACHE_SIZE 256
+#define MAX_EXIT_HANDLERS 8
+#define MAX_EXACT_INTEGER 9007199254740992LL
+
+/** Functions to call when the MEX file is cleared.
+ */
+static void (*exit_handlers[MAX_EXIT_HANDLERS])(void);
+static int num_exit_handlers = 0;
+
 static bool ConvertArrayToBSON(const mxArray* input,
                                const char* name,
+                               const encode_options_t* options,
                                bson_t* output);
-static mxArray* ConvertNextToMxArray(bson_iter_t* it);
+static mxArray* ConvertValueToMxArray(const bson_iter_t* it,
+                                      const decode_options_t* options);
 static mxArray* Convert2DOrNDArrayToCellArray(const mxArray* input);
 
+/** Call the exit handlers in the reverse order of registration.
+ */
+static void RunExitHandlers(void) {
+  while (num_exit_handlers > 0)
+    exit_handlers[--num_exit_handlers]();
+}
+
+EXTERN_C void AddExitHandler(void (*handler)(void)) {
+  int i;
+  for (i = 0; i < num_exit_handlers; ++i)
+    if (exit_handlers[i] == handler)
+      return;
+  if (num_exit_handlers == MAX_EXIT_HANDLERS)
+    mexErrMsgIdAndTxt("bsonmex:error", "Too many exit handlers.");
+  exit_handlers[num_exit_handlers++] = handler;
+  mexAtExit(RunExitHandlers);
+}
+
 /** Convert mxArray to BSON binary.
  */
 static bool ConvertBinaryArrayToBSON(const mxArray* input,
                                      const char* name,
                                      bson_t* output) {
   size_t num_elements = mxGetNumberOfElements(input);
-  int length = 0;
   const uint8_t* data;
   if (num_elements == 0)
     return BSON_APPEND_NULL(output, (name) ? name : "0");
+  if (num_elements > INT32_MAX)
+    return false;
   data = (const uint8_t*)mxGetData(input);
-  length = mxGetNumberOfElements(input);
   return BSON_APPEND_BINARY(output,
                             (name) ? name : "0",
                             BSON_SUBTYPE_BINARY,
                             data,
-                            length);
+                            (uint32_t)num_elements);
 }
 
 /** Convert mxArray to BSON int array.
@@ -45,7 +76,7 @@ static bool ConvertShortArrayToBSON(const mxArray* input,
   size_t num_elements = mxGetNumberOfElements(input);
   int16_t* values = (int16_t*)mxGetData(input);
   bson_t array;
-  int i;
+  size_t i;
   if (num_elements == 0)
     return BSON_APPEND_NULL(output, (name) ? name : "0");
   if (num_elements == 1)
@@ -57,7 +88,7 @@ static bool ConvertShortArrayToBSON(const mxArray* input,
                                        &array))
     return false;
   for (i = 0; i < num_elements; ++i) {
-    if (sprintf(key, "%d", i) < 0)
+    if (sprintf(key, "%lu", (unsigned long)i) < 0)
       return false;
     if (!BSON_APPEND_INT32((name) ? &array : output, key, values[i]))
       return false;
@@ -76,7 +107,7 @@ static bool ConvertIntegerArrayToBSON(const mxArray* input,
   size_t num_elements = mxGetNumberOfElements(input);
   int32_t* values = (int32_t*)mxGetData(input);
   bson_t array;
-  int i;
+  size_t i;
   if (num_elements == 0)
     return BSON_APPEND_NULL(output, (name) ? name : "0");
   if (num_elements == 1)
@@ -88,7 +119,7 @@ static bool ConvertIntegerArrayToBSON(const mxArray* input,
                                        &array))
     return false;
   for (i = 0; i < num_elements; ++i) {
-    if (sprintf(key, "%d", i) < 0)
+    if (sprintf(key, "%lu", (unsigned long)i) < 0)
       return false;
     if (!BSON_APPEND_INT32((name) ? &array : output, key, values[i]))
       return false;
@@ -107,7 +138,7 @@ static bool ConvertLongArrayToBSON(const mxArray* input,
   size_t num_elements = mxGetNumberOfElements(input);
   int64_t* values = (int64_t*)mxGetData(input);
   bson_t array;
-  int i;
+  size_t i;
   if (num_elements == 0)
     return BSON_APPEND_NULL(output, (name) ? name : "0");
   if (num_elements == 1)
@@ -119,7 +150,7 @@ static bool ConvertLongArrayToBSON(const mxArray* input,
                                        &array))
     return false;
   for (i = 0; i < num_elements; ++i) {
-    if (sprintf(key, "%d", i) < 0)
+    if (sprintf(key, "%lu", (unsigned long)i) < 0)
       return false;
     if (!BSON_APPEND_INT64((name) ? &array : output, key, values[i]))
       return false;
@@ -138,7 +169,7 @@ static bool ConvertLogicalArrayToBSON(const mxArray* input,
   size_t num_elements = mxGetNumberOfElements(input);
   mxLogical* values = mxGetLogicals(input);
   bson_t array;
-  int i;
+  size_t i;
   if (num_elements == 0)
     return BSON_APPEND_NULL(output, (name) ? name : "0");
   if (num_elements == 1)
@@ -150,7 +181,7 @@ static bool ConvertLogicalArrayToBSON(const mxArray* input,
                                        &array))
     return false;
   for (i = 0; i < num_elements; ++i) {
-    if (sprintf(key, "%d", i) < 0)
+    if (sprintf(key, "%lu", (unsigned long)i) < 0)
       return false;
     if (!BSON_APPEND_BOOL((name) ? &array : output, key, values[i]))
       return false;
@@ -194,7 +225,7 @@ static bool ConvertFloatArrayToBSON(const mxArray* input,
   size_t num_elements = mxGetNumberOfElements(input);
   float* values = (float*)mxGetData(input);
   bson_t array;
-  int i;
+  size_t i;
   if (num_elements == 0)
     return BSON_APPEND_NULL(output, (name) ? name : "0");
   if (num_elements == 1)
@@ -206,7 +237,7 @@ static bool ConvertFloatArrayToBSON(const mxArray* input,
                                        &array))
     return false;
   for (i = 0; i < num_elements; ++i) {
-    if (sprintf(key, "%d", i) < 0)
+    if (sprintf(key, "%lu", (unsigned long)i) < 0)
       return false;
     if (!BSON_APPEND_DOUBLE((name) ? &array : output, key, values[i]))
       return false;
@@ -225,7 +256,7 @@ static bool ConvertDoubleArrayToBSON(const mxArray* input,
   size_t num_elements = mxGetNumberOfElements(input);
   double* values = mxGetPr(input);
   bson_t array;
-  int i;
+  size_t i;
   if (num_elements == 0)
     return BSON_APPEND_NULL(output, (name) ? name : "0");
   if (num_elements == 1)
@@ -237,7 +268,7 @@ static bool ConvertDoubleArrayToBSON(const mxArray* input,
                                        &array))
     return false;
   for (i = 0; i < num_elements; ++i) {
-    if (sprintf(key, "%d", i) < 0)
+    if (sprintf(key, "%lu", (unsigned long)i) < 0)
       return false;
     if (!BSON_APPEND_DOUBLE((name) ? &array : output, key, values[i]))
       return false;
@@ -255,7 +286,7 @@ static bool ConvertDateArrayToBSON(const mxArray* input,
   char key[16];
   size_t num_elements = mxGetNumberOfElements(input);
   bson_t array;
-  int i;
+  size_t i;
   if (num_elements == 0)
     return BSON_APPEND_NULL(output, (name) ? name : "0");
   if (num_elements == 1) {
@@ -275,7 +306,7 @@ static bool ConvertDateArrayToBSON(const mxArray* input,
   for (i = 0; i < num_elements; ++i) {
     mxArray* value;
     int64_t date_value;
-    if (sprintf(key, "%d", i) < 0)
+    if (sprintf(key, "%lu", (unsigned long)i) < 0)
       return false;
     value = mxGetProperty(input, i, "number");
     if (!value)
@@ -291,32 +322,6 @@ static bool ConvertDateArrayToBSON(const mxArray* input,
   return true;
 }
 
-/** Convert cell mxArray to BSON array.
- */
-static bool ConvertCellArrayToBSON(const mxArray* input,
-                                   const char* name,
-                                   bson_t* output) {
-  char key[16];
-  size_t num_elements = mxGetNumberOfElements(input);
-  bson_t array;
-  int i;
-  if (name && !bson_append_array_begin(output,
-                                       name,
-                                       (int)strlen(name),
-                                       &array))
-    return false;
-  for (i = 0; i < num_elements; ++i) {
-    mxArray* element = mxGetCell(input, i);
-    if (sprintf(key, "%d", i) < 0)
-      return false;
-    if (!ConvertArrayToBSON(element, key, (name) ? &array : output))
-      return false;
-  }
-  if (name && !bson_append_array_end(output, &array))
-    return false;
-  return true;
-}
-
 /** Check if oid is given.
  */
 static bool ConvertStringToOID(const mxArray* element,
@@ -328,72 +333,95 @@ static bool ConvertStringToOID(const mxArray* element,
   return BSON_APPEND_OID(output, "_id", &oid);
 }
 
-/** Convert struct mxArray to BSON array.
+/** Get the i-th slice of any ND (>2D) array along the last dimension.
+ * @return Newly allocated mxArray, or NULL if not supported.
  */
-static bool ConvertStructArrayToBSON(const mxArray* input,
-                                     const char* name,
-                                     bson_t* output) {
-  size_t num_elements = mxGetNumberOfElements(input);
-  int num_fields = mxGetNumberOfFields(input);
-  bson_t array;
-  int i, j;
-  if (num_elements == 1) {
-    bson_t document;
-    if (name && !bson_append_document_begin(output,
-                                           name,
-                                           (int)strlen(name),
-                                           &document))
-      return false;
-    for (i = 0; i < num_fields; ++i) {
-      mxArray* element = mxGetFieldByNumber(input, 0, i);
-      const char* field_name = mxGetFieldNameByNumber(input, i);
-      /* Convert string to OID only if a scalar struct with id field. */
-      if (name == NULL &&
-          strcmp(field_name, "id_") == 0 &&
-          mxIsChar(element) &&
-          mxGetNumberOfElements(element) == 12) {
-        if (!ConvertStringToOID(element, (name) ? &document : output))
-          return false;
+static mxArray* GetNDArraySlice(const mxArray* input,
+                                mwSize ndims,
+                                const mwSize* dims,
+                                mwSize i) {
+  mwSize num_elements = mxGetNumberOfElements(input) / dims[ndims - 1];
+  mxArray* element = NULL;
+  mwSize j;
+  switch (mxGetClassID(input)) {
+    case mxSTRUCT_CLASS: {
+      int nfields = mxGetNumberOfFields(input);
+      const char** fields = (const char**)ArenaMalloc(
+          sizeof(const char*) * nfields);
+      int k;
+      for (k = 0; k < nfields; ++k)
+        fields[k] = mxGetFieldNameByNumber(input, k);
+      element = mxCreateStructArray(ndims - 1, dims, nfields, fields);
+      for (j = 0; j < num_elements; ++j) {
+        mwSize index = j + i * num_elements;
+        for (k = 0; k < nfields; ++k) {
+          mxArray* value = mxDuplicateArray(mxGetFieldByNumber(input,
+                                                               index,
+                                                               k));
+          mxSetFieldByNumber(element, j, k, value);
+        }
       }
-      else
-        if (!ConvertArrayToBSON(element,
-                                field_name,
-                                (name) ? &document : output))
-          return false;
+      ArenaFree(fields);
+      break;
     }
-    if (name && !bson_append_document_end(output, &document))
-      return false;
-  }
-  else {
-    char key[16];
-    if (name && !bson_append_array_begin(output,
-                                         name,
-                                         (int)strlen(name),
-                                         &array))
-      return false;
-    for (j = 0; j < num_elements; ++j) {
-      bson_t document;
-      if (sprintf(key, "%d", j) < 0)
-        return false;
-      if (!bson_append_document_begin((name) ? &array : output,
-                                      key,
-                                      (int)strlen(key),
-                                      &document))
-        return false;
-      for (i = 0; i < num_fields; ++i) {
-        mxArray* element = mxGetFieldByNumber(input, 0, i);
-        const char* field_name = mxGetFieldNameByNumber(input, i);
-        if (!ConvertArrayToBSON(element, field_name, &document))
-          return false;
+    case mxCELL_CLASS: {
+      element = mxCreateCellArray(ndims - 1, dims);
+      for (j = 0; j < num_elements; ++j) {
+        mwSize index = j + num_elements * i;
+        mxSetCell(element, j, mxDuplicateArray(mxGetCell(input, index)));
       }
-      if (!bson_append_document_end((name) ? &array : output,
-                                    &document))
-        return false;
+      break;
     }
-    if (name && !bson_append_array_end(output, &array))
-      return false;
+    case mxDOUBLE_CLASS:
+    case mxINT8_CLASS:
+    case mxUINT8_CLASS:
+    case mxINT16_CLASS:
+    case mxUINT16_CLASS:
+    case mxINT32_CLASS:
+    case mxUINT32_CLASS:
+    case mxINT64_CLASS:
+    case mxUINT64_CLASS:
+    case mxSINGLE_CLASS: {
+      mwSize element_size, stride;
+      element = mxCreateNumericArray(ndims - 1,
+                                     dims,
+                                     mxGetClassID(input),
+                                     mxREAL);
+      element_size = mxGetElementSize(input);
+      stride = element_size * num_elements;
+      memcpy((void*)mxGetData(element),
+             (void*)mxGetData(input) + i * stride,
+             stride);
+      break;
+    }
+    case mxCHAR_CLASS: {
+      mwSize element_size, stride;
+      element = mxCreateCharArray(ndims - 1, dims);
+      element_size = mxGetElementSize(input);
+      stride = element_size * num_elements;
+      memcpy((void*)mxGetData(element),
+             (void*)mxGetData(input) + i * stride,
+             stride);
+      break;
+    }
+    case mxLOGICAL_CLASS: {
+      mwSize element_size, stride;
+      element = mxCreateLogicalArray(ndims - 1, dims);
+      element_size = mxGetElementSize(input);
+      stride = element_size * num_elements;
+      memcpy((void*)mxGetData(element),
+             (void*)mxGetData(input) + i * stride,
+             stride);
+      break;
+    }
+    case mxOBJECT_CLASS:
+    case mxVOID_CLASS:
+    case mxFUNCTION_CLASS:
+    case mxOPAQUE_CLASS:
+    default:
+      return NULL;
   }
-  return true;
+  return element;
 }
 
 /** Convert any ND (>2D) array to a nested cell array.
@@ -403,89 +431,10 @@ static mxArray* ConvertNDArrayToCellArray(const mxArray* input,
                                    const mwSize* dims) {
   mwSize last_dimentions = dims[ndims - 1];
   mxArray* array = mxCreateCellMatrix(1, last_dimentions);
-  mwSize num_elements = mxGetNumberOfElements(input) / last_dimentions;
-  int i, j;
+  mwSize i;
   for (i = 0; i < last_dimentions; ++i) {
-    mxArray* element = NULL;
+    mxArray* element = GetNDArraySlice(input, ndims, dims, i);
     mxArray* split_element;
-    switch (mxGetClassID(input)) {
-      case mxSTRUCT_CLASS: {
-        int nfields = mxGetNumberOfFields(input);
-        const char** fields = (const char**)mxMalloc(
-            sizeof(const char*) * nfields);
-        int k;
-        for (k = 0; k < nfields; ++k)
-          fields[k] = mxGetFieldNameByNumber(input, k);
-        element = mxCreateStructArray(ndims - 1, dims, nfields, fields);
-        for (j = 0; j < num_elements; ++j) {
-          mwSize index = j + i * num_elements;
-          for (k = 0; k < nfields; ++k) {
-            mxArray* value = mxDuplicateArray(mxGetFieldByNumber(input,
-                                                                 index,
-                                                                 k));
-            mxSetFieldByNumber(element, j, k, value);
-          }
-        }
-        mxFree(fields);
-        break;
-      }
-      case mxCELL_CLASS: {
-        element = mxCreateCellArray(ndims - 1, dims);
-        for (j = 0; j < num_elements; ++j) {
-          mwSize index = j + num_elements * i;
-          mxSetCell(element, j, mxDuplicateArray(mxGetCell(input, index)));
-        }
-        break;
-      }
-      case mxDOUBLE_CLASS:
-      case mxINT8_CLASS:
-      case mxUINT8_CLASS:
-      case mxINT16_CLASS:
-      case mxUINT16_CLASS:
-      case mxINT32_CLASS:
-      case mxUINT32_CLASS:
-      case mxINT64_CLASS:
-      case mxUINT64_CLASS:
-      case mxSINGLE_CLASS: {
-        mwSize element_size, stride;
-        element = mxCreateNumericArray(ndims - 1,
-                                       dims,
-                                       mxGetClassID(input),
-                                       mxREAL);
-        element_size = mxGetElementSize(input);
-        stride = element_size * num_elements;
-        memcpy((void*)mxGetData(element),
-               (void*)mxGetData(input) + i * stride,
-               stride);
-        break;
-      }
-      case mxCHAR_CLASS: {
-        mwSize element_size, stride;
-        element = mxCreateCharArray(ndims - 1, dims);
-        element_size = mxGetElementSize(input);
-        stride = element_size * num_elements;
-        memcpy((void*)mxGetData(element),
-               (void*)mxGetData(input) + i * stride,
-               stride);
-        break;
-      }
-      case mxLOGICAL_CLASS: {
-        mwSize element_size, stride;
-        element = mxCreateLogicalArray(ndims - 1, dims);
-        element_size = mxGetElementSize(input);
-        stride = element_size * num_elements;
-        memcpy((void*)mxGetData(element),
-               (void*)mxGetData(input) + i * stride,
-               stride);
-        break;
-      }
-      case mxOBJECT_CLASS:
-      case mxVOID_CLASS:
-      case mxFUNCTION_CLASS:
-      case mxOPAQUE_CLASS:
-      default:
-        return NULL;
-    }
     if (!element)
       return NULL;
     split_element = Convert2DOrNDArrayToCellArray(element);
@@ -498,112 +447,122 @@ static mxArray* ConvertNDArrayToCellArray(const mxArray* input,
   return array;
 }
 
-/** Convert any 2D array to a cell array of row vectors.
+/** Get the i-th row vector of any 2D array.
+ * @return Newly allocated mxArray, or NULL if not supported.
  */
-static mxArray* Convert2DArrayToCellArray(const mxArray* input,
-                                   mwSize ndims,
-                                   const mwSize* dims) {
-  mxArray* array = mxCreateCellMatrix(1, dims[0]);
-  int i, j;
-  for (i = 0; i < dims[0]; ++i) {
-    mxArray* element = NULL;
-    switch (mxGetClassID(input)) {
-      case mxSTRUCT_CLASS: {
-        int nfields = mxGetNumberOfFields(input);
-        const char** fields = (const char**)mxMalloc(
-            sizeof(const char*) * nfields);
-        int k;
-        for (k = 0; k < nfields; ++k)
-          fields[k] = mxGetFieldNameByNumber(input, k);
-        element = mxCreateStructMatrix(1, dims[1], nfields, fields);
-        for (j = 0; j < dims[1]; ++j) {
-          mwSize index = i + j * dims[0];
-          for (k = 0; k < nfields; ++k) {
-            mxArray* value = mxDuplicateArray(mxGetFieldByNumber(input,
-                                                                 index,
-                                                                 k));
-            mxSetFieldByNumber(element, j, k, value);
-          }
+static mxArray* Get2DArrayRow(const mxArray* input,
+                              const mwSize* dims,
+                              mwSize i) {
+  mxArray* element = NULL;
+  mwSize j;
+  switch (mxGetClassID(input)) {
+    case mxSTRUCT_CLASS: {
+      int nfields = mxGetNumberOfFields(input);
+      const char** fields = (const char**)ArenaMalloc(
+          sizeof(const char*) * nfields);
+      int k;
+      for (k = 0; k < nfields; ++k)
+        fields[k] = mxGetFieldNameByNumber(input, k);
+      element = mxCreateStructMatrix(1, dims[1], nfields, fields);
+      for (j = 0; j < dims[1]; ++j) {
+        mwSize index = i + j * dims[0];
+        for (k = 0; k < nfields; ++k) {
+          mxArray* value = mxDuplicateArray(mxGetFieldByNumber(input,
+                                                               index,
+                                                               k));
+          mxSetFieldByNumber(element, j, k, value);
         }
-        mxFree(fields);
-        break;
       }
-      case mxCELL_CLASS: {
-        element = mxCreateCellMatrix(1, dims[1]);
-        for (j = 0; j < dims[1]; ++j) {
-          mwSize index = i + j * dims[0];
-          mxSetCell(element, j, mxDuplicateArray(mxGetCell(input, index)));
-        }
-        break;
+      ArenaFree(fields);
+      break;
+    }
+    case mxCELL_CLASS: {
+      element = mxCreateCellMatrix(1, dims[1]);
+      for (j = 0; j < dims[1]; ++j) {
+        mwSize index = i + j * dims[0];
+        mxSetCell(element, j, mxDuplicateArray(mxGetCell(input, index)));
       }
-      case mxDOUBLE_CLASS:
-      case mxINT8_CLASS:
-      case mxUINT8_CLASS:
-      case mxINT16_CLASS:
-      case mxUINT16_CLASS:
-      case mxINT32_CLASS:
-      case mxUINT32_CLASS:
-      case mxINT64_CLASS:
-      case mxUINT64_CLASS:
-      case mxSINGLE_CLASS: {
-        mwSize element_size, stride;
-        void* input_data;
-        void* output_data;
-        element = mxCreateNumericMatrix(1,
-                                        dims[1],
-                                        mxGetClassID(input),
-                                        mxREAL);
-        element_size = mxGetElementSize(input);
-        stride = element_size * dims[0];
-        input_data = (void*)mxGetData(input) + i * element_size;
-        output_data = (void*)mxGetData(element);
-        for (j = 0; j < dims[1]; ++j) {
-          memcpy(output_data, input_data, element_size);
-          input_data += stride;
-          output_data += element_size;
-        }
-        break;
+      break;
+    }
+    case mxDOUBLE_CLASS:
+    case mxINT8_CLASS:
+    case mxUINT8_CLASS:
+    case mxINT16_CLASS:
+    case mxUINT16_CLASS:
+    case mxINT32_CLASS:
+    case mxUINT32_CLASS:
+    case mxINT64_CLASS:
+    case mxUINT64_CLASS:
+    case mxSINGLE_CLASS: {
+      mwSize element_size, stride;
+      void* input_data;
+      void* output_data;
+      element = mxCreateNumericMatrix(1,
+                                      dims[1],
+                                      mxGetClassID(input),
+                                      mxREAL);
+      element_size = mxGetElementSize(input);
+      stride = element_size * dims[0];
+      input_data = (void*)mxGetData(input) + i * element_size;
+      output_data = (void*)mxGetData(element);
+      for (j = 0; j < dims[1]; ++j) {
+        memcpy(output_data, input_data, element_size);
+        input_data += stride;
+        output_data += element_size;
       }
-      case mxCHAR_CLASS: {
-        mwSize char_dims[] = {1, dims[1]};
-        mwSize element_size, stride;
-        void* input_data;
-        void* output_data;
-        element = mxCreateCharArray(2, char_dims);
-        element_size = mxGetElementSize(input);
-        stride = element_size * dims[0];
-        input_data = (void*)mxGetData(input) + i * element_size;
-        output_data = (void*)mxGetData(element);
-        for (j = 0; j < dims[1]; ++j) {
-          memcpy(output_data, input_data, element_size);
-          input_data += stride;
-          output_data += element_size;
-        }
-        break;
+      break;
+    }
+    case mxCHAR_CLASS: {
+      mwSize char_dims[] = {1, dims[1]};
+      mwSize element_size, stride;
+      void* input_data;
+      void* output_data;
+      element = mxCreateCharArray(2, char_dims);
+      element_size = mxGetElementSize(input);
+      stride = element_size * dims[0];
+      input_data = (void*)mxGetData(input) + i * element_size;
+      output_data = (void*)mxGetData(element);
+      for (j = 0; j < dims[1]; ++j) {
+        memcpy(output_data, input_data, element_size);
+        input_data += stride;
+        output_data += element_size;
       }
-      case mxLOGICAL_CLASS: {
-        mwSize element_size, stride;
-        void* input_data;
-        void* output_data;
-        element = mxCreateLogicalMatrix(1, dims[1]);
-        element_size = mxGetElementSize(input);
-        stride = element_size * dims[0];
-        input_data = (void*)mxGetData(input) + i * element_size;
-        output_data = (void*)mxGetData(element);
-        for (j = 0; j < dims[1]; ++j) {
-          memcpy(output_data, input_data, element_size);
-          input_data += stride;
-          output_data += element_size;
-        }
-        break;
+      break;
+    }
+    case mxLOGICAL_CLASS: {
+      mwSize element_size, stride;
+      void* input_data;
+      void* output_data;
+      element = mxCreateLogicalMatrix(1, dims[1]);
+      element_size = mxGetElementSize(input);
+      stride = element_size * dims[0];
+      input_data = (void*)mxGetData(input) + i * element_size;
+      output_data = (void*)mxGetData(element);
+      for (j = 0; j < dims[1]; ++j) {
+        memcpy(output_data, input_data, element_size);
+        input_data += stride;
+        output_data += element_size;
       }
-      case mxOBJECT_CLASS:
-      case mxVOID_CLASS:
-      case mxFUNCTION_CLASS:
-      case mxOPAQUE_CLASS:
-      default:
-        return NULL;
+      break;
     }
+    case mxOBJECT_CLASS:
+    case mxVOID_CLASS:
+    case mxFUNCTION_CLASS:
+    case mxOPAQUE_CLASS:
+    default:
+      return NULL;
+  }
+  return element;
+}
+
+/** Convert any 2D array to a cell array of row vectors.
+ */
+static mxArray* Convert2DArrayToCellArray(const mxArray* input,
+                                          const mwSize* dims) {
+  mxArray* array = mxCreateCellMatrix(1, dims[0]);
+  mwSize i;
+  for (i = 0; i < dims[0]; ++i) {
+    mxArray* element = Get2DArrayRow(input, dims, i);
     if (!element)
       return NULL;
     mxSetCell(array, i, element);
@@ -620,808 +579,3183 @@ static mxArray* Convert2DOrNDArrayToCellArray(const mxArray* input) {
     return (mxArray*)input;
   }
   else if (ndims == 2)
-    return Convert2DArrayToCellArray(input, ndims, dims);
+    return Convert2DArrayToCellArray(input, dims);
   else
     return ConvertNDArrayToCellArray(input, ndims, dims);
 }
 
-/** Convert any mxArray to BSON.
+/** Get the packed codec requested in the encoder options.
+ * @return codec, or 0 if the input is not packed.
  */
-static bool ConvertArrayToBSON(const mxArray* input,
-                               const char* name,
-                               bson_t* output) {
-  mxArray* array = Convert2DOrNDArrayToCellArray(input);
+static int GetPackCodec(const mxArray* input,
+                        const encode_options_t* options) {
+  size_t num_elements = mxGetNumberOfElements(input);
+  /* Sparse matrices are always packed. */
+  if (mxIsSparse(input))
+    return (num_elements) ? PACK_CODEC_SPARSE_CSC : 0;
+  /* Large arrays are stored in chunks out of the document. */
+  if (options->chunk_writer &&
+      (mxIsNumeric(input) || mxIsLogical(input)) &&
+      !mxIsComplex(input) &&
+      num_elements &&
+      num_elements * mxGetElementSize(input) >= options->chunk_threshold)
+    return PACK_CODEC_CHUNKED;
+  /* Complex arrays are always packed with interleaved values. */
+  if (mxIsComplex(input) && mxIsNumeric(input))
+    return (num_elements) ? PACK_CODEC_RAW : 0;
+  if (num_elements <= 1)
+    return 0;
+  switch (mxGetClassID(input)) {
+    case mxLOGICAL_CLASS:
+      if (options->pack_logical)
+        return PACK_CODEC_BITSET;
+      break;
+    case mxINT64_CLASS:
+    case mxUINT64_CLASS:
+      if (options->delta_encode)
+        return PACK_CODEC_DELTA_VARINT;
+      break;
+    case mxOBJECT_CLASS:
+      if (options->delta_encode && mxIsClass(input, "bson.datetime"))
+        return PACK_CODEC_DELTA_VARINT;
+      return 0;
+    default:
+      break;
+  }
+  /* Large numeric arrays are stored raw to be compressed. */
+  if (options->compress &&
+      (mxIsNumeric(input) || mxIsLogical(input)) &&
+      !mxIsSparse(input) &&
+      !mxIsComplex(input) &&
+      num_elements * mxGetElementSize(input) >= options->compress_threshold)
+    return PACK_CODEC_RAW;
+  return 0;
+}
+
+/** Kind of a container visited by the encoder.
+ */
+typedef enum {
+  ENCODE_CELL = 0,    /* Elements of a cell array. */
+  ENCODE_STRUCT,      /* Fields of an element of a struct array. */
+  ENCODE_STRUCT_ARRAY /* Elements of a struct array. */
+} encode_frame_kind_t;
+
+/** Open container of the encoder. Frames are linked from the innermost and
+ * do not move while open, because libbson refers to the parent document.
+ */
+typedef struct encode_frame_t {
+  struct encode_frame_t* parent; /* Enclosing frame, or NULL. */
+  const mxArray* input;  /* Cell or struct array to visit. */
+  mxArray* split;        /* Cell array split from 2D or ND input, or NULL. */
+  bson_t* container;     /* Document to close the frame in, or NULL. */
+  bson_t* output;        /* Document receiving the elements. */
+  size_t index;          /* Next element or field to visit. */
+  size_t element;        /* Element of the struct array. */
+  encode_frame_kind_t kind;
+  bson_t document;       /* Document or array opened by the frame. */
+} encode_frame_t;
+
+/** Explicit stack of the encoder.
+ */
+typedef struct encode_stack_t {
+  encode_frame_t* top;
+  size_t depth;
+  const encode_options_t* options;
+} encode_stack_t;
+
+/** Open a frame to visit a cell or struct array.
+ * @param split cell array to destroy when the frame is closed, or NULL.
+ * @param name key of the container, or NULL to append to the output.
+ */
+static bool PushEncodeFrame(encode_stack_t* stack,
+                            encode_frame_kind_t kind,
+                            const mxArray* input,
+                            mxArray* split,
+                            size_t element,
+                            const char* name,
+                            bson_t* output) {
+  encode_frame_t* frame;
+  if (stack->options->max_depth && stack->depth > stack->options->max_depth) {
+    if (split)
+      mxDestroyArray(split);
+    return false;
+  }
+  frame = (encode_frame_t*)ArenaMalloc(sizeof(encode_frame_t));
+  frame->parent = stack->top;
+  frame->input = input;
+  frame->split = split;
+  frame->container = (name) ? output : NULL;
+  frame->output = (name) ? &frame->document : output;
+  frame->index = 0;
+  frame->element = element;
+  frame->kind = kind;
+  /* Link the frame first, so that a failure destroys the split array. */
+  stack->top = frame;
+  ++stack->depth;
+  if (!name)
+    return true;
+  return (kind == ENCODE_STRUCT) ?
+      bson_append_document_begin(output,
+                                 name,
+                                 (int)strlen(name),
+                                 &frame->document) :
+      bson_append_array_begin(output,
+                              name,
+                              (int)strlen(name),
+                              &frame->document);
+}
+
+/** Remove the innermost frame without closing its document.
+ */
+static void DiscardEncodeFrame(encode_stack_t* stack) {
+  encode_frame_t* frame = stack->top;
+  if (frame->split)
+    mxDestroyArray(frame->split);
+  stack->top = frame->parent;
+  --stack->depth;
+  ArenaFree(frame);
+}
+
+/** Close the document of the innermost frame and remove the frame.
+ */
+static bool PopEncodeFrame(encode_stack_t* stack) {
+  encode_frame_t* frame = stack->top;
+  bool status = true;
+  if (frame->container)
+    status = (frame->kind == ENCODE_STRUCT) ?
+        bson_append_document_end(frame->container, &frame->document) :
+        bson_append_array_end(frame->container, &frame->document);
+  DiscardEncodeFrame(stack);
+  return status;
+}
+
+/** Append any mxArray to BSON. Cell and struct arrays open a frame, and
+ * their elements are appended as the frame is visited.
+ */
+static bool AppendArrayToBSON(encode_stack_t* stack,
+                              const mxArray* input,
+                              const char* name,
+                              bson_t* output) {
+  mxArray* array;
+  mxArray* split;
+  /* Packed arrays keep the N-D shape in the binary. */
+  int codec = GetPackCodec(input, stack->options);
+  if (codec)
+    return ConvertPackedArrayToBSON(input,
+                                    name,
+                                    (pack_codec_t)codec,
+                                    stack->options,
+                                    output);
+  array = Convert2DOrNDArrayToCellArray(input);
   if (!array)
     return false;
+  split = (array != input) ? array : NULL;
   switch (mxGetClassID(array)) {
     case mxDOUBLE_CLASS:
       return ConvertDoubleArrayToBSON(array, name, output);
-      break;
     case mxSTRUCT_CLASS:
-      return ConvertStructArrayToBSON(array, name, output);
-      break;
+      return PushEncodeFrame(stack,
+                             (mxGetNumberOfElements(array) == 1) ?
+                             ENCODE_STRUCT : ENCODE_STRUCT_ARRAY,
+                             array,
+                             split,
+                             0,
+                             name,
+                             output);
     case mxCELL_CLASS:
-      return ConvertCellArrayToBSON(array, name, output);
-      break;
+      return PushEncodeFrame(stack, ENCODE_CELL, array, split, 0, name, output);
     case mxLOGICAL_CLASS:
       return ConvertLogicalArrayToBSON(array, name, output);
-      break;
     case mxCHAR_CLASS:
       return ConvertCharArrayToBSON(array, name, output);
-      break;
     case mxINT8_CLASS:
     case mxUINT8_CLASS:
       return ConvertBinaryArrayToBSON(array, name, output);
-      break;
     case mxINT16_CLASS:
     case mxUINT16_CLASS:
       return ConvertShortArrayToBSON(array, name, output);
-      break;
     case mxINT32_CLASS:
     case mxUINT32_CLASS:
       return ConvertIntegerArrayToBSON(array, name, output);
-      break;
     case mxINT64_CLASS:
     case mxUINT64_CLASS:
       return ConvertLongArrayToBSON(array, name, output);
-      break;
     case mxSINGLE_CLASS:
       return ConvertFloatArrayToBSON(array, name, output);
-      break;
     case mxOBJECT_CLASS:
     case mxVOID_CLASS:
     case mxFUNCTION_CLASS:
     case mxOPAQUE_CLASS:
     default:
-      if (mxIsClass(input, "bson.datetime")) {
+      if (mxIsClass(input, "bson.datetime"))
         return ConvertDateArrayToBSON(array, name, output);
-        break;        
-      }
       return false;
   }
-  if (array != input)
-    mxDestroyArray(array);
-  return false;
 }
 
-/** Check the type and the size of the BSON object.
+/** Append the next element of the innermost frame, or close the frame after
+ * the last element.
  */
-static void CheckBSONObject(bson_iter_t* it,
-                            int* object_size, 
-                            const char*** keys,
-                            int* array_type) {
-  int element_type;
-  bool is_first = true;
-  bool is_array = true;
-  *object_size = 0;
-  while (bson_iter_next(it)) {
-    bson_type_t type = bson_iter_type(it);
-    const char* key;
-    const char* key_ptr;
-    bool is_digit;
-    if (type == BSON_TYPE_EOD)
-      break;
-    key = bson_iter_key(it);
-    (*object_size)++;
-    /* Keep key names for a struct array. */
-    if (keys) {
-      *keys = (const char**)mxRealloc(*keys,
-                                      *object_size * sizeof(const char*));
-      (*keys)[(*object_size) - 1] = key;
-    }
-    /* Check if it has an consistent index. */
-    key_ptr = key;
-    is_digit = true;
-    while (*key_ptr != 0)
-      is_digit &= (isdigit(*key_ptr++) > 0);
-    is_array = (is_digit) ? is_array & (*object_size - 1 == atol(key)) : false;
-    /* Check the array type from element. */
-    if (array_type) {
-      switch (type) {
-        case BSON_TYPE_DOUBLE:
-          element_type = mxDOUBLE_CLASS;
-          break;
-        case BSON_TYPE_INT32:
-          element_type = mxINT32_CLASS;
-          break;
-        case BSON_TYPE_INT64:
-          element_type = mxINT64_CLASS;
-          break;
-        case BSON_TYPE_BOOL:
-          element_type = mxLOGICAL_CLASS;
-          break;
-        case BSON_TYPE_UTF8:
-          element_type = mxCHAR_CLASS;
-          break;
-        case BSON_TYPE_BINARY:
-          element_type = mxUINT8_CLASS;
-          break;
-        default:
-          element_type = mxCELL_CLASS;
-          break;
-      }
-      if (is_first) {
-        *array_type = element_type;
-        is_first = false;
-      }
-      else
-        *array_type = (*array_type == element_type) ?
-                      element_type : mxCELL_CLASS;
+static bool VisitEncodeFrame(encode_stack_t* stack) {
+  encode_frame_t* frame = stack->top;
+  char key[24];
+  switch (frame->kind) {
+    case ENCODE_CELL:
+      if (frame->index == mxGetNumberOfElements(frame->input))
+        return PopEncodeFrame(stack);
+      if (sprintf(key, "%lu", (unsigned long)frame->index) < 0)
+        return false;
+      return AppendArrayToBSON(stack,
+                               mxGetCell(frame->input, frame->index++),
+                               key,
+                               frame->output);
+    case ENCODE_STRUCT_ARRAY:
+      if (frame->index == mxGetNumberOfElements(frame->input))
+        return PopEncodeFrame(stack);
+      if (sprintf(key, "%lu", (unsigned long)frame->index) < 0)
+        return false;
+      return PushEncodeFrame(stack,
+                             ENCODE_STRUCT,
+                             frame->input,
+                             NULL,
+                             frame->index++,
+                             key,
+                             frame->output);
+    case ENCODE_STRUCT: {
+      int field = (int)frame->index;
+      const mxArray* element;
+      const char* field_name;
+      if (field == mxGetNumberOfFields(frame->input))
+        return PopEncodeFrame(stack);
+      element = mxGetFieldByNumber(frame->input, frame->element, field);
+      field_name = mxGetFieldNameByNumber(frame->input, field);
+      ++frame->index;
+      /* Convert string to OID only if a scalar struct with id field. */
+      if (!frame->container &&
+          strcmp(field_name, "id_") == 0 &&
+          mxIsChar(element) &&
+          mxGetNumberOfElements(element) == 12)
+        return ConvertStringToOID(element, frame->output);
+      return AppendArrayToBSON(stack, element, field_name, frame->output);
     }
+    default:
+      return false;
   }
-  if (array_type && !is_array)
-    *array_type = mxSTRUCT_CLASS;
 }
 
-/** Convert BSON array to double mxArray.
+/** Convert any mxArray to BSON. Nested arrays are visited on an explicit
+ * stack instead of recursion, and limited by the max_depth option.
  */
-static mxArray* ConvertBSONArrayToDoubleArray(bson_iter_t* it, int size) {
-  mxArray* element = mxCreateDoubleMatrix(1, size, mxREAL);
-  double* output_data;
-  if (!element)
-    return NULL;
-  output_data = mxGetPr(element);
-  while (bson_iter_next(it)) {
-    bson_type_t type = bson_iter_type(it);
-    switch (type) {
-      case BSON_TYPE_EOD:
-        break;
-      case BSON_TYPE_DOUBLE:
-        *(output_data++) = bson_iter_double(it);
-        break;
-      case BSON_TYPE_INT32:
-        *(output_data++) = bson_iter_int32(it);
-        break;
-      case BSON_TYPE_INT64:
-        *(output_data++) = bson_iter_int64(it);
-        break;
-      case BSON_TYPE_BOOL:
-        *(output_data++) = bson_iter_bool(it);
-        break;
-      default:
-        mxDestroyArray(element);
-        return NULL;
-    }
-  }
-  return element;
+static bool ConvertArrayToBSON(const mxArray* input,
+                               const char* name,
+                               const encode_options_t* options,
+                               bson_t* output) {
+  encode_stack_t stack;
+  bool status;
+  stack.top = NULL;
+  stack.depth = 0;
+  stack.options = options;
+  status = AppendArrayToBSON(&stack, input, name, output);
+  while (status && stack.top)
+    status = VisitEncodeFrame(&stack);
+  while (stack.top)
+    DiscardEncodeFrame(&stack);
+  return status;
 }
 
-/** Convert BSON array to integer mxArray.
+/** Field of a compiled struct layout.
  */
-static mxArray* ConvertBSONArrayToIntegerArray(bson_iter_t* it, int size) {
-  mxArray* element = mxCreateNumericMatrix(1, size, mxINT32_CLASS, mxREAL);
-  int32_t* output_data;
-  if (!element)
-    return NULL;
-  output_data = (int32_t*)mxGetData(element);
-  while (bson_iter_next(it)) {
-    bson_type_t type = bson_iter_type(it);
-    switch (type) {
-      case BSON_TYPE_EOD:
-        break;
-      case BSON_TYPE_DOUBLE:
-        *(output_data++) = bson_iter_double(it);
-        break;
-      case BSON_TYPE_INT32:
-        *(output_data++) = bson_iter_int32(it);
-        break;
-      case BSON_TYPE_INT64:
-        *(output_data++) = bson_iter_int64(it);
-        break;
-      case BSON_TYPE_BOOL:
-        *(output_data++) = bson_iter_bool(it);
-        break;
-      default:
-        mxDestroyArray(element);
-        return NULL;
-    }
-  }
-  return element;
-}
+typedef struct encode_plan_field_t {
+  char* name;         /* Key of the field. */
+  int name_length;
+  mxClassID class_id; /* Class of the template value. */
+  bool is_scalar;     /* Template value is a real full scalar. */
+  encode_plan_t* plan; /* Layout of a nested scalar struct, or NULL. */
+} encode_plan_field_t;
 
-/** Convert BSON array to long mxArray.
+/** Compiled layout of a struct.
  */
-static mxArray* ConvertBSONArrayToLongArray(bson_iter_t* it, int size) {
-  mxArray* element = mxCreateNumericMatrix(1, size, mxINT64_CLASS, mxREAL);
-  int64_t* output_data;
-  if (!element)
-    return NULL;
-  output_data = (int64_t*)mxGetData(element);
-  while (bson_iter_next(it)) {
-    bson_type_t type = bson_iter_type(it);
-    switch (type) {
-      case BSON_TYPE_EOD:
-        break;
-      case BSON_TYPE_DOUBLE:
-        *(output_data++) = bson_iter_double(it);
-        break;
-      case BSON_TYPE_INT32:
-        *(output_data++) = bson_iter_int32(it);
-        break;
-      case BSON_TYPE_INT64:
-        *(output_data++) = bson_iter_int64(it);
-        break;
-      case BSON_TYPE_BOOL:
-        *(output_data++) = bson_iter_bool(it);
-        break;
-      default:
-        mxDestroyArray(element);
-        return NULL;
-    }
-  }
-  return element;
+struct encode_plan_t {
+  int num_fields;
+  encode_plan_field_t* fields;
+};
+
+/** Append a char array as a UTF-8 string without calling unicode2native.
+ * @param matched set to false for a lone surrogate, which is left to
+ *                unicode2native.
+ */
+static bool AppendPlannedString(const mxArray* input,
+                                const encode_plan_field_t* field,
+                                bson_t* output,
+                                bool* matched) {
+  size_t num_elements = mxGetNumberOfElements(input);
+  const mxChar* chars = mxGetChars(input);
+  char* value = (char*)ArenaMalloc(num_elements * 3);
+  char* end = value;
+  size_t i;
+  bool status;
+  for (i = 0; i < num_elements && end; ++i)
+    end = WriteCharUTF8(chars, 1, num_elements, &i, end);
+  *matched = end != NULL;
+  status = !*matched || bson_append_utf8(output,
+                                         field->name,
+                                         field->name_length,
+                                         value,
+                                         (int)(end - value));
+  ArenaFree(value);
+  return status;
 }
 
-/** Convert BSON array to logical mxArray.
+static bool AppendPlannedStruct(const mxArray* input,
+                                mwIndex index,
+                                const encode_plan_t* plan,
+                                bool is_root,
+                                const encode_options_t* options,
+                                bson_t* output);
+
+/** Append a field value in the class and the shape of the plan.
+ * @param matched set to false if the value does not fit the plan.
  */
-static mxArray* ConvertBSONArrayToLogicalArray(bson_iter_t* it, int size) {
-  mxArray* element = mxCreateLogicalMatrix(1, size);
-  mxLogical* output_data;
-  if (!element)
-    return NULL;
-  output_data = mxGetLogicals(element);
-  while (bson_iter_next(it)) {
-    bson_type_t type = bson_iter_type(it);
-    switch (type) {
-      case BSON_TYPE_EOD:
-        break;
-      case BSON_TYPE_DOUBLE:
-        *(output_data++) = bson_iter_double(it);
-        break;
-      case BSON_TYPE_INT32:
-        *(output_data++) = bson_iter_int32(it);
-        break;
-      case BSON_TYPE_INT64:
-        *(output_data++) = bson_iter_int32(it);
-        break;
-      case BSON_TYPE_BOOL:
-        *(output_data++) = bson_iter_bool(it);
-        break;
-      default:
-        mxDestroyArray(element);
-        return NULL;
-    }
+static bool AppendPlannedValue(const mxArray* input,
+                               const encode_plan_field_t* field,
+                               const encode_options_t* options,
+                               bson_t* output,
+                               bool* matched) {
+  *matched = input &&
+             mxGetClassID(input) == field->class_id &&
+             !mxIsComplex(input) &&
+             !mxIsSparse(input);
+  if (!*matched)
+    return true;
+  if (field->plan) {
+    bson_t document;
+    *matched = mxGetNumberOfElements(input) == 1 &&
+               MatchEncodePlan(input, field->plan);
+    if (!*matched)
+      return true;
+    return bson_append_document_begin(output,
+                                      field->name,
+                                      field->name_length,
+                                      &document) &&
+           AppendPlannedStruct(input,
+                               0,
+                               field->plan,
+                               false,
+                               options,
+                               &document) &&
+           bson_append_document_end(output, &document);
+  }
+  if (field->class_id == mxCHAR_CLASS) {
+    *matched = mxGetNumberOfElements(input) > 0 &&
+               mxGetNumberOfDimensions(input) == 2 &&
+               (mxGetM(input) <= 1 || mxGetN(input) <= 1);
+    return !*matched || AppendPlannedString(input, field, output, matched);
+  }
+  *matched = field->is_scalar &&
+             mxGetNumberOfElements(input) == 1 &&
+             !GetPackCodec(input, options);
+  if (!*matched)
+    return true;
+  switch (field->class_id) {
+    case mxDOUBLE_CLASS:
+      return bson_append_double(output,
+                                field->name,
+                                field->name_length,
+                                *(const double*)mxGetData(input));
+    case mxSINGLE_CLASS:
+      return bson_append_double(output,
+                                field->name,
+                                field->name_length,
+                                *(const float*)mxGetData(input));
+    case mxLOGICAL_CLASS:
+      return bson_append_bool(output,
+                              field->name,
+                              field->name_length,
+                              *mxGetLogicals(input) != 0);
+    case mxINT16_CLASS:
+    case mxUINT16_CLASS:
+      return bson_append_int32(output,
+                               field->name,
+                               field->name_length,
+                               *(const int16_t*)mxGetData(input));
+    case mxINT32_CLASS:
+    case mxUINT32_CLASS:
+      return bson_append_int32(output,
+                               field->name,
+                               field->name_length,
+                               *(const int32_t*)mxGetData(input));
+    case mxINT64_CLASS:
+    case mxUINT64_CLASS:
+      return bson_append_int64(output,
+                               field->name,
+                               field->name_length,
+                               *(const int64_t*)mxGetData(input));
+    default:
+      *matched = false;
+      return true;
   }
-  return element;
 }
 
-/** Convert BSON array to cell mxArray.
+/** Append the fields of a struct element by the plan. Fields that do not
+ * fit the plan are converted as usual.
  */
-static mxArray* ConvertBSONArrayToCellArray(bson_iter_t* it, int size) {
-  mxArray* element = mxCreateCellMatrix(1, size);
+static bool AppendPlannedStruct(const mxArray* input,
+                                mwIndex index,
+                                const encode_plan_t* plan,
+                                bool is_root,
+                                const encode_options_t* options,
+                                bson_t* output) {
   int i;
-  if (!element)
-    return NULL;
-  for (i = 0; i < size; ++i) {
-    mxArray* sub_element = ConvertNextToMxArray(it);
-    if (!sub_element) {
-      mxDestroyArray(element);
-      return NULL;
+  for (i = 0; i < plan->num_fields; ++i) {
+    const encode_plan_field_t* field = &plan->fields[i];
+    mxArray* element = mxGetFieldByNumber(input, index, i);
+    bool matched = false;
+    /* Keep the OID conversion of the id_ field at the root. */
+    if (!(is_root && strcmp(field->name, "id_") == 0) &&
+        !AppendPlannedValue(element, field, options, output, &matched))
+      return false;
+    if (!matched) {
+      if (is_root &&
+          strcmp(field->name, "id_") == 0 &&
+          mxIsChar(element) &&
+          mxGetNumberOfElements(element) == 12) {
+        if (!ConvertStringToOID(element, output))
+          return false;
+      }
+      else if (!ConvertArrayToBSON(element, field->name, options, output))
+        return false;
     }
-    mxSetCell(element, i, sub_element);
   }
-  return element;
+  return true;
 }
 
-/** Convert keys to matlab-safe names.
+/** Convert a struct scalar or vector to BSON by the plan.
  */
-static char** CreateSafeKeys(int size, const char* keys[]) {
-  char buffer[64]; /* Matlab's variable can be up to 63 characters. */
-  char** safe_keys = (char**)mxMalloc(size * sizeof(char*));
-  int i, j;
-  for (i = 0; i < size; ++i) {
-    const char* input = keys[i];
-    char* output = buffer;
-    bool duplicated;
-    int suffix = 0;
-    memset(buffer, 0, 64 * sizeof(char));
-    /* Special case: oid maps to "id_" field. */
-    if (strcmp(input, "_id") == 0) {
-      strcpy(output, "id_");
-      output += strlen(output);
-    }
-    else {
-      /* variable name: [a-zA-Z][a-zA-Z0-9_]* */
-      /* Trim leading non-alphanumeric. */
-      while (*input && !isalnum(*input))
-        ++input;
-      /* If starting from numeric, prepend 'x'. */
-      if (*input && isdigit(*input))
-        *output++ = 'x';
-      while (*input && output < &buffer[63]) {
-        if (isalnum(*input))
-          *output++ = *input++;
-        else {
-          /* Convert any consecutive non-alphanumeric to underscore. */
-          *output++ = '_';
-          while (*input && !isalnum(*input))
-            ++input;
-        }
-      }
-    }
-    /* If empty, name it 'x'. */
-    if (output == buffer)
-      *output++ = 'x';
-    /* Check if the name is duplicated. If it is, append a number. */
-    do {
-      duplicated = false;
-      for (j = 0; j < i; ++j)
-        duplicated |= (strcmp(safe_keys[j], buffer) == 0);
-      if (duplicated) {
-        /* Append a suffix if duplicated. */
-        char suffix_buffer[32];
-        int length = sprintf(suffix_buffer, "%d", suffix++);
-        if (output + length < &buffer[31])
-          strcpy(output, suffix_buffer);
-        else {
-          /* No resolution to the name collision... */
-          for (j = 0; j < i; ++j)
-            mxFree(safe_keys[j]);
-          mxFree(safe_keys);
-          return NULL;
-        }
-      }
-    } while (duplicated);
-    /* Copy the safe key name. */
-    safe_keys[i] = (char*)mxCalloc(strlen(buffer)+1, sizeof(char));
-    strcpy(safe_keys[i], buffer);
+static bool ConvertPlannedArrayToBSON(const mxArray* input,
+                                      const encode_options_t* options,
+                                      bson_t* output) {
+  size_t num_elements = mxGetNumberOfElements(input);
+  char key[16];
+  size_t j;
+  if (!mxIsStruct(input) || !MatchEncodePlan(input, options->plan))
+    return false;
+  /* Matrices are nested in arrays of rows as usual. */
+  if (mxGetNumberOfDimensions(input) != 2 ||
+      (mxGetM(input) > 1 && mxGetN(input) > 1))
+    return ConvertArrayToBSON(input, NULL, options, output);
+  if (num_elements == 1)
+    return AppendPlannedStruct(input, 0, options->plan, true, options, output);
+  for (j = 0; j < num_elements; ++j) {
+    bson_t document;
+    int key_length = sprintf(key, "%lu", (unsigned long)j);
+    if (key_length < 0 ||
+        !bson_append_document_begin(output, key, key_length, &document) ||
+        !AppendPlannedStruct(input,
+                             j,
+                             options->plan,
+                             false,
+                             options,
+                             &document) ||
+        !bson_append_document_end(output, &document))
+      return false;
   }
-  return safe_keys;
+  return true;
 }
 
-/** Delete keys.
+/** State of the streaming encoder.
  */
-static void DestroySafekeys(int size, char** keys) {
-  int i;
-  for (i = 0; i < size; ++i)
-    mxFree(keys[i]);
-  mxFree(keys);
+typedef struct stream_state_t {
+  const stream_writer_t* writer;
+  bson_t batch;      /* Elements not yet written to the stream. */
+  uint64_t position; /* Number of bytes written to the stream. */
+  size_t depth;      /* Number of open documents. */
+  size_t max_depth;  /* Maximum nesting depth. */
+} stream_state_t;
+
+/** Write batched elements to the stream.
+ */
+static bool FlushStreamBatch(stream_state_t* state) {
+  const uint8_t* data = bson_get_data(&state->batch);
+  size_t length = state->batch.len - 5;
+  if (length == 0)
+    return true;
+  /* Elements of the batch are between the length and the terminator. */
+  if (!state->writer->write(data + 4, length, state->writer->context))
+    return false;
+  state->position += length;
+  bson_reinit(&state->batch);
+  return true;
 }
 
-/** Convert BSON array to struct mxArray.
+/** Write bytes to the stream.
  */
-static mxArray* ConvertBSONArrayToStructArray(bson_iter_t* it,
-                                              int size,
-                                              const char** keys) {
-  char** safe_keys = CreateSafeKeys(size, keys);
-  mxArray* element;
+static bool WriteStream(stream_state_t* state,
+                        const uint8_t* data,
+                        size_t length) {
+  if (!state->writer->write(data, length, state->writer->context))
+    return false;
+  state->position += length;
+  return true;
+}
+
+/** Begin a document or an array in the stream. The length is written when
+ * the document ends.
+ * @param type BSON_TYPE_DOCUMENT or BSON_TYPE_ARRAY.
+ * @param name key of the element, or NULL for the top-level document.
+ * @param start position of the length of the document.
+ */
+static bool BeginStreamDocument(stream_state_t* state,
+                                bson_type_t type,
+                                const char* name,
+                                uint64_t* start) {
+  static const uint8_t kEmptyLength[4] = {0, 0, 0, 0};
+  uint8_t type_byte = (uint8_t)type;
+  if ((state->max_depth && state->depth > state->max_depth) ||
+      !FlushStreamBatch(state))
+    return false;
+  if (name && (!WriteStream(state, &type_byte, 1) ||
+               !WriteStream(state, (const uint8_t*)name, strlen(name) + 1)))
+    return false;
+  *start = state->position;
+  ++state->depth;
+  return WriteStream(state, kEmptyLength, sizeof(kEmptyLength));
+}
+
+/** End a document or an array in the stream and patch its length.
+ */
+static bool EndStreamDocument(stream_state_t* state, uint64_t start) {
+  static const uint8_t kTerminator = 0;
+  uint8_t length_bytes[4];
+  uint64_t length;
   int i;
-  if (!safe_keys)
-    return NULL;
-  element = mxCreateStructMatrix(1,
-                                 1,
-                                 size,
-                                 (const char**)safe_keys);
-  DestroySafekeys(size, safe_keys);
-  if (!element)
-    return NULL;
-  for (i = 0; i < size; ++i) {
-    mxArray* sub_element = ConvertNextToMxArray(it);
-    if (!sub_element) {
-      mxDestroyArray(element);
-      return NULL;
+  if (!FlushStreamBatch(state) || !WriteStream(state, &kTerminator, 1))
+    return false;
+  --state->depth;
+  length = state->position - start;
+  if (length > BSON_MAX_SIZE)
+    return false;
+  for (i = 0; i < 4; ++i)
+    length_bytes[i] = (uint8_t)(length >> (8 * i));
+  return state->writer->patch(start,
+                              length_bytes,
+                              sizeof(length_bytes),
+                              state->writer->context);
+}
+
+/** Append elements of a vector to the batch, flushing as the batch fills.
+ * Values are converted as in the array converters.
+ */
+static bool StreamVectorElements(const mxArray* input,
+                                 stream_state_t* state) {
+  char key[24];
+  size_t num_elements = mxGetNumberOfElements(input);
+  const void* values = mxGetData(input);
+  size_t i;
+  for (i = 0; i < num_elements; ++i) {
+    bool status;
+    if (sprintf(key, "%lu", (unsigned long)i) < 0)
+      return false;
+    switch (mxGetClassID(input)) {
+      case mxDOUBLE_CLASS:
+        status = BSON_APPEND_DOUBLE(&state->batch,
+                                    key,
+                                    ((const double*)values)[i]);
+        break;
+      case mxSINGLE_CLASS:
+        status = BSON_APPEND_DOUBLE(&state->batch,
+                                    key,
+                                    ((const float*)values)[i]);
+        break;
+      case mxINT16_CLASS:
+      case mxUINT16_CLASS:
+        status = BSON_APPEND_INT32(&state->batch,
+                                   key,
+                                   ((const int16_t*)values)[i]);
+        break;
+      case mxINT32_CLASS:
+      case mxUINT32_CLASS:
+        status = BSON_APPEND_INT32(&state->batch,
+                                   key,
+                                   ((const int32_t*)values)[i]);
+        break;
+      case mxINT64_CLASS:
+      case mxUINT64_CLASS:
+        status = BSON_APPEND_INT64(&state->batch,
+                                   key,
+                                   ((const int64_t*)values)[i]);
+        break;
+      case mxLOGICAL_CLASS:
+        status = BSON_APPEND_BOOL(&state->batch,
+                                  key,
+                                  ((const mxLogical*)values)[i]);
+        break;
+      default:
+        return false;
     }
-    mxSetFieldByNumber(element, 0, i, sub_element);
+    if (!status)
+      return false;
+    if (state->batch.len >= state->writer->buffer_size &&
+        !FlushStreamBatch(state))
+      return false;
   }
-  return element;
+  return true;
 }
 
-/** Merge cell array of numeric arrays to an N-D numeric array.
+static bool StreamArrayToBSON(const mxArray* input,
+                              const char* name,
+                              const encode_options_t* options,
+                              stream_state_t* state);
+
+/** Stream struct mxArray as in ConvertStructArrayToBSON.
  */
-static void MergeNumericArrays(mxArray** array) {
-  int size = mxGetNumberOfElements(*array);
-  mxArray* element = mxGetCell(*array, 0);
-  mxClassID class_id = mxGetClassID(element);
-  mwSize ndims = mxGetNumberOfDimensions(element);
-  const mwSize* dims = mxGetDimensions(element);
-  mxArray* new_array = NULL;
+static bool StreamStructArrayToBSON(const mxArray* input,
+                                    const char* name,
+                                    const encode_options_t* options,
+                                    stream_state_t* state) {
+  size_t num_elements = mxGetNumberOfElements(input);
+  int num_fields = mxGetNumberOfFields(input);
+  uint64_t start, document_start;
+  int i;
+  size_t j;
+  if (num_elements == 1) {
+    if (name && !BeginStreamDocument(state, BSON_TYPE_DOCUMENT, name, &start))
+      return false;
+    for (i = 0; i < num_fields; ++i) {
+      mxArray* element = mxGetFieldByNumber(input, 0, i);
+      const char* field_name = mxGetFieldNameByNumber(input, i);
+      if (name == NULL &&
+          strcmp(field_name, "id_") == 0 &&
+          mxIsChar(element) &&
+          mxGetNumberOfElements(element) == 12) {
+        if (!ConvertStringToOID(element, &state->batch))
+          return false;
+      }
+      else if (!StreamArrayToBSON(element, field_name, options, state))
+        return false;
+    }
+    return !name || EndStreamDocument(state, start);
+  }
+  if (name && !BeginStreamDocument(state, BSON_TYPE_ARRAY, name, &start))
+    return false;
+  for (j = 0; j < num_elements; ++j) {
+    char key[24];
+    if (sprintf(key, "%lu", (unsigned long)j) < 0 ||
+        !BeginStreamDocument(state,
+                             BSON_TYPE_DOCUMENT,
+                             key,
+                             &document_start))
+      return false;
+    for (i = 0; i < num_fields; ++i)
+      if (!StreamArrayToBSON(mxGetFieldByNumber(input, j, i),
+                             mxGetFieldNameByNumber(input, i),
+                             options,
+                             state))
+        return false;
+    if (!EndStreamDocument(state, document_start))
+      return false;
+  }
+  return !name || EndStreamDocument(state, start);
+}
+
+/** Stream rows or slices of any 2D or ND array one at a time, as in
+ * Convert2DOrNDArrayToCellArray.
+ */
+static bool StreamSplitArrayToBSON(const mxArray* input,
+                                   const char* name,
+                                   const encode_options_t* options,
+                                   stream_state_t* state) {
+  mwSize ndims = mxGetNumberOfDimensions(input);
+  const mwSize* dims = mxGetDimensions(input);
+  mwSize num_splits = (ndims == 2) ? dims[0] : dims[ndims - 1];
+  uint64_t start;
+  mwSize i;
+  if (name && !BeginStreamDocument(state, BSON_TYPE_ARRAY, name, &start))
+    return false;
+  for (i = 0; i < num_splits; ++i) {
+    char key[24];
+    bool status;
+    mxArray* element = (ndims == 2) ?
+        Get2DArrayRow(input, dims, i) :
+        GetNDArraySlice(input, ndims, dims, i);
+    if (!element)
+      return false;
+    status = sprintf(key, "%lu", (unsigned long)i) >= 0 &&
+             StreamArrayToBSON(element, key, options, state);
+    mxDestroyArray(element);
+    if (!status)
+      return false;
+  }
+  return !name || EndStreamDocument(state, start);
+}
+
+/** Stream any mxArray to BSON. Documents and arrays are written as they are
+ * visited, and other elements are encoded by ConvertArrayToBSON in batches.
+ */
+static bool StreamArrayToBSON(const mxArray* input,
+                              const char* name,
+                              const encode_options_t* options,
+                              stream_state_t* state) {
+  mwSize ndims = mxGetNumberOfDimensions(input);
+  const mwSize* dims = mxGetDimensions(input);
+  size_t num_elements = mxGetNumberOfElements(input);
+  uint64_t start;
+  size_t i;
+  /* Packed arrays are a single element. */
+  if (!GetPackCodec(input, options)) {
+    if (ndims > 2 || (dims[0] > 1 && dims[1] > 1))
+      return StreamSplitArrayToBSON(input, name, options, state);
+    switch (mxGetClassID(input)) {
+      case mxSTRUCT_CLASS:
+        return StreamStructArrayToBSON(input, name, options, state);
+      case mxCELL_CLASS:
+        if (name &&
+            !BeginStreamDocument(state, BSON_TYPE_ARRAY, name, &start))
+          return false;
+        for (i = 0; i < num_elements; ++i) {
+          char key[24];
+          if (sprintf(key, "%lu", (unsigned long)i) < 0 ||
+              !StreamArrayToBSON(mxGetCell(input, i), key, options, state))
+            return false;
+        }
+        return !name || EndStreamDocument(state, start);
+      case mxDOUBLE_CLASS:
+      case mxSINGLE_CLASS:
+      case mxINT16_CLASS:
+      case mxUINT16_CLASS:
+      case mxINT32_CLASS:
+      case mxUINT32_CLASS:
+      case mxINT64_CLASS:
+      case mxUINT64_CLASS:
+      case mxLOGICAL_CLASS:
+        if (num_elements <= 1)
+          break;
+        if (name &&
+            !BeginStreamDocument(state, BSON_TYPE_ARRAY, name, &start))
+          return false;
+        return StreamVectorElements(input, state) &&
+               (!name || EndStreamDocument(state, start));
+      default:
+        break;
+    }
+  }
+  if (!ConvertArrayToBSON(input, name, options, &state->batch))
+    return false;
+  return state->batch.len < state->writer->buffer_size ||
+         FlushStreamBatch(state);
+}
+
+/** Check if the class is a numeric array type.
+ */
+static bool IsNumericArrayType(int array_type) {
+  switch (array_type) {
+    case mxDOUBLE_CLASS:
+    case mxSINGLE_CLASS:
+    case mxINT8_CLASS:
+    case mxUINT8_CLASS:
+    case mxINT16_CLASS:
+    case mxUINT16_CLASS:
+    case mxINT32_CLASS:
+    case mxUINT32_CLASS:
+    case mxINT64_CLASS:
+    case mxUINT64_CLASS:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/** Check if the class is decoded from BSON double, int32, or int64.
+ */
+static bool IsBSONNumericArrayType(int array_type) {
+  return array_type == mxDOUBLE_CLASS ||
+         array_type == mxINT32_CLASS ||
+         array_type == mxINT64_CLASS;
+}
+
+/** Get the rank of the integer class in the order of the value range.
+ */
+static int GetIntegerClassRank(int class_id, bool* is_signed) {
+  *is_signed = (class_id == mxINT8_CLASS || class_id == mxINT16_CLASS ||
+                class_id == mxINT32_CLASS || class_id == mxINT64_CLASS);
+  switch (class_id) {
+    case mxINT8_CLASS:
+    case mxUINT8_CLASS:
+      return 0;
+    case mxINT16_CLASS:
+    case mxUINT16_CLASS:
+      return 1;
+    case mxINT32_CLASS:
+    case mxUINT32_CLASS:
+      return 2;
+    default:
+      return 3;
+  }
+}
+
+/** Promote the array type to hold the element type without loss of the
+ * numeric value. Integers promote to the narrowest integer class covering
+ * both ranges, and any integer mixed with single or double promotes to the
+ * floating point class. Other combinations fall back to cell.
+ */
+static int PromoteArrayType(int array_type, int element_type) {
+  static const int kSignedClasses[] = {
+    mxINT8_CLASS, mxINT16_CLASS, mxINT32_CLASS, mxINT64_CLASS
+  };
+  static const int kUnsignedClasses[] = {
+    mxUINT8_CLASS, mxUINT16_CLASS, mxUINT32_CLASS, mxUINT64_CLASS
+  };
+  bool array_signed, element_signed;
+  int array_rank, element_rank;
+  if (array_type == element_type)
+    return element_type;
+  if (!IsNumericArrayType(array_type) || !IsNumericArrayType(element_type))
+    return mxCELL_CLASS;
+  if (array_type == mxDOUBLE_CLASS || element_type == mxDOUBLE_CLASS)
+    return mxDOUBLE_CLASS;
+  if (array_type == mxSINGLE_CLASS || element_type == mxSINGLE_CLASS)
+    return mxSINGLE_CLASS;
+  array_rank = GetIntegerClassRank(array_type, &array_signed);
+  element_rank = GetIntegerClassRank(element_type, &element_signed);
+  if (array_signed == element_signed)
+    return (array_signed) ?
+        kSignedClasses[BSON_MAX(array_rank, element_rank)] :
+        kUnsignedClasses[BSON_MAX(array_rank, element_rank)];
+  if (!array_signed) {
+    int rank = array_rank;
+    array_rank = element_rank;
+    element_rank = rank;
+  }
+  /* Signed class needs to be wider than the unsigned. */
+  return kSignedClasses[BSON_MIN(3, BSON_MAX(array_rank, element_rank + 1))];
+}
+
+/** Check if the floating point value is an integer in the range of int64.
+ */
+static bool IsInt64Value(double value) {
+  return value >= -9223372036854775808.0 &&
+         value < 9223372036854775808.0 &&
+         (double)(int64_t)value == value;
+}
+
+/** Get the smallest integer class that holds the range of values.
+ */
+static mxClassID GetSmallestIntegerClass(int64_t min_value,
+                                         int64_t max_value) {
+  if (min_value >= 0) {
+    if (max_value <= UINT8_MAX)
+      return mxUINT8_CLASS;
+    if (max_value <= UINT16_MAX)
+      return mxUINT16_CLASS;
+    if (max_value <= UINT32_MAX)
+      return mxUINT32_CLASS;
+  }
+  else {
+    if (min_value >= INT8_MIN && max_value <= INT8_MAX)
+      return mxINT8_CLASS;
+    if (min_value >= INT16_MIN && max_value <= INT16_MAX)
+      return mxINT16_CLASS;
+    if (min_value >= INT32_MIN && max_value <= INT32_MAX)
+      return mxINT32_CLASS;
+  }
+  return mxINT64_CLASS;
+}
+
+/** Class of an array inferred from the types of the elements.
+ */
+typedef struct array_type_t {
+  int class_id;
+  bool is_first;
+  bool has_null;
+  bool has_int64;      /* Any int64 element. */
+  bool int64_doubles;  /* All double elements are integers in int64 range. */
+  int64_t min_value;   /* Range of integer elements. */
+  int64_t max_value;
+} array_type_t;
+
+/** Start inferring the class of an array.
+ */
+static void InitArrayType(array_type_t* array_type) {
+  array_type->class_id = mxUNKNOWN_CLASS;
+  array_type->is_first = true;
+  array_type->has_null = false;
+  array_type->has_int64 = false;
+  array_type->int64_doubles = true;
+  array_type->min_value = INT64_MAX;
+  array_type->max_value = INT64_MIN;
+}
+
+/** Update the class of an array with the BSON type of an element. Null and
+ * undefined are deferred until the end, as they become NaN in a numeric
+ * array.
+ * @param integer_value value of an int32 or int64 element.
+ * @param double_value value of a double element.
+ */
+static void UpdateArrayType(array_type_t* array_type,
+                            bson_type_t type,
+                            int64_t integer_value,
+                            double double_value) {
+  int element_type;
+  switch (type) {
+    case BSON_TYPE_NULL:
+    case BSON_TYPE_UNDEFINED:
+      array_type->has_null = true;
+      return;
+    case BSON_TYPE_DOUBLE:
+      element_type = mxDOUBLE_CLASS;
+      /* Integral doubles can join an int64 array without loss. */
+      if (IsInt64Value(double_value)) {
+        integer_value = (int64_t)double_value;
+        array_type->min_value = BSON_MIN(array_type->min_value,
+                                         integer_value);
+        array_type->max_value = BSON_MAX(array_type->max_value,
+                                         integer_value);
+      }
+      else
+        array_type->int64_doubles = false;
+      break;
+    case BSON_TYPE_INT32:
+    case BSON_TYPE_INT64:
+      /* Keep the range for the smallest integer class. */
+      element_type = (type == BSON_TYPE_INT32) ?
+          mxINT32_CLASS : mxINT64_CLASS;
+      array_type->has_int64 |= (type == BSON_TYPE_INT64);
+      array_type->min_value = BSON_MIN(array_type->min_value, integer_value);
+      array_type->max_value = BSON_MAX(array_type->max_value, integer_value);
+      break;
+    case BSON_TYPE_BOOL:
+      element_type = mxLOGICAL_CLASS;
+      break;
+    case BSON_TYPE_UTF8:
+      element_type = mxCHAR_CLASS;
+      break;
+    case BSON_TYPE_BINARY:
+      element_type = mxUINT8_CLASS;
+      break;
+    default:
+      element_type = mxCELL_CLASS;
+      break;
+  }
+  if (array_type->is_first) {
+    array_type->class_id = element_type;
+    array_type->is_first = false;
+  }
+  else if (IsBSONNumericArrayType(array_type->class_id) &&
+           IsBSONNumericArrayType(element_type))
+    array_type->class_id = PromoteArrayType(array_type->class_id,
+                                            element_type);
+  else
+    array_type->class_id = (array_type->class_id == element_type) ?
+                           element_type : mxCELL_CLASS;
+}
+
+/** Check if the integer elements of the array are exact in double.
+ */
+static bool IsExactInDouble(const array_type_t* array_type) {
+  return !array_type->has_int64 ||
+         (array_type->min_value >= -MAX_EXACT_INTEGER &&
+          array_type->max_value <= MAX_EXACT_INTEGER);
+}
+
+/** Get the inferred class of an array after all the elements. A mix of
+ * int64 and double stays int64 if every double is an integer in range.
+ * Otherwise, int64 elements beyond 2^53 keep the array a cell rather than
+ * lose precision in double, as with null.
+ */
+static int FinishArrayType(const array_type_t* array_type, bool is_array) {
+  if (!is_array)
+    return mxSTRUCT_CLASS;
+  if (array_type->has_null)
+    return (!array_type->is_first &&
+            IsBSONNumericArrayType(array_type->class_id) &&
+            IsExactInDouble(array_type)) ?
+           mxDOUBLE_CLASS : mxCELL_CLASS;
+  if (array_type->class_id == mxDOUBLE_CLASS && array_type->has_int64) {
+    if (array_type->int64_doubles)
+      return mxINT64_CLASS;
+    if (!IsExactInDouble(array_type))
+      return mxCELL_CLASS;
+  }
+  return array_type->class_id;
+}
+
+/** Check if the key is the decimal index of an array element.
+ */
+static bool IsArrayIndexKey(const char* key, int index) {
+  const char* key_ptr = key;
+  bool is_digit = true;
+  while (*key_ptr != 0)
+    is_digit &= (isdigit(*key_ptr++) > 0);
+  return is_digit && index == atol(key);
+}
+
+/** Check the type and the size of the BSON object.
+ */
+static void CheckBSONObject(bson_iter_t* it,
+                            int* object_size, 
+                            const char*** keys,
+                            int* array_type,
+                            int64_t* min_value,
+                            int64_t* max_value) {
+  array_type_t element_types;
+  bool is_array = true;
+  *object_size = 0;
+  InitArrayType(&element_types);
+  while (bson_iter_next(it)) {
+    bson_type_t type = bson_iter_type(it);
+    const char* key;
+    if (type == BSON_TYPE_EOD)
+      break;
+    key = bson_iter_key(it);
+    (*object_size)++;
+    /* Keep key names for a struct array. */
+    if (keys) {
+      *keys = (const char**)ArenaRealloc(*keys,
+                                         *object_size * sizeof(const char*));
+      (*keys)[(*object_size) - 1] = key;
+    }
+    /* Check if it has an consistent index. */
+    is_array = is_array && IsArrayIndexKey(key, *object_size - 1);
+    /* Check the array type from element. */
+    if (array_type)
+      UpdateArrayType(&element_types,
+                      type,
+                      (type == BSON_TYPE_INT32) ? bson_iter_int32(it) :
+                      (type == BSON_TYPE_INT64) ? bson_iter_int64(it) : 0,
+                      (type == BSON_TYPE_DOUBLE) ? bson_iter_double(it) : 0);
+  }
+  if (array_type) {
+    *array_type = FinishArrayType(&element_types, is_array);
+    *min_value = element_types.min_value;
+    *max_value = element_types.max_value;
+  }
+}
+
+/** Convert BSON array to double mxArray.
+ */
+static mxArray* ConvertBSONArrayToDoubleArray(bson_iter_t* it, int size) {
+  mxArray* element = mxCreateDoubleMatrix(1, size, mxREAL);
+  double* output_data;
+  if (!element)
+    return NULL;
+  output_data = mxGetPr(element);
+  while (bson_iter_next(it)) {
+    bson_type_t type = bson_iter_type(it);
+    switch (type) {
+      case BSON_TYPE_EOD:
+        break;
+      case BSON_TYPE_DOUBLE:
+        *(output_data++) = bson_iter_double(it);
+        break;
+      case BSON_TYPE_INT32:
+        *(output_data++) = bson_iter_int32(it);
+        break;
+      case BSON_TYPE_INT64:
+        *(output_data++) = bson_iter_int64(it);
+        break;
+      case BSON_TYPE_BOOL:
+        *(output_data++) = bson_iter_bool(it);
+        break;
+      case BSON_TYPE_NULL:
+      case BSON_TYPE_UNDEFINED:
+        *(output_data++) = mxGetNaN();
+        break;
+      default:
+        mxDestroyArray(element);
+        return NULL;
+    }
+  }
+  return element;
+}
+
+/** Convert BSON array to integer mxArray.
+ */
+static mxArray* ConvertBSONArrayToIntegerArray(bson_iter_t* it, int size) {
+  mxArray* element = mxCreateNumericMatrix(1, size, mxINT32_CLASS, mxREAL);
+  int32_t* output_data;
+  if (!element)
+    return NULL;
+  output_data = (int32_t*)mxGetData(element);
+  while (bson_iter_next(it)) {
+    bson_type_t type = bson_iter_type(it);
+    switch (type) {
+      case BSON_TYPE_EOD:
+        break;
+      case BSON_TYPE_DOUBLE:
+        *(output_data++) = bson_iter_double(it);
+        break;
+      case BSON_TYPE_INT32:
+        *(output_data++) = bson_iter_int32(it);
+        break;
+      case BSON_TYPE_INT64:
+        *(output_data++) = bson_iter_int64(it);
+        break;
+      case BSON_TYPE_BOOL:
+        *(output_data++) = bson_iter_bool(it);
+        break;
+      default:
+        mxDestroyArray(element);
+        return NULL;
+    }
+  }
+  return element;
+}
+
+/** Convert BSON array to long mxArray.
+ */
+static mxArray* ConvertBSONArrayToLongArray(bson_iter_t* it, int size) {
+  mxArray* element = mxCreateNumericMatrix(1, size, mxINT64_CLASS, mxREAL);
+  int64_t* output_data;
+  if (!element)
+    return NULL;
+  output_data = (int64_t*)mxGetData(element);
+  while (bson_iter_next(it)) {
+    bson_type_t type = bson_iter_type(it);
+    switch (type) {
+      case BSON_TYPE_EOD:
+        break;
+      case BSON_TYPE_DOUBLE:
+        *(output_data++) = bson_iter_double(it);
+        break;
+      case BSON_TYPE_INT32:
+        *(output_data++) = bson_iter_int32(it);
+        break;
+      case BSON_TYPE_INT64:
+        *(output_data++) = bson_iter_int64(it);
+        break;
+      case BSON_TYPE_BOOL:
+        *(output_data++) = bson_iter_bool(it);
+        break;
+      default:
+        mxDestroyArray(element);
+        return NULL;
+    }
+  }
+  return element;
+}
+
+/** Get the element of numeric data as both integer and floating point.
+ */
+static void GetNumericValue(const void* data,
+                            mxClassID class_id,
+                            size_t index,
+                            int64_t* long_value,
+                            double* value) {
+  switch (class_id) {
+    case mxDOUBLE_CLASS:
+      *value = ((const double*)data)[index];
+      *long_value = (int64_t)*value;
+      return;
+    case mxSINGLE_CLASS:
+      *value = ((const float*)data)[index];
+      *long_value = (int64_t)*value;
+      return;
+    case mxINT8_CLASS:
+      *long_value = ((const int8_t*)data)[index];
+      break;
+    case mxUINT8_CLASS:
+      *long_value = ((const uint8_t*)data)[index];
+      break;
+    case mxINT16_CLASS:
+      *long_value = ((const int16_t*)data)[index];
+      break;
+    case mxUINT16_CLASS:
+      *long_value = ((const uint16_t*)data)[index];
+      break;
+    case mxINT32_CLASS:
+      *long_value = ((const int32_t*)data)[index];
+      break;
+    case mxUINT32_CLASS:
+      *long_value = ((const uint32_t*)data)[index];
+      break;
+    case mxINT64_CLASS:
+    case mxUINT64_CLASS:
+    default:
+      *long_value = ((const int64_t*)data)[index];
+      break;
+  }
+  *value = (double)*long_value;
+}
+
+/** Set the element of numeric data. Integer classes take the integer value
+ * and floating point classes take the floating point value.
+ */
+static void SetNumericValue(void* data,
+                            mxClassID class_id,
+                            size_t index,
+                            int64_t long_value,
+                            double value) {
+  switch (class_id) {
+    case mxDOUBLE_CLASS:
+      ((double*)data)[index] = value;
+      break;
+    case mxSINGLE_CLASS:
+      ((float*)data)[index] = (float)value;
+      break;
+    case mxINT8_CLASS:
+      ((int8_t*)data)[index] = (int8_t)long_value;
+      break;
+    case mxUINT8_CLASS:
+      ((uint8_t*)data)[index] = (uint8_t)long_value;
+      break;
+    case mxINT16_CLASS:
+      ((int16_t*)data)[index] = (int16_t)long_value;
+      break;
+    case mxUINT16_CLASS:
+      ((uint16_t*)data)[index] = (uint16_t)long_value;
+      break;
+    case mxINT32_CLASS:
+      ((int32_t*)data)[index] = (int32_t)long_value;
+      break;
+    case mxUINT32_CLASS:
+      ((uint32_t*)data)[index] = (uint32_t)long_value;
+      break;
+    case mxINT64_CLASS:
+    case mxUINT64_CLASS:
+    default:
+      ((int64_t*)data)[index] = long_value;
+      break;
+  }
+}
+
+/** Convert BSON array to numeric mxArray of any class. Used for the classes
+ * narrowed by the decoder options.
+ */
+static mxArray* ConvertBSONArrayToNumericArray(bson_iter_t* it,
+                                               int size,
+                                               mxClassID class_id) {
+  mxArray* element = mxCreateNumericMatrix(1, size, class_id, mxREAL);
+  void* output_data;
+  size_t index = 0;
+  if (!element)
+    return NULL;
+  output_data = mxGetData(element);
+  while (bson_iter_next(it)) {
+    bson_type_t type = bson_iter_type(it);
+    int64_t long_value;
+    double value;
+    switch (type) {
+      case BSON_TYPE_EOD:
+        continue;
+      case BSON_TYPE_DOUBLE:
+        value = bson_iter_double(it);
+        long_value = (int64_t)value;
+        break;
+      case BSON_TYPE_INT32:
+        long_value = bson_iter_int32(it);
+        value = (double)long_value;
+        break;
+      case BSON_TYPE_INT64:
+        long_value = bson_iter_int64(it);
+        value = (double)long_value;
+        break;
+      case BSON_TYPE_BOOL:
+        long_value = bson_iter_bool(it);
+        value = (double)long_value;
+        break;
+      case BSON_TYPE_NULL:
+      case BSON_TYPE_UNDEFINED:
+        long_value = 0;
+        value = mxGetNaN();
+        break;
+      default:
+        mxDestroyArray(element);
+        return NULL;
+    }
+    SetNumericValue(output_data, class_id, index++, long_value, value);
+  }
+  return element;
+}
+
+/** Convert BSON array to logical mxArray.
+ */
+static mxArray* ConvertBSONArrayToLogicalArray(bson_iter_t* it, int size) {
+  mxArray* element = mxCreateLogicalMatrix(1, size);
+  mxLogical* output_data;
+  if (!element)
+    return NULL;
+  output_data = mxGetLogicals(element);
+  while (bson_iter_next(it)) {
+    bson_type_t type = bson_iter_type(it);
+    switch (type) {
+      case BSON_TYPE_EOD:
+        break;
+      case BSON_TYPE_DOUBLE:
+        *(output_data++) = bson_iter_double(it);
+        break;
+      case BSON_TYPE_INT32:
+        *(output_data++) = bson_iter_int32(it);
+        break;
+      case BSON_TYPE_INT64:
+        *(output_data++) = bson_iter_int32(it);
+        break;
+      case BSON_TYPE_BOOL:
+        *(output_data++) = bson_iter_bool(it);
+        break;
+      default:
+        mxDestroyArray(element);
+        return NULL;
+    }
+  }
+  return element;
+}
+
+/** Sanitized names of a set of keys, kept across calls.
+ */
+typedef struct key_cache_entry_t {
+  uint64_t signature;    /* Hash of the keys. */
+  int size;
+  const char* raw_keys;  /* Keys separated by null characters. */
+  const char** names;    /* Matlab-safe names of the keys. */
+} key_cache_entry_t;
+
+/** Key cache indexed by the lower bits of the signature.
+ */
+static key_cache_entry_t* key_cache[KEY_CACHE_SIZE];
+
+/** Release the key cache.
+ */
+static void ClearKeyCache(void) {
+  int i;
+  for (i = 0; i < KEY_CACHE_SIZE; ++i) {
+    free(key_cache[i]);
+    key_cache[i] = NULL;
+  }
+}
+
+/** Convert a key to a matlab-safe name.
+ * @return end of the name in the buffer.
+ */
+static char* SanitizeKey(const char* input, char* buffer) {
+  char* output = buffer;
+  /* Special case: oid maps to "id_" field. */
+  if (strcmp(input, "_id") == 0) {
+    strcpy(output, "id_");
+    output += strlen(output);
+  }
+  else {
+    /* variable name: [a-zA-Z][a-zA-Z0-9_]* */
+    /* Trim leading non-alphanumeric. */
+    while (*input && !isalnum(*input))
+      ++input;
+    /* If starting from numeric, prepend 'x'. */
+    if (*input && isdigit(*input))
+      *output++ = 'x';
+    while (*input && output < &buffer[63]) {
+      if (isalnum(*input))
+        *output++ = *input++;
+      else {
+        /* Convert any consecutive non-alphanumeric to underscore. */
+        *output++ = '_';
+        while (*input && !isalnum(*input))
+          ++input;
+      }
+    }
+  }
+  /* If empty, name it 'x'. */
+  if (output == buffer)
+    *output++ = 'x';
+  *output = '\0';
+  return output;
+}
+
+/** Create a cache entry of matlab-safe names. Duplicated names are found in
+ * a hash set, and numbered.
+ * @return entry, or NULL if a duplicated name cannot be resolved.
+ */
+static key_cache_entry_t* CreateKeyCacheEntry(int size,
+                                              const char* keys[],
+                                              uint64_t signature) {
+  size_t raw_length = 0;
+  size_t capacity = 16;
+  int* slots;
+  key_cache_entry_t* entry;
+  char* raw_keys;
+  char* names;
+  int i;
+  for (i = 0; i < size; ++i)
+    raw_length += strlen(keys[i]) + 1;
+  while (capacity < 2 * (size_t)size)
+    capacity *= 2;
+  /* The names are stored in one block after the entry. */
+  entry = (key_cache_entry_t*)malloc(sizeof(key_cache_entry_t) +
+                                     (size + 1) * sizeof(char*) +
+                                     raw_length +
+                                     (size_t)size * 64);
+  if (!entry)
+    return NULL;
+  entry->signature = signature;
+  entry->size = size;
+  entry->names = (const char**)(entry + 1);
+  raw_keys = (char*)(entry->names + size + 1);
+  entry->raw_keys = raw_keys;
+  names = raw_keys + raw_length;
+  slots = (int*)ArenaCalloc(capacity, sizeof(int));
+  for (i = 0; i < size; ++i) {
+    char buffer[64]; /* Matlab's variable can be up to 63 characters. */
+    char* output = SanitizeKey(keys[i], buffer);
+    int suffix = 0;
+    size_t slot;
+    strcpy(raw_keys, keys[i]);
+    raw_keys += strlen(raw_keys) + 1;
+    /* Check if the name is duplicated. If it is, append a number. */
+    while (true) {
+      size_t length = strlen(buffer);
+      slot = (size_t)HashBytes((const uint8_t*)buffer, length) &
+             (capacity - 1);
+      while (slots[slot] && strcmp(entry->names[slots[slot] - 1], buffer))
+        slot = (slot + 1) & (capacity - 1);
+      if (!slots[slot])
+        break;
+      {
+        char suffix_buffer[32];
+        int suffix_length = sprintf(suffix_buffer, "%d", suffix++);
+        /* No resolution to the name collision... */
+        if (output + suffix_length > &buffer[63]) {
+          ArenaFree(slots);
+          free(entry);
+          return NULL;
+        }
+        strcpy(output, suffix_buffer);
+      }
+    }
+    slots[slot] = i + 1;
+    strcpy(names, buffer);
+    entry->names[i] = names;
+    names += strlen(names) + 1;
+  }
+  ArenaFree(slots);
+  return entry;
+}
+
+/** Get matlab-safe names of the keys. The names of a key set seen before
+ * are taken from the key cache.
+ * @return names owned by the cache, valid until the next call, or NULL.
+ */
+static const char** GetSafeKeys(int size, const char* keys[]) {
+  uint64_t signature = (uint64_t)size;
+  key_cache_entry_t** slot;
+  int i;
+  for (i = 0; i < size; ++i)
+    signature = (signature ^ HashBytes((const uint8_t*)keys[i],
+                                       strlen(keys[i]))) *
+                0x9E3779B185EBCA87ULL;
+  slot = &key_cache[signature & (KEY_CACHE_SIZE - 1)];
+  if (*slot && (*slot)->signature == signature && (*slot)->size == size) {
+    const char* raw_key = (*slot)->raw_keys;
+    for (i = 0; i < size && strcmp(raw_key, keys[i]) == 0; ++i)
+      raw_key += strlen(raw_key) + 1;
+    if (i == size)
+      return (*slot)->names;
+  }
+  free(*slot);
+  *slot = CreateKeyCacheEntry(size, keys, signature);
+  if (!*slot)
+    return NULL;
+  AddExitHandler(ClearKeyCache);
+  return (*slot)->names;
+}
+
+/** Merge cell array of numeric arrays to an N-D numeric array.
+ */
+static void MergeNumericArrays(mxArray** array) {
+  int size = mxGetNumberOfElements(*array);
+  mxArray* element = mxGetCell(*array, 0);
+  mxClassID class_id = mxGetClassID(element);
+  mwSize ndims = mxGetNumberOfDimensions(element);
+  const mwSize* dims = mxGetDimensions(element);
+  mxArray* new_array = NULL;
+  int i;
+  if (ndims < 2)
+    return;
+  if (dims[0] == 1) {
+    size_t value_size, element_size;
+    /* Stack row vectors. */
+    new_array = mxCreateNumericMatrix(size, dims[1], class_id, mxREAL);
+    if (!new_array)
+      return;
+    value_size = mxGetNumberOfElements(element);
+    element_size = mxGetElementSize(element);
+    for (i = 0; i < size; ++i) {
+      mxArray* value = mxGetCell(*array, i);
+      void* input = (void*)mxGetData(value);
+      void* output = (void*)mxGetData(new_array) + i * element_size;
+      int j;
+      for (j = 0; j < value_size; ++j) {
+        memcpy(output, input, element_size);
+        input += element_size;
+        output += size * element_size;
+      }
+    }
+  }
+  else {
+    /* Expand the last dimension. */
+    mwSize* new_dims = (mwSize*)ArenaMalloc((ndims + 1) * sizeof(mwSize));
+    size_t stride;
+    memcpy(new_dims, dims, ndims * sizeof(mwSize));
+    new_dims[ndims] = size;
+    new_array = mxCreateNumericArray(ndims + 1, new_dims, class_id, mxREAL);
+    ArenaFree(new_dims);
+    if (!new_array)
+      return;
+    stride = mxGetNumberOfElements(element) * mxGetElementSize(element);
+    for (i = 0; i < size; ++i) {
+      mxArray* value = mxGetCell(*array, i);
+      memcpy(mxGetData(new_array) + i * stride, mxGetData(value), stride);
+    }
+  }
+  mxDestroyArray(*array);
+  *array = new_array;
+}
+
+/** Merge cell array of cell arrays to an N-D cell array.
+ */
+static void MergeCellArrays(mxArray** array) {
+  int size = mxGetNumberOfElements(*array);
+  mxArray* element = mxGetCell(*array, 0);
+  mwSize ndims = mxGetNumberOfDimensions(element);
+  const mwSize* dims = mxGetDimensions(element);
+  mxArray* new_array = NULL;
+  int i, j;
+  if (ndims < 2)
+    return;
+  if (ndims == 2 && dims[0] == 1) {
+    /* Stack row vectors. */
+    new_array = mxCreateCellMatrix(size, dims[1]);
+    if (!new_array)
+      return;
+    for (i = 0; i < size; ++i) {
+      mxArray* value = mxGetCell(*array, i);
+      for (j = 0; j < dims[1]; ++j)
+        mxSetCell(new_array,
+                  i + j * size,
+                  mxDuplicateArray(mxGetCell(value, j)));
+    }
+  }
+  else {
+    /* Expand the last dimension. */
+    mwSize* new_dims = (mwSize*)ArenaMalloc(sizeof(mwSize) * (ndims + 1));
+    mwSize element_size;
+    memcpy(new_dims, dims, sizeof(mwSize) * ndims);
+    new_dims[ndims] = size;
+    new_array = mxCreateCellArray(ndims + 1, new_dims);
+    ArenaFree(new_dims);
+    element_size = mxGetNumberOfElements(element);
+    for (i = 0; i < size; ++i) {
+      mxArray* value = mxGetCell(*array, i);
+      for (j = 0; j < element_size; ++j) {
+        mxSetCell(new_array,
+                  j + i * element_size,
+                  mxDuplicateArray(mxGetCell(value, j)));
+      }
+    }
+  }
+  mxDestroyArray(*array);
+  *array = new_array;
+}
+
+/** Merge cell array of struct arrays to an N-D cell array.
+ */
+static void MergeStructArrays(mxArray** array) {
+  int size = mxGetNumberOfElements(*array);
+  mxArray* element = mxGetCell(*array, 0);
+  mwSize ndims = mxGetNumberOfDimensions(element);
+  const mwSize* dims = mxGetDimensions(element);
+  mxArray* new_array = NULL;
+  int num_fields;
+  int i, j, k;
+  const char** fields;
+  bool mergeable = true;
+  if (ndims < 2)
+    return;
+  /* Check if all fields are the same. */
+  num_fields = mxGetNumberOfFields(element);
+  fields = (const char**)ArenaMalloc(sizeof(const char*) * num_fields);
+  for (i = 0; i < num_fields; ++i)
+    fields[i] = mxGetFieldNameByNumber(element, i);
+  for (i = 1; i < size; ++i) {
+    mxArray* value = mxGetCell(*array, i);
+    if (mxGetNumberOfFields(value) == num_fields)
+      for (k = 0; k < num_fields; ++k)
+        mergeable &= strcmp(fields[k], mxGetFieldNameByNumber(value, k)) == 0;
+    else
+      mergeable = false;
+  }
+  if (!mergeable) {
+    ArenaFree(fields);
+    return;
+  }
+  if (ndims == 2 && dims[0] == 1 && dims[1] == 1) {
+    /* Concatenate into a row vector. */
+    new_array = mxCreateStructMatrix(1, size, num_fields, fields);
+    if (!new_array)
+      return;
+    for (i = 0; i < size; ++i) {
+      mxArray* value = mxGetCell(*array, i);
+      for (k = 0; k < num_fields; ++k) {
+        mxArray* field = mxDuplicateArray(mxGetFieldByNumber(value, 0, k));
+        mxSetFieldByNumber(new_array, i, k, field);
+      }
+    }
+  }
+  else if (ndims == 2 && dims[0] == 1) {
+    /* Stack row vectors. */
+    new_array = mxCreateStructMatrix(size, dims[1], num_fields, fields);
+    if (!new_array)
+      return;
+    for (i = 0; i < size; ++i) {
+      mxArray* value = mxGetCell(*array, i);
+      for (j = 0; j < dims[1]; ++j)
+        for (k = 0; k < num_fields; ++k) {
+          mxArray* field = mxDuplicateArray(mxGetFieldByNumber(value, j, k));
+          mxSetFieldByNumber(new_array, i + j * size, k, field);
+        }
+    }
+  }
+  else {
+    /* Expand the last dimension. */
+    mwSize* new_dims = (mwSize*)ArenaMalloc(sizeof(mwSize) * (ndims + 1));
+    mwSize element_size;
+    memcpy(new_dims, dims, sizeof(mwSize) * ndims);
+    new_dims[ndims] = size;
+    new_array = mxCreateStructArray(ndims + 1, new_dims, num_fields, fields);
+    ArenaFree(new_dims);
+    element_size = mxGetNumberOfElements(element);
+    for (i = 0; i < size; ++i) {
+      mxArray* value = mxGetCell(*array, i);
+      for (j = 0; j < element_size; ++j)
+        for (k = 0; k < num_fields; ++k) {
+          mxArray* field = mxDuplicateArray(mxGetFieldByNumber(value, j, k));
+          mxSetFieldByNumber(new_array, j + i * element_size, k, field);
+        }
+    }
+  }
+  ArenaFree(fields);
+  mxDestroyArray(*array);
+  *array = new_array;
+}
+
+/** Merge cell array of bson.datetime arrays to an N-D date array.
+ */
+static void MergeDateArrays(mxArray** array) {
+  int size = mxGetNumberOfElements(*array);
+  mxArray* element = mxGetCell(*array, 0);
+  mwSize ndims = mxGetNumberOfDimensions(element);
+  const mwSize* dims = mxGetDimensions(element);
+  mxArray* new_array = NULL;
+  int dimension;
   int i;
   if (ndims < 2)
     return;
-  if (dims[0] == 1) {
-    size_t value_size, element_size;
-    /* Stack row vectors. */
-    new_array = mxCreateNumericMatrix(size, dims[1], class_id, mxREAL);
-    if (!new_array)
+  dimension = (ndims == 2 && dims[0] == 1 && dims[1] == 1) ? 2 :
+              (ndims == 2 && dims[0] == 1) ? 1 : ndims;
+  mxArray** rhs = (mxArray**)ArenaMalloc(sizeof(mxArray*) * (1 + size));
+  rhs[0] = mxCreateDoubleScalar(2);
+  for (i = 0; i < size; ++i)
+    rhs[i + 1] = mxGetCell(*array, i);
+  mexCallMATLAB(1, &new_array, (1 + size), rhs, "cat");
+  mxDestroyArray(rhs[0]);
+  ArenaFree(rhs);
+  mxDestroyArray(*array);
+  *array = new_array;
+}
+
+/** Convert a numeric mxArray to the promoted class.
+ */
+static mxArray* ConvertNumericArrayClass(const mxArray* input,
+                                         mxClassID class_id) {
+  size_t num_elements = mxGetNumberOfElements(input);
+  mxClassID input_class_id = mxGetClassID(input);
+  mxArray* element;
+  const void* input_data = mxGetData(input);
+  void* output_data;
+  size_t i;
+  if (!IsNumericArrayType(input_class_id))
+    return NULL;
+  element = mxCreateNumericArray(mxGetNumberOfDimensions(input),
+                                 mxGetDimensions(input),
+                                 class_id,
+                                 mxREAL);
+  if (!element)
+    return NULL;
+  output_data = mxGetData(element);
+  for (i = 0; i < num_elements; ++i) {
+    int64_t long_value;
+    double value;
+    GetNumericValue(input_data, input_class_id, i, &long_value, &value);
+    SetNumericValue(output_data, class_id, i, long_value, value);
+  }
+  return element;
+}
+
+/** Promote numeric elements of the cell array to the given class in place.
+ */
+static bool PromoteNumericCells(mxArray* array, mxClassID class_id) {
+  int size = mxGetNumberOfElements(array);
+  int i;
+  for (i = 0; i < size; ++i) {
+    mxArray* element = mxGetCell(array, i);
+    mxArray* promoted_element;
+    if (mxGetClassID(element) == class_id)
+      continue;
+    promoted_element = ConvertNumericArrayClass(element, class_id);
+    if (!promoted_element)
+      return false;
+    mxDestroyArray(element);
+    mxSetCell(array, i, promoted_element);
+  }
+  return true;
+}
+
+/** Check if the floating point elements of the cell array hold only
+ * integers in the range of int64, so that they merge with int64 elements
+ * without loss.
+ */
+static bool HasInt64FloatCells(const mxArray* array) {
+  int size = mxGetNumberOfElements(array);
+  int i;
+  for (i = 0; i < size; ++i) {
+    const mxArray* element = mxGetCell(array, i);
+    size_t count = mxGetNumberOfElements(element);
+    size_t j;
+    if (!mxIsDouble(element) && !mxIsSingle(element))
+      continue;
+    if (mxIsComplex(element))
+      return false;
+    for (j = 0; j < count; ++j) {
+      double value = (mxIsDouble(element)) ?
+          ((const double*)mxGetData(element))[j] :
+          ((const float*)mxGetData(element))[j];
+      if (!IsInt64Value(value))
+        return false;
+    }
+  }
+  return true;
+}
+
+/** Check if the int64 elements of the cell array are exact in double.
+ */
+static bool HasExactInt64Cells(const mxArray* array) {
+  int size = mxGetNumberOfElements(array);
+  int i;
+  for (i = 0; i < size; ++i) {
+    const mxArray* element = mxGetCell(array, i);
+    const int64_t* data = (const int64_t*)mxGetData(element);
+    size_t count = mxGetNumberOfElements(element);
+    size_t j;
+    if (mxGetClassID(element) != mxINT64_CLASS)
+      continue;
+    for (j = 0; j < count; ++j) {
+      if (data[j] < -MAX_EXACT_INTEGER || data[j] > MAX_EXACT_INTEGER)
+        return false;
+    }
+  }
+  return true;
+}
+
+/** Try to merge cell array to N-D array in place.
+ * @param array mxArray to be merged into N-D.
+ */
+static void TryMergeCellToNDArray(mxArray** array) {
+  int size = mxGetNumberOfElements(*array);
+  mxArray* element;
+  mxClassID class_id;
+  mwSize ndims;
+  const mwSize* dims;
+  bool mergeable = true;
+  bool promotable = false;
+  bool has_int64;
+  int i;
+  if (!size)
+    return;
+  /* Get the type information about the first element. */
+  element = mxGetCell(*array, 0);
+  class_id = mxGetClassID(element);
+  has_int64 = class_id == mxINT64_CLASS;
+  ndims = mxGetNumberOfDimensions(element);
+  dims = mxGetDimensions(element);
+  /* Scan the rest of elements. Numeric classes are promoted. */
+  for (i = 1; i < size; ++i) {
+    mxClassID element_class_id;
+    element = mxGetCell(*array, i);
+    element_class_id = mxGetClassID(element);
+    has_int64 |= element_class_id == mxINT64_CLASS;
+    if (class_id != element_class_id &&
+        IsNumericArrayType(class_id) &&
+        IsNumericArrayType(element_class_id)) {
+      class_id = PromoteArrayType(class_id, element_class_id);
+      promotable = true;
+    }
+    else
+      mergeable &= class_id == element_class_id;
+    mergeable &= ndims == mxGetNumberOfDimensions(element) &&
+        memcmp(dims, mxGetDimensions(element), ndims * sizeof(mwSize)) == 0;
+  }
+  if (!mergeable)
+    return;
+  if (promotable &&
+      has_int64 &&
+      (class_id == mxDOUBLE_CLASS || class_id == mxSINGLE_CLASS)) {
+    if (HasInt64FloatCells(*array))
+      class_id = mxINT64_CLASS;
+    else if (!HasExactInt64Cells(*array))
       return;
-    value_size = mxGetNumberOfElements(element);
-    element_size = mxGetElementSize(element);
-    for (i = 0; i < size; ++i) {
-      mxArray* value = mxGetCell(*array, i);
-      void* input = (void*)mxGetData(value);
-      void* output = (void*)mxGetData(new_array) + i * element_size;
-      int j;
-      for (j = 0; j < value_size; ++j) {
-        memcpy(output, input, element_size);
-        input += element_size;
-        output += size * element_size;
+  }
+  if (promotable && !PromoteNumericCells(*array, class_id))
+    return;
+  switch (class_id) {
+    case mxDOUBLE_CLASS:
+    case mxSINGLE_CLASS:
+    case mxINT8_CLASS:
+    case mxUINT8_CLASS:
+    case mxINT16_CLASS:
+    case mxUINT16_CLASS:
+    case mxINT32_CLASS:
+    case mxUINT32_CLASS:
+    case mxINT64_CLASS:
+    case mxUINT64_CLASS:
+    case mxLOGICAL_CLASS:
+      MergeNumericArrays(array);
+      break;
+    /*case mxCHAR_CLASS: Let's not merge strings to an N-D array. */
+    case mxCELL_CLASS:
+      MergeCellArrays(array);
+      break;
+    case mxSTRUCT_CLASS:
+      MergeStructArrays(array);
+      break;
+    default:
+      if (mxIsClass(element, "bson.datetime"))
+        MergeDateArrays(array);
+      break;
+  }
+}
+
+/** Resolve the numeric array class requested in the decoder options.
+ */
+static mxClassID ResolveArrayType(int array_type,
+                                  int64_t min_value,
+                                  int64_t max_value,
+                                  const decode_options_t* options) {
+  switch (array_type) {
+    case mxINT32_CLASS:
+    case mxINT64_CLASS:
+      if (options->integer_class == BSONMEX_INTEGER_SMALLEST)
+        return GetSmallestIntegerClass(min_value, max_value);
+      break;
+    case mxDOUBLE_CLASS:
+      return options->float_class;
+    default:
+      break;
+  }
+  return (mxClassID)array_type;
+}
+
+/** Open container of the decoder.
+ */
+typedef struct decode_frame_t {
+  bson_iter_t it;   /* Iterator over the elements. */
+  size_t child;     /* Next node of the JSON tape instead of the iterator. */
+  mxArray* element; /* Cell or struct to fill, or the only value. */
+  int size;         /* Number of elements. */
+  int index;        /* Number of visited elements. */
+  int array_type;   /* Array type of the container by CheckBSONObject. */
+  bool is_single;   /* Pass the only element as the value. */
+} decode_frame_t;
+
+/** Explicit stack of the decoder.
+ */
+typedef struct decode_stack_t {
+  decode_frame_t* frames;
+  size_t depth;
+  size_t capacity;
+  const decode_options_t* options;
+} decode_stack_t;
+
+/** Add a frame to visit the elements of a container.
+ * @param element cell or struct to fill, or NULL to pass the only element.
+ * @return the new frame.
+ */
+static decode_frame_t* PushDecodeFrame(decode_stack_t* stack,
+                                       mxArray* element,
+                                       int size,
+                                       int array_type) {
+  decode_frame_t* frame;
+  if (stack->depth == stack->capacity) {
+    stack->capacity = (stack->capacity) ? 2 * stack->capacity : 16;
+    stack->frames = (decode_frame_t*)ArenaRealloc(
+        stack->frames,
+        stack->capacity * sizeof(decode_frame_t));
+  }
+  frame = &stack->frames[stack->depth++];
+  frame->element = element;
+  frame->size = size;
+  frame->index = 0;
+  frame->array_type = array_type;
+  frame->is_single = (element == NULL);
+  return frame;
+}
+
+/** Destroy the containers of the open frames after an error. Elements are
+ * set in the container when they end.
+ */
+static void ClearDecodeStack(decode_stack_t* stack) {
+  while (stack->depth)
+    if (stack->frames[--stack->depth].element)
+      mxDestroyArray(stack->frames[stack->depth].element);
+}
+
+/** Convert a numeric or logical container at the iterator, or open a frame
+ * to visit the elements of other containers.
+ * @param it bson iterator inside the container.
+ * @param value converted array, or NULL if a frame is opened.
+ * @return false if unsuccessful.
+ */
+static bool BeginDecodeFrame(decode_stack_t* stack,
+                             bson_iter_t* it,
+                             mxArray** value) {
+  const decode_options_t* options = stack->options;
+  bson_iter_t iterator_copy = *it;
+  decode_frame_t* frame;
+  mxArray* element = NULL;
+  int object_size, array_type;
+  int64_t min_value, max_value;
+  const char** keys = NULL;
+  *value = NULL;
+  if (options->max_depth && stack->depth > options->max_depth)
+    return false;
+  /* Check the array type. */
+  CheckBSONObject(&iterator_copy,
+                  &object_size,
+                  &keys,
+                  &array_type,
+                  &min_value,
+                  &max_value);
+  /* An empty document is not known to be an array or a struct. */
+  if (object_size == 0) {
+    *value = mxCreateDoubleMatrix(0, 0, mxREAL);
+    return *value != NULL;
+  }
+  if (!keys)
+    return false;
+  switch (array_type) {
+    case mxDOUBLE_CLASS:
+    case mxINT32_CLASS:
+    case mxINT64_CLASS: {
+      mxClassID class_id = ResolveArrayType(array_type,
+                                            min_value,
+                                            max_value,
+                                            options);
+      if (class_id == mxDOUBLE_CLASS)
+        *value = ConvertBSONArrayToDoubleArray(it, object_size);
+      else if (class_id == mxINT32_CLASS)
+        *value = ConvertBSONArrayToIntegerArray(it, object_size);
+      else if (class_id == mxINT64_CLASS)
+        *value = ConvertBSONArrayToLongArray(it, object_size);
+      else
+        *value = ConvertBSONArrayToNumericArray(it, object_size, class_id);
+      break;
+    }
+    case mxLOGICAL_CLASS:
+      *value = ConvertBSONArrayToLogicalArray(it, object_size);
+      break;
+    case mxCHAR_CLASS:
+    case mxUINT8_CLASS:
+      if (object_size > 1)
+        element = mxCreateCellMatrix(1, object_size);
+      break;
+    case mxCELL_CLASS:
+      element = mxCreateCellMatrix(1, object_size);
+      break;
+    case mxSTRUCT_CLASS: {
+      const char** safe_keys = GetSafeKeys(object_size, keys);
+      if (safe_keys)
+        element = mxCreateStructMatrix(1, 1, object_size, safe_keys);
+      break;
+    }
+    default:
+      break;
+  }
+  ArenaFree(keys);
+  if (*value)
+    return true;
+  if (!element && (array_type != mxCHAR_CLASS &&
+                   array_type != mxUINT8_CLASS))
+    return false;
+  frame = PushDecodeFrame(stack, element, object_size, array_type);
+  frame->it = *it;
+  return true;
+}
+
+/** Remove the innermost frame.
+ * @return value of the container.
+ */
+static mxArray* EndDecodeFrame(decode_stack_t* stack) {
+  decode_frame_t* frame = &stack->frames[--stack->depth];
+  mxArray* element = frame->element;
+  /* Merge a cell array to N-D array if possible. */
+  if (frame->array_type == mxCELL_CLASS)
+    TryMergeCellToNDArray(&element);
+  return element;
+}
+
+/** Set the value of the last visited element of the innermost frame.
+ */
+static void SetDecodedValue(decode_stack_t* stack, mxArray* value) {
+  decode_frame_t* frame = &stack->frames[stack->depth - 1];
+  if (frame->is_single)
+    frame->element = value;
+  else if (frame->array_type == mxSTRUCT_CLASS)
+    mxSetFieldByNumber(frame->element, 0, frame->index - 1, value);
+  else
+    mxSetCell(frame->element, frame->index - 1, value);
+}
+
+/** Convert bson iterator to mxArray*. The iterator must be pointing to a BSON
+ * array. Nested documents are visited on an explicit stack instead of
+ * recursion, and limited by the max_depth option.
+ * @param it bson iterator to convert to mxArray.
+ * @param options decoder options.
+ * @return Newly allocated mxArray, or NULL if unsuccessful.
+ */
+static mxArray* ConvertBSONIteratorToMxArray(
+    bson_iter_t* it,
+    const decode_options_t* options) {
+  decode_stack_t stack;
+  mxArray* value = NULL;
+  bool status;
+  stack.frames = NULL;
+  stack.depth = 0;
+  stack.capacity = 0;
+  stack.options = options;
+  status = BeginDecodeFrame(&stack, it, &value);
+  while (status && stack.depth) {
+    decode_frame_t* frame = &stack.frames[stack.depth - 1];
+    if (frame->index == frame->size) {
+      value = EndDecodeFrame(&stack);
+      status = value != NULL;
+    }
+    else if (!bson_iter_next(&frame->it))
+      status = false;
+    else {
+      bson_type_t type = bson_iter_type(&frame->it);
+      ++frame->index;
+      if (type == BSON_TYPE_DOCUMENT || type == BSON_TYPE_ARRAY) {
+        bson_iter_t sub_iterator;
+        status = bson_iter_recurse(&frame->it, &sub_iterator) &&
+                 BeginDecodeFrame(&stack, &sub_iterator, &value);
+      }
+      else {
+        value = ConvertValueToMxArray(&frame->it, options);
+        status = value != NULL;
+      }
+    }
+    /* A new frame gives its value when it ends. */
+    if (status && value && stack.depth)
+      SetDecodedValue(&stack, value);
+  }
+  if (!status) {
+    ClearDecodeStack(&stack);
+    value = NULL;
+  }
+  ArenaFree(stack.frames);
+  return value;
+}
+
+/** Create a scalar of the integer class requested in the decoder options.
+ */
+static mxArray* CreateIntegerScalar(int64_t value,
+                                    mxClassID native_class_id,
+                                    const decode_options_t* options) {
+  mxClassID class_id;
+  mxArray* element;
+  switch (options->integer_class) {
+    case BSONMEX_INTEGER_NATIVE:
+      class_id = native_class_id;
+      break;
+    case BSONMEX_INTEGER_SMALLEST:
+      class_id = GetSmallestIntegerClass(value, value);
+      break;
+    case BSONMEX_INTEGER_AUTO:
+    default:
+      class_id = (native_class_id == mxINT32_CLASS) ?
+          mxDOUBLE_CLASS : native_class_id;
+      break;
+  }
+  element = mxCreateNumericMatrix(1, 1, class_id, mxREAL);
+  if (element)
+    SetNumericValue(mxGetData(element), class_id, 0, value, (double)value);
+  return element;
+}
+
+/** Convert the BSON value at the iterator.
+ */
+static mxArray* ConvertValueToMxArray(const bson_iter_t* it,
+                                      const decode_options_t* options) {
+  mxArray* element = NULL;
+  bson_type_t type = bson_iter_type(it);
+  switch (type) {
+    case BSON_TYPE_EOD:
+      break;
+    case BSON_TYPE_DOUBLE:
+      if (options->float_class == mxSINGLE_CLASS) {
+        element = mxCreateNumericMatrix(1, 1, mxSINGLE_CLASS, mxREAL);
+        *(float*)mxGetData(element) = (float)bson_iter_double(it);
       }
+      else
+        element = mxCreateDoubleScalar(bson_iter_double(it));
+      break;
+    case BSON_TYPE_UTF8:
+    case BSON_TYPE_SYMBOL: {
+      uint32_t length = 0;
+      const char* value = bson_iter_utf8(it, &length);
+      element = mxCreateString(value);
+      break;
+    }
+    case BSON_TYPE_DOCUMENT:
+    case BSON_TYPE_ARRAY: {
+      bson_iter_t sub_iterator;
+      bson_iter_recurse(it, &sub_iterator);
+      element = ConvertBSONIteratorToMxArray(&sub_iterator, options);
+      break;
+    }
+    case BSON_TYPE_BINARY: {
+      bson_subtype_t subtype;
+      uint32_t element_size;
+      const uint8_t *binary;
+      bson_iter_binary(it, &subtype, &element_size, &binary);
+      if (subtype == BSON_SUBTYPE_USER &&
+          (!ConvertPackedBinaryToMxArray(binary,
+                                         element_size,
+                                         options,
+                                         &element) ||
+           element))
+        break;
+      element = mxCreateNumericMatrix(1,
+                                      element_size,
+                                      mxUINT8_CLASS,
+                                      mxREAL);
+      memcpy(mxGetData(element), binary, element_size);
+      break;
+    }
+    case BSON_TYPE_UNDEFINED:
+      element = mxCreateDoubleScalar(mxGetNaN());
+      break;
+    case BSON_TYPE_OID: {
+      char oid_string[25];
+      bson_oid_to_string(bson_iter_oid(it), oid_string);
+      element = mxCreateString(oid_string);
+      break;
+    }
+    case BSON_TYPE_BOOL:
+      element = mxCreateLogicalScalar(bson_iter_bool(it));
+      break;
+    case BSON_TYPE_DATE_TIME: {
+      int64_t date_value = bson_iter_date_time(it);
+      mxArray* date_number = mxCreateDoubleScalar(
+          ((double)date_value / 86400.0) + 719529);
+      mexCallMATLAB(1, &element, 1, &date_number, "bson.datetime");
+      mxDestroyArray(date_number);
+      break;
+    }
+    case BSON_TYPE_NULL:
+    case BSON_TYPE_DBPOINTER:
+      element = mxCreateDoubleMatrix(0, 0, mxREAL);
+      break;
+    case BSON_TYPE_REGEX:
+      element = mxCreateString(bson_iter_regex(it, NULL));
+      break;
+    case BSON_TYPE_CODE:
+    case BSON_TYPE_CODEWSCOPE: {
+      uint32_t length;
+      element = mxCreateString(bson_iter_code(it, &length));
+      break;
+    }
+    case BSON_TYPE_INT32:
+      element = CreateIntegerScalar(bson_iter_int32(it),
+                                    mxINT32_CLASS,
+                                    options);
+      break;
+    case BSON_TYPE_TIMESTAMP: {
+      time_t time_value = bson_iter_time_t(it);
+      mxArray* date_number = mxCreateDoubleScalar(
+          ((double)time_value / 86400.0) + 719529);
+      mexCallMATLAB(1, &element, 1, &date_number, "bson.datetime");
+      mxDestroyArray(date_number);
+      break;
     }
+    case BSON_TYPE_INT64:
+      element = CreateIntegerScalar(bson_iter_int64(it),
+                                    mxINT64_CLASS,
+                                    options);
+      break;
+    case BSON_TYPE_MAXKEY:
+      element = mxCreateDoubleScalar(mxGetInf());
+      break;
+    case BSON_TYPE_MINKEY:
+      element = mxCreateDoubleScalar(-mxGetInf());
+      break;
+    default:
+      break;
+  }
+  return element;
+}
+
+static mxArray* ConvertJSONNodeToMxArray(const json_tape_t* tape,
+                                         size_t index,
+                                         const decode_options_t* options);
+
+/** Check the type and the keys of the JSON container, as CheckBSONObject.
+ */
+static void CheckJSONObject(const json_tape_t* tape,
+                            size_t index,
+                            const char** keys,
+                            int* array_type,
+                            int64_t* min_value,
+                            int64_t* max_value) {
+  const json_node_t* node = &tape->nodes[index];
+  array_type_t element_types;
+  bool is_array = true;
+  size_t child = index + 1;
+  size_t i;
+  InitArrayType(&element_types);
+  for (i = 0; i < node->size; ++i) {
+    const json_node_t* element = &tape->nodes[child];
+    keys[i] = element->key;
+    if (node->type == BSON_TYPE_DOCUMENT)
+      is_array = is_array && IsArrayIndexKey(element->key, (int)i);
+    UpdateArrayType(&element_types,
+                    element->type,
+                    (element->type == BSON_TYPE_INT32 ||
+                     element->type == BSON_TYPE_INT64) ?
+                    element->value.integer : 0,
+                    (element->type == BSON_TYPE_DOUBLE) ?
+                    element->value.number : 0);
+    child = element->next;
   }
-  else {
-    /* Expand the last dimension. */
-    mwSize* new_dims = (mwSize*)mxMalloc((ndims + 1) * sizeof(mwSize));
-    size_t stride;
-    memcpy(new_dims, dims, ndims * sizeof(mwSize));
-    new_dims[ndims] = size;
-    new_array = mxCreateNumericArray(ndims + 1, new_dims, class_id, mxREAL);
-    mxFree(new_dims);
-    if (!new_array)
-      return;
-    stride = mxGetNumberOfElements(element) * mxGetElementSize(element);
-    for (i = 0; i < size; ++i) {
-      mxArray* value = mxGetCell(*array, i);
-      memcpy(mxGetData(new_array) + i * stride, mxGetData(value), stride);
+  *array_type = FinishArrayType(&element_types, is_array);
+  *min_value = element_types.min_value;
+  *max_value = element_types.max_value;
+}
+
+/** Convert JSON array to numeric mxArray of any class.
+ */
+static mxArray* ConvertJSONArrayToNumericArray(const json_tape_t* tape,
+                                               size_t index,
+                                               mxClassID class_id) {
+  const json_node_t* node = &tape->nodes[index];
+  mxArray* element = mxCreateNumericMatrix(1, node->size, class_id, mxREAL);
+  void* output_data;
+  size_t child = index + 1;
+  size_t i;
+  if (!element)
+    return NULL;
+  output_data = mxGetData(element);
+  for (i = 0; i < node->size; ++i) {
+    const json_node_t* value_node = &tape->nodes[child];
+    int64_t long_value = 0;
+    double value;
+    switch (value_node->type) {
+      case BSON_TYPE_DOUBLE:
+        value = value_node->value.number;
+        long_value = (int64_t)value;
+        break;
+      case BSON_TYPE_INT32:
+      case BSON_TYPE_INT64:
+        long_value = value_node->value.integer;
+        value = (double)long_value;
+        break;
+      case BSON_TYPE_BOOL:
+        long_value = value_node->value.boolean;
+        value = (double)long_value;
+        break;
+      default:
+        value = mxGetNaN();
+        break;
     }
+    SetNumericValue(output_data, class_id, i, long_value, value);
+    child = value_node->next;
   }
-  mxDestroyArray(*array);
-  *array = new_array;
+  return element;
 }
 
-/** Merge cell array of cell arrays to an N-D cell array.
+/** Convert JSON array to logical mxArray.
  */
-static void MergeCellArrays(mxArray** array) {
-  int size = mxGetNumberOfElements(*array);
-  mxArray* element = mxGetCell(*array, 0);
-  mwSize ndims = mxGetNumberOfDimensions(element);
-  const mwSize* dims = mxGetDimensions(element);
-  mxArray* new_array = NULL;
-  int i, j;
-  if (ndims < 2)
-    return;
-  if (ndims == 2 && dims[0] == 1) {
-    /* Stack row vectors. */
-    new_array = mxCreateCellMatrix(size, dims[1]);
-    if (!new_array)
-      return;
-    for (i = 0; i < size; ++i) {
-      mxArray* value = mxGetCell(*array, i);
-      for (j = 0; j < dims[1]; ++j)
-        mxSetCell(new_array,
-                  i + j * size,
-                  mxDuplicateArray(mxGetCell(value, j)));
+static mxArray* ConvertJSONArrayToLogicalArray(const json_tape_t* tape,
+                                               size_t index) {
+  const json_node_t* node = &tape->nodes[index];
+  mxArray* element = mxCreateLogicalMatrix(1, node->size);
+  mxLogical* output_data;
+  size_t child = index + 1;
+  size_t i;
+  if (!element)
+    return NULL;
+  output_data = mxGetLogicals(element);
+  for (i = 0; i < node->size; ++i) {
+    output_data[i] = tape->nodes[child].value.boolean;
+    child = tape->nodes[child].next;
+  }
+  return element;
+}
+
+/** Convert a numeric or logical JSON container, or open a frame to visit the
+ * elements of other containers, as BeginDecodeFrame.
+ * @param index index of the container in the tape.
+ * @param value converted array, or NULL if a frame is opened.
+ * @return false if unsuccessful.
+ */
+static bool BeginJSONFrame(decode_stack_t* stack,
+                           const json_tape_t* tape,
+                           size_t index,
+                           mxArray** value) {
+  const decode_options_t* options = stack->options;
+  const json_node_t* node = &tape->nodes[index];
+  mxArray* element = NULL;
+  const char** keys;
+  int array_type;
+  int64_t min_value, max_value;
+  *value = NULL;
+  if (options->max_depth && stack->depth > options->max_depth)
+    return false;
+  /* Empty containers decode as empty BSON documents. */
+  if (node->size == 0) {
+    *value = mxCreateDoubleMatrix(0, 0, mxREAL);
+    return *value != NULL;
+  }
+  keys = (const char**)ArenaMalloc(node->size * sizeof(const char*));
+  CheckJSONObject(tape, index, keys, &array_type, &min_value, &max_value);
+  switch (array_type) {
+    case mxDOUBLE_CLASS:
+    case mxINT32_CLASS:
+    case mxINT64_CLASS:
+      *value = ConvertJSONArrayToNumericArray(
+          tape,
+          index,
+          ResolveArrayType(array_type, min_value, max_value, options));
+      break;
+    case mxLOGICAL_CLASS:
+      *value = ConvertJSONArrayToLogicalArray(tape, index);
+      break;
+    case mxCHAR_CLASS:
+      if (node->size > 1)
+        element = mxCreateCellMatrix(1, node->size);
+      break;
+    case mxCELL_CLASS:
+      element = mxCreateCellMatrix(1, node->size);
+      break;
+    case mxSTRUCT_CLASS: {
+      const char** safe_keys = GetSafeKeys((int)node->size, keys);
+      if (safe_keys)
+        element = mxCreateStructMatrix(1, 1, (int)node->size, safe_keys);
+      break;
     }
+    default:
+      break;
   }
-  else {
-    /* Expand the last dimension. */
-    mwSize* new_dims = (mwSize*)mxMalloc(sizeof(mwSize) * (ndims + 1));
-    mwSize element_size;
-    memcpy(new_dims, dims, sizeof(mwSize) * ndims);
-    new_dims[ndims] = size;
-    new_array = mxCreateCellArray(ndims + 1, new_dims);
-    mxFree(new_dims);
-    element_size = mxGetNumberOfElements(element);
-    for (i = 0; i < size; ++i) {
-      mxArray* value = mxGetCell(*array, i);
-      for (j = 0; j < element_size; ++j) {
-        mxSetCell(new_array,
-                  j + i * element_size,
-                  mxDuplicateArray(mxGetCell(value, j)));
+  ArenaFree(keys);
+  if (*value)
+    return true;
+  if (!element && array_type != mxCHAR_CLASS)
+    return false;
+  PushDecodeFrame(stack, element, (int)node->size, array_type)->child =
+      index + 1;
+  return true;
+}
+
+/** Convert JSON container to mxArray, as ConvertBSONIteratorToMxArray.
+ * Nested containers are visited on the stack of the decoder.
+ */
+static mxArray* ConvertJSONContainerToMxArray(
+    const json_tape_t* tape,
+    size_t index,
+    const decode_options_t* options) {
+  decode_stack_t stack;
+  mxArray* value = NULL;
+  bool status;
+  stack.frames = NULL;
+  stack.depth = 0;
+  stack.capacity = 0;
+  stack.options = options;
+  status = BeginJSONFrame(&stack, tape, index, &value);
+  while (status && stack.depth) {
+    decode_frame_t* frame = &stack.frames[stack.depth - 1];
+    if (frame->index == frame->size) {
+      value = EndDecodeFrame(&stack);
+      status = value != NULL;
+    }
+    else {
+      size_t child = frame->child;
+      bson_type_t type = tape->nodes[child].type;
+      frame->child = tape->nodes[child].next;
+      ++frame->index;
+      if (type == BSON_TYPE_DOCUMENT || type == BSON_TYPE_ARRAY)
+        status = BeginJSONFrame(&stack, tape, child, &value);
+      else {
+        value = ConvertJSONNodeToMxArray(tape, child, options);
+        status = value != NULL;
       }
     }
+    /* A new frame gives its value when it ends. */
+    if (status && value && stack.depth)
+      SetDecodedValue(&stack, value);
   }
-  mxDestroyArray(*array);
-  *array = new_array;
+  if (!status) {
+    ClearDecodeStack(&stack);
+    value = NULL;
+  }
+  ArenaFree(stack.frames);
+  return value;
 }
 
-/** Merge cell array of struct arrays to an N-D cell array.
+/** Convert a JSON node to mxArray, as ConvertValueToMxArray.
  */
-static void MergeStructArrays(mxArray** array) {
-  int size = mxGetNumberOfElements(*array);
-  mxArray* element = mxGetCell(*array, 0);
-  mwSize ndims = mxGetNumberOfDimensions(element);
-  const mwSize* dims = mxGetDimensions(element);
-  mxArray* new_array = NULL;
-  int num_fields;
-  int i, j, k;
-  const char** fields;
-  bool mergeable = true;
-  if (ndims < 2)
-    return;
-  /* Check if all fields are the same. */
-  num_fields = mxGetNumberOfFields(element);
-  fields = (const char**)mxMalloc(sizeof(const char*) * num_fields);
-  for (i = 0; i < num_fields; ++i)
-    fields[i] = mxGetFieldNameByNumber(element, i);
-  for (i = 1; i < size; ++i) {
-    mxArray* value = mxGetCell(*array, i);
-    if (mxGetNumberOfFields(value) == num_fields)
-      for (k = 0; k < num_fields; ++k)
-        mergeable &= strcmp(fields[k], mxGetFieldNameByNumber(value, k)) == 0;
-    else
-      mergeable = false;
+static mxArray* ConvertJSONNodeToMxArray(const json_tape_t* tape,
+                                         size_t index,
+                                         const decode_options_t* options) {
+  const json_node_t* node = &tape->nodes[index];
+  mxArray* element = NULL;
+  switch (node->type) {
+    case BSON_TYPE_DOUBLE:
+      if (options->float_class == mxSINGLE_CLASS) {
+        element = mxCreateNumericMatrix(1, 1, mxSINGLE_CLASS, mxREAL);
+        *(float*)mxGetData(element) = (float)node->value.number;
+      }
+      else
+        element = mxCreateDoubleScalar(node->value.number);
+      break;
+    case BSON_TYPE_UTF8:
+      element = mxCreateString(node->value.string);
+      break;
+    case BSON_TYPE_DOCUMENT:
+    case BSON_TYPE_ARRAY:
+      element = ConvertJSONContainerToMxArray(tape, index, options);
+      break;
+    case BSON_TYPE_BOOL:
+      element = mxCreateLogicalScalar(node->value.boolean);
+      break;
+    case BSON_TYPE_NULL:
+      element = mxCreateDoubleMatrix(0, 0, mxREAL);
+      break;
+    case BSON_TYPE_INT32:
+    case BSON_TYPE_INT64:
+      element = CreateIntegerScalar(node->value.integer,
+                                    (node->type == BSON_TYPE_INT32) ?
+                                    mxINT32_CLASS : mxINT64_CLASS,
+                                    options);
+      break;
+    default:
+      break;
   }
-  if (!mergeable) {
-    mxFree(fields);
-    return;
+  return element;
+}
+
+EXTERN_C bool ConvertMxArrayToBSON(const mxArray* input,
+                                   const encode_options_t* options,
+                                   bson_t* output) {
+  bson_init(output);
+  if (!ConvertMxArrayToReusedBSON(input, options, output)) {
+    bson_destroy(output);
+    return false;
   }
-  if (ndims == 2 && dims[0] == 1 && dims[1] == 1) {
-    /* Concatenate into a row vector. */
-    new_array = mxCreateStructMatrix(1, size, num_fields, fields);
-    if (!new_array)
-      return;
-    for (i = 0; i < size; ++i) {
-      mxArray* value = mxGetCell(*array, i);
-      for (k = 0; k < num_fields; ++k) {
-        mxArray* field = mxDuplicateArray(mxGetFieldByNumber(value, 0, k));
-        mxSetFieldByNumber(new_array, i, k, field);
+  return true;
+}
+
+EXTERN_C bool ConvertMxArrayToReusedBSON(const mxArray* input,
+                                         const encode_options_t* options,
+                                         bson_t* output) {
+  static const encode_options_t kDefaultOptions = BSONMEX_ENCODE_OPTIONS_INIT;
+  bool status;
+  if (!options)
+    options = &kDefaultOptions;
+  bson_reinit(output);
+  BeginArena();
+  status = (options->plan) ?
+      ConvertPlannedArrayToBSON(input, options, output) :
+      ConvertArrayToBSON(input, NULL, options, output);
+  EndArena();
+  return status;
+}
+
+EXTERN_C encode_plan_t* CreateEncodePlan(const mxArray* input) {
+  encode_plan_t* plan;
+  int i;
+  if (!mxIsStruct(input) || mxGetNumberOfElements(input) == 0)
+    return NULL;
+  plan = (encode_plan_t*)calloc(1, sizeof(encode_plan_t));
+  if (!plan)
+    return NULL;
+  plan->num_fields = mxGetNumberOfFields(input);
+  plan->fields = (encode_plan_field_t*)calloc(
+      (plan->num_fields) ? plan->num_fields : 1,
+      sizeof(encode_plan_field_t));
+  if (!plan->fields) {
+    free(plan);
+    return NULL;
+  }
+  for (i = 0; i < plan->num_fields; ++i) {
+    encode_plan_field_t* field = &plan->fields[i];
+    const char* name = mxGetFieldNameByNumber(input, i);
+    const mxArray* value = mxGetFieldByNumber(input, 0, i);
+    field->name_length = (int)strlen(name);
+    field->name = (char*)malloc(field->name_length + 1);
+    if (!field->name) {
+      DestroyEncodePlan(plan);
+      return NULL;
+    }
+    memcpy(field->name, name, field->name_length + 1);
+    field->class_id = (value) ? mxGetClassID(value) : mxUNKNOWN_CLASS;
+    field->is_scalar = value &&
+                       mxGetNumberOfElements(value) == 1 &&
+                       !mxIsComplex(value) &&
+                       !mxIsSparse(value);
+    if (field->class_id == mxSTRUCT_CLASS && field->is_scalar) {
+      field->plan = CreateEncodePlan(value);
+      if (!field->plan) {
+        DestroyEncodePlan(plan);
+        return NULL;
       }
     }
   }
-  else if (ndims == 2 && dims[0] == 1) {
-    /* Stack row vectors. */
-    new_array = mxCreateStructMatrix(size, dims[1], num_fields, fields);
-    if (!new_array)
-      return;
-    for (i = 0; i < size; ++i) {
-      mxArray* value = mxGetCell(*array, i);
-      for (j = 0; j < dims[1]; ++j)
-        for (k = 0; k < num_fields; ++k) {
-          mxArray* field = mxDuplicateArray(mxGetFieldByNumber(value, j, k));
-          mxSetFieldByNumber(new_array, i + j * size, k, field);
-        }
-    }
+  return plan;
+}
+
+EXTERN_C void DestroyEncodePlan(encode_plan_t* plan) {
+  int i;
+  if (!plan)
+    return;
+  for (i = 0; i < plan->num_fields; ++i) {
+    free(plan->fields[i].name);
+    DestroyEncodePlan(plan->fields[i].plan);
   }
-  else {
-    /* Expand the last dimension. */
-    mwSize* new_dims = (mwSize*)mxMalloc(sizeof(mwSize) * (ndims + 1));
-    mwSize element_size;
-    memcpy(new_dims, dims, sizeof(mwSize) * ndims);
-    new_dims[ndims] = size;
-    new_array = mxCreateStructArray(ndims + 1, new_dims, num_fields, fields);
-    mxFree(new_dims);
-    element_size = mxGetNumberOfElements(element);
-    for (i = 0; i < size; ++i) {
-      mxArray* value = mxGetCell(*array, i);
-      for (j = 0; j < element_size; ++j)
-        for (k = 0; k < num_fields; ++k) {
-          mxArray* field = mxDuplicateArray(mxGetFieldByNumber(value, j, k));
-          mxSetFieldByNumber(new_array, j + i * element_size, k, field);
-        }
-    }
+  free(plan->fields);
+  free(plan);
+}
+
+EXTERN_C bool MatchEncodePlan(const mxArray* input,
+                              const encode_plan_t* plan) {
+  int i;
+  if (mxGetNumberOfFields(input) != plan->num_fields)
+    return false;
+  for (i = 0; i < plan->num_fields; ++i)
+    if (strcmp(mxGetFieldNameByNumber(input, i), plan->fields[i].name) != 0)
+      return false;
+  return true;
+}
+
+EXTERN_C bool ConvertMxArrayToBSONStream(const mxArray* input,
+                                         const encode_options_t* options,
+                                         const stream_writer_t* output) {
+  static const encode_options_t kDefaultOptions = BSONMEX_ENCODE_OPTIONS_INIT;
+  stream_state_t state;
+  uint64_t start;
+  bool status;
+  if (!options)
+    options = &kDefaultOptions;
+  state.writer = output;
+  state.position = 0;
+  state.depth = 0;
+  state.max_depth = (options->max_depth) ?
+      options->max_depth : BSONMEX_RECURSIVE_MAX_DEPTH;
+  bson_init(&state.batch);
+  BeginArena();
+  status = BeginStreamDocument(&state, BSON_TYPE_DOCUMENT, NULL, &start) &&
+           StreamArrayToBSON(input, NULL, options, &state) &&
+           EndStreamDocument(&state, start);
+  EndArena();
+  bson_destroy(&state.batch);
+  return status;
+}
+
+EXTERN_C bool ConvertBSONToMxArray(const bson_t* input,
+                                   const decode_options_t* options,
+                                   mxArray** output) {
+  static const decode_options_t kDefaultOptions = BSONMEX_DECODE_OPTIONS_INIT;
+  bson_iter_t it;
+  if (!options)
+    options = &kDefaultOptions;
+  BeginArena();
+  if (bson_iter_init(&it, input))
+    *output = ConvertBSONIteratorToMxArray(&it, options);
+  else
+    *output = mxCreateDoubleMatrix(0, 0, mxREAL);
+  EndArena();
+  return *output != NULL;
+}
+
+/** Kind of a schema node.
+ */
+typedef enum {
+  SCHEMA_ANY = 0,       /* Decoded as usual. */
+  SCHEMA_NUMERIC,       /* Numeric or logical array. */
+  SCHEMA_CHAR,          /* String. */
+  SCHEMA_DOCUMENT,      /* Scalar struct. */
+  SCHEMA_DOCUMENT_ARRAY /* Struct row vector of an array of documents. */
+} schema_kind_t;
+
+/** Any size of a schema dimension.
+ */
+#define SCHEMA_ANY_SIZE ((mwSize)-1)
+
+/** Node of the schema.
+ */
+struct decode_schema_t {
+  schema_kind_t kind;
+  mxClassID class_id;
+  mwSize dims[2];      /* Size of a numeric array, or SCHEMA_ANY_SIZE. */
+  int num_fields;
+  const char** names;  /* Field names of a struct. */
+  decode_schema_t* fields;
+};
+
+/** State of the schema decoder.
+ */
+typedef struct schema_state_t {
+  const decode_options_t* options;
+  char path[256];     /* Dot-separated path of the current value. */
+  size_t path_length;
+  char** mismatches;
+  size_t num_mismatches;
+} schema_state_t;
+
+/** Parse a schema string of the class and the size.
+ */
+static bool ParseSchemaString(const mxArray* input, decode_schema_t* schema) {
+  static const struct {
+    const char* name;
+    mxClassID class_id;
+  } kClasses[] = {
+    {"double", mxDOUBLE_CLASS}, {"single", mxSINGLE_CLASS},
+    {"int8", mxINT8_CLASS}, {"uint8", mxUINT8_CLASS},
+    {"int16", mxINT16_CLASS}, {"uint16", mxUINT16_CLASS},
+    {"int32", mxINT32_CLASS}, {"uint32", mxUINT32_CLASS},
+    {"int64", mxINT64_CLASS}, {"uint64", mxUINT64_CLASS},
+    {"logical", mxLOGICAL_CLASS}
+  };
+  char value[64];
+  char* size;
+  size_t i;
+  int j;
+  if (mxGetString(input, value, sizeof(value)) != 0)
+    return false;
+  size = strchr(value, '[');
+  if (size)
+    *size++ = '\0';
+  if (strcmp(value, "any") == 0 || strcmp(value, "char") == 0) {
+    schema->kind = (value[0] == 'a') ? SCHEMA_ANY : SCHEMA_CHAR;
+    return size == NULL;
+  }
+  schema->kind = SCHEMA_NUMERIC;
+  schema->class_id = mxUNKNOWN_CLASS;
+  for (i = 0; i < sizeof(kClasses) / sizeof(kClasses[0]); ++i)
+    if (strcmp(value, kClasses[i].name) == 0)
+      schema->class_id = kClasses[i].class_id;
+  if (schema->class_id == mxUNKNOWN_CLASS)
+    return false;
+  schema->dims[0] = 1;
+  schema->dims[1] = 1;
+  if (!size)
+    return true;
+  /* The size is given as [RxC], where : is any size. */
+  for (j = 0; j < 2; ++j) {
+    char* end = size + 1;
+    if (*size == ':')
+      schema->dims[j] = SCHEMA_ANY_SIZE;
+    else
+      schema->dims[j] = (mwSize)strtoul(size, &end, 10);
+    if (end == size || *end != ((j == 0) ? 'x' : ']'))
+      return false;
+    size = end + 1;
+  }
+  return *size == '\0';
+}
+
+/** Parse a schema node.
+ */
+static bool ParseSchemaNode(const mxArray* input, decode_schema_t* schema) {
+  int i;
+  if (mxIsChar(input))
+    return ParseSchemaString(input, schema);
+  if (!mxIsStruct(input))
+    return false;
+  schema->kind = (mxGetNumberOfElements(input) == 1) ?
+      SCHEMA_DOCUMENT : SCHEMA_DOCUMENT_ARRAY;
+  schema->num_fields = mxGetNumberOfFields(input);
+  schema->names = (const char**)mxCalloc(schema->num_fields + 1,
+                                         sizeof(const char*));
+  schema->fields = (decode_schema_t*)mxCalloc(schema->num_fields + 1,
+                                              sizeof(decode_schema_t));
+  for (i = 0; i < schema->num_fields; ++i) {
+    const mxArray* field = (mxGetNumberOfElements(input)) ?
+        mxGetFieldByNumber(input, 0, i) : NULL;
+    schema->names[i] = mxGetFieldNameByNumber(input, i);
+    /* Fields of an empty struct array are decoded as usual. */
+    if (field && !ParseSchemaNode(field, &schema->fields[i]))
+      return false;
   }
-  mxFree(fields);
-  mxDestroyArray(*array);
-  *array = new_array;
+  return true;
 }
 
-/** Merge cell array of bson.datetime arrays to an N-D date array.
+/** Record the current path as a mismatch.
  */
-static void MergeDateArrays(mxArray** array) {
-  int size = mxGetNumberOfElements(*array);
-  mxArray* element = mxGetCell(*array, 0);
-  mwSize ndims = mxGetNumberOfDimensions(element);
-  const mwSize* dims = mxGetDimensions(element);
-  mxArray* new_array = NULL;
-  int dimension;
-  int i;
-  if (ndims < 2)
-    return;
-  dimension = (ndims == 2 && dims[0] == 1 && dims[1] == 1) ? 2 :
-              (ndims == 2 && dims[0] == 1) ? 1 : ndims;
-  mxArray** rhs = (mxArray**)mxMalloc(sizeof(mxArray*) * (1 + size));
-  rhs[0] = mxCreateDoubleScalar(2);
-  for (i = 0; i < size; ++i)
-    rhs[i + 1] = mxGetCell(*array, i);
-  mexCallMATLAB(1, &new_array, (1 + size), rhs, "cat");
-  mxDestroyArray(rhs[0]);
-  mxFree(rhs);
-  mxDestroyArray(*array);
-  *array = new_array;
+static void AddSchemaMismatch(schema_state_t* state) {
+  char* path = (char*)mxMalloc(state->path_length + 1);
+  memcpy(path, state->path, state->path_length);
+  path[state->path_length] = '\0';
+  state->mismatches = (char**)mxRealloc(
+      state->mismatches,
+      (state->num_mismatches + 1) * sizeof(char*));
+  state->mismatches[state->num_mismatches++] = path;
 }
 
-/** Try to merge cell array to N-D array in place.
- * @param array mxArray to be merged into N-D.
+/** Append a key to the current path.
+ * @return length of the path before the key.
  */
-static void TryMergeCellToNDArray(mxArray** array) {
-  int size = mxGetNumberOfElements(*array);
-  mxArray* element;
-  mxClassID class_id;
-  mwSize ndims;
-  const mwSize* dims;
-  bool mergeable = true;
-  int i;
-  if (!size)
-    return;
-  /* Get the type information about the first element. */
-  element = mxGetCell(*array, 0);
-  class_id = mxGetClassID(element);
-  ndims = mxGetNumberOfDimensions(element);
-  dims = mxGetDimensions(element);
-  /* Scan the rest of elements. */
-  for (i = 1; i < size; ++i) {
-    element = mxGetCell(*array, i);
-    mergeable &= class_id == mxGetClassID(element) &&
-        ndims == mxGetNumberOfDimensions(element) &&
-        memcmp(dims, mxGetDimensions(element), ndims * sizeof(mwSize)) == 0;
+static size_t PushSchemaPath(schema_state_t* state, const char* key) {
+  size_t length = state->path_length;
+  int size = snprintf(state->path + length,
+                      sizeof(state->path) - length,
+                      (length) ? ".%s" : "%s",
+                      key);
+  if (size > 0)
+    state->path_length = BSON_MIN(length + size, sizeof(state->path) - 1);
+  return length;
+}
+
+/** Create an empty value of the schema.
+ */
+static mxArray* CreateSchemaDefault(const decode_schema_t* schema) {
+  switch (schema->kind) {
+    case SCHEMA_NUMERIC:
+      return (schema->class_id == mxLOGICAL_CLASS) ?
+          mxCreateLogicalMatrix(0, 0) :
+          mxCreateNumericMatrix(0, 0, schema->class_id, mxREAL);
+    case SCHEMA_CHAR:
+      return mxCreateString("");
+    case SCHEMA_DOCUMENT: {
+      mxArray* element = mxCreateStructMatrix(1,
+                                              1,
+                                              schema->num_fields,
+                                              schema->names);
+      int i;
+      for (i = 0; i < schema->num_fields; ++i)
+        mxSetFieldByNumber(element,
+                           0,
+                           i,
+                           CreateSchemaDefault(&schema->fields[i]));
+      return element;
+    }
+    case SCHEMA_DOCUMENT_ARRAY:
+      return mxCreateStructMatrix(1, 0, schema->num_fields, schema->names);
+    case SCHEMA_ANY:
+    default:
+      return mxCreateDoubleMatrix(0, 0, mxREAL);
   }
-  if (!mergeable)
-    return;
+}
+
+/** Check if the integer is in the range of the class.
+ */
+static bool IsIntegerInClass(int64_t value, mxClassID class_id) {
   switch (class_id) {
-    case mxDOUBLE_CLASS:
-    case mxLOGICAL_CLASS:
-      MergeNumericArrays(array);
-      break;
-    /*case mxCHAR_CLASS: Let's not merge strings to an N-D array. */
-    case mxCELL_CLASS:
-      MergeCellArrays(array);
-      break;
-    case mxSTRUCT_CLASS:
-      MergeStructArrays(array);
-      break;
+    case mxINT8_CLASS:
+      return value >= INT8_MIN && value <= INT8_MAX;
+    case mxUINT8_CLASS:
+      return value >= 0 && value <= UINT8_MAX;
+    case mxINT16_CLASS:
+      return value >= INT16_MIN && value <= INT16_MAX;
+    case mxUINT16_CLASS:
+      return value >= 0 && value <= UINT16_MAX;
+    case mxINT32_CLASS:
+      return value >= INT32_MIN && value <= INT32_MAX;
+    case mxUINT32_CLASS:
+      return value >= 0 && value <= UINT32_MAX;
+    case mxUINT64_CLASS:
+      return value >= 0;
     default:
-      if (mxIsClass(element, "bson.datetime"))
-        MergeDateArrays(array);
-      break;
+      return true;
   }
 }
 
-/** Convert bson iterator to mxArray*. The iterator must be pointing to a BSON
- * array.
- * @param it bson iterator to convert to mxArray.
- * @param output mxArray to be created.
- * @return Newly allocated mxArray, or NULL if unsuccessful.
+/** Store a BSON number at the index of the output data.
+ * @return false if the value does not fit the class.
  */
-static mxArray* ConvertBSONIteratorToMxArray(bson_iter_t* it) {
-  mxArray* element = NULL;
-  bson_iter_t iterator_copy = *it;
-  /* Check the array type. */
-  int object_size, array_type;
-  const char** keys = NULL;
-  CheckBSONObject(&iterator_copy, &object_size, &keys, &array_type);
-  if (!keys)
-    return NULL;
-  /* Convert. */
-  switch (array_type) {
-    case mxDOUBLE_CLASS:
-      element = ConvertBSONArrayToDoubleArray(it, object_size);
-      break;
-    case mxINT32_CLASS:
-      element = ConvertBSONArrayToIntegerArray(it, object_size);
-      break;
-    case mxINT64_CLASS:
-      element = ConvertBSONArrayToLongArray(it, object_size);
-      break;
-    case mxLOGICAL_CLASS:
-      element = ConvertBSONArrayToLogicalArray(it, object_size);
-      break;
-    case mxCHAR_CLASS:
-    case mxUINT8_CLASS:
-      if (object_size == 1)
-        element = ConvertNextToMxArray(it);
-      else
-        element = ConvertBSONArrayToCellArray(it, object_size);
+static bool SetSchemaNumber(const bson_iter_t* it,
+                            mxClassID class_id,
+                            void* data,
+                            size_t index) {
+  bool is_float = (class_id == mxDOUBLE_CLASS ||
+                   class_id == mxSINGLE_CLASS);
+  int64_t long_value;
+  double value;
+  switch (bson_iter_type(it)) {
+    case BSON_TYPE_BOOL:
+      if (class_id != mxLOGICAL_CLASS)
+        return false;
+      ((mxLogical*)data)[index] = bson_iter_bool(it);
+      return true;
+    case BSON_TYPE_DOUBLE:
+      value = bson_iter_double(it);
+      if (is_float) {
+        SetNumericValue(data, class_id, index, 0, value);
+        return true;
+      }
+      if (!(value >= -9.2e18 && value <= 9.2e18))
+        return false;
+      long_value = (int64_t)value;
+      if ((double)long_value != value)
+        return false;
       break;
-    case mxCELL_CLASS:
-      element = ConvertBSONArrayToCellArray(it, object_size);
+    case BSON_TYPE_INT32:
+      long_value = bson_iter_int32(it);
+      value = (double)long_value;
       break;
-    case mxSTRUCT_CLASS:
-      element = ConvertBSONArrayToStructArray(it, object_size, keys);
+    case BSON_TYPE_INT64:
+      long_value = bson_iter_int64(it);
+      value = (double)long_value;
       break;
+    case BSON_TYPE_NULL:
+      if (!is_float)
+        return false;
+      SetNumericValue(data, class_id, index, 0, mxGetNaN());
+      return true;
     default:
-      break;
+      return false;
   }
-  mxFree(keys);
-  /* Merge a cell array to N-D array if possible. */
-  if (array_type == mxCELL_CLASS)
-    TryMergeCellToNDArray(&element);
-  return element;
+  if (class_id == mxLOGICAL_CLASS || !IsIntegerInClass(long_value, class_id))
+    return false;
+  SetNumericValue(data, class_id, index, long_value, value);
+  return true;
 }
 
-/** Proceed to next and Convert a BSON value.
+/** Count elements of a BSON array.
  */
-static mxArray* ConvertNextToMxArray(bson_iter_t* it) {
-  mxArray* element = NULL;
-  bson_type_t type;
-  if (!bson_iter_next(it))
-    return NULL;
-  type = bson_iter_type(it);
-  switch (type) {
-    case BSON_TYPE_EOD:
-      break;
-    case BSON_TYPE_DOUBLE:
-      element = mxCreateDoubleScalar(bson_iter_double(it));
+static size_t CountSchemaElements(const bson_iter_t* it) {
+  bson_iter_t element;
+  size_t size = 0;
+  if (!bson_iter_recurse(it, &element))
+    return 0;
+  while (bson_iter_next(&element))
+    ++size;
+  return size;
+}
+
+/** Check if the size fits the schema, turning a vector to the orientation
+ * of the schema.
+ */
+static bool MatchSchemaSize(const decode_schema_t* schema,
+                            size_t* rows,
+                            size_t* columns) {
+  /* Empty values take the fixed size of the schema, if it is empty. */
+  if (*rows == 0 || *columns == 0) {
+    *rows = (schema->dims[0] == SCHEMA_ANY_SIZE) ? 0 : schema->dims[0];
+    *columns = (schema->dims[1] == SCHEMA_ANY_SIZE) ? 0 : schema->dims[1];
+    return *rows == 0 || *columns == 0;
+  }
+  if ((schema->dims[0] == SCHEMA_ANY_SIZE || schema->dims[0] == *rows) &&
+      (schema->dims[1] == SCHEMA_ANY_SIZE || schema->dims[1] == *columns))
+    return true;
+  if (*rows == 1 &&
+      (schema->dims[0] == SCHEMA_ANY_SIZE || schema->dims[0] == *columns) &&
+      schema->dims[1] == 1) {
+    *rows = *columns;
+    *columns = 1;
+    return true;
+  }
+  return false;
+}
+
+/** Decode a number, a vector, or a matrix of rows into the class of the
+ * schema.
+ */
+static mxArray* ConvertSchemaNumeric(const bson_iter_t* it,
+                                     const decode_schema_t* schema,
+                                     const decode_options_t* options) {
+  size_t rows = 1, columns = 1, i, j;
+  bool is_matrix = false;
+  bson_iter_t row, element;
+  mxArray* output;
+  void* data;
+  switch (bson_iter_type(it)) {
+    case BSON_TYPE_NULL:
+      rows = columns = 0;
       break;
-    case BSON_TYPE_UTF8:
-    case BSON_TYPE_SYMBOL: {
-      uint32_t length = 0;
-      const char* value = bson_iter_utf8(it, &length);
-      element = mxCreateString(value);
+    case BSON_TYPE_ARRAY:
+      columns = CountSchemaElements(it);
+      if (columns && bson_iter_recurse(it, &row) && bson_iter_next(&row) &&
+          BSON_ITER_HOLDS_ARRAY(&row)) {
+        is_matrix = true;
+        rows = columns;
+        columns = CountSchemaElements(&row);
+      }
+      else if (columns == 0)
+        rows = 0;
       break;
+    case BSON_TYPE_BINARY: {
+      /* Packed arrays are decoded as usual, and must have the class. */
+      mxArray* element = ConvertValueToMxArray(it, options);
+      size_t element_rows, element_columns;
+      if (!element)
+        return NULL;
+      element_rows = mxGetM(element);
+      element_columns = mxGetN(element);
+      if (mxGetClassID(element) == schema->class_id &&
+          mxGetNumberOfDimensions(element) == 2 &&
+          !mxIsComplex(element) &&
+          MatchSchemaSize(schema, &element_rows, &element_columns)) {
+        mxSetM(element, element_rows);
+        mxSetN(element, element_columns);
+        return element;
+      }
+      mxDestroyArray(element);
+      return NULL;
     }
-    case BSON_TYPE_DOCUMENT:
-    case BSON_TYPE_ARRAY: {
-      bson_iter_t sub_iterator;
-      bson_iter_recurse(it, &sub_iterator);
-      element = ConvertBSONIteratorToMxArray(&sub_iterator);
+    default:
       break;
+  }
+  if (!MatchSchemaSize(schema, &rows, &columns))
+    return NULL;
+  output = (schema->class_id == mxLOGICAL_CLASS) ?
+      mxCreateLogicalMatrix(rows, columns) :
+      mxCreateNumericMatrix(rows, columns, schema->class_id, mxREAL);
+  data = mxGetData(output);
+  if (rows * columns == 0)
+    return output;
+  if (!BSON_ITER_HOLDS_ARRAY(it)) {
+    if (SetSchemaNumber(it, schema->class_id, data, 0))
+      return output;
+    mxDestroyArray(output);
+    return NULL;
+  }
+  /* Matrices are arrays of rows, and stored in column-major order. */
+  bson_iter_recurse(it, &row);
+  for (i = 0; bson_iter_next(&row); ++i) {
+    bool status;
+    if (is_matrix) {
+      status = BSON_ITER_HOLDS_ARRAY(&row) &&
+               bson_iter_recurse(&row, &element);
+      for (j = 0; status && j < columns; ++j)
+        status = bson_iter_next(&element) &&
+                 SetSchemaNumber(&element,
+                                 schema->class_id,
+                                 data,
+                                 j * rows + i);
+      status = status && !bson_iter_next(&element);
     }
-    case BSON_TYPE_BINARY: {
-      bson_subtype_t subtype;
-      uint32_t element_size;
-      const uint8_t *binary;
-      bson_iter_binary(it, &subtype, &element_size, &binary);
-      element = mxCreateNumericMatrix(1,
-                                      element_size,
-                                      mxUINT8_CLASS,
-                                      mxREAL);
-      memcpy(mxGetData(element), binary, element_size);
-      break;
+    else
+      status = SetSchemaNumber(&row, schema->class_id, data, i);
+    if (!status) {
+      mxDestroyArray(output);
+      return NULL;
     }
-    case BSON_TYPE_UNDEFINED:
-      element = mxCreateDoubleScalar(mxGetNaN());
-      break;
-    case BSON_TYPE_OID: {
-      char oid_string[25];
-      bson_oid_to_string(bson_iter_oid(it), oid_string);
-      element = mxCreateString(oid_string);
-      break;
+  }
+  return output;
+}
+
+static mxArray* ConvertSchemaValue(schema_state_t* state,
+                                   const bson_iter_t* it,
+                                   const decode_schema_t* schema);
+
+/** Decode the elements of a document into the struct element. Sanitized
+ * keys are looked up from the field after the last one, so documents in the
+ * schema order are read in one pass. Keys out of the schema are skipped.
+ * @param element iterator over the elements of the document.
+ */
+static void ConvertSchemaFields(schema_state_t* state,
+                                bson_iter_t* element,
+                                const decode_schema_t* schema,
+                                mxArray* output,
+                                size_t index) {
+  int next = 0;
+  int i;
+  while (bson_iter_next(element)) {
+    const char* key = bson_iter_key(element);
+    char name[64];
+    /* Keys match the field names as they are decoded without the schema. */
+    SanitizeKey(key, name);
+    for (i = 0; i < schema->num_fields; ++i) {
+      int field = (next + i) % schema->num_fields;
+      if (strcmp(name, schema->names[field]) == 0) {
+        if (!mxGetFieldByNumber(output, index, field)) {
+          size_t length = PushSchemaPath(state, key);
+          mxSetFieldByNumber(output,
+                             index,
+                             field,
+                             ConvertSchemaValue(state,
+                                                element,
+                                                &schema->fields[field]));
+          state->path_length = length;
+        }
+        next = field + 1;
+        break;
+      }
     }
-    case BSON_TYPE_BOOL:
-      element = mxCreateLogicalScalar(bson_iter_bool(it));
-      break;
-    case BSON_TYPE_DATE_TIME: {
-      int64_t date_value = bson_iter_date_time(it);
-      mxArray* date_number = mxCreateDoubleScalar(
-          ((double)date_value / 86400.0) + 719529);
-      mexCallMATLAB(1, &element, 1, &date_number, "bson.datetime");
-      mxDestroyArray(date_number);
-      break;
+  }
+  /* Missing fields are mismatches. */
+  for (i = 0; i < schema->num_fields; ++i) {
+    if (!mxGetFieldByNumber(output, index, i)) {
+      size_t length = PushSchemaPath(state, schema->names[i]);
+      AddSchemaMismatch(state);
+      mxSetFieldByNumber(output,
+                         index,
+                         i,
+                         CreateSchemaDefault(&schema->fields[i]));
+      state->path_length = length;
     }
-    case BSON_TYPE_NULL:
-    case BSON_TYPE_DBPOINTER:
-      element = mxCreateDoubleMatrix(0, 0, mxREAL);
-      break;
-    case BSON_TYPE_REGEX:
-      element = mxCreateString(bson_iter_regex(it, NULL));
+  }
+}
+
+/** Decode a value by the schema, recording a mismatch if it does not fit.
+ */
+static mxArray* ConvertSchemaValue(schema_state_t* state,
+                                   const bson_iter_t* it,
+                                   const decode_schema_t* schema) {
+  mxArray* output = NULL;
+  switch (schema->kind) {
+    case SCHEMA_ANY:
+      output = ConvertValueToMxArray(it, state->options);
       break;
-    case BSON_TYPE_CODE:
-    case BSON_TYPE_CODEWSCOPE: {
-      uint32_t length;
-      element = mxCreateString(bson_iter_code(it, &length));
+    case SCHEMA_NUMERIC:
+      output = ConvertSchemaNumeric(it, schema, state->options);
       break;
-    }
-    case BSON_TYPE_INT32:
-      element = mxCreateDoubleScalar(bson_iter_int32(it));
+    case SCHEMA_CHAR:
+      if (bson_iter_type(it) == BSON_TYPE_UTF8 ||
+          bson_iter_type(it) == BSON_TYPE_SYMBOL)
+        output = ConvertValueToMxArray(it, state->options);
+      else if (bson_iter_type(it) == BSON_TYPE_NULL)
+        output = mxCreateString("");
       break;
-    case BSON_TYPE_TIMESTAMP: {
-      time_t time_value = bson_iter_time_t(it);
-      mxArray* date_number = mxCreateDoubleScalar(
-          ((double)time_value / 86400.0) + 719529);
-      mexCallMATLAB(1, &element, 1, &date_number, "bson.datetime");
-      mxDestroyArray(date_number);
+    case SCHEMA_DOCUMENT: {
+      bson_iter_t element;
+      if (!BSON_ITER_HOLDS_DOCUMENT(it) || !bson_iter_recurse(it, &element))
+        break;
+      output = mxCreateStructMatrix(1, 1, schema->num_fields, schema->names);
+      ConvertSchemaFields(state, &element, schema, output, 0);
       break;
     }
-    case BSON_TYPE_INT64:
-      element = mxCreateNumericMatrix(1, 1, mxINT64_CLASS, mxREAL);
-      *(int64_t*)mxGetData(element) = bson_iter_int64(it);
-      break;
-    case BSON_TYPE_MAXKEY:
-      element = mxCreateDoubleScalar(mxGetInf());
-      break;
-    case BSON_TYPE_MINKEY:
-      element = mxCreateDoubleScalar(-mxGetInf());
+    case SCHEMA_DOCUMENT_ARRAY: {
+      bson_iter_t element, fields;
+      size_t i;
+      if (bson_iter_type(it) == BSON_TYPE_NULL) {
+        output = CreateSchemaDefault(schema);
+        break;
+      }
+      if (!BSON_ITER_HOLDS_ARRAY(it) || !bson_iter_recurse(it, &element))
+        break;
+      output = mxCreateStructMatrix(1,
+                                    CountSchemaElements(it),
+                                    schema->num_fields,
+                                    schema->names);
+      for (i = 0; bson_iter_next(&element); ++i) {
+        size_t length = PushSchemaPath(state, bson_iter_key(&element));
+        if (BSON_ITER_HOLDS_DOCUMENT(&element) &&
+            bson_iter_recurse(&element, &fields))
+          ConvertSchemaFields(state, &fields, schema, output, i);
+        else {
+          int j;
+          AddSchemaMismatch(state);
+          for (j = 0; j < schema->num_fields; ++j)
+            mxSetFieldByNumber(output,
+                               i,
+                               j,
+                               CreateSchemaDefault(&schema->fields[j]));
+        }
+        state->path_length = length;
+      }
       break;
+    }
     default:
       break;
   }
-  return element;
+  if (!output) {
+    AddSchemaMismatch(state);
+    output = CreateSchemaDefault(schema);
+  }
+  return output;
 }
 
-EXTERN_C bool ConvertMxArrayToBSON(const mxArray* input, bson_t* output) {
-  bson_init(output);
-  if (!ConvertArrayToBSON(input, NULL, output)) {
-    bson_destroy(output);
-    return false;
+EXTERN_C decode_schema_t* CreateDecodeSchema(const mxArray* input) {
+  decode_schema_t* schema;
+  if (!mxIsStruct(input) || mxGetNumberOfElements(input) != 1)
+    return NULL;
+  schema = (decode_schema_t*)mxCalloc(1, sizeof(decode_schema_t));
+  if (!ParseSchemaNode(input, schema)) {
+    DestroyDecodeSchema(schema);
+    return NULL;
   }
-  return true;
+  return schema;
+}
+
+/** Release the fields of a schema node.
+ */
+static void DestroySchemaNode(decode_schema_t* schema) {
+  int i;
+  for (i = 0; schema->fields && i < schema->num_fields; ++i)
+    DestroySchemaNode(&schema->fields[i]);
+  mxFree(schema->fields);
+  mxFree((void*)schema->names);
+}
+
+EXTERN_C void DestroyDecodeSchema(decode_schema_t* schema) {
+  if (!schema)
+    return;
+  DestroySchemaNode(schema);
+  mxFree(schema);
 }
 
-EXTERN_C bool ConvertBSONToMxArray(const bson_t* input, mxArray** output) {
+EXTERN_C bool ConvertBSONToMxArrayWithSchema(const bson_t* input,
+                                             const decode_schema_t* schema,
+                                             const decode_options_t* options,
+                                             mxArray** output,
+                                             mxArray** mismatches) {
+  static const decode_options_t kDefaultOptions = BSONMEX_DECODE_OPTIONS_INIT;
+  schema_state_t state;
   bson_iter_t it;
+  size_t i;
+  if (!options)
+    options = &kDefaultOptions;
+  state.options = options;
+  state.path_length = 0;
+  state.mismatches = NULL;
+  state.num_mismatches = 0;
+  *output = mxCreateStructMatrix(1, 1, schema->num_fields, schema->names);
+  BeginArena();
   if (bson_iter_init(&it, input))
-    *output = ConvertBSONIteratorToMxArray(&it);
-  else
-    *output = mxCreateDoubleMatrix(0, 0, mxREAL);
+    ConvertSchemaFields(&state, &it, schema, *output, 0);
+  EndArena();
+  *mismatches = mxCreateCellMatrix(1, state.num_mismatches);
+  for (i = 0; i < state.num_mismatches; ++i) {
+    mxSetCell(*mismatches, i, mxCreateString(state.mismatches[i]));
+    mxFree(state.mismatches[i]);
+  }
+  mxFree(state.mismatches);
+  return true;
+}
+
+EXTERN_C bool ConvertBSONValueToMxArray(const bson_iter_t* input,
+                                        const decode_options_t* options,
+                                        mxArray** output) {
+  static const decode_options_t kDefaultOptions = BSONMEX_DECODE_OPTIONS_INIT;
+  if (!options)
+    options = &kDefaultOptions;
+  BeginArena();
+  *output = ConvertValueToMxArray(input, options);
+  EndArena();
+  return *output != NULL;
+}
+
+EXTERN_C bool ConvertJSONToMxArray(char* input,
+                                   size_t length,
+                                   const decode_options_t* options,
+                                   size_t* error_offset,
+                                   mxArray** output) {
+  static const decode_options_t kDefaultOptions = BSONMEX_DECODE_OPTIONS_INIT;
+  json_tape_t tape;
+  if (!options)
+    options = &kDefaultOptions;
+  *output = NULL;
+  if (!ParseJSONTape(input, length, &tape, error_offset))
+    return false;
+  BeginArena();
+  *output = ConvertJSONNodeToMxArray(&tape, 0, options);
+  EndArena();
+  DestroyJSONTape(&tape);
   return *output != NULL;
-}
\ No newline at end of file
+}
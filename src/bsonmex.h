@@ -10,19 +10,212 @@
 #include <matrix.h>
 #include <stdbool.h>
 
+/** Store the data of a numeric or logical array out of the document.
+ * @param input mxArray to store.
+ * @param context chunk_context of the options.
+ * @param offset location of the stored data.
+ * @return true if success.
+ */
+typedef bool (*chunk_writer_t)(const mxArray* input,
+                               void* context,
+                               uint64_t* offset);
+
+/** Load the data of an array stored out of the document.
+ * @param offset location of the stored data.
+ * @param chunk_size chunk size used to store the data.
+ * @param data output buffer of the array data.
+ * @param size size of the array data in bytes.
+ * @param context chunk_context of the options.
+ * @return true if success.
+ */
+typedef bool (*chunk_reader_t)(uint64_t offset,
+                               size_t chunk_size,
+                               uint8_t* data,
+                               size_t size,
+                               void* context);
+
+/** Compiled layout of a struct for the encoder.
+ */
+typedef struct encode_plan_t encode_plan_t;
+
+/** Options to change the behavior of the encoder.
+ */
+typedef struct encode_options_t {
+  bool pack_logical; /* Pack logical arrays into a bitset binary. */
+  bool delta_encode; /* Pack int64 and date arrays into delta varints. */
+  bool compress;     /* Compress packed payloads by zlib. */
+  size_t compress_threshold; /* Minimum payload size to compress. */
+  size_t chunk_size;         /* Size of a chunk of chunked arrays. */
+  size_t chunk_threshold;    /* Minimum array size to store in chunks. */
+  chunk_writer_t chunk_writer; /* Chunk storage, or NULL to disable. */
+  void* chunk_context;
+  const encode_plan_t* plan; /* Layout of the input struct, or NULL. */
+  size_t max_depth;          /* Maximum nesting depth, or 0. */
+} encode_options_t;
+
+/** Default encoder options.
+ */
+#define BSONMEX_ENCODE_OPTIONS_INIT \
+    {false, false, false, 100000, 16777216, 1073741824, NULL, NULL, NULL, 0}
+
+/** Maximum nesting depth of the converters that recurse on the call stack,
+ * used when the options do not limit the depth.
+ */
+#define BSONMEX_RECURSIVE_MAX_DEPTH 1000
+
+/** Class of decoded BSON integers.
+ */
+typedef enum {
+  BSONMEX_INTEGER_AUTO = 0, /* double scalars, int32 or int64 arrays. */
+  BSONMEX_INTEGER_NATIVE,   /* int32 or int64 for both scalars and arrays. */
+  BSONMEX_INTEGER_SMALLEST  /* Smallest integer class holding the values. */
+} integer_class_t;
+
+/** Options to change the behavior of the decoder.
+ */
+typedef struct decode_options_t {
+  integer_class_t integer_class;
+  mxClassID float_class; /* mxDOUBLE_CLASS or mxSINGLE_CLASS. */
+  chunk_reader_t chunk_reader; /* Chunk storage, or NULL to disable. */
+  void* chunk_context;
+  size_t max_depth; /* Maximum nesting depth, or 0. */
+} decode_options_t;
+
+/** Default decoder options.
+ */
+#define BSONMEX_DECODE_OPTIONS_INIT \
+    {BSONMEX_INTEGER_AUTO, mxDOUBLE_CLASS, NULL, NULL, 0}
+
+/** Register a function to call when the MEX file is cleared. Unlike
+ * mexAtExit, which keeps only the last function, every registered function
+ * is called once.
+ * @param handler function to call.
+ */
+EXTERN_C void AddExitHandler(void (*handler)(void));
 /** Convert mxArray* to bson.
  * @param input mxArray to convert to bson.
- * @param flags options to change the behavior.
+ * @param options encoder options, or NULL for the default. If the options
+ *                have a plan, the input must be a struct matching the plan.
  * @param output bson object to be created. Caller is responsible for calling
  *               bson_destroy() after use. 
  * @return true if success.
  */
-EXTERN_C bool ConvertMxArrayToBSON(const mxArray* input, bson_t* output);
+EXTERN_C bool ConvertMxArrayToBSON(const mxArray* input,
+                                   const encode_options_t* options,
+                                   bson_t* output);
+/** Convert mxArray* to bson, reusing the buffer of an initialized document.
+ * The document is emptied by bson_reinit() first.
+ * @param input mxArray to convert to bson.
+ * @param options encoder options, or NULL for the default.
+ * @param output initialized bson object. Caller must destroy it on failure.
+ * @return true if success.
+ */
+EXTERN_C bool ConvertMxArrayToReusedBSON(const mxArray* input,
+                                         const encode_options_t* options,
+                                         bson_t* output);
+/** Compile the layout of a template struct. Keys are kept as given, and
+ * each field records the class and the shape that the encoder can append
+ * without conversion. Nested scalar structs are compiled, too.
+ * @param input template struct.
+ * @return plan, or NULL if the input is not a struct. Caller must call
+ *         DestroyEncodePlan() after use.
+ */
+EXTERN_C encode_plan_t* CreateEncodePlan(const mxArray* input);
+/** Release the plan.
+ */
+EXTERN_C void DestroyEncodePlan(encode_plan_t* plan);
+/** Check if the fields of the struct are the fields of the plan.
+ */
+EXTERN_C bool MatchEncodePlan(const mxArray* input, const encode_plan_t* plan);
+/** Output stream of the streaming encoder.
+ */
+typedef struct stream_writer_t {
+  /* Append data to the end of the stream. */
+  bool (*write)(const uint8_t* data, size_t size, void* context);
+  /* Overwrite data at the position from the start of the stream. */
+  bool (*patch)(uint64_t position,
+                const uint8_t* data,
+                size_t size,
+                void* context);
+  size_t buffer_size; /* Size of elements to batch before writing. */
+  void* context;
+} stream_writer_t;
+
+/** Convert mxArray* to bson written to a stream. Documents and arrays are
+ * written as they are visited, and their lengths are patched when they end.
+ * The depth is limited to BSONMEX_RECURSIVE_MAX_DEPTH unless the options
+ * give a limit.
+ * @param input mxArray to convert to bson.
+ * @param options encoder options, or NULL for the default.
+ * @param output stream to write.
+ * @return true if success.
+ */
+EXTERN_C bool ConvertMxArrayToBSONStream(const mxArray* input,
+                                         const encode_options_t* options,
+                                         const stream_writer_t* output);
 /** Convert bson to mxArray*.
  * @param input bson object to convert to mxArray.
+ * @param options decoder options, or NULL for the default.
+ * @param output mxArray to be created.
+ * @return true if success.
+ */
+EXTERN_C bool ConvertBSONToMxArray(const bson_t* input,
+                                   const decode_options_t* options,
+                                   mxArray** output);
+/** Convert the bson value at the iterator to mxArray*.
+ * @param input bson iterator pointing to the value to convert.
+ * @param options decoder options, or NULL for the default.
+ * @param output mxArray to be created.
+ * @return true if success.
+ */
+EXTERN_C bool ConvertBSONValueToMxArray(const bson_iter_t* input,
+                                        const decode_options_t* options,
+                                        mxArray** output);
+/** Expected classes and shapes of a decoded document.
+ */
+typedef struct decode_schema_t decode_schema_t;
+
+/** Create a schema from a struct. Each field is a struct of a nested
+ * document, a struct array of an array of documents, or a string of the
+ * class and the size, such as 'double', 'int32[1x:]', 'char', or 'any'.
+ * @param input schema struct. Field names are kept by reference, so the
+ *              input must outlive the schema.
+ * @return schema, or NULL if invalid. Caller must call DestroyDecodeSchema()
+ *         after use.
+ */
+EXTERN_C decode_schema_t* CreateDecodeSchema(const mxArray* input);
+/** Release the schema.
+ */
+EXTERN_C void DestroyDecodeSchema(decode_schema_t* schema);
+/** Convert bson to mxArray* of the classes and shapes of the schema, without
+ * inferring them from the values. A value that does not fit the schema is
+ * decoded as an empty value of the class.
+ * @param input bson object to convert to mxArray.
+ * @param schema schema of the document.
+ * @param options decoder options, or NULL for the default.
+ * @param output mxArray to be created.
+ * @param mismatches cell array of the paths of values not fitting the schema.
+ * @return true if success.
+ */
+EXTERN_C bool ConvertBSONToMxArrayWithSchema(const bson_t* input,
+                                             const decode_schema_t* schema,
+                                             const decode_options_t* options,
+                                             mxArray** output,
+                                             mxArray** mismatches);
+/** Convert JSON text to mxArray* directly, inferring arrays and structs as
+ * ConvertBSONToMxArray does for the BSON that libbson would create from the
+ * text.
+ * @param input null-terminated JSON text. Strings are unescaped in place.
+ * @param length length of the text.
+ * @param options decoder options, or NULL for the default.
+ * @param error_offset position of a syntax error, if not NULL.
  * @param output mxArray to be created.
  * @return true if success.
  */
-EXTERN_C bool ConvertBSONToMxArray(const bson_t* input, mxArray** output);
+EXTERN_C bool ConvertJSONToMxArray(char* input,
+                                   size_t length,
+                                   const decode_options_t* options,
+                                   size_t* error_offset,
+                                   mxArray** output);
 
 #endif /* __BSONMEX_H__ */
@@ -0,0 +1,1009 @@
+/** Packed array codec implementation.
+ *
+ * Kota Yamaguchi 2013
+ */
+
+#include "bsonpack.h"
+#include <mex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define PACK_HEADER_SIZE 8
+#define PACK_MAX_DIMS 255
+
+#if defined(MX_HAS_INTERLEAVED_COMPLEX) && MX_HAS_INTERLEAVED_COMPLEX
+#define PACK_INTERLEAVED_COMPLEX 1
+#else
+#define PACK_INTERLEAVED_COMPLEX 0
+#endif
+
+/** Decoded header of the packed binary.
+ */
+typedef struct pack_header_t {
+  pack_codec_t codec;
+  int flags;
+  mxClassID class_id;
+  mwSize ndims;
+  mwSize dims[PACK_MAX_DIMS];
+  size_t num_elements;
+  size_t raw_size;
+  const uint8_t* payload;
+  size_t payload_length;
+} pack_header_t;
+
+/** Table of packed class to mxClassID, indexed by pack_class_t.
+ */
+static const mxClassID kPackClassTable[] = {
+  mxUNKNOWN_CLASS,
+  mxLOGICAL_CLASS,
+  mxDOUBLE_CLASS,
+  mxSINGLE_CLASS,
+  mxINT8_CLASS,
+  mxUINT8_CLASS,
+  mxINT16_CLASS,
+  mxUINT16_CLASS,
+  mxINT32_CLASS,
+  mxUINT32_CLASS,
+  mxINT64_CLASS,
+  mxUINT64_CLASS,
+  mxOBJECT_CLASS
+};
+
+/** Get the packed class of mxArray, or 0 if not supported.
+ */
+static int GetPackClass(const mxArray* input) {
+  mxClassID class_id = mxGetClassID(input);
+  int i;
+  if (class_id == mxOBJECT_CLASS)
+    return (mxIsClass(input, "bson.datetime")) ? PACK_CLASS_DATETIME : 0;
+  for (i = 1; i < (int)(sizeof(kPackClassTable) / sizeof(mxClassID)); ++i)
+    if (kPackClassTable[i] == class_id)
+      return i;
+  return 0;
+}
+
+/** Get the size of a real value of the class.
+ */
+static size_t GetRealElementSize(mxClassID class_id) {
+  switch (class_id) {
+    case mxDOUBLE_CLASS:
+    case mxINT64_CLASS:
+    case mxUINT64_CLASS:
+      return 8;
+    case mxSINGLE_CLASS:
+    case mxINT32_CLASS:
+    case mxUINT32_CLASS:
+      return 4;
+    case mxINT16_CLASS:
+    case mxUINT16_CLASS:
+      return 2;
+    default:
+      return 1;
+  }
+}
+
+/** Get the size of a value of mxArray, including the imaginary part.
+ */
+static size_t GetValueSize(const mxArray* input) {
+  return GetRealElementSize(mxGetClassID(input)) *
+         ((mxIsComplex(input)) ? 2 : 1);
+}
+
+/** Copy real and imaginary parts of separate complex storage in interleaved
+ * order, typed so that the loop is vectorized by the compiler.
+ */
+#define INTERLEAVE_COMPLEX(type, real, imag, output, count) \
+  do { \
+    size_t i; \
+    for (i = 0; i < (count); ++i) { \
+      memcpy((output) + (2 * i) * sizeof(type), \
+             (real) + i * sizeof(type), \
+             sizeof(type)); \
+      memcpy((output) + (2 * i + 1) * sizeof(type), \
+             (imag) + i * sizeof(type), \
+             sizeof(type)); \
+    } \
+  } while (0)
+
+/** Copy interleaved complex values into separate complex storage.
+ */
+#define DEINTERLEAVE_COMPLEX(type, input, real, imag, count) \
+  do { \
+    size_t i; \
+    for (i = 0; i < (count); ++i) { \
+      memcpy((real) + i * sizeof(type), \
+             (input) + (2 * i) * sizeof(type), \
+             sizeof(type)); \
+      memcpy((imag) + i * sizeof(type), \
+             (input) + (2 * i + 1) * sizeof(type), \
+             sizeof(type)); \
+    } \
+  } while (0)
+
+/** Write the first count complex values of mxArray in interleaved order.
+ * Interleaved complex storage is a single copy.
+ * @return pointer to the end of the output.
+ */
+static uint8_t* InterleaveComplex(const mxArray* input,
+                                  size_t count,
+                                  uint8_t* output) {
+  size_t size = GetRealElementSize(mxGetClassID(input));
+#if PACK_INTERLEAVED_COMPLEX
+  memcpy(output, mxGetData(input), 2 * size * count);
+#else
+  const uint8_t* real = (const uint8_t*)mxGetData(input);
+  const uint8_t* imag = (const uint8_t*)mxGetImagData(input);
+  switch (size) {
+    case 8:
+      INTERLEAVE_COMPLEX(uint64_t, real, imag, output, count);
+      break;
+    case 4:
+      INTERLEAVE_COMPLEX(uint32_t, real, imag, output, count);
+      break;
+    case 2:
+      INTERLEAVE_COMPLEX(uint16_t, real, imag, output, count);
+      break;
+    default:
+      INTERLEAVE_COMPLEX(uint8_t, real, imag, output, count);
+      break;
+  }
+#endif
+  return output + 2 * size * count;
+}
+
+/** Read count interleaved complex values into a complex mxArray.
+ */
+static void DeinterleaveComplex(const uint8_t* input,
+                                size_t count,
+                                mxArray* output) {
+  size_t size = GetRealElementSize(mxGetClassID(output));
+#if PACK_INTERLEAVED_COMPLEX
+  memcpy(mxGetData(output), input, 2 * size * count);
+#else
+  uint8_t* real = (uint8_t*)mxGetData(output);
+  uint8_t* imag = (uint8_t*)mxGetImagData(output);
+  switch (size) {
+    case 8:
+      DEINTERLEAVE_COMPLEX(uint64_t, input, real, imag, count);
+      break;
+    case 4:
+      DEINTERLEAVE_COMPLEX(uint32_t, input, real, imag, count);
+      break;
+    case 2:
+      DEINTERLEAVE_COMPLEX(uint16_t, input, real, imag, count);
+      break;
+    default:
+      DEINTERLEAVE_COMPLEX(uint8_t, input, real, imag, count);
+      break;
+  }
+#endif
+}
+
+/** Write a little-endian uint64 value.
+ */
+static void WriteUInt64(uint8_t* output, uint64_t value) {
+  value = BSON_UINT64_TO_LE(value);
+  memcpy(output, &value, sizeof(uint64_t));
+}
+
+/** Read a little-endian uint64 value.
+ */
+static uint64_t ReadUInt64(const uint8_t* input) {
+  uint64_t value;
+  memcpy(&value, input, sizeof(uint64_t));
+  return BSON_UINT64_FROM_LE(value);
+}
+
+/** Get the size of the header for the mxArray.
+ */
+static size_t GetPackHeaderSize(const mxArray* input) {
+  return PACK_HEADER_SIZE +
+         mxGetNumberOfDimensions(input) * sizeof(uint64_t);
+}
+
+/** Write the header of the packed binary.
+ * @return pointer to the payload.
+ */
+static uint8_t* WritePackHeader(const mxArray* input,
+                                pack_codec_t codec,
+                                int flags,
+                                uint8_t* output) {
+  mwSize ndims = mxGetNumberOfDimensions(input);
+  const mwSize* dims = mxGetDimensions(input);
+  mwSize i;
+  output[0] = 'm';
+  output[1] = 'x';
+  output[2] = (uint8_t)codec;
+  output[3] = (uint8_t)(flags |
+                        ((mxIsComplex(input)) ? PACK_FLAG_COMPLEX : 0));
+  output[4] = (uint8_t)GetPackClass(input);
+  output[5] = (uint8_t)ndims;
+  output[6] = 0;
+  output[7] = 0;
+  output += PACK_HEADER_SIZE;
+  for (i = 0; i < ndims; ++i) {
+    WriteUInt64(output, dims[i]);
+    output += sizeof(uint64_t);
+  }
+  return output;
+}
+
+/** Read the header of the packed binary.
+ * @return true if the data is a valid packed binary.
+ */
+static bool ReadPackHeader(const uint8_t* data,
+                           uint32_t length,
+                           pack_header_t* header) {
+  int class_index;
+  mwSize i;
+  if (length < PACK_HEADER_SIZE || data[0] != 'm' || data[1] != 'x')
+    return false;
+  header->codec = (pack_codec_t)data[2];
+  header->flags = data[3];
+  class_index = data[4];
+  if (class_index <= 0 ||
+      class_index >= (int)(sizeof(kPackClassTable) / sizeof(mxClassID)))
+    return false;
+  header->class_id = kPackClassTable[class_index];
+  header->ndims = data[5];
+  if (header->ndims < 2 ||
+      length < PACK_HEADER_SIZE + header->ndims * sizeof(uint64_t))
+    return false;
+  data += PACK_HEADER_SIZE;
+  header->num_elements = 1;
+  for (i = 0; i < header->ndims; ++i) {
+    uint64_t dimension = ReadUInt64(data);
+    if (dimension && header->num_elements > SIZE_MAX / dimension)
+      return false;
+    header->dims[i] = (mwSize)dimension;
+    header->num_elements *= (size_t)dimension;
+    data += sizeof(uint64_t);
+  }
+  length -= PACK_HEADER_SIZE + header->ndims * sizeof(uint64_t);
+  header->raw_size = length;
+  if (header->flags & PACK_FLAG_ZLIB) {
+    if (length < sizeof(uint64_t))
+      return false;
+    header->raw_size = (size_t)ReadUInt64(data);
+    data += sizeof(uint64_t);
+    length -= sizeof(uint64_t);
+  }
+  header->payload = data;
+  header->payload_length = length;
+  return true;
+}
+
+/** Pack logical values into a bitset, LSB first. Eight values are packed at a
+ * time by gathering the low bit of each byte in a 64-bit word.
+ */
+static void PackBitset(const mxLogical* input,
+                       size_t num_elements,
+                       uint8_t* output) {
+  size_t i = 0;
+  for (; i + 8 <= num_elements; i += 8) {
+    uint64_t word;
+    memcpy(&word, input + i, sizeof(uint64_t));
+    word = BSON_UINT64_FROM_LE(word) & 0x0101010101010101ULL;
+    *output++ = (uint8_t)((word * 0x0102040810204080ULL) >> 56);
+  }
+  if (i < num_elements) {
+    uint8_t bits = 0;
+    int j;
+    for (j = 0; i < num_elements; ++i, ++j)
+      bits |= (input[i] != 0) << j;
+    *output = bits;
+  }
+}
+
+/** Unpack a bitset into logical values. Each byte expands to a 64-bit word
+ * from the lookup table.
+ */
+static void UnpackBitset(const uint8_t* input,
+                         size_t num_elements,
+                         mxLogical* output) {
+  static uint64_t kExpandTable[256];
+  static bool table_initialized = false;
+  size_t i = 0;
+  if (!table_initialized) {
+    int value, j;
+    for (value = 0; value < 256; ++value) {
+      uint64_t word = 0;
+      for (j = 0; j < 8; ++j)
+        word |= (uint64_t)((value >> j) & 1) << (8 * j);
+      kExpandTable[value] = BSON_UINT64_TO_LE(word);
+    }
+    table_initialized = true;
+  }
+  for (; i + 8 <= num_elements; i += 8)
+    memcpy(output + i, &kExpandTable[*input++], sizeof(uint64_t));
+  for (; i < num_elements; ++i)
+    output[i] = (*input >> (i % 8)) & 1;
+}
+
+/** Count trailing zero bits of a non-zero word.
+ */
+static int CountTrailingZeros(uint64_t word) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(word);
+#else
+  int count = 0;
+  while (!(word & 1)) {
+    word >>= 1;
+    ++count;
+  }
+  return count;
+#endif
+}
+
+/** Encode int64 values as zigzag varints of the delta from the previous
+ * value. Arithmetic is in uint64 so that the delta wraps around.
+ * @return number of bytes written.
+ */
+static size_t PackDeltaVarint(const int64_t* input,
+                              size_t num_elements,
+                              uint8_t* output) {
+  uint8_t* output_start = output;
+  uint64_t previous = 0;
+  size_t i;
+  for (i = 0; i < num_elements; ++i) {
+    uint64_t delta = (uint64_t)input[i] - previous;
+    uint64_t value = (delta << 1) ^ (uint64_t)((int64_t)delta >> 63);
+    previous = (uint64_t)input[i];
+    while (value >= 0x80) {
+      *output++ = (uint8_t)(value | 0x80);
+      value >>= 7;
+    }
+    *output++ = (uint8_t)value;
+  }
+  return output - output_start;
+}
+
+/** Read a LEB128 varint byte by byte.
+ * @return true if a complete varint is read.
+ */
+static bool ReadVarint(const uint8_t** input,
+                       const uint8_t* input_end,
+                       uint64_t* value) {
+  int shift = 0;
+  *value = 0;
+  while (*input < input_end && shift < 70) {
+    uint8_t byte = *(*input)++;
+    *value |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return true;
+    shift += 7;
+  }
+  return false;
+}
+
+/** Decode zigzag varints of deltas into int64 values. The terminating byte
+ * of each varint is located with a single 64-bit word test, and a run of
+ * eight 1-byte varints is decoded at once.
+ * @return true if the payload holds exactly num_elements values.
+ */
+static bool UnpackDeltaVarint(const uint8_t* input,
+                              size_t length,
+                              size_t num_elements,
+                              int64_t* output) {
+  const uint8_t* input_end = input + length;
+  uint64_t previous = 0;
+  size_t i = 0;
+  while (i < num_elements) {
+    uint64_t value = 0;
+    uint64_t word;
+    uint64_t stop_bits = 0;
+    if (input_end - input >= 8) {
+      memcpy(&word, input, sizeof(uint64_t));
+      word = BSON_UINT64_FROM_LE(word);
+      stop_bits = ~word & 0x8080808080808080ULL;
+    }
+    if (stop_bits == 0x8080808080808080ULL && i + 8 <= num_elements) {
+      /* Eight 1-byte varints. */
+      int j;
+      for (j = 0; j < 8; ++j) {
+        value = (word >> (8 * j)) & 0x7F;
+        previous += (value >> 1) ^ (0 - (value & 1));
+        output[i++] = (int64_t)previous;
+      }
+      input += 8;
+      continue;
+    }
+    if (stop_bits) {
+      int size = CountTrailingZeros(stop_bits) / 8 + 1;
+      int j;
+      for (j = 0; j < size; ++j)
+        value |= ((word >> (8 * j)) & 0x7F) << (7 * j);
+      input += size;
+    }
+    else if (!ReadVarint(&input, input_end, &value))
+      return false;
+    previous += (value >> 1) ^ (0 - (value & 1));
+    output[i++] = (int64_t)previous;
+  }
+  return input == input_end;
+}
+
+/** Get BSON date values of bson.datetime array, in the same unit as
+ * ConvertDateArrayToBSON.
+ * @return mxMalloc-ed values, or NULL if failed.
+ */
+static int64_t* GetDateValues(const mxArray* input) {
+  size_t num_elements = mxGetNumberOfElements(input);
+  mxArray* numbers = NULL;
+  int64_t* values;
+  const double* number_data;
+  size_t i;
+  if (mexCallMATLAB(1, &numbers, 1, (mxArray**)&input, "double") != 0 ||
+      mxGetNumberOfElements(numbers) != num_elements)
+    return NULL;
+  values = (int64_t*)mxMalloc(num_elements * sizeof(int64_t));
+  number_data = mxGetPr(numbers);
+  for (i = 0; i < num_elements; ++i)
+    values[i] = (int64_t)((number_data[i] - 719529) * 86400);
+  mxDestroyArray(numbers);
+  return values;
+}
+
+/** Write sparse indices as uint64 values.
+ */
+static uint8_t* WriteIndices(const mwIndex* input,
+                             size_t size,
+                             uint8_t* output) {
+  size_t i;
+  for (i = 0; i < size; ++i) {
+    WriteUInt64(output, input[i]);
+    output += sizeof(uint64_t);
+  }
+  return output;
+}
+
+/** Pack a sparse matrix in compressed sparse column format.
+ * @return number of bytes written.
+ */
+static size_t PackSparseCSC(const mxArray* input, uint8_t* output) {
+  uint8_t* output_start = output;
+  size_t num_columns = mxGetN(input);
+  const mwIndex* jc = mxGetJc(input);
+  size_t nnz = jc[num_columns];
+  size_t values_size = nnz * GetValueSize(input);
+  WriteUInt64(output, nnz);
+  output += sizeof(uint64_t);
+  output = WriteIndices(jc, num_columns + 1, output);
+  output = WriteIndices(mxGetIr(input), nnz, output);
+  if (mxIsComplex(input))
+    return InterleaveComplex(input, nnz, output) - output_start;
+  memcpy(output, mxGetData(input), values_size);
+  return output + values_size - output_start;
+}
+
+/** Get the maximum size of the payload.
+ */
+static bool GetPayloadSize(const mxArray* input,
+                           pack_codec_t codec,
+                           size_t* payload_size) {
+  size_t num_elements = mxGetNumberOfElements(input);
+  switch (codec) {
+    case PACK_CODEC_BITSET:
+      if (!mxIsLogical(input))
+        return false;
+      *payload_size = (num_elements + 7) / 8;
+      return true;
+    case PACK_CODEC_DELTA_VARINT:
+      if (mxGetClassID(input) != mxINT64_CLASS &&
+          mxGetClassID(input) != mxUINT64_CLASS &&
+          !mxIsClass(input, "bson.datetime"))
+        return false;
+      if (num_elements > SIZE_MAX / 10)
+        return false;
+      *payload_size = num_elements * 10;
+      return true;
+    case PACK_CODEC_RAW:
+      if (!mxIsNumeric(input) && !mxIsLogical(input))
+        return false;
+      *payload_size = num_elements * GetValueSize(input);
+      return true;
+    case PACK_CODEC_SPARSE_CSC: {
+      size_t num_columns = mxGetN(input);
+      size_t nnz;
+      if (!mxIsSparse(input) || mxGetNumberOfDimensions(input) != 2)
+        return false;
+      nnz = mxGetJc(input)[num_columns];
+      *payload_size = sizeof(uint64_t) * (num_columns + 2 + nnz) +
+                      nnz * GetValueSize(input);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+/** Write the payload of the codec.
+ * @return true if success.
+ */
+static bool WritePayload(const mxArray* input,
+                         pack_codec_t codec,
+                         uint8_t* output,
+                         size_t* payload_size) {
+  size_t num_elements = mxGetNumberOfElements(input);
+  switch (codec) {
+    case PACK_CODEC_BITSET:
+      PackBitset(mxGetLogicals(input), num_elements, output);
+      return true;
+    case PACK_CODEC_SPARSE_CSC:
+      *payload_size = PackSparseCSC(input, output);
+      return true;
+    case PACK_CODEC_RAW:
+      if (!mxIsComplex(input))
+        return false;
+      InterleaveComplex(input, num_elements, output);
+      return true;
+    case PACK_CODEC_DELTA_VARINT:
+      if (mxIsClass(input, "bson.datetime")) {
+        int64_t* values = GetDateValues(input);
+        if (!values)
+          return false;
+        *payload_size = PackDeltaVarint(values, num_elements, output);
+        mxFree(values);
+      }
+      else
+        *payload_size = PackDeltaVarint((const int64_t*)mxGetData(input),
+                                        num_elements,
+                                        output);
+      return true;
+    default:
+      return false;
+  }
+}
+
+/** Append the header and the payload, compressed if requested and smaller.
+ */
+static bool AppendPackedBinary(const mxArray* input,
+                               const char* name,
+                               pack_codec_t codec,
+                               const uint8_t* payload,
+                               size_t payload_size,
+                               bool compress,
+                               bson_t* output) {
+  size_t header_size = GetPackHeaderSize(input);
+  size_t buffer_size = header_size + payload_size;
+  uint8_t* buffer = NULL;
+  bool status;
+  if (compress) {
+    uLongf compressed_size = compressBound(payload_size);
+    uint8_t* compressed_payload;
+    buffer = (uint8_t*)mxMalloc(header_size + sizeof(uint64_t) +
+                                compressed_size);
+    compressed_payload = WritePackHeader(input,
+                                         codec,
+                                         PACK_FLAG_ZLIB,
+                                         buffer);
+    WriteUInt64(compressed_payload, payload_size);
+    compressed_payload += sizeof(uint64_t);
+    if (compress2(compressed_payload,
+                  &compressed_size,
+                  payload,
+                  payload_size,
+                  Z_DEFAULT_COMPRESSION) == Z_OK &&
+        compressed_size + sizeof(uint64_t) < payload_size)
+      buffer_size = header_size + sizeof(uint64_t) + compressed_size;
+    else {
+      mxFree(buffer);
+      buffer = NULL;
+    }
+  }
+  if (!buffer) {
+    buffer = (uint8_t*)mxMalloc(buffer_size);
+    memcpy(WritePackHeader(input, codec, 0, buffer), payload, payload_size);
+  }
+  status = buffer_size <= BSON_MAX_SIZE &&
+           bson_append_binary(output,
+                              (name) ? name : "0",
+                              (int)strlen((name) ? name : "0"),
+                              BSON_SUBTYPE_USER,
+                              buffer,
+                              (uint32_t)buffer_size);
+  mxFree(buffer);
+  return status;
+}
+
+/** Store the array data in chunks and append the reference to the chunks.
+ */
+static bool AppendChunkedBinary(const mxArray* input,
+                                const char* name,
+                                const encode_options_t* options,
+                                bson_t* output) {
+  uint8_t payload[2 * sizeof(uint64_t)];
+  uint64_t offset;
+  if (!options->chunk_writer ||
+      !options->chunk_size ||
+      mxIsComplex(input) ||
+      mxIsSparse(input) ||
+      (!mxIsNumeric(input) && !mxIsLogical(input)) ||
+      !options->chunk_writer(input, options->chunk_context, &offset))
+    return false;
+  WriteUInt64(payload, offset);
+  WriteUInt64(payload + sizeof(uint64_t), options->chunk_size);
+  return AppendPackedBinary(input,
+                            name,
+                            PACK_CODEC_CHUNKED,
+                            payload,
+                            sizeof(payload),
+                            false,
+                            output);
+}
+
+EXTERN_C bool ConvertPackedArrayToBSON(const mxArray* input,
+                                       const char* name,
+                                       pack_codec_t codec,
+                                       const encode_options_t* options,
+                                       bson_t* output) {
+  size_t payload_size;
+  uint8_t* payload = NULL;
+  bool status;
+  if (mxGetNumberOfDimensions(input) > PACK_MAX_DIMS ||
+      !GetPackClass(input))
+    return false;
+  if (codec == PACK_CODEC_CHUNKED)
+    return AppendChunkedBinary(input, name, options, output);
+  if (!GetPayloadSize(input, codec, &payload_size))
+    return false;
+  /* Raw payload is the data of the mxArray itself, unless complex values
+   * are stored separately. */
+  if (codec != PACK_CODEC_RAW ||
+      (mxIsComplex(input) && !PACK_INTERLEAVED_COMPLEX)) {
+    payload = (uint8_t*)mxMalloc(payload_size);
+    if (!WritePayload(input, codec, payload, &payload_size)) {
+      mxFree(payload);
+      return false;
+    }
+  }
+  status = AppendPackedBinary(
+      input,
+      name,
+      codec,
+      (payload) ? payload : (const uint8_t*)mxGetData(input),
+      payload_size,
+      options->compress && payload_size >= options->compress_threshold,
+      output);
+  if (payload)
+    mxFree(payload);
+  return status;
+}
+
+/** Get the maximum size of the inflated payload for the codec.
+ */
+static size_t GetMaxRawSize(const pack_header_t* header) {
+  /* zlib cannot compress more than about 1032:1. */
+  size_t max_size = (header->payload_length > SIZE_MAX / 1032) ?
+      SIZE_MAX : header->payload_length * 1032 + 64;
+  switch (header->codec) {
+    case PACK_CODEC_BITSET:
+      return BSON_MIN(max_size, (header->num_elements + 7) / 8);
+    case PACK_CODEC_DELTA_VARINT:
+      return (header->num_elements > SIZE_MAX / 10) ?
+          max_size : BSON_MIN(max_size, header->num_elements * 10);
+    case PACK_CODEC_RAW:
+    case PACK_CODEC_SPARSE_CSC:
+      return max_size;
+    default:
+      return 0;
+  }
+}
+
+/** Inflate the zlib payload to the output buffer of the raw size.
+ */
+static bool InflatePayload(const pack_header_t* header, uint8_t* output) {
+  uLongf raw_size = header->raw_size;
+  return uncompress(output,
+                    &raw_size,
+                    header->payload,
+                    header->payload_length) == Z_OK &&
+         raw_size == header->raw_size;
+}
+
+/** Convert a raw payload to a numeric or logical array. A compressed payload
+ * is inflated directly into the mxArray, unless complex values have to be
+ * deinterleaved to separate storage.
+ */
+static mxArray* ConvertRawToMxArray(const pack_header_t* header) {
+  bool is_complex = (header->flags & PACK_FLAG_COMPLEX) != 0;
+  bool is_compressed = (header->flags & PACK_FLAG_ZLIB) != 0;
+  size_t value_size = GetRealElementSize(header->class_id) *
+                      ((is_complex) ? 2 : 1);
+  mxArray* element;
+  size_t data_size;
+  if (header->class_id == mxOBJECT_CLASS ||
+      (header->class_id == mxLOGICAL_CLASS && is_complex) ||
+      header->num_elements > SIZE_MAX / value_size)
+    return NULL;
+  /* Check the size before allocating, so a corrupt header falls back to
+   * uint8 instead of running out of memory. */
+  data_size = header->num_elements * value_size;
+  if (header->raw_size != data_size ||
+      ((is_compressed) ? data_size > GetMaxRawSize(header) :
+                         header->payload_length != data_size))
+    return NULL;
+  if (header->class_id == mxLOGICAL_CLASS)
+    element = mxCreateLogicalArray(header->ndims, header->dims);
+  else
+    element = mxCreateNumericArray(header->ndims,
+                                   header->dims,
+                                   header->class_id,
+                                   (is_complex) ? mxCOMPLEX : mxREAL);
+  if (!element)
+    return NULL;
+  if (is_complex && !PACK_INTERLEAVED_COMPLEX) {
+    uint8_t* payload = (uint8_t*)header->payload;
+    if (is_compressed) {
+      payload = (uint8_t*)mxMalloc(data_size);
+      if (!InflatePayload(header, payload)) {
+        mxFree(payload);
+        mxDestroyArray(element);
+        return NULL;
+      }
+    }
+    DeinterleaveComplex(payload, header->num_elements, element);
+    if (is_compressed)
+      mxFree(payload);
+  }
+  else if (is_compressed) {
+    if (!InflatePayload(header, (uint8_t*)mxGetData(element))) {
+      mxDestroyArray(element);
+      return NULL;
+    }
+  }
+  else
+    memcpy(mxGetData(element), header->payload, data_size);
+  return element;
+}
+
+/** Convert a bitset payload to a logical array.
+ */
+static mxArray* ConvertBitsetToMxArray(const pack_header_t* header) {
+  mxArray* element;
+  if (header->class_id != mxLOGICAL_CLASS ||
+      header->payload_length < (header->num_elements + 7) / 8)
+    return NULL;
+  element = mxCreateLogicalArray(header->ndims, header->dims);
+  if (element)
+    UnpackBitset(header->payload,
+                 header->num_elements,
+                 mxGetLogicals(element));
+  return element;
+}
+
+/** Convert a delta varint payload to an int64 or bson.datetime array.
+ */
+static mxArray* ConvertDeltaVarintToMxArray(const pack_header_t* header) {
+  static const char* kDateField = "number";
+  mxArray* element;
+  mxArray* date_element = NULL;
+  int64_t* values;
+  size_t i;
+  /* Each varint takes at least a byte, so the payload bounds the size
+   * before anything is allocated. */
+  if (header->num_elements > header->payload_length ||
+      header->num_elements > SIZE_MAX / sizeof(int64_t))
+    return NULL;
+  if (header->class_id == mxINT64_CLASS ||
+      header->class_id == mxUINT64_CLASS) {
+    element = mxCreateNumericArray(header->ndims,
+                                   header->dims,
+                                   header->class_id,
+                                   mxREAL);
+    if (element && !UnpackDeltaVarint(header->payload,
+                                      header->payload_length,
+                                      header->num_elements,
+                                      (int64_t*)mxGetData(element))) {
+      mxDestroyArray(element);
+      element = NULL;
+    }
+    return element;
+  }
+  if (header->class_id != mxOBJECT_CLASS)
+    return NULL;
+  /* bson.datetime is created from a struct array of date numbers. */
+  values = (int64_t*)mxMalloc(header->num_elements * sizeof(int64_t));
+  if (!UnpackDeltaVarint(header->payload,
+                         header->payload_length,
+                         header->num_elements,
+                         values)) {
+    mxFree(values);
+    return NULL;
+  }
+  element = mxCreateStructArray(header->ndims,
+                                header->dims,
+                                1,
+                                &kDateField);
+  for (i = 0; i < header->num_elements; ++i)
+    mxSetFieldByNumber(element,
+                       i,
+                       0,
+                       mxCreateDoubleScalar(
+                           ((double)values[i] / 86400.0) + 719529));
+  mxFree(values);
+  mexCallMATLAB(1, &date_element, 1, &element, "bson.datetime");
+  mxDestroyArray(element);
+  return date_element;
+}
+
+/** Read sparse indices and check that they are below the limit.
+ */
+static bool ReadIndices(const uint8_t* input,
+                        size_t size,
+                        uint64_t limit,
+                        mwIndex* output) {
+  size_t i;
+  for (i = 0; i < size; ++i) {
+    uint64_t value = ReadUInt64(input);
+    if (value >= limit)
+      return false;
+    output[i] = (mwIndex)value;
+    input += sizeof(uint64_t);
+  }
+  return true;
+}
+
+/** Convert a compressed sparse column payload to a sparse matrix. The column
+ * offsets and row indices are validated, as a malformed sparse matrix would
+ * crash Matlab.
+ */
+static mxArray* ConvertSparseCSCToMxArray(const pack_header_t* header) {
+  const uint8_t* input = header->payload;
+  size_t num_rows, num_columns, nnz, values_size, i;
+  mxArray* element;
+  mwIndex* jc;
+  mwIndex* ir;
+  bool is_complex;
+  if (header->ndims != 2 ||
+      header->payload_length < sizeof(uint64_t) ||
+      (header->class_id != mxDOUBLE_CLASS &&
+       header->class_id != mxLOGICAL_CLASS))
+    return NULL;
+  num_rows = header->dims[0];
+  num_columns = header->dims[1];
+  nnz = (size_t)ReadUInt64(input);
+  input += sizeof(uint64_t);
+  is_complex = (header->flags & PACK_FLAG_COMPLEX) != 0;
+  if (is_complex && header->class_id != mxDOUBLE_CLASS)
+    return NULL;
+  values_size = ((header->class_id == mxDOUBLE_CLASS) ?
+      sizeof(double) : sizeof(mxLogical)) * ((is_complex) ? 2 : 1);
+  if (nnz > header->num_elements ||
+      num_columns + 2 + nnz > header->payload_length / sizeof(uint64_t) ||
+      header->payload_length != sizeof(uint64_t) * (num_columns + 2 + nnz) +
+                                nnz * values_size)
+    return NULL;
+  element = (header->class_id == mxDOUBLE_CLASS) ?
+      mxCreateSparse(num_rows,
+                     num_columns,
+                     BSON_MAX(nnz, 1),
+                     (is_complex) ? mxCOMPLEX : mxREAL) :
+      mxCreateSparseLogicalMatrix(num_rows, num_columns, BSON_MAX(nnz, 1));
+  if (!element)
+    return NULL;
+  jc = mxGetJc(element);
+  if (!ReadIndices(input, num_columns + 1, (uint64_t)nnz + 1, jc) ||
+      jc[0] != 0 || jc[num_columns] != nnz ||
+      !ReadIndices(input + sizeof(uint64_t) * (num_columns + 1),
+                   nnz,
+                   num_rows,
+                   mxGetIr(element))) {
+    mxDestroyArray(element);
+    return NULL;
+  }
+  ir = mxGetIr(element);
+  for (i = 0; i < num_columns; ++i) {
+    mwIndex k;
+    bool valid = jc[i] <= jc[i + 1];
+    for (k = jc[i] + 1; valid && k < jc[i + 1]; ++k)
+      valid = ir[k - 1] < ir[k];
+    if (!valid) {
+      mxDestroyArray(element);
+      return NULL;
+    }
+  }
+  input += sizeof(uint64_t) * (num_columns + 1 + nnz);
+  if (is_complex)
+    DeinterleaveComplex(input, nnz, element);
+  else
+    memcpy(mxGetData(element), input, nnz * values_size);
+  return element;
+}
+
+/** Convert a reference to chunks to a numeric or logical array. The chunks
+ * are loaded directly into the mxArray.
+ */
+static mxArray* ConvertChunkedToMxArray(const pack_header_t* header,
+                                        const decode_options_t* options) {
+  mxArray* element;
+  uint64_t offset;
+  uint64_t chunk_size;
+  if (!options->chunk_reader ||
+      header->flags ||
+      header->payload_length != 2 * sizeof(uint64_t) ||
+      header->class_id == mxOBJECT_CLASS)
+    return NULL;
+  offset = ReadUInt64(header->payload);
+  chunk_size = ReadUInt64(header->payload + sizeof(uint64_t));
+  if (chunk_size == 0 || chunk_size > SIZE_MAX)
+    return NULL;
+  if (header->class_id == mxLOGICAL_CLASS)
+    element = mxCreateLogicalArray(header->ndims, header->dims);
+  else
+    element = mxCreateNumericArray(header->ndims,
+                                   header->dims,
+                                   header->class_id,
+                                   mxREAL);
+  if (!element)
+    return NULL;
+  if (!options->chunk_reader(
+          offset,
+          (size_t)chunk_size,
+          (uint8_t*)mxGetData(element),
+          header->num_elements * GetRealElementSize(header->class_id),
+          options->chunk_context)) {
+    mxDestroyArray(element);
+    return NULL;
+  }
+  return element;
+}
+
+/** Convert the payload of a packed binary by the codec of the header.
+ * @return Newly allocated mxArray, or NULL if unsuccessful.
+ */
+static mxArray* ConvertPayloadToMxArray(pack_header_t* header,
+                                        const decode_options_t* options) {
+  mxArray* element = NULL;
+  uint8_t* inflated_payload = NULL;
+  if (header->codec == PACK_CODEC_RAW)
+    return ConvertRawToMxArray(header);
+  if (header->codec == PACK_CODEC_CHUNKED)
+    return ConvertChunkedToMxArray(header, options);
+  if ((header->flags & PACK_FLAG_COMPLEX) &&
+      header->codec != PACK_CODEC_SPARSE_CSC)
+    return NULL;
+  if (header->flags & PACK_FLAG_ZLIB) {
+    if (header->raw_size > GetMaxRawSize(header))
+      return NULL;
+    inflated_payload = (uint8_t*)mxMalloc(header->raw_size);
+    if (!InflatePayload(header, inflated_payload)) {
+      mxFree(inflated_payload);
+      return NULL;
+    }
+    header->payload = inflated_payload;
+    header->payload_length = header->raw_size;
+  }
+  switch (header->codec) {
+    case PACK_CODEC_BITSET:
+      element = ConvertBitsetToMxArray(header);
+      break;
+    case PACK_CODEC_DELTA_VARINT:
+      element = ConvertDeltaVarintToMxArray(header);
+      break;
+    case PACK_CODEC_SPARSE_CSC:
+      element = ConvertSparseCSCToMxArray(header);
+      break;
+    default:
+      break;
+  }
+  if (inflated_payload)
+    mxFree(inflated_payload);
+  return element;
+}
+
+EXTERN_C bool ConvertPackedBinaryToMxArray(const uint8_t* data,
+                                           uint32_t length,
+                                           const decode_options_t* options,
+                                           mxArray** output) {
+  pack_header_t header;
+  *output = NULL;
+  if (!ReadPackHeader(data, length, &header))
+    return true;
+  *output = ConvertPayloadToMxArray(&header, options);
+  /* Chunk references and compressed payloads mean nothing as bytes. */
+  return *output ||
+         (header.codec != PACK_CODEC_CHUNKED &&
+          !(header.flags & PACK_FLAG_ZLIB));
+}
@@ -0,0 +1,88 @@
+/** Packed array codec for BSON user-defined binary.
+ *
+ * A packed array is stored as a BSON binary of BSON_SUBTYPE_USER with the
+ * following little-endian layout.
+ *
+ *   uint8_t  magic[2]     "mx"
+ *   uint8_t  codec        PACK_CODEC_*
+ *   uint8_t  flags        PACK_FLAG_*
+ *   uint8_t  class_id     PACK_CLASS_*
+ *   uint8_t  ndims        Number of dimensions.
+ *   uint16_t reserved     0.
+ *   uint64_t dims[ndims]  Dimensions of the array.
+ *   uint64_t raw_size     Size of the inflated payload, if PACK_FLAG_ZLIB.
+ *   uint8_t  payload[]    Codec-specific payload, zlib stream if
+ *                         PACK_FLAG_ZLIB. Complex values are interleaved
+ *                         real and imaginary parts if PACK_FLAG_COMPLEX.
+ *
+ * Kota Yamaguchi 2013
+ */
+
+#ifndef __BSONPACK_H__
+#define __BSONPACK_H__
+
+#include "bsonmex.h"
+
+/** Codec of the packed payload.
+ */
+typedef enum {
+  PACK_CODEC_BITSET = 1,     /* 1 bit per element, LSB first. */
+  PACK_CODEC_DELTA_VARINT,   /* Delta of int64, zigzag LEB128 varint. */
+  PACK_CODEC_RAW,            /* Little-endian column-major elements. */
+  PACK_CODEC_SPARSE_CSC,     /* uint64 nnz, jc[n+1], ir[nnz], values. */
+  PACK_CODEC_CHUNKED         /* uint64 offset, uint64 chunk_size of the
+                                raw data stored in chunk documents. */
+} pack_codec_t;
+
+/** Flags of the packed binary.
+ */
+typedef enum {
+  PACK_FLAG_ZLIB = 1,   /* Payload is compressed by zlib. */
+  PACK_FLAG_COMPLEX = 2 /* Values are interleaved real and imaginary. */
+} pack_flag_t;
+
+/** Class of the packed array.
+ */
+typedef enum {
+  PACK_CLASS_LOGICAL = 1,
+  PACK_CLASS_DOUBLE,
+  PACK_CLASS_SINGLE,
+  PACK_CLASS_INT8,
+  PACK_CLASS_UINT8,
+  PACK_CLASS_INT16,
+  PACK_CLASS_UINT16,
+  PACK_CLASS_INT32,
+  PACK_CLASS_UINT32,
+  PACK_CLASS_INT64,
+  PACK_CLASS_UINT64,
+  PACK_CLASS_DATETIME /* bson.datetime in int64 BSON date values. */
+} pack_class_t;
+
+/** Append mxArray to BSON as a packed binary.
+ * @param input mxArray to pack.
+ * @param name key of the element.
+ * @param codec codec of the payload.
+ * @param options encoder options.
+ * @param output bson object to append.
+ * @return true if success.
+ */
+EXTERN_C bool ConvertPackedArrayToBSON(const mxArray* input,
+                                       const char* name,
+                                       pack_codec_t codec,
+                                       const encode_options_t* options,
+                                       bson_t* output);
+/** Convert a packed binary to mxArray*.
+ * @param data binary data of BSON_SUBTYPE_USER.
+ * @param length length of the binary data.
+ * @param options decoder options.
+ * @param output Newly allocated mxArray, or NULL if not a valid packed array
+ *               and the data is kept as uint8.
+ * @return false if the data is a chunk reference or a compressed payload
+ *         that cannot be loaded.
+ */
+EXTERN_C bool ConvertPackedBinaryToMxArray(const uint8_t* data,
+                                           uint32_t length,
+                                           const decode_options_t* options,
+                                           mxArray** output);
+
+#endif /* __BSONPACK_H__ */
@@ -0,0 +1,332 @@
+/** BSON document validator implementation.
+ *
+ * Kota Yamaguchi 2013
+ */
+
+#include "bsonvalid.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BSONVALID_HAS_SSE2 1
+#else
+#define BSONVALID_HAS_SSE2 0
+#endif
+
+#define VALIDATE_STACK_SIZE 32
+
+/** Open document of the validator.
+ */
+typedef struct validate_frame_t {
+  size_t end;   /* Position of the terminator of the document. */
+  size_t after; /* Required position after the document, or 0. */
+} validate_frame_t;
+
+/** State of the validator. Documents are tracked on an explicit stack, so
+ * deep nesting does not overflow the stack of a worker thread.
+ */
+typedef struct validator_t {
+  const uint8_t* data;
+  const validate_options_t* options;
+  size_t position;
+  size_t element; /* Position of the current element. */
+  validate_frame_t* stack;
+  size_t depth;
+  size_t capacity;
+  validate_frame_t frames[VALIDATE_STACK_SIZE];
+} validator_t;
+
+/** Read a little-endian int32.
+ */
+static int32_t ReadInt32(const uint8_t* input) {
+  return (int32_t)((uint32_t)input[0] |
+                   ((uint32_t)input[1] << 8) |
+                   ((uint32_t)input[2] << 16) |
+                   ((uint32_t)input[3] << 24));
+}
+
+/** Find the first byte of an invalid UTF-8 sequence. Runs of ASCII are
+ * skipped 16 bytes at a time.
+ * @return position of the invalid byte, or NULL if valid.
+ */
+static const uint8_t* FindInvalidUTF8(const uint8_t* input,
+                                      const uint8_t* end) {
+  while (input < end) {
+    uint8_t c;
+    uint8_t low = 0x80, high = 0xBF;
+    int size, i;
+#if BSONVALID_HAS_SSE2
+    while (input + 16 <= end &&
+           !_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)input)))
+      input += 16;
+    if (input >= end)
+      break;
+#endif
+    c = *input;
+    if (c < 0x80) {
+      ++input;
+      continue;
+    }
+    /* Ranges of the second byte exclude overlong forms, surrogates, and
+     * code points above U+10FFFF. */
+    if (c >= 0xC2 && c <= 0xDF)
+      size = 1;
+    else if (c >= 0xE0 && c <= 0xEF) {
+      size = 2;
+      if (c == 0xE0)
+        low = 0xA0;
+      else if (c == 0xED)
+        high = 0x9F;
+    }
+    else if (c >= 0xF0 && c <= 0xF4) {
+      size = 3;
+      if (c == 0xF0)
+        low = 0x90;
+      else if (c == 0xF4)
+        high = 0x8F;
+    }
+    else
+      return input;
+    if (end - input <= size || input[1] < low || input[1] > high)
+      return input;
+    for (i = 2; i <= size; ++i)
+      if ((input[i] & 0xC0) != 0x80)
+        return input;
+    input += size + 1;
+  }
+  return NULL;
+}
+
+/** Check UTF-8 of the bytes, moving the position to the invalid byte.
+ */
+static const char* CheckUTF8(validator_t* validator,
+                             size_t position,
+                             size_t end,
+                             const char* reason) {
+  const uint8_t* invalid;
+  if (!validator->options->utf8)
+    return NULL;
+  invalid = FindInvalidUTF8(validator->data + position,
+                            validator->data + end);
+  if (!invalid)
+    return NULL;
+  validator->position = invalid - validator->data;
+  return reason;
+}
+
+/** Enter a document at the position, which must end by the limit.
+ * @param after required position after the document, or 0.
+ */
+static const char* BeginDocument(validator_t* validator,
+                                 size_t limit,
+                                 size_t after) {
+  size_t available = limit - validator->position;
+  int32_t length;
+  if (available < 5)
+    return "truncated document";
+  length = ReadInt32(validator->data + validator->position);
+  if (length < 5)
+    return "invalid document length";
+  if ((size_t)length > available)
+    return (validator->depth) ?
+        "document exceeds its container" : "truncated document";
+  if (validator->data[validator->position + length - 1] != 0)
+    return "missing document terminator";
+  if (validator->options->max_depth &&
+      validator->depth > validator->options->max_depth)
+    return "maximum depth exceeded";
+  if (validator->depth == validator->capacity) {
+    size_t capacity = 2 * validator->capacity;
+    validate_frame_t* stack = (validator->stack == validator->frames) ?
+        (validate_frame_t*)malloc(capacity * sizeof(validate_frame_t)) :
+        (validate_frame_t*)realloc(validator->stack,
+                                   capacity * sizeof(validate_frame_t));
+    if (!stack)
+      return "out of memory";
+    if (validator->stack == validator->frames)
+      memcpy(stack, validator->frames, sizeof(validator->frames));
+    validator->stack = stack;
+    validator->capacity = capacity;
+  }
+  validator->stack[validator->depth].end = validator->position + length - 1;
+  validator->stack[validator->depth++].after = after;
+  validator->position += 4;
+  return NULL;
+}
+
+/** Check a null-terminated string such as a key.
+ */
+static const char* CheckCString(validator_t* validator,
+                                size_t end,
+                                const char* reason) {
+  const uint8_t* terminator = (const uint8_t*)memchr(
+      validator->data + validator->position,
+      0,
+      end - validator->position);
+  size_t position = validator->position;
+  if (!terminator)
+    return reason;
+  validator->position = terminator - validator->data + 1;
+  return CheckUTF8(validator,
+                   position,
+                   validator->position - 1,
+                   "invalid UTF-8 key");
+}
+
+/** Check a length-prefixed string.
+ */
+static const char* CheckString(validator_t* validator, size_t end) {
+  size_t position = validator->position;
+  int32_t length;
+  if (end - position < 4)
+    return "element exceeds the document";
+  length = ReadInt32(validator->data + position);
+  if (length < 1 || (size_t)length > end - position - 4)
+    return "invalid string length";
+  if (validator->data[position + 4 + length - 1] != 0)
+    return "missing string terminator";
+  validator->position = position + 4 + length;
+  return CheckUTF8(validator,
+                   position + 4,
+                   position + 4 + length - 1,
+                   "invalid UTF-8 string");
+}
+
+/** Check a binary element.
+ */
+static const char* CheckBinary(validator_t* validator, size_t end) {
+  size_t position = validator->position;
+  int32_t length;
+  if (end - position < 5)
+    return "element exceeds the document";
+  length = ReadInt32(validator->data + position);
+  if (length < 0 || (size_t)length > end - position - 5)
+    return "invalid binary length";
+  /* The deprecated binary subtype has another length inside. */
+  if (validator->data[position + 4] == BSON_SUBTYPE_BINARY_DEPRECATED &&
+      (length < 4 || ReadInt32(validator->data + position + 5) != length - 4))
+    return "invalid binary length";
+  validator->position = position + 5 + length;
+  return NULL;
+}
+
+/** Check the value of an element of the type.
+ */
+static const char* CheckValue(validator_t* validator,
+                              uint8_t type,
+                              size_t end) {
+  size_t size = 0;
+  const char* reason;
+  switch (type) {
+    case BSON_TYPE_DOUBLE:
+    case BSON_TYPE_DATE_TIME:
+    case BSON_TYPE_TIMESTAMP:
+    case BSON_TYPE_INT64:
+      size = 8;
+      break;
+    case BSON_TYPE_INT32:
+      size = 4;
+      break;
+    case BSON_TYPE_OID:
+      size = 12;
+      break;
+    case 0x13: /* Decimal128. */
+      size = 16;
+      break;
+    case BSON_TYPE_UNDEFINED:
+    case BSON_TYPE_NULL:
+    case BSON_TYPE_MAXKEY:
+    case BSON_TYPE_MINKEY:
+      break;
+    case BSON_TYPE_BOOL:
+      if (end - validator->position >= 1 &&
+          validator->data[validator->position] > 1)
+        return "invalid boolean";
+      size = 1;
+      break;
+    case BSON_TYPE_UTF8:
+    case BSON_TYPE_CODE:
+    case BSON_TYPE_SYMBOL:
+      return CheckString(validator, end);
+    case BSON_TYPE_DOCUMENT:
+    case BSON_TYPE_ARRAY:
+      return BeginDocument(validator, end, 0);
+    case BSON_TYPE_BINARY:
+      return CheckBinary(validator, end);
+    case BSON_TYPE_REGEX:
+      reason = CheckCString(validator, end, "unterminated regular expression");
+      return (reason) ? reason :
+          CheckCString(validator, end, "unterminated regular expression");
+    case BSON_TYPE_DBPOINTER:
+      reason = CheckString(validator, end);
+      if (reason)
+        return reason;
+      size = 12;
+      break;
+    case BSON_TYPE_CODEWSCOPE: {
+      size_t after;
+      int32_t length;
+      if (end - validator->position < 4)
+        return "element exceeds the document";
+      length = ReadInt32(validator->data + validator->position);
+      if (length < 14 || (size_t)length > end - validator->position)
+        return "invalid code with scope length";
+      after = validator->position + length;
+      validator->position += 4;
+      reason = CheckString(validator, after);
+      return (reason) ? reason : BeginDocument(validator, after, after);
+    }
+    default:
+      validator->position = validator->element;
+      return "unknown element type";
+  }
+  if (size > end - validator->position)
+    return "element exceeds the document";
+  validator->position += size;
+  return NULL;
+}
+
+EXTERN_C bool ValidateBSONDocument(const uint8_t* data,
+                                   size_t length,
+                                   const validate_options_t* options,
+                                   size_t* error_offset,
+                                   const char** reason) {
+  validator_t validator;
+  const char* error;
+  validator.data = data;
+  validator.options = options;
+  validator.position = 0;
+  validator.element = 0;
+  validator.stack = validator.frames;
+  validator.depth = 0;
+  validator.capacity = VALIDATE_STACK_SIZE;
+  error = BeginDocument(&validator, length, 0);
+  while (!error && validator.depth) {
+    validate_frame_t frame = validator.stack[validator.depth - 1];
+    uint8_t type;
+    if (validator.position == frame.end) {
+      ++validator.position;
+      --validator.depth;
+      if (frame.after && validator.position != frame.after)
+        error = "invalid code with scope length";
+      continue;
+    }
+    validator.element = validator.position;
+    type = data[validator.position++];
+    if (type == BSON_TYPE_EOD) {
+      validator.position = validator.element;
+      error = "unexpected end of document";
+      break;
+    }
+    error = CheckCString(&validator, frame.end, "unterminated key");
+    if (!error)
+      error = CheckValue(&validator, type, frame.end);
+  }
+  if (validator.stack != validator.frames)
+    free(validator.stack);
+  *error_offset = validator.position;
+  *reason = error;
+  return error == NULL;
+}
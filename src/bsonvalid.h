@@ -0,0 +1,41 @@
+/** BSON document validator.
+ *
+ * Unlike bson_validate, the validator reports the reason of an error and
+ * limits the nesting depth. It does not allocate Matlab memory, and can run
+ * on worker threads.
+ *
+ * Kota Yamaguchi 2013
+ */
+
+#ifndef __BSONVALID_H__
+#define __BSONVALID_H__
+
+#include "bsonmex.h"
+
+/** Options of the validator.
+ */
+typedef struct validate_options_t {
+  bool utf8;        /* Check that keys and strings are valid UTF-8. */
+  size_t max_depth; /* Maximum nesting depth of documents, or 0. */
+  int num_threads;  /* Number of workers, or 0 for the processors. */
+} validate_options_t;
+
+/** Default validator options.
+ */
+#define BSONVALID_OPTIONS_INIT {false, 0, 0}
+
+/** Validate a BSON document.
+ * @param data data of the document.
+ * @param length size of the data, at least the length of the document.
+ * @param options validator options.
+ * @param error_offset offset of the error from the start of the document.
+ * @param reason reason of the error, a static string.
+ * @return true if valid.
+ */
+EXTERN_C bool ValidateBSONDocument(const uint8_t* data,
+                                   size_t length,
+                                   const validate_options_t* options,
+                                   size_t* error_offset,
+                                   const char** reason);
+
+#endif /* __BSONVALID_H__ */
@@ -4,9 +4,17 @@
  */
 
 #include "bsonmex.h"
+#include "bsonarena.h"
+#include "bsoncache.h"
+#include "bsonio.h"
+#include "bsonjson.h"
 #include <mex.h>
+/* Recover the arena from an error raised in a previous call. */
+#define MEX_DISPATCH_PREPARE() ResetArena()
 #include "mex-dispatch.h"
+#include <limits.h>
 #include <stdlib.h>
+#include <strings.h>
 
 #define MEX_ERROR(...) mexErrMsgIdAndTxt("bsonmex:error", __VA_ARGS__)
 #define MEX_ASSERT(condition, ...) if (!(condition)) MEX_ERROR(__VA_ARGS__)
@@ -36,17 +44,610 @@ static bson_t* CreateBSON(const mxArray* input) {
   return value;
 }
 
+/** Get a string option value.
+ */
+static void GetOptionString(const mxArray* input,
+                            const char* name,
+                            char* value,
+                            size_t length) {
+  MEX_ASSERT(mxIsChar(input) && mxGetString(input, value, length) == 0,
+             "Invalid value for %s option.", name);
+}
+
+/** Get a logical option value.
+ */
+static bool GetOptionLogical(const mxArray* input, const char* name) {
+  MEX_ASSERT((mxIsLogical(input) || mxIsNumeric(input)) &&
+             mxGetNumberOfElements(input) == 1,
+             "Invalid value for %s option.", name);
+  return mxGetScalar(input) != 0;
+}
+
+/** Get a non-negative integer option value.
+ */
+static size_t GetOptionSize(const mxArray* input, const char* name) {
+  double value;
+  MEX_ASSERT(mxIsNumeric(input) && mxGetNumberOfElements(input) == 1,
+             "Invalid value for %s option.", name);
+  value = mxGetScalar(input);
+  MEX_ASSERT(value >= 0 && value == (double)(size_t)value,
+             "Invalid value for %s option.", name);
+  return (size_t)value;
+}
+
+/** Parse an encoder option.
+ * @return false if the name is not an encoder option.
+ */
+static bool ParseEncodeOption(const char* name,
+                              const mxArray* input,
+                              encode_options_t* options) {
+  if (strcasecmp(name, "PackLogical") == 0)
+    options->pack_logical = GetOptionLogical(input, name);
+  else if (strcasecmp(name, "DeltaEncode") == 0)
+    options->delta_encode = GetOptionLogical(input, name);
+  else if (strcasecmp(name, "Compress") == 0) {
+    char value[64];
+    GetOptionString(input, name, value, sizeof(value));
+    if (strcasecmp(value, "zlib") == 0)
+      options->compress = true;
+    else if (strcasecmp(value, "none") == 0)
+      options->compress = false;
+    else
+      MEX_ERROR("Invalid Compress: %s.", value);
+  }
+  else if (strcasecmp(name, "CompressThreshold") == 0)
+    options->compress_threshold = GetOptionSize(input, name);
+  else if (strcasecmp(name, "Depth") == 0)
+    options->max_depth = GetOptionSize(input, name);
+  else
+    return false;
+  return true;
+}
+
+static const encode_plan_t* GetEncodePlan(const mxArray* input);
+
+/** Parse an option of the encode functions, which also take a plan and
+ * an allocator.
+ * @param use_arena whether to allocate libbson memory from the arena.
+ * @return false if the name is not an option of the encode functions.
+ */
+static bool ParseEncodeCallOption(const char* name,
+                                  const mxArray* input,
+                                  encode_options_t* options,
+                                  bool* use_arena) {
+  if (strcasecmp(name, "Plan") == 0)
+    options->plan = GetEncodePlan(input);
+  else if (strcasecmp(name, "Allocator") == 0) {
+    char value[64];
+    GetOptionString(input, name, value, sizeof(value));
+    if (strcasecmp(value, "arena") == 0)
+      *use_arena = true;
+    else if (strcasecmp(value, "default") == 0)
+      *use_arena = false;
+    else
+      MEX_ERROR("Invalid Allocator: %s.", value);
+  }
+  else
+    return ParseEncodeOption(name, input, options);
+  return true;
+}
+
+/** Parse name-value pairs of encoder options.
+ * @param use_arena whether to allocate libbson memory from the arena.
+ */
+static void ParseEncodeOptions(int nrhs,
+                               const mxArray *prhs[],
+                               encode_options_t* options,
+                               bool* use_arena) {
+  int i;
+  MEX_ASSERT(nrhs % 2 == 0, "Options must be given in name-value pairs.");
+  for (i = 0; i < nrhs; i += 2) {
+    char name[64];
+    GetOptionString(prhs[i], "name", name, sizeof(name));
+    if (!ParseEncodeCallOption(name, prhs[i + 1], options, use_arena))
+      MEX_ERROR("Unknown option: %s.", name);
+  }
+}
+
+/** Parse name-value pairs of file writer options.
+ */
+static void ParseWriteOptions(int nrhs,
+                              const mxArray *prhs[],
+                              encode_options_t* options,
+                              write_options_t* write_options) {
+  int i;
+  MEX_ASSERT(nrhs % 2 == 0, "Options must be given in name-value pairs.");
+  for (i = 0; i < nrhs; i += 2) {
+    char name[64];
+    GetOptionString(prhs[i], "name", name, sizeof(name));
+    if (strcasecmp(name, "ChunkSize") == 0) {
+      options->chunk_size = GetOptionSize(prhs[i + 1], name);
+      MEX_ASSERT(options->chunk_size > 0 &&
+                 options->chunk_size <= BSONIO_MAX_CHUNK_SIZE,
+                 "Invalid ChunkSize: %lu.",
+                 (unsigned long)options->chunk_size);
+    }
+    else if (strcasecmp(name, "ChunkThreshold") == 0)
+      options->chunk_threshold = GetOptionSize(prhs[i + 1], name);
+    else if (strcasecmp(name, "Streaming") == 0)
+      write_options->streaming = GetOptionLogical(prhs[i + 1], name);
+    else if (strcasecmp(name, "BufferSize") == 0) {
+      write_options->buffer_size = GetOptionSize(prhs[i + 1], name);
+      MEX_ASSERT(write_options->buffer_size >= 64,
+                 "Invalid BufferSize: %lu.",
+                 (unsigned long)write_options->buffer_size);
+    }
+    else if (!ParseEncodeOption(name, prhs[i + 1], options))
+      MEX_ERROR("Unknown option: %s.", name);
+  }
+}
+
+/** Parse a decoder option.
+ * @return false if the name is not a decoder option.
+ */
+static bool ParseDecodeOption(const char* name,
+                              const mxArray* input,
+                              decode_options_t* options) {
+  char value[64];
+  if (strcasecmp(name, "IntegerClass") == 0) {
+    GetOptionString(input, name, value, sizeof(value));
+    if (strcasecmp(value, "auto") == 0)
+      options->integer_class = BSONMEX_INTEGER_AUTO;
+    else if (strcasecmp(value, "native") == 0)
+      options->integer_class = BSONMEX_INTEGER_NATIVE;
+    else if (strcasecmp(value, "smallest") == 0)
+      options->integer_class = BSONMEX_INTEGER_SMALLEST;
+    else
+      MEX_ERROR("Invalid IntegerClass: %s.", value);
+  }
+  else if (strcasecmp(name, "FloatClass") == 0) {
+    GetOptionString(input, name, value, sizeof(value));
+    if (strcasecmp(value, "double") == 0)
+      options->float_class = mxDOUBLE_CLASS;
+    else if (strcasecmp(value, "single") == 0)
+      options->float_class = mxSINGLE_CLASS;
+    else
+      MEX_ERROR("Invalid FloatClass: %s.", value);
+  }
+  else if (strcasecmp(name, "Depth") == 0)
+    options->max_depth = GetOptionSize(input, name);
+  else
+    return false;
+  return true;
+}
+
+/** Parse name-value pairs of decoder options.
+ */
+static void ParseDecodeOptions(int nrhs,
+                               const mxArray *prhs[],
+                               decode_options_t* options) {
+  int i;
+  MEX_ASSERT(nrhs % 2 == 0, "Options must be given in name-value pairs.");
+  for (i = 0; i < nrhs; i += 2) {
+    char name[64];
+    GetOptionString(prhs[i], "name", name, sizeof(name));
+    if (!ParseDecodeOption(name, prhs[i + 1], options))
+      MEX_ERROR("Unknown option: %s.", name);
+  }
+}
+
+/** Parse name-value pairs of file reader options.
+ */
+static void ParseReadOptions(int nrhs,
+                             const mxArray *prhs[],
+                             decode_options_t* options,
+                             read_options_t* read_options) {
+  int i;
+  MEX_ASSERT(nrhs % 2 == 0, "Options must be given in name-value pairs.");
+  for (i = 0; i < nrhs; i += 2) {
+    char name[64];
+    GetOptionString(prhs[i], "name", name, sizeof(name));
+    if (strcasecmp(name, "Offset") == 0) {
+      read_options->offset = GetOptionSize(prhs[i + 1], name);
+      read_options->range = true;
+    }
+    else if (strcasecmp(name, "Length") == 0) {
+      read_options->length = GetOptionSize(prhs[i + 1], name);
+      read_options->range = true;
+    }
+    else if (strcasecmp(name, "ReadAhead") == 0)
+      read_options->read_ahead = GetOptionSize(prhs[i + 1], name);
+    else if (!ParseDecodeOption(name, prhs[i + 1], options))
+      MEX_ERROR("Unknown option: %s.", name);
+  }
+}
+
+/** Parse JSON exporter and importer options.
+ */
+static void ParseExportOptions(int nrhs,
+                               const mxArray *prhs[],
+                               export_options_t* options) {
+  int i;
+  MEX_ASSERT(nrhs % 2 == 0, "Options must be given in name-value pairs.");
+  for (i = 0; i < nrhs; i += 2) {
+    char name[64];
+    GetOptionString(prhs[i], "name", name, sizeof(name));
+    if (strcasecmp(name, "Threads") == 0) {
+      size_t num_threads = GetOptionSize(prhs[i + 1], name);
+      MEX_ASSERT(num_threads <= 1024, "Invalid value for %s option.", name);
+      options->num_threads = (int)num_threads;
+    }
+    else if (strcasecmp(name, "BatchSize") == 0) {
+      options->batch_size = GetOptionSize(prhs[i + 1], name);
+      MEX_ASSERT(options->batch_size > 0,
+                 "Invalid value for %s option.", name);
+    }
+    else
+      MEX_ERROR("Unknown option: %s.", name);
+  }
+}
+
+/** Parse batch validator options.
+ */
+static void ParseValidateOptions(int nrhs,
+                                 const mxArray *prhs[],
+                                 validate_options_t* options) {
+  int i;
+  MEX_ASSERT(nrhs % 2 == 0, "Options must be given in name-value pairs.");
+  for (i = 0; i < nrhs; i += 2) {
+    char name[64];
+    GetOptionString(prhs[i], "name", name, sizeof(name));
+    if (strcasecmp(name, "UTF8") == 0)
+      options->utf8 = GetOptionLogical(prhs[i + 1], name);
+    else if (strcasecmp(name, "Depth") == 0)
+      options->max_depth = GetOptionSize(prhs[i + 1], name);
+    else if (strcasecmp(name, "Threads") == 0) {
+      size_t num_threads = GetOptionSize(prhs[i + 1], name);
+      MEX_ASSERT(num_threads <= 1024, "Invalid value for %s option.", name);
+      options->num_threads = (int)num_threads;
+    }
+    else
+      MEX_ERROR("Unknown option: %s.", name);
+  }
+}
+
+/** Get a filename argument.
+ * @return filename. Caller must mxFree the returned string.
+ */
+static char* GetFilename(const mxArray* input) {
+  char* filename;
+  MEX_ASSERT(mxIsChar(input), "Expected a filename.");
+  filename = mxArrayToString(input);
+  MEX_ASSERT(filename, "Invalid filename.");
+  return filename;
+}
+
+/** Kind of an object kept in MEX memory.
+ */
+typedef enum {
+  HANDLE_DOCUMENT = 1, /* bson_t* of bson.Document. */
+  HANDLE_ENCODE_PLAN   /* encode_plan_t* of bson.EncoderPlan. */
+} handle_kind_t;
+
+/** Object kept in MEX memory behind a handle.
+ */
+typedef struct handle_entry_t {
+  uint64_t id;    /* Serial number in the upper bits and slot in the lower. */
+  handle_kind_t kind;
+  void* value;
+} handle_entry_t;
+
+/** Table of handles. Each handle locks the MEX file, so that handles stay
+ * valid until released.
+ */
+static handle_entry_t* handle_table = NULL;
+static size_t handle_table_size = 0;
+static uint32_t handle_serial = 0;
+
+/** Release the object of a handle.
+ */
+static void DestroyHandleValue(handle_entry_t* entry) {
+  if (entry->kind == HANDLE_DOCUMENT)
+    bson_destroy((bson_t*)entry->value);
+  else if (entry->kind == HANDLE_ENCODE_PLAN)
+    DestroyEncodePlan((encode_plan_t*)entry->value);
+  entry->value = NULL;
+  entry->id = 0;
+}
+
+/** Release all the handles.
+ */
+static void DestroyHandleTable(void) {
+  size_t i;
+  for (i = 0; i < handle_table_size; ++i)
+    if (handle_table[i].value)
+      DestroyHandleValue(&handle_table[i]);
+  free(handle_table);
+  handle_table = NULL;
+  handle_table_size = 0;
+}
+
+/** Add an object to the table. The object is released on failure.
+ * @return handle of the object.
+ */
+static uint64_t AddHandle(handle_kind_t kind, void* value) {
+  size_t slot;
+  if (!handle_table)
+    AddExitHandler(DestroyHandleTable);
+  for (slot = 0; slot < handle_table_size; ++slot)
+    if (!handle_table[slot].value)
+      break;
+  if (slot == handle_table_size) {
+    size_t size = (handle_table_size) ? 2 * handle_table_size : 16;
+    handle_entry_t* table = NULL;
+    if (size <= UINT32_MAX)
+      table = (handle_entry_t*)realloc(handle_table,
+                                       size * sizeof(handle_entry_t));
+    if (!table) {
+      handle_entry_t entry = {0, kind, value};
+      DestroyHandleValue(&entry);
+      MEX_ERROR("Failed to allocate a handle.");
+    }
+    memset(table + handle_table_size,
+           0,
+           (size - handle_table_size) * sizeof(handle_entry_t));
+    handle_table = table;
+    handle_table_size = size;
+  }
+  if (++handle_serial == 0)
+    ++handle_serial;
+  handle_table[slot].id = ((uint64_t)handle_serial << 32) | slot;
+  handle_table[slot].kind = kind;
+  handle_table[slot].value = value;
+  mexLock();
+  return handle_table[slot].id;
+}
+
+/** Find the table entry of a handle.
+ * @return entry of the handle, or NULL if released.
+ */
+static handle_entry_t* FindHandle(const mxArray* input, handle_kind_t kind) {
+  uint64_t id;
+  size_t slot;
+  MEX_ASSERT(mxIsUint64(input) && mxGetNumberOfElements(input) == 1,
+             "Invalid handle.");
+  id = *(const uint64_t*)mxGetData(input);
+  slot = (size_t)(id & 0xFFFFFFFF);
+  if (slot >= handle_table_size || handle_table[slot].id != id ||
+      handle_table[slot].kind != kind || !handle_table[slot].value)
+    return NULL;
+  return &handle_table[slot];
+}
+
+/** Release a handle. Released handles are ignored.
+ */
+static void ReleaseHandle(const mxArray* input, handle_kind_t kind) {
+  handle_entry_t* entry = FindHandle(input, kind);
+  if (!entry)
+    return;
+  DestroyHandleValue(entry);
+  mexUnlock();
+}
+
+/** Create a uint64 scalar of a handle.
+ */
+static mxArray* CreateHandleScalar(uint64_t id) {
+  mxArray* output = mxCreateNumericMatrix(1, 1, mxUINT64_CLASS, mxREAL);
+  *(uint64_t*)mxGetData(output) = id;
+  return output;
+}
+
+/** Get the document of a handle.
+ */
+static const bson_t* GetDocument(const mxArray* input) {
+  handle_entry_t* entry = FindHandle(input, HANDLE_DOCUMENT);
+  MEX_ASSERT(entry, "Invalid document handle.");
+  return (const bson_t*)entry->value;
+}
+
+/** Get the plan of a bson.EncoderPlan object or its handle.
+ */
+static const encode_plan_t* GetEncodePlan(const mxArray* input) {
+  mxArray* id = (mxIsClass(input, "bson.EncoderPlan")) ?
+      mxGetProperty(input, 0, "id") : NULL;
+  handle_entry_t* entry = FindHandle((id) ? id : input, HANDLE_ENCODE_PLAN);
+  if (id)
+    mxDestroyArray(id);
+  MEX_ASSERT(entry, "Invalid encoder plan.");
+  return (const encode_plan_t*)entry->value;
+}
+
+/** Find a dot-separated path in the document. An empty path refers to the
+ * document itself, and leaves the iterator uninitialized.
+ * @return false if the path is not found.
+ */
+static bool FindDocumentPath(const bson_t* value,
+                             const mxArray* input,
+                             bson_iter_t* it,
+                             bool* is_root) {
+  char* path;
+  bson_iter_t root;
+  bool found = true;
+  MEX_ASSERT(mxIsChar(input), "Expected a path.");
+  *is_root = mxIsEmpty(input);
+  if (*is_root)
+    return true;
+  path = mxArrayToString(input);
+  MEX_ASSERT(path, "Invalid path.");
+  found = bson_iter_init(&root, value) &&
+          bson_iter_find_descendant(&root, path, it);
+  mxFree(path);
+  return found;
+}
+
+/** Find a document or array at the path, and iterate over its elements.
+ */
+static void FindDocumentContainer(const bson_t* value,
+                                  const mxArray* input,
+                                  bson_iter_t* it) {
+  bson_iter_t element;
+  bool is_root;
+  MEX_ASSERT(FindDocumentPath(value, input, &element, &is_root),
+             "Path not found.");
+  if (is_root) {
+    MEX_ASSERT(bson_iter_init(it, value), "Invalid BSON data.");
+    return;
+  }
+  MEX_ASSERT((BSON_ITER_HOLDS_DOCUMENT(&element) ||
+              BSON_ITER_HOLDS_ARRAY(&element)) &&
+             bson_iter_recurse(&element, it),
+             "Not a document or an array.");
+}
+
+/** Create a document to encode into. With the arena, the buffer grows in
+ * the current arena scope through its own realloc function, and the libbson
+ * allocator is left untouched in case the encoder raises an error.
+ * @param use_arena whether to grow the buffer in the arena.
+ * @param buffer pointer to the buffer, which must outlive the document.
+ * @param buffer_length pointer to the capacity of the buffer.
+ */
+static bson_t* CreateEncodeBuffer(bool use_arena,
+                                  uint8_t** buffer,
+                                  size_t* buffer_length) {
+  bson_t* value = (use_arena) ?
+      bson_new_from_buffer(buffer, buffer_length, ArenaReallocBuffer, NULL) :
+      bson_new();
+  MEX_ASSERT(value, "Failed to create a document.");
+  return value;
+}
+
 /** Encode a matlab variable in BSON.
  */
 static void encode(int nlhs, mxArray *plhs[],
                    int nrhs, const mxArray *prhs[]) {
-  bson_t value;
-  CheckInputArguments(1, 1, nrhs);
+  bson_t* value;
+  uint8_t* buffer = NULL;
+  size_t buffer_length = 0;
+  bool result;
+  bool use_arena = false;
+  encode_options_t options = BSONMEX_ENCODE_OPTIONS_INIT;
+  CheckInputArguments(1, INT_MAX, nrhs);
   CheckOutputArguments(0, 1, nlhs);
-  MEX_ASSERT(ConvertMxArrayToBSON(prhs[0], &value), "Failed to convert.");
-  plhs[0] = mxCreateNumericMatrix(1, value.len, mxUINT8_CLASS, mxREAL);
-  memcpy(mxGetData(plhs[0]), bson_get_data(&value), value.len);
-  bson_destroy(&value);
+  ParseEncodeOptions(nrhs - 1, prhs + 1, &options, &use_arena);
+  if (options.plan)
+    MEX_ASSERT(mxIsStruct(prhs[0]) &&
+               MatchEncodePlan(prhs[0], options.plan),
+               "Input does not match the plan.");
+  /* The document buffer grows in the arena and is copied out. */
+  BeginArena();
+  value = CreateEncodeBuffer(use_arena, &buffer, &buffer_length);
+  result = ConvertMxArrayToReusedBSON(prhs[0], &options, value);
+  if (result) {
+    plhs[0] = mxCreateNumericMatrix(1, value->len, mxUINT8_CLASS, mxREAL);
+    memcpy(mxGetData(plhs[0]), bson_get_data(value), value->len);
+  }
+  bson_destroy(value);
+  EndArena();
+  MEX_ASSERT(result, "Failed to convert.");
+}
+
+/** Encode each element of a cell array in BSON, reusing one buffer.
+ */
+static void encodeMany(int nlhs, mxArray *plhs[],
+                       int nrhs, const mxArray *prhs[]) {
+  bson_t* value;
+  uint8_t* value_buffer = NULL;
+  size_t value_buffer_length = 0;
+  bool matched = true;
+  bool result = true;
+  bool use_arena = false;
+  bool concatenate = false;
+  uint8_t* buffer = NULL;
+  size_t length = 0, capacity = 0;
+  size_t num_values, index;
+  int i;
+  encode_options_t options = BSONMEX_ENCODE_OPTIONS_INIT;
+  CheckInputArguments(1, INT_MAX, nrhs);
+  CheckOutputArguments(0, 1, nlhs);
+  MEX_ASSERT(mxIsCell(prhs[0]), "Expected cell array.");
+  MEX_ASSERT(nrhs % 2 == 1, "Options must be given in name-value pairs.");
+  for (i = 1; i < nrhs; i += 2) {
+    char name[64];
+    GetOptionString(prhs[i], "name", name, sizeof(name));
+    if (strcasecmp(name, "Concatenate") == 0)
+      concatenate = GetOptionLogical(prhs[i + 1], name);
+    else if (!ParseEncodeCallOption(name, prhs[i + 1], &options, &use_arena))
+      MEX_ERROR("Unknown option: %s.", name);
+  }
+  num_values = mxGetNumberOfElements(prhs[0]);
+  if (!concatenate)
+    plhs[0] = mxCreateCellArray(mxGetNumberOfDimensions(prhs[0]),
+                                mxGetDimensions(prhs[0]));
+  BeginArena();
+  value = CreateEncodeBuffer(use_arena, &value_buffer, &value_buffer_length);
+  for (index = 0; index < num_values; ++index) {
+    const mxArray* element = mxGetCell(prhs[0], index);
+    if (options.plan)
+      matched = element &&
+                mxIsStruct(element) &&
+                MatchEncodePlan(element, options.plan);
+    result = matched &&
+             element &&
+             ConvertMxArrayToReusedBSON(element, &options, value);
+    if (!result)
+      break;
+    if (concatenate) {
+      if (length + value->len > capacity) {
+        capacity = (2 * capacity > length + value->len) ?
+            2 * capacity : length + value->len;
+        buffer = (uint8_t*)ArenaRealloc(buffer, capacity);
+      }
+      memcpy(buffer + length, bson_get_data(value), value->len);
+      length += value->len;
+    }
+    else {
+      mxArray* output = mxCreateNumericMatrix(1,
+                                              value->len,
+                                              mxUINT8_CLASS,
+                                              mxREAL);
+      memcpy(mxGetData(output), bson_get_data(value), value->len);
+      mxSetCell(plhs[0], index, output);
+    }
+  }
+  bson_destroy(value);
+  if (result && concatenate) {
+    plhs[0] = mxCreateNumericMatrix(1, length, mxUINT8_CLASS, mxREAL);
+    if (length)
+      memcpy(mxGetData(plhs[0]), buffer, length);
+  }
+  ArenaFree(buffer);
+  EndArena();
+  MEX_ASSERT(matched,
+             "Element %lu does not match the plan.",
+             (unsigned long)(index + 1));
+  MEX_ASSERT(result,
+             "Failed to convert element %lu.",
+             (unsigned long)(index + 1));
+}
+
+/** Decode BSON by the schema. Mismatches are an error unless requested.
+ */
+static void DecodeWithSchema(int nlhs,
+                             mxArray *plhs[],
+                             const mxArray* input,
+                             const mxArray* schema_input,
+                             const decode_options_t* options) {
+  decode_schema_t* schema = CreateDecodeSchema(schema_input);
+  bson_t* value = NULL;
+  mxArray* mismatches = NULL;
+  bool result = false;
+  MEX_ASSERT(schema, "Invalid value for Schema option.");
+  value = CreateBSON(input);
+  result = ConvertBSONToMxArrayWithSchema(value,
+                                          schema,
+                                          options,
+                                          &plhs[0],
+                                          &mismatches);
+  bson_destroy(value);
+  DestroyDecodeSchema(schema);
+  MEX_ASSERT(result, "Failed to convert.");
+  if (nlhs > 1)
+    plhs[1] = mismatches;
+  else if (mxGetNumberOfElements(mismatches)) {
+    char path[256];
+    mxGetString(mxGetCell(mismatches, 0), path, sizeof(path));
+    MEX_ERROR("Value does not match the schema: %s.", path);
+  }
 }
 
 /** Decode a matlab variable from BSON.
@@ -55,12 +656,168 @@ static void decode(int nlhs, mxArray *plhs[],
                    int nrhs, const mxArray *prhs[]) {
   bson_t* value = NULL;
   bool result = false;
-  CheckInputArguments(1, 1, nrhs);
-  CheckOutputArguments(0, 1, nlhs);
+  bool use_cache = false;
+  uint64_t hash = 0;
+  const mxArray* schema_input = NULL;
+  int i;
+  decode_options_t options = BSONMEX_DECODE_OPTIONS_INIT;
+  CheckInputArguments(1, INT_MAX, nrhs);
+  CheckOutputArguments(0, 2, nlhs);
+  MEX_ASSERT(nrhs % 2 == 1, "Options must be given in name-value pairs.");
+  for (i = 1; i < nrhs; i += 2) {
+    char name[64];
+    GetOptionString(prhs[i], "name", name, sizeof(name));
+    if (strcasecmp(name, "Cache") == 0)
+      use_cache = GetOptionLogical(prhs[i + 1], name);
+    else if (strcasecmp(name, "Schema") == 0)
+      schema_input = prhs[i + 1];
+    else if (!ParseDecodeOption(name, prhs[i + 1], &options))
+      MEX_ERROR("Unknown option: %s.", name);
+  }
+  if (schema_input) {
+    MEX_ASSERT(!use_cache, "Cache cannot be used with Schema.");
+    DecodeWithSchema(nlhs, plhs, prhs[0], schema_input, &options);
+    return;
+  }
+  if (nlhs > 1)
+    plhs[1] = mxCreateCellMatrix(1, 0);
+  if (use_cache) {
+    MEX_ASSERT(mxIsUint8(prhs[0]), "Expected uint8 array.");
+    hash = HashBytes((const uint8_t*)mxGetData(prhs[0]),
+                     mxGetNumberOfElements(prhs[0]));
+    plhs[0] = FindDecodeCache((const uint8_t*)mxGetData(prhs[0]),
+                              mxGetNumberOfElements(prhs[0]),
+                              hash,
+                              &options);
+    if (plhs[0])
+      return;
+  }
   value = CreateBSON(prhs[0]);
-  result = ConvertBSONToMxArray(value, &plhs[0]);
+  result = ConvertBSONToMxArray(value, &options, &plhs[0]);
   bson_destroy(value);
   MEX_ASSERT(result, "Failed to convert.");
+  if (use_cache) {
+    AddExitHandler(ClearDecodeCache);
+    AddDecodeCache((const uint8_t*)mxGetData(prhs[0]),
+                   mxGetNumberOfElements(prhs[0]),
+                   hash,
+                   &options,
+                   plhs[0]);
+  }
+}
+
+/** Read the length of the document at the start of the data.
+ */
+static size_t ReadLength(const uint8_t* data) {
+  return (size_t)data[0] |
+         ((size_t)data[1] << 8) |
+         ((size_t)data[2] << 16) |
+         ((size_t)data[3] << 24);
+}
+
+/** Decode BSON documents of a cell array or of a concatenated buffer.
+ */
+static void decodeMany(int nlhs, mxArray *plhs[],
+                       int nrhs, const mxArray *prhs[]) {
+  bson_t value;
+  mxArray* output;
+  size_t num_values, index;
+  decode_options_t options = BSONMEX_DECODE_OPTIONS_INIT;
+  CheckInputArguments(1, INT_MAX, nrhs);
+  CheckOutputArguments(0, 1, nlhs);
+  ParseDecodeOptions(nrhs - 1, prhs + 1, &options);
+  if (mxIsCell(prhs[0])) {
+    num_values = mxGetNumberOfElements(prhs[0]);
+    plhs[0] = mxCreateCellArray(mxGetNumberOfDimensions(prhs[0]),
+                                mxGetDimensions(prhs[0]));
+    for (index = 0; index < num_values; ++index) {
+      const mxArray* element = mxGetCell(prhs[0], index);
+      /* Documents are read in place without a copy. */
+      MEX_ASSERT(element &&
+                 mxIsUint8(element) &&
+                 bson_init_static(&value,
+                                  (const uint8_t*)mxGetData(element),
+                                  mxGetNumberOfElements(element)),
+                 "Invalid BSON data at element %lu.",
+                 (unsigned long)(index + 1));
+      MEX_ASSERT(ConvertBSONToMxArray(&value, &options, &output),
+                 "Failed to convert element %lu.",
+                 (unsigned long)(index + 1));
+      mxSetCell(plhs[0], index, output);
+    }
+  }
+  else {
+    const uint8_t* data;
+    size_t length;
+    size_t offset = 0;
+    MEX_ASSERT(mxIsUint8(prhs[0]), "Expected uint8 array or cell array.");
+    data = (const uint8_t*)mxGetData(prhs[0]);
+    length = mxGetNumberOfElements(prhs[0]);
+    /* Frame the documents by their lengths first. */
+    for (num_values = 0; offset < length; ++num_values) {
+      size_t document_length = (length - offset >= 4) ?
+          ReadLength(data + offset) : 0;
+      MEX_ASSERT(document_length >= 5 &&
+                 document_length <= length - offset,
+                 "Invalid BSON data at document %lu.",
+                 (unsigned long)(num_values + 1));
+      offset += document_length;
+    }
+    plhs[0] = mxCreateCellMatrix(1, num_values);
+    for (index = 0, offset = 0; index < num_values; ++index) {
+      size_t document_length = ReadLength(data + offset);
+      MEX_ASSERT(bson_init_static(&value, data + offset, document_length),
+                 "Invalid BSON data at document %lu.",
+                 (unsigned long)(index + 1));
+      MEX_ASSERT(ConvertBSONToMxArray(&value, &options, &output),
+                 "Failed to convert document %lu.",
+                 (unsigned long)(index + 1));
+      mxSetCell(plhs[0], index, output);
+      offset += document_length;
+    }
+  }
+}
+
+/** Configure the decode cache, and get its statistics.
+ */
+static void decodeCache(int nlhs, mxArray *plhs[],
+                        int nrhs, const mxArray *prhs[]) {
+  decode_cache_stats_t stats;
+  const char* fields[] = {"hits", "misses", "evictions", "entries", "bytes",
+                          "capacity", "maxBytes"};
+  int i;
+  CheckOutputArguments(0, 1, nlhs);
+  MEX_ASSERT(nrhs % 2 == 0, "Options must be given in name-value pairs.");
+  GetDecodeCacheStats(&stats);
+  for (i = 0; i < nrhs; i += 2) {
+    char name[64];
+    GetOptionString(prhs[i], "name", name, sizeof(name));
+    if (strcasecmp(name, "Capacity") == 0)
+      stats.capacity = GetOptionSize(prhs[i + 1], name);
+    else if (strcasecmp(name, "MaxBytes") == 0)
+      stats.max_bytes = GetOptionSize(prhs[i + 1], name);
+    else if (strcasecmp(name, "Clear") == 0) {
+      if (GetOptionLogical(prhs[i + 1], name))
+        ClearDecodeCache();
+    }
+    else
+      MEX_ERROR("Unknown option: %s.", name);
+  }
+  SetDecodeCacheCapacity(stats.capacity, stats.max_bytes);
+  GetDecodeCacheStats(&stats);
+  plhs[0] = mxCreateStructMatrix(1, 1, 7, fields);
+  mxSetField(plhs[0], 0, "hits", mxCreateDoubleScalar((double)stats.hits));
+  mxSetField(plhs[0], 0, "misses",
+             mxCreateDoubleScalar((double)stats.misses));
+  mxSetField(plhs[0], 0, "evictions",
+             mxCreateDoubleScalar((double)stats.evictions));
+  mxSetField(plhs[0], 0, "entries",
+             mxCreateDoubleScalar((double)stats.entries));
+  mxSetField(plhs[0], 0, "bytes", mxCreateDoubleScalar((double)stats.bytes));
+  mxSetField(plhs[0], 0, "capacity",
+             mxCreateDoubleScalar((double)stats.capacity));
+  mxSetField(plhs[0], 0, "maxBytes",
+             mxCreateDoubleScalar((double)stats.max_bytes));
 }
 
 /** Check if the input is a valid BSON.
@@ -115,10 +872,327 @@ static void fromJSON(int nlhs, mxArray *plhs[],
   bson_destroy(&value);
 }
 
+/** Convert JSON to a matlab variable without BSON.
+ */
+static void parseJSON(int nlhs, mxArray *plhs[],
+                      int nrhs, const mxArray *prhs[]) {
+  char* json_string = NULL;
+  size_t error_offset = SIZE_MAX;
+  bool result = false;
+  decode_options_t options = BSONMEX_DECODE_OPTIONS_INIT;
+  CheckInputArguments(1, INT_MAX, nrhs);
+  CheckOutputArguments(0, 1, nlhs);
+  MEX_ASSERT(mxIsChar(prhs[0]), "Expected a JSON string.");
+  ParseDecodeOptions(nrhs - 1, prhs + 1, &options);
+  json_string = mxArrayToString(prhs[0]);
+  MEX_ASSERT(json_string, "Invalid JSON string.");
+  result = ConvertJSONToMxArray(json_string,
+                                strlen(json_string),
+                                &options,
+                                &error_offset,
+                                &plhs[0]);
+  mxFree(json_string);
+  MEX_ASSERT(result || error_offset == SIZE_MAX,
+             "Failed to parse JSON at %lu.",
+             (unsigned long)error_offset);
+  MEX_ASSERT(result, "Failed to convert.");
+}
+
+/** Convert a matlab variable to JSON without BSON.
+ */
+static void toJSON(int nlhs, mxArray *plhs[],
+                   int nrhs, const mxArray *prhs[]) {
+  char* filename = NULL;
+  char* json_string = NULL;
+  size_t length = 0;
+  FILE* file = NULL;
+  bool result = false;
+  int i;
+  CheckInputArguments(1, INT_MAX, nrhs);
+  MEX_ASSERT((nrhs - 1) % 2 == 0,
+             "Options must be given in name-value pairs.");
+  for (i = 1; i < nrhs; i += 2) {
+    char name[64];
+    GetOptionString(prhs[i], "name", name, sizeof(name));
+    MEX_ASSERT(strcasecmp(name, "File") == 0, "Unknown option: %s.", name);
+    if (filename)
+      mxFree(filename);
+    filename = GetFilename(prhs[i + 1]);
+  }
+  CheckOutputArguments(0, (filename) ? 0 : 1, nlhs);
+  if (filename) {
+    file = fopen(filename, "wb");
+    MEX_ASSERT(file, "Failed to open: %s.", filename);
+  }
+  result = ConvertMxArrayToJSON(prhs[0], file, &json_string, &length);
+  if (file)
+    result = (fclose(file) == 0) && result;
+  MEX_ASSERT(result, (filename) ? "Failed to write: %s." :
+                                  "Failed to convert.", filename);
+  if (filename)
+    mxFree(filename);
+  else {
+    plhs[0] = mxCreateString(json_string);
+    mxFree(json_string);
+  }
+}
+
+/** Read a matlab variable from a BSON file.
+ */
+static void readFile(int nlhs, mxArray *plhs[],
+                     int nrhs, const mxArray *prhs[]) {
+  char* filename = NULL;
+  bool result = false;
+  decode_options_t options = BSONMEX_DECODE_OPTIONS_INIT;
+  read_options_t read_options = BSONIO_READ_OPTIONS_INIT;
+  CheckInputArguments(1, INT_MAX, nrhs);
+  CheckOutputArguments(0, 1, nlhs);
+  ParseReadOptions(nrhs - 1, prhs + 1, &options, &read_options);
+  filename = GetFilename(prhs[0]);
+  result = ReadBSONFile(filename, &options, &read_options, &plhs[0]);
+  MEX_ASSERT(result, "Failed to read: %s.", filename);
+  mxFree(filename);
+}
+
+/** Write a matlab variable to a BSON file.
+ */
+static void writeFile(int nlhs, mxArray *plhs[],
+                      int nrhs, const mxArray *prhs[]) {
+  char* filename = NULL;
+  bool result = false;
+  encode_options_t options = BSONMEX_ENCODE_OPTIONS_INIT;
+  write_options_t write_options = BSONIO_WRITE_OPTIONS_INIT;
+  (void)plhs;
+  CheckInputArguments(2, INT_MAX, nrhs);
+  CheckOutputArguments(0, 0, nlhs);
+  ParseWriteOptions(nrhs - 2, prhs + 2, &options, &write_options);
+  filename = GetFilename(prhs[1]);
+  result = WriteBSONFile(filename, prhs[0], &options, &write_options);
+  MEX_ASSERT(result, "Failed to write: %s.", filename);
+  mxFree(filename);
+}
+
+/** Export a BSON file to a newline-delimited JSON file.
+ */
+static void exportJSON(int nlhs, mxArray *plhs[],
+                       int nrhs, const mxArray *prhs[]) {
+  char* input_filename = NULL;
+  char* output_filename = NULL;
+  bool result = false;
+  export_options_t options = BSONIO_EXPORT_OPTIONS_INIT;
+  (void)plhs;
+  CheckInputArguments(2, INT_MAX, nrhs);
+  CheckOutputArguments(0, 0, nlhs);
+  ParseExportOptions(nrhs - 2, prhs + 2, &options);
+  input_filename = GetFilename(prhs[0]);
+  output_filename = GetFilename(prhs[1]);
+  result = ExportJSONFile(input_filename, output_filename, &options);
+  MEX_ASSERT(result, "Failed to export: %s.", input_filename);
+  mxFree(input_filename);
+  mxFree(output_filename);
+}
+
+/** Import a JSON file to a BSON file.
+ */
+static void importJSON(int nlhs, mxArray *plhs[],
+                       int nrhs, const mxArray *prhs[]) {
+  char* input_filename = NULL;
+  char* output_filename = NULL;
+  size_t error_offset = SIZE_MAX;
+  bool result = false;
+  export_options_t options = BSONIO_EXPORT_OPTIONS_INIT;
+  (void)plhs;
+  CheckInputArguments(2, INT_MAX, nrhs);
+  CheckOutputArguments(0, 0, nlhs);
+  ParseExportOptions(nrhs - 2, prhs + 2, &options);
+  input_filename = GetFilename(prhs[0]);
+  output_filename = GetFilename(prhs[1]);
+  result = ImportJSONFile(input_filename,
+                          output_filename,
+                          &options,
+                          &error_offset);
+  MEX_ASSERT(result || error_offset == SIZE_MAX,
+             "Failed to parse JSON at %lu: %s.",
+             (unsigned long)error_offset,
+             input_filename);
+  MEX_ASSERT(result, "Failed to import: %s.", input_filename);
+  mxFree(input_filename);
+  mxFree(output_filename);
+}
+
+/** Validate concatenated BSON documents in a buffer or a file.
+ */
+static void validateMany(int nlhs, mxArray *plhs[],
+                         int nrhs, const mxArray *prhs[]) {
+  validate_options_t options = BSONVALID_OPTIONS_INIT;
+  validate_result_t result;
+  const char* fields[] = {"document", "offset", "reason"};
+  CheckInputArguments(1, INT_MAX, nrhs);
+  CheckOutputArguments(0, 2, nlhs);
+  ParseValidateOptions(nrhs - 1, prhs + 1, &options);
+  if (mxIsChar(prhs[0])) {
+    char* filename = GetFilename(prhs[0]);
+    bool status = ValidateBSONFile(filename, &options, &result);
+    MEX_ASSERT(status, "Failed to read: %s.", filename);
+    mxFree(filename);
+  }
+  else {
+    MEX_ASSERT(mxIsUint8(prhs[0]), "Expected uint8 array or a filename.");
+    ValidateBSONBuffer((const uint8_t*)mxGetData(prhs[0]),
+                       mxGetNumberOfElements(prhs[0]),
+                       &options,
+                       &result);
+  }
+  plhs[0] = mxCreateLogicalMatrix(1, result.num_documents);
+  if (result.num_documents)
+    memcpy(mxGetLogicals(plhs[0]),
+           result.status,
+           result.num_documents * sizeof(mxLogical));
+  mxFree(result.status);
+  if (nlhs < 2)
+    return;
+  if (!result.has_error) {
+    plhs[1] = mxCreateDoubleMatrix(0, 0, mxREAL);
+    return;
+  }
+  plhs[1] = mxCreateStructMatrix(1, 1, 3, fields);
+  mxSetField(plhs[1], 0, "document",
+             mxCreateDoubleScalar((double)result.error_document + 1));
+  mxSetField(plhs[1], 0, "offset",
+             mxCreateDoubleScalar((double)result.error_offset));
+  mxSetField(plhs[1], 0, "reason", mxCreateString(result.error_reason));
+}
+
+/** Compile the layout of a template struct, and return its handle.
+ */
+static void compileEncoder(int nlhs, mxArray *plhs[],
+                           int nrhs, const mxArray *prhs[]) {
+  encode_plan_t* plan;
+  CheckInputArguments(1, 1, nrhs);
+  CheckOutputArguments(0, 1, nlhs);
+  MEX_ASSERT(mxIsStruct(prhs[0]) && mxGetNumberOfElements(prhs[0]) > 0,
+             "Expected a non-empty struct.");
+  plan = CreateEncodePlan(prhs[0]);
+  MEX_ASSERT(plan, "Failed to compile.");
+  plhs[0] = CreateHandleScalar(AddHandle(HANDLE_ENCODE_PLAN, plan));
+}
+
+/** Release an encoder plan handle. Released handles are ignored.
+ */
+static void destroyEncoderPlan(int nlhs, mxArray *plhs[],
+                               int nrhs, const mxArray *prhs[]) {
+  (void)plhs;
+  CheckInputArguments(1, 1, nrhs);
+  CheckOutputArguments(0, 0, nlhs);
+  ReleaseHandle(prhs[0], HANDLE_ENCODE_PLAN);
+}
+
+/** Keep a BSON document in MEX memory, and return its handle.
+ */
+static void createDocument(int nlhs, mxArray *plhs[],
+                           int nrhs, const mxArray *prhs[]) {
+  bson_t* value = NULL;
+  CheckInputArguments(1, 1, nrhs);
+  CheckOutputArguments(0, 1, nlhs);
+  MEX_ASSERT(mxIsUint8(prhs[0]), "Expected uint8 array.");
+  value = CreateBSON(prhs[0]);
+  if (!bson_validate(value, BSON_VALIDATE_NONE, NULL)) {
+    bson_destroy(value);
+    MEX_ERROR("Invalid BSON data.");
+  }
+  plhs[0] = CreateHandleScalar(AddHandle(HANDLE_DOCUMENT, value));
+}
+
+/** Release a document handle. Released handles are ignored.
+ */
+static void destroyDocument(int nlhs, mxArray *plhs[],
+                            int nrhs, const mxArray *prhs[]) {
+  (void)plhs;
+  CheckInputArguments(1, 1, nrhs);
+  CheckOutputArguments(0, 0, nlhs);
+  ReleaseHandle(prhs[0], HANDLE_DOCUMENT);
+}
+
+/** Decode the value at a path of a document handle.
+ */
+static void decodeDocument(int nlhs, mxArray *plhs[],
+                           int nrhs, const mxArray *prhs[]) {
+  const bson_t* value;
+  bson_iter_t it;
+  bool is_root, found, result;
+  decode_options_t options = BSONMEX_DECODE_OPTIONS_INIT;
+  CheckInputArguments(2, INT_MAX, nrhs);
+  CheckOutputArguments(0, 2, nlhs);
+  ParseDecodeOptions(nrhs - 2, prhs + 2, &options);
+  value = GetDocument(prhs[0]);
+  found = FindDocumentPath(value, prhs[1], &it, &is_root);
+  if (nlhs > 1)
+    plhs[1] = mxCreateLogicalScalar(found);
+  else
+    MEX_ASSERT(found, "Path not found.");
+  if (!found) {
+    plhs[0] = mxCreateDoubleMatrix(0, 0, mxREAL);
+    return;
+  }
+  result = (is_root) ? ConvertBSONToMxArray(value, &options, &plhs[0]) :
+                       ConvertBSONValueToMxArray(&it, &options, &plhs[0]);
+  MEX_ASSERT(result, "Failed to convert.");
+}
+
+/** Get keys of the document or array at a path of a document handle.
+ */
+static void getDocumentKeys(int nlhs, mxArray *plhs[],
+                            int nrhs, const mxArray *prhs[]) {
+  bson_iter_t it, counter;
+  size_t size = 0;
+  size_t i;
+  CheckInputArguments(2, 2, nrhs);
+  CheckOutputArguments(0, 1, nlhs);
+  FindDocumentContainer(GetDocument(prhs[0]), prhs[1], &it);
+  counter = it;
+  while (bson_iter_next(&counter))
+    ++size;
+  plhs[0] = mxCreateCellMatrix(1, size);
+  for (i = 0; i < size && bson_iter_next(&it); ++i)
+    mxSetCell(plhs[0], i, mxCreateString(bson_iter_key(&it)));
+}
+
+/** Get the number of elements of the document or array at a path of a
+ * document handle.
+ */
+static void getDocumentLength(int nlhs, mxArray *plhs[],
+                              int nrhs, const mxArray *prhs[]) {
+  bson_iter_t it;
+  size_t size = 0;
+  CheckInputArguments(2, 2, nrhs);
+  CheckOutputArguments(0, 1, nlhs);
+  FindDocumentContainer(GetDocument(prhs[0]), prhs[1], &it);
+  while (bson_iter_next(&it))
+    ++size;
+  plhs[0] = mxCreateDoubleScalar((double)size);
+}
+
 MEX_DISPATCH_MAIN(
   MEX_DISPATCH_ADD(encode),
+  MEX_DISPATCH_ADD(encodeMany),
+  MEX_DISPATCH_ADD(compileEncoder),
+  MEX_DISPATCH_ADD(destroyEncoderPlan),
   MEX_DISPATCH_ADD(decode),
+  MEX_DISPATCH_ADD(decodeMany),
+  MEX_DISPATCH_ADD(decodeCache),
   MEX_DISPATCH_ADD(validate),
+  MEX_DISPATCH_ADD(validateMany),
   MEX_DISPATCH_ADD(asJSON),
-  MEX_DISPATCH_ADD(fromJSON)
+  MEX_DISPATCH_ADD(fromJSON),
+  MEX_DISPATCH_ADD(parseJSON),
+  MEX_DISPATCH_ADD(toJSON),
+  MEX_DISPATCH_ADD(readFile),
+  MEX_DISPATCH_ADD(writeFile),
+  MEX_DISPATCH_ADD(exportJSON),
+  MEX_DISPATCH_ADD(importJSON),
+  MEX_DISPATCH_ADD(createDocument),
+  MEX_DISPATCH_ADD(destroyDocument),
+  MEX_DISPATCH_ADD(decodeDocument),
+  MEX_DISPATCH_ADD(getDocumentKeys),
+  MEX_DISPATCH_ADD(getDocumentLength)
 )
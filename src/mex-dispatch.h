@@ -41,6 +41,10 @@
  *   // mylibrary-impl.c
  *   void myFunction(...) {}
  *   void myFunction2(...) {}
+ *
+ * Note: define MEX_DISPATCH_PREPARE() before including this file to run a
+ * statement before every dispatched function, e.g. to reset a global state
+ * left by an error in a previous call.
  * 
  */
 
@@ -50,6 +54,10 @@
 #include <mex.h>
 #include <string.h>
 
+#ifndef MEX_DISPATCH_PREPARE
+#define MEX_DISPATCH_PREPARE()
+#endif
+
 /** Declare a dispachable function.
  */
 #define MEX_DISPATCH_DECLARE(name) \
@@ -80,6 +88,7 @@ void mexFunction(int nlhs, mxArray** plhs, int nrhs, const mxArray** prhs) { \
     mexErrMsgIdAndTxt("dispatch:error", "Failed to get a function name."); \
   for (i = 0; i < sizeof(kFunctionTable) / sizeof(function_entry_t); ++i) { \
     if (strcmp(kFunctionTable[i].name, function_name) == 0) { \
+      MEX_DISPATCH_PREPARE(); \
       kFunctionTable[i].function(nlhs, plhs, nrhs - 1, prhs + 1); \
       return; \
     } \
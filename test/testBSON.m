@@ -32,4 +32,421 @@ function testBSON
     disp(value1);
     disp(value2);
   end
+
+  % Mixed numeric arrays are promoted, and null becomes NaN.
+  value = bson.decode(bson.fromJSON('{"a": [1, 2.5, null], "b": [[1, 2], [3.5, 4]]}'));
+  assert(isa(value.a, 'double') && isequal(value.a(1:2), [1, 2.5]));
+  assert(isnan(value.a(3)));
+  assert(isequal(value.b, [1, 2; 3.5, 4]));
+  large = int64(2^53) + 1;
+  value = bson.decode(bson.encode(struct('a', {{large, 2}}, ...
+                                         'b', {{{large, 2}, {3, 4}}})));
+  assert(isa(value.a, 'int64') && isequal(value.a, [large, 2]));
+  assert(isa(value.b, 'int64') && isequal(value.b, [large, 2; 3, 4]));
+  value = bson.decode(bson.fromJSON(['{"a": [9007199254740993, null], ', ...
+                                     '"b": [9007199254740993, 0.5], ', ...
+                                     '"c": [[9007199254740993], [0.5]], ', ...
+                                     '"d": [3, null]}']), ...
+                      'IntegerClass', 'native');
+  assert(iscell(value.a) && isequal(value.a{1}, large) && isempty(value.a{2}));
+  assert(iscell(value.b) && isequal(value.b{1}, large));
+  assert(iscell(value.c) && isequal(value.c{1}, large));
+  assert(isa(value.d, 'double') && isnan(value.d(2)));
+
+  % Compact classes.
+  bson_value = bson.fromJSON('{"a": [1, 200], "b": [-1, 300], "c": 5, "d": 1.5}');
+  value = bson.decode(bson_value, 'IntegerClass', 'smallest', ...
+                      'FloatClass', 'single');
+  assert(isa(value.a, 'uint8') && isequal(value.a, [1, 200]));
+  assert(isa(value.b, 'int16') && isequal(value.b, [-1, 300]));
+  assert(isa(value.c, 'uint8') && isa(value.d, 'single'));
+  value = bson.decode(bson_value, 'IntegerClass', 'native');
+  assert(isa(value.c, 'int32'));
+
+  % Packed logical arrays.
+  value1 = struct('mask', rand(7, 5, 3) > 0.5);
+  bson_value = bson.encode(value1, 'PackLogical', true);
+  assert(bson.validate(bson_value));
+  assert(numel(bson_value) < numel(value1.mask));
+  assert(isequal(bson.decode(bson_value), value1));
+
+  % Delta encoded int64 and datetime arrays.
+  value1 = struct('id', int64(1e12) + int64(cumsum(randi(100, 1, 1000))));
+  bson_value = bson.encode(value1, 'DeltaEncode', true);
+  assert(numel(bson_value) < 2 * numel(value1.id));
+  assert(isequal(bson.decode(bson_value), value1));
+  value1 = bson.datetime(struct('number', ...
+                                num2cell(datenum('2009-01-01') + (0:9) / 24)));
+  value2 = bson.decode(bson.encode(value1, 'DeltaEncode', true));
+  assert(isequal(size(value2), size(value1)));
+  assert(all(abs(double(value2) - double(value1)) < 1 / 86400));
+  bson_value = bson.encode(struct('t', value1), 'DeltaEncode', true);
+  offset = strfind(char(bson_value), 'mx');
+  bson_value(offset(1) + (8:23)) = typecast(uint64([2^61, 1]), 'uint8');
+  value2 = bson.decode(bson_value);
+  assert(isa(value2.t, 'uint8'));
+
+  % Compressed arrays.
+  value1 = struct('weights', repmat(magic(8), [100, 10, 2]), ...
+                  'raw', uint8(mod(1:1e5, 7)));
+  bson_value = bson.encode(value1, 'Compress', 'zlib', ...
+                           'CompressThreshold', 1e4);
+  assert(numel(bson_value) < 1e5);
+  assert(isequal(bson.decode(bson_value), value1));
+  bson_value = bson.encode(struct('w', repmat(magic(8), [100, 10])), ...
+                           'Compress', 'zlib', 'CompressThreshold', 1e4);
+  offset = strfind(char(bson_value), 'mx');
+  bson_value(offset(1) + (32:47)) = 0;
+  try
+    bson.decode(bson_value);
+    assert(false);
+  catch exception
+    assert(~isempty(strfind(exception.message, 'convert')));
+  end
+
+  % Sparse matrices.
+  value1 = struct('a', sprand(1e5, 1e5, 1e-6), 'b', sparse(eye(3) > 0));
+  bson_value = bson.encode(value1);
+  assert(bson.validate(bson_value));
+  value2 = bson.decode(bson_value);
+  assert(issparse(value2.a) && isequal(value2, value1));
+
+  % Complex arrays.
+  value1 = struct('z', fft(rand(4, 3, 2)), ...
+                  's', single(1 + 2i), ...
+                  'i', int16([1 + 2i, -3i]), ...
+                  'sp', sparse([1 0; 0 2i]));
+  value2 = bson.decode(bson.encode(value1));
+  assert(~isreal(value2.s) && isequal(value2, value1));
+  bson_value = bson.encode(struct('z', complex([1, 2], [3, 4])));
+  offset = strfind(char(bson_value), 'mx');
+  bson_value(offset(1) + (8:15)) = typecast(uint64(2^40), 'uint8');
+  value2 = bson.decode(bson_value);
+  assert(isa(value2.z, 'uint8'));
+
+  % Chunked arrays.
+  filename = [tempname, '.bson'];
+  value1 = struct('a', rand(300, 200), 'b', 'text', 'c', uint16(1:1e4));
+  bson.write(value1, filename, 'ChunkSize', 4096, 'ChunkThreshold', 1e4);
+  value2 = bson.read(filename);
+  fid = fopen(filename, 'r');
+  bson_value = fread(fid, inf, 'uint8=>uint8')';
+  fclose(fid);
+  delete(filename);
+  assert(isequal(value2, value1));
+  offset = 0;
+  while offset + double(typecast(bson_value(offset + (1:4)), 'int32')) < ...
+        numel(bson_value)
+    offset = offset + double(typecast(bson_value(offset + (1:4)), 'int32'));
+  end
+  try
+    bson.decode(bson_value(offset + 1:end));
+    assert(false);
+  catch exception
+    assert(~isempty(strfind(exception.message, 'convert')));
+  end
+  filename = [tempname, '.bson'];
+  value1 = struct('files_id', int64(0), 'n', int32(0), 'data', uint8(1:64));
+  bson.write(value1, filename);
+  value2 = bson.read(filename);
+  value3 = bson.read(filename, 'ReadAhead', 64);
+  delete(filename);
+  assert(isequal(value2, value1) && isequal(value3, value1));
+
+  % Streaming writer.
+  filename = [tempname, '.bson'];
+  value1 = struct('a', {{rand(30, 20), 'text', struct('b', num2cell(1:5))}}, ...
+                  'c', int32(1:1e4), ...
+                  'd', true(3, 4, 2));
+  bson.write(value1, filename, 'Streaming', true, 'BufferSize', 1024);
+  fid = fopen(filename, 'r');
+  bson_value = fread(fid, inf, 'uint8=>uint8')';
+  fclose(fid);
+  delete(filename);
+  assert(isequal(bson_value, bson.encode(value1)));
+
+  % Range reads.
+  filename = [tempname, '.bson'];
+  bson_values = {bson.encode(struct('k', 1)), ...
+                 bson.encode(struct('k', 'two')), ...
+                 bson.encode(struct('k', [3 4]))};
+  fid = fopen(filename, 'w');
+  fwrite(fid, [bson_values{:}], 'uint8');
+  fclose(fid);
+  offset = numel(bson_values{1});
+  value1 = bson.read(filename, 'Offset', offset);
+  value2 = bson.read(filename, 'Offset', offset, ...
+                     'Length', numel(bson_values{2}) + numel(bson_values{3}));
+  value3 = bson.read(filename, 'ReadAhead', 64);
+  delete(filename);
+  assert(iscell(value3) && isequal(value3{3}, value2{2}));
+  assert(isequal(value1, struct('k', 'two')));
+  assert(iscell(value2) && isequal(value2{2}, struct('k', [3 4])));
+
+  % Gzip-compressed files.
+  filename = [tempname, '.bson.gz'];
+  value1 = struct('a', repmat(1:100, 1, 100), 'b', 'text');
+  bson.write(value1, filename, 'ChunkSize', 4096, 'ChunkThreshold', 1e4);
+  fid = fopen(filename, 'r');
+  magic = fread(fid, 2, 'uint8=>uint8')';
+  fclose(fid);
+  value2 = bson.read(filename);
+  delete(filename);
+  assert(isequal(magic, uint8([31 139])) && isequal(value2, value1));
+
+  % NDJSON export.
+  filename = [tempname, '.bson'];
+  json_filename = [tempname, '.json'];
+  bson_values = arrayfun(@(k) bson.encode(struct('k', k)), 1:100, ...
+                         'UniformOutput', false);
+  fid = fopen(filename, 'w');
+  fwrite(fid, [bson_values{:}], 'uint8');
+  fclose(fid);
+  bson.exportJSON(filename, json_filename, 'Threads', 3, 'BatchSize', 256);
+  fid = fopen(json_filename, 'r');
+  json_value = fread(fid, inf, 'char=>char')';
+  fclose(fid);
+  delete(filename);
+  delete(json_filename);
+  lines = strsplit(strtrim(json_value), sprintf('\n'));
+  assert(numel(lines) == 100);
+  assert(strcmp(lines{42}, bson.asJSON(bson_values{42})));
+
+  % JSON import.
+  json_filename = [tempname, '.json'];
+  filename = [tempname, '.bson'];
+  fid = fopen(json_filename, 'w');
+  fprintf(fid, '[{"k": 1, "s": "a}"},\n {"k": [2, 3]}]\n');
+  fclose(fid);
+  bson.importJSON(json_filename, filename, 'Threads', 2, 'BatchSize', 8);
+  value1 = bson.read(filename);
+  delete(json_filename);
+  delete(filename);
+  assert(iscell(value1) && numel(value1) == 2);
+  assert(isequal(value1{1}.s, 'a}') && isequal(value1{2}.k, [2, 3]));
+  fid = fopen(json_filename, 'w');
+  fprintf(fid, '[{"a":1},,{"b":2},]');
+  fclose(fid);
+  try
+    bson.importJSON(json_filename, filename, 'BatchSize', 8);
+    assert(false);
+  catch exception
+    assert(~isempty(strfind(exception.message, 'at 9')));
+  end
+  delete(json_filename);
+  delete(filename);
+
+  % Direct JSON decoding.
+  json_value = ['{"a": [1, 2.5, null], "b": [[1, 2], [3, 4]], ', ...
+                '"c": [{"x": 1}, {"x": 2}], "d": "tab\tquote\"", ', ...
+                '"e": [true, false], "f": 5}'];
+  value1 = bson.parseJSON(json_value, 'IntegerClass', 'smallest');
+  value2 = bson.decode(bson.fromJSON(json_value), 'IntegerClass', 'smallest');
+  assert(isequaln(value1, value2));
+  assert(isequal(value1.d, sprintf('tab\tquote"')));
+  assert(isa(value1.b, 'uint8') && isequal(size(value1.c), [1, 2]));
+  json_values = {'{}', '[]', '{"a": []}'};
+  for i = 1:numel(json_values)
+    value1 = bson.parseJSON(json_values{i});
+    value2 = bson.decode(bson.fromJSON(json_values{i}));
+    assert(isequal(value1, value2));
+  end
+  assert(isempty(value1.a));
+
+  % Direct JSON writing.
+  value1 = struct('a', [1, 2.5; 3, 4], 'b', sprintf('q"\n'), ...
+                  'c', {{true, 0.1}}, 'd', struct('x', {1, 2}));
+  json_value = bson.toJSON(value1);
+  value2 = bson.parseJSON(json_value);
+  assert(isequal(value2, value1));
+  filename = [tempname, '.json'];
+  bson.toJSON(value1, 'File', filename);
+  fid = fopen(filename, 'r');
+  json_value2 = fread(fid, inf, 'char=>char')';
+  fclose(fid);
+  delete(filename);
+  assert(strcmp(json_value2, json_value));
+  assert(strcmp(bson.toJSON(single([0.1, 1/3])), '[0.1,0.33333334]'));
+
+  % Batch validation.
+  bson_values = arrayfun(@(k) bson.encode(struct('k', {{k, 'text'}})), ...
+                         1:50, 'UniformOutput', false);
+  offset = numel([bson_values{1:29}]);
+  bson_values{30}(end - 5) = uint8(255);
+  bson_value = [bson_values{:}];
+  [status, error] = bson.validateMany(bson_value, 'Threads', 4);
+  assert(all(status) && isempty(error));
+  [status, error] = bson.validateMany(bson_value, 'UTF8', true);
+  assert(numel(status) == 50 && isequal(find(~status), 30));
+  assert(error.document == 30 && error.offset == offset + numel(bson_values{30}) - 6);
+  [status, error] = bson.validateMany(bson.encode(struct('a', struct('b', struct('c', 1)))), ...
+                                      'Depth', 1);
+  assert(~status && strcmp(error.reason, 'maximum depth exceeded'));
+  [status, error] = bson.validateMany(bson_value(1:end - 1));
+  assert(numel(status) == 50 && ~status(end));
+  assert(strcmp(error.reason, 'truncated document'));
+
+  % Document handles.
+  value1 = struct('a', struct('b', int32(1:3), 'c', 'text'), 'd', {{1, 'x'}});
+  document = bson.Document(bson.encode(value1));
+  assert(isequal(document.keys(), {'a', 'd'}));
+  assert(isequal(document.keys('a'), {'b', 'c'}) && document.length('d') == 2);
+  assert(isequal(document.get('a.b'), value1.a.b));
+  assert(isequal(document.get('d.1'), 'x') && isempty(document.get('e')));
+  assert(isequal(document.get('e', 0), 0));
+  assert(isa(document.decode('a.b', 'IntegerClass', 'smallest'), 'uint8'));
+  assert(isequal(document.decode(), value1));
+  clear document;
+
+  % Decode cache.
+  bson.decodeCache('Clear', true, 'Capacity', 2);
+  bson_values = {bson.encode(struct('a', 1:3)), bson.encode(struct('b', 'x')), ...
+                 bson.encode(struct('c', true))};
+  value1 = bson.decode(bson_values{1}, 'Cache', true);
+  value2 = bson.decode(bson_values{1}, 'Cache', true);
+  bson.decode(bson_values{1}, 'Cache', true, 'IntegerClass', 'native');
+  assert(isequal(value1, value2) && isequal(value2, struct('a', 1:3)));
+  bson.decode(bson_values{2}, 'Cache', true);
+  bson.decode(bson_values{3}, 'Cache', true);
+  stats = bson.decodeCache();
+  assert(stats.hits == 1 && stats.misses == 4);
+  assert(stats.entries == 2 && stats.evictions == 2);
+  stats = bson.decodeCache('Clear', true, 'Capacity', 64);
+  assert(stats.entries == 0 && stats.hits == 0);
+
+  % Encoder plans.
+  template = struct('t', 0, 'level', 'info', 'n', int32(0), 'ok', true, ...
+                    'tags', {{'a'}}, 'meta', struct('host', 'x', 'pid', 1));
+  plan = bson.compileEncoder(template);
+  value1 = struct('t', 1.5, 'level', sprintf('caf\xe9'), 'n', int32(7), ...
+                  'ok', false, 'tags', {{'b', 'c'}}, ...
+                  'meta', struct('host', 'y', 'pid', [1 2]));
+  assert(isequal(bson.encode(value1, 'Plan', plan), bson.encode(value1)));
+  value1 = repmat(value1, 1, 3);
+  assert(isequal(bson.encode(value1, 'Plan', plan), bson.encode(value1)));
+  try
+    bson.encode(struct('t', 1), 'Plan', plan);
+    assert(false);
+  catch exception
+    assert(~isempty(strfind(exception.message, 'plan')));
+  end
+  clear plan;
+
+  % Schema decoding.
+  schema = struct('t', 'double', 'v', 'single[1x:]', 'm', 'int32[:x2]', ...
+                  'name', 'char', 'src', struct('id', 'uint8'), ...
+                  'items', struct('k', 'logical'), 'extra', 'any');
+  value1 = struct('t', 5, 'v', [1.5 2 3], 'm', [1 2; 3 4; 5 6], ...
+                  'name', 'abc', 'src', struct('id', 7, 'skip', 'x'), ...
+                  'items', struct('k', {true, false}), 'extra', {{1, 'a'}});
+  value2 = bson.decode(bson.encode(value1), 'Schema', schema);
+  assert(isa(value2.v, 'single') && isequal(value2.v, single(value1.v)));
+  assert(isa(value2.m, 'int32') && isequal(value2.m, int32(value1.m)));
+  assert(isa(value2.src.id, 'uint8') && ~isfield(value2.src, 'skip'));
+  assert(isequal([value2.items.k], [true, false]));
+  assert(isequal(value2.extra, value1.extra) && value2.t == 5);
+  value1.v = [];
+  value1.src.id = 300;
+  value1 = rmfield(value1, 'name');
+  [value2, mismatches] = bson.decode(bson.encode(value1), 'Schema', schema);
+  assert(isequal(size(value2.v), [1, 0]) && isa(value2.v, 'single'));
+  assert(isequal(sort(mismatches), {'name', 'src.id'}));
+  assert(isa(value2.src.id, 'uint8') && isempty(value2.src.id));
+  bson_value = bson.fromJSON('{"_id": 1, "a-b": 2, "1x": 3}');
+  value2 = bson.decode(bson_value, 'Schema', ...
+                       struct('id_', 'int32', 'a_b', 'double', 'x1x', 'any'));
+  assert(value2.id_ == 1 && value2.a_b == 2 && value2.x1x == 3);
+
+  % Sanitized keys.
+  bson_value = bson.fromJSON('{"_id": 1, "a b": 2, "a-b": 3, "a_b": 4, "1x": 5}');
+  for i = 1:2
+    value1 = bson.decode(bson_value);
+    assert(isequal(fieldnames(value1), {'id_'; 'a_b'; 'a_b0'; 'a_b1'; 'x1x'}));
+  end
+  keys = arrayfun(@(k) sprintf('"k%d": %d', mod(k, 100), k), 1:2000, ...
+                  'UniformOutput', false);
+  value1 = bson.parseJSON(['{', strjoin(keys, ', '), '}']);
+  assert(numel(fieldnames(value1)) == 2000 && value1.k10 == 10);
+
+  % Arena allocator.
+  value1 = struct('a', {struct('b', {1, 'x'}), 2}, 'c', rand(3, 4, 2));
+  bson_value = bson.encode(value1, 'Allocator', 'arena');
+  assert(isequal(bson_value, bson.encode(value1)));
+  assert(isequal(bson.decode(bson_value), bson.decode(bson.encode(value1))));
+  try
+    bson.encode(value1, 'Allocator', 'pool');
+    assert(false);
+  catch exception
+    assert(~isempty(strfind(exception.message, 'Allocator')));
+  end
+
+  % Maximum depth.
+  value1 = 1;
+  for i = 1:2000
+    value1 = {value1, i};
+  end
+  value2 = bson.decode(bson.encode(value1));
+  for i = 1:1998
+    value2 = value2{1};
+  end
+  assert(isequal(value2{2}, 2));
+  value1 = struct('a', struct('b', struct('c', 1)));
+  bson_value = bson.encode(value1, 'Depth', 2);
+  assert(isequal(bson.decode(bson_value, 'Depth', 2), value1));
+  try
+    bson.decode(bson_value, 'Depth', 1);
+    assert(false);
+  catch exception
+    assert(~isempty(strfind(exception.message, 'convert')));
+  end
+  for i = 1:2
+    try
+      bson.decode(bson_value, 'Cache', true, 'Depth', i);
+      assert(i == 2);
+    catch exception
+      assert(i == 1 && ~isempty(strfind(exception.message, 'convert')));
+    end
+  end
+  try
+    bson.decode(bson_value, 'Cache', true, 'Depth', 1);
+    assert(false);
+  catch exception
+    assert(~isempty(strfind(exception.message, 'convert')));
+  end
+  try
+    bson.encode(value1, 'Depth', 1);
+    assert(false);
+  catch exception
+    assert(~isempty(strfind(exception.message, 'convert')));
+  end
+  json_value = [repmat('{"a": ', 1, 2000), '1', repmat('}', 1, 2000)];
+  value2 = bson.parseJSON(json_value);
+  for i = 1:2000
+    value2 = value2.a;
+  end
+  assert(value2 == 1);
+  try
+    bson.parseJSON(json_value, 'Depth', 1000);
+    assert(false);
+  catch exception
+    assert(~isempty(strfind(exception.message, 'convert')));
+  end
+
+  % Batch encoding and decoding.
+  values = {struct('a', 1), struct('b', 'x'), struct('c', {{1, 'y'}})};
+  bson_values = bson.encodeMany(values);
+  assert(isequal(size(bson_values), size(values)));
+  assert(isequal(bson_values{2}, bson.encode(values{2})));
+  assert(isequal(bson.decodeMany(bson_values), values));
+  bson_value = bson.encodeMany(values, 'Concatenate', true);
+  assert(isequal(bson_value, [bson_values{:}]));
+  assert(isequal(bson.decodeMany(bson_value, 'IntegerClass', 'native'), ...
+                 values));
+  assert(isempty(bson.decodeMany(uint8([]))));
+  try
+    bson.decodeMany(bson_value(1:end - 1));
+    assert(false);
+  catch exception
+    assert(~isempty(strfind(exception.message, 'document 3')));
+  end
 end